@@ -0,0 +1,588 @@
+/*
+ * Copyright (C) 2012-2014 The Paparazzi Community
+ *               2015 Freek van Tienen <freek.v.tienen@gmail.com>
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/bayer.c
+ * Fixed-point debayering of raw Bayer images (16 bit or MIPI packed RAW10/RAW12) to UYVY or grayscale
+ *
+ * The debayering runs in two steps. First every quad is converted to Y, U and V
+ * (BT.601 with 8 bit fixed-point weights) in planes of the half resolution
+ * image, row by row with contiguous loads. Then the output is sampled from the
+ * planes through tables of plane offsets per output column and row, which
+ * handle the rotation and scaling for both sampling modes. Both steps are split
+ * in bands of rows that run on threads.
+ */
+
+#include "bayer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "simd.h"
+
+/**
+ * Convert a quad to Y, U and V
+ * @param[in] r The red value (8 bit)
+ * @param[in] g The green value (8 bit)
+ * @param[in] b The blue value (8 bit)
+ * @param[out] *y The Y value
+ * @param[out] *u The U value
+ * @param[out] *v The V value
+ */
+static inline void bayer_rgb_to_yuv(int32_t r, int32_t g, int32_t b, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+  *y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+  *u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+  *v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+#if defined(CV_SIMD_SSE2)
+/**
+ * Convert 8 quads to Y, U and V
+ * @param[in] R The red values (8 bit in 16 bit lanes)
+ * @param[in] G The green values (8 bit in 16 bit lanes)
+ * @param[in] B The blue values (8 bit in 16 bit lanes)
+ * @param[out] *py The Y values
+ * @param[out] *pu The U values
+ * @param[out] *pv The V values
+ */
+CV_INLINE void bayer_rgb_to_yuv_sse2(__m128i R, __m128i G, __m128i B, uint8_t *py, uint8_t *pu, uint8_t *pv)
+{
+  __m128i round = _mm_set1_epi16(128);
+
+  // Y is at most 56228 before the shift, so it is shifted unsigned
+  __m128i Y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(66)),
+                                          _mm_mullo_epi16(G, _mm_set1_epi16(129))),
+                            _mm_add_epi16(_mm_mullo_epi16(B, _mm_set1_epi16(25)), round));
+  Y = _mm_add_epi16(_mm_srli_epi16(Y, 8), _mm_set1_epi16(16));
+  __m128i U = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(-38)),
+                                          _mm_mullo_epi16(G, _mm_set1_epi16(-74))),
+                            _mm_add_epi16(_mm_mullo_epi16(B, _mm_set1_epi16(112)), round));
+  U = _mm_add_epi16(_mm_srai_epi16(U, 8), round);
+  __m128i V = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(112)),
+                                          _mm_mullo_epi16(G, _mm_set1_epi16(-94))),
+                            _mm_add_epi16(_mm_mullo_epi16(B, _mm_set1_epi16(-18)), round));
+  V = _mm_add_epi16(_mm_srai_epi16(V, 8), round);
+
+  _mm_storel_epi64((__m128i *)py, _mm_packus_epi16(Y, Y));
+  _mm_storel_epi64((__m128i *)pu, _mm_packus_epi16(U, U));
+  _mm_storel_epi64((__m128i *)pv, _mm_packus_epi16(V, V));
+}
+#elif defined(CV_SIMD_NEON)
+/**
+ * Convert 8 quads to Y, U and V
+ * @param[in] R The red values (8 bit in 16 bit lanes)
+ * @param[in] G The green values (8 bit in 16 bit lanes)
+ * @param[in] B The blue values (8 bit in 16 bit lanes)
+ * @param[out] *py The Y values
+ * @param[out] *pu The U values
+ * @param[out] *pv The V values
+ */
+CV_INLINE void bayer_rgb_to_yuv_neon(uint16x8_t R, uint16x8_t G, uint16x8_t B, uint8_t *py, uint8_t *pu, uint8_t *pv)
+{
+  int16x8_t Rs = vreinterpretq_s16_u16(R);
+  int16x8_t Gs = vreinterpretq_s16_u16(G);
+  int16x8_t Bs = vreinterpretq_s16_u16(B);
+
+  // Y is at most 56228 before the shift, so it is calculated unsigned
+  uint16x8_t Y = vmlaq_n_u16(vmlaq_n_u16(vmlaq_n_u16(vdupq_n_u16(128), R, 66), G, 129), B, 25);
+  int16x8_t U = vmlaq_n_s16(vmlaq_n_s16(vmlaq_n_s16(vdupq_n_s16(128), Rs, -38), Gs, -74), Bs, 112);
+  int16x8_t V = vmlaq_n_s16(vmlaq_n_s16(vmlaq_n_s16(vdupq_n_s16(128), Rs, 112), Gs, -94), Bs, -18);
+
+  vst1_u8(py, vmovn_u16(vaddq_u16(vshrq_n_u16(Y, 8), vdupq_n_u16(16))));
+  vst1_u8(pu, vqmovun_s16(vaddq_s16(vshrq_n_s16(U, 8), vdupq_n_s16(128))));
+  vst1_u8(pv, vqmovun_s16(vaddq_s16(vshrq_n_s16(V, 8), vdupq_n_s16(128))));
+}
+#endif
+
+/**
+ * Convert a row of quads of a 16 bit raw image
+ * @param[in] n The amount of quads
+ * @param[in] *gr The green pixel of the first quad, followed by the red pixel
+ * @param[in] *b The blue pixel of the first quad
+ * @param[out] *py The Y values
+ * @param[out] *pu The U values
+ * @param[out] *pv The V values
+ */
+static void bayer_quads_raw16(uint16_t n, uint16_t *gr, uint16_t *b, uint8_t *py, uint8_t *pu, uint8_t *pv)
+{
+  int32_t qx = 0;
+
+#if defined(CV_SIMD_SSE2)
+  for (; qx + 8 <= n; qx += 8) {
+    // The pixel pairs of the quads as 32 bit lanes, the 8 most significant bits of each pixel are used
+    __m128i gr0 = _mm_loadu_si128((__m128i *)&gr[2 * qx]);
+    __m128i gr1 = _mm_loadu_si128((__m128i *)&gr[2 * qx + 8]);
+    __m128i b0 = _mm_loadu_si128((__m128i *)&b[2 * qx]);
+    __m128i b1 = _mm_loadu_si128((__m128i *)&b[2 * qx + 8]);
+    __m128i G = _mm_packs_epi32(_mm_srli_epi32(_mm_slli_epi32(gr0, 16), 24), _mm_srli_epi32(_mm_slli_epi32(gr1, 16), 24));
+    __m128i R = _mm_packs_epi32(_mm_srli_epi32(gr0, 24), _mm_srli_epi32(gr1, 24));
+    __m128i B = _mm_packs_epi32(_mm_srli_epi32(_mm_slli_epi32(b0, 16), 24), _mm_srli_epi32(_mm_slli_epi32(b1, 16), 24));
+    bayer_rgb_to_yuv_sse2(R, G, B, &py[qx], &pu[qx], &pv[qx]);
+  }
+#elif defined(CV_SIMD_NEON)
+  for (; qx + 8 <= n; qx += 8) {
+    uint16x8x2_t gr8 = vld2q_u16(&gr[2 * qx]);
+    uint16x8_t B = vshrq_n_u16(vld2q_u16(&b[2 * qx]).val[0], 8);
+    bayer_rgb_to_yuv_neon(vshrq_n_u16(gr8.val[1], 8), vshrq_n_u16(gr8.val[0], 8), B, &py[qx], &pu[qx], &pv[qx]);
+  }
+#endif
+
+  for (; qx < n; qx++) {
+    bayer_rgb_to_yuv(gr[2 * qx + 1] >> 8, gr[2 * qx] >> 8, b[2 * qx] >> 8, &py[qx], &pu[qx], &pv[qx]);
+  }
+}
+
+/**
+ * Convert a row of quads of which the rows are unpacked to 8 bit
+ * @param[in] n The amount of quads
+ * @param[in] *gr The green pixel of the first quad, followed by the red pixel
+ * @param[in] *b The blue pixel of the first quad
+ * @param[out] *py The Y values
+ * @param[out] *pu The U values
+ * @param[out] *pv The V values
+ */
+static void bayer_quads_raw8(uint16_t n, uint8_t *gr, uint8_t *b, uint8_t *py, uint8_t *pu, uint8_t *pv)
+{
+  int32_t qx = 0;
+
+#if defined(CV_SIMD_SSE2)
+  __m128i low = _mm_set1_epi16(0xFF);
+  for (; qx + 8 <= n; qx += 8) {
+    __m128i gr8 = _mm_loadu_si128((__m128i *)&gr[2 * qx]);
+    __m128i B = _mm_and_si128(_mm_loadu_si128((__m128i *)&b[2 * qx]), low);
+    bayer_rgb_to_yuv_sse2(_mm_srli_epi16(gr8, 8), _mm_and_si128(gr8, low), B, &py[qx], &pu[qx], &pv[qx]);
+  }
+#elif defined(CV_SIMD_NEON)
+  for (; qx + 8 <= n; qx += 8) {
+    uint8x8x2_t gr8 = vld2_u8(&gr[2 * qx]);
+    uint16x8_t B = vmovl_u8(vld2_u8(&b[2 * qx]).val[0]);
+    bayer_rgb_to_yuv_neon(vmovl_u8(gr8.val[1]), vmovl_u8(gr8.val[0]), B, &py[qx], &pu[qx], &pv[qx]);
+  }
+#endif
+
+  for (; qx < n; qx++) {
+    bayer_rgb_to_yuv(gr[2 * qx + 1], gr[2 * qx], b[2 * qx], &py[qx], &pu[qx], &pv[qx]);
+  }
+}
+
+/**
+ * Unpack the 8 most significant bits of the samples of a packed raw row
+ * In both MIPI formats these are whole bytes, so only the bytes with the least significant bits are skipped.
+ * @param[in] *bayer The debayering (RAW10 or RAW12)
+ * @param[in] *src The packed row
+ * @param[out] *dst The unpacked row of in_w bytes
+ */
+static void bayer_unpack_row(struct bayer_t *bayer, uint8_t *src, uint8_t *dst)
+{
+  uint32_t g = 0;
+
+  if (bayer->format == BAYER_RAW10) {
+    // Groups of 5 bytes with 4 samples
+    uint32_t groups = bayer->in_w / 4;
+#if defined(CV_SIMD_SSE2)
+    __m128i first = _mm_set_epi32(0, 0, 0, -1);
+    __m128i second = _mm_set_epi32(0, 0, -1, 0);
+    for (; 5 * g + 26 <= bayer->in_stride; g += 4) {
+      __m128i v0 = _mm_loadu_si128((__m128i *)&src[5 * g]);
+      __m128i v1 = _mm_loadu_si128((__m128i *)&src[5 * g + 10]);
+      v0 = _mm_or_si128(_mm_and_si128(v0, first), _mm_and_si128(_mm_srli_si128(v0, 1), second));
+      v1 = _mm_or_si128(_mm_and_si128(v1, first), _mm_and_si128(_mm_srli_si128(v1, 1), second));
+      _mm_storeu_si128((__m128i *)&dst[4 * g], _mm_unpacklo_epi64(v0, v1));
+    }
+#elif defined(CV_SIMD_NEON)
+    static const uint8_t msb[8] = {0, 1, 2, 3, 5, 6, 7, 8};
+    uint8x8_t idx = vld1_u8(msb);
+    for (; 5 * g + 16 <= bayer->in_stride; g += 2) {
+      uint8x8x2_t v = {{vld1_u8(&src[5 * g]), vld1_u8(&src[5 * g + 8])}};
+      vst1_u8(&dst[4 * g], vtbl2_u8(v, idx));
+    }
+#endif
+    for (; g < groups; g++) {
+      memcpy(&dst[4 * g], &src[5 * g], 4);
+    }
+  } else {
+    // Groups of 3 bytes with 2 samples
+    uint32_t groups = bayer->in_w / 2;
+#if defined(CV_SIMD_SSE2)
+    __m128i pair[4] = {_mm_set_epi16(0, 0, 0, 0, 0, 0, 0, -1), _mm_set_epi16(0, 0, 0, 0, 0, 0, -1, 0),
+                       _mm_set_epi16(0, 0, 0, 0, 0, -1, 0, 0), _mm_set_epi16(0, 0, 0, 0, -1, 0, 0, 0)
+                      };
+    for (; 3 * g + 28 <= bayer->in_stride; g += 8) {
+      __m128i v[2];
+      for (uint8_t i = 0; i < 2; i++) {
+        __m128i p = _mm_loadu_si128((__m128i *)&src[3 * g + 12 * i]);
+        v[i] = _mm_or_si128(_mm_or_si128(_mm_and_si128(p, pair[0]), _mm_and_si128(_mm_srli_si128(p, 1), pair[1])),
+                            _mm_or_si128(_mm_and_si128(_mm_srli_si128(p, 2), pair[2]),
+                                         _mm_and_si128(_mm_srli_si128(p, 3), pair[3])));
+      }
+      _mm_storeu_si128((__m128i *)&dst[2 * g], _mm_unpacklo_epi64(v[0], v[1]));
+    }
+#elif defined(CV_SIMD_NEON)
+    for (; 3 * g + 48 <= bayer->in_stride; g += 16) {
+      uint8x16x3_t v = vld3q_u8(&src[3 * g]);
+      uint8x16x2_t msb = {{v.val[0], v.val[1]}};
+      vst2q_u8(&dst[2 * g], msb);
+    }
+#endif
+    for (; g < groups; g++) {
+      dst[2 * g] = src[3 * g];
+      dst[2 * g + 1] = src[3 * g + 1];
+    }
+  }
+}
+
+/**
+ * Convert the quads of rows qy0 up to qy1 of a raw image to the Y, U and V planes of the half resolution image
+ * Packed rows are unpacked one at a time to the row buffers of the band, so no 16 bit copy of the image is made.
+ * @param[in] *bayer The debayering
+ * @param[in] *in The raw image
+ * @param[in] band The band, which selects the row buffers
+ * @param[in] qy0 The first quad row
+ * @param[in] qy1 The end of the quad rows
+ */
+void bayer_quads(struct bayer_t *bayer, struct image_t *in, uint8_t band, uint16_t qy0, uint16_t qy1)
+{
+  uint8_t *raw = (uint8_t *)in->buf;
+  uint32_t plane_size = bayer->quad_w * bayer->quad_h;
+
+  for (uint16_t qy = qy0; qy < qy1; qy++) {
+    // The row with the green and red pixels of the quads and the row with the blue pixels
+    uint8_t *row0 = &raw[(2 * qy + bayer->red_y) * bayer->in_stride];
+    uint8_t *row1 = row0 + bayer->in_stride;
+    uint8_t *py = &bayer->planes[qy * bayer->quad_w];
+    uint8_t *pu = py + plane_size;
+    uint8_t *pv = pu + plane_size;
+
+    if (bayer->format == BAYER_RAW16) {
+      bayer_quads_raw16(bayer->quad_w, &((uint16_t *)row0)[bayer->red_x], &((uint16_t *)row1)[bayer->red_x], py, pu, pv);
+    } else {
+      uint8_t *rows = &bayer->rows[band * 2 * bayer->in_w];
+      bayer_unpack_row(bayer, row0, rows);
+      bayer_unpack_row(bayer, row1, rows + bayer->in_w);
+      bayer_quads_raw8(bayer->quad_w, &rows[bayer->red_x], &rows[bayer->in_w + bayer->red_x], py, pu, pv);
+    }
+  }
+}
+
+/**
+ * Sample a plane of the half resolution image at an output pixel
+ * @param[in] *plane The plane
+ * @param[in] *x_offset The offsets of the sample and the next sample of the output column
+ * @param[in] x_weight The weight of the next sample of the output column
+ * @param[in] *y_offset The offsets of the sample and the next sample of the output row
+ * @param[in] y_weight The weight of the next sample of the output row
+ * @param[in] bilinear Interpolate between the samples
+ * @return The sampled value
+ */
+static inline uint8_t bayer_sample_plane(uint8_t *plane, int32_t *x_offset, uint32_t x_weight, int32_t *y_offset,
+    uint32_t y_weight, bool bilinear)
+{
+  if (!bilinear) {
+    return plane[x_offset[0] + y_offset[0]];
+  }
+  uint32_t top = plane[x_offset[0] + y_offset[0]] * (256 - x_weight) + plane[x_offset[1] + y_offset[0]] * x_weight;
+  uint32_t bottom = plane[x_offset[0] + y_offset[1]] * (256 - x_weight) + plane[x_offset[1] + y_offset[1]] * x_weight;
+  return (top * (256 - y_weight) + bottom * y_weight + 32768) >> 16;
+}
+
+/**
+ * Sample the output rows y0 up to y1 from the planes of the half resolution image
+ * @param[in] *bayer The debayering, after bayer_quads for the whole image
+ * @param[out] *out The output image (YUV422 or grayscale)
+ * @param[in] y0 The first output row
+ * @param[in] y1 The end of the output rows
+ */
+void bayer_sample(struct bayer_t *bayer, struct image_t *out, uint16_t y0, uint16_t y1)
+{
+  uint32_t plane_size = bayer->quad_w * bayer->quad_h;
+  uint8_t *py = bayer->planes;
+  uint8_t *pu = py + plane_size;
+  uint8_t *pv = pu + plane_size;
+  bool bilinear = (bayer->interpolation == BAYER_SAMPLE_BILINEAR);
+  int32_t *xo = bayer->x_offset;
+  uint8_t *xw = bayer->x_weight;
+  uint16_t x;
+
+  for (uint16_t y = y0; y < y1; y++) {
+    int32_t *yo = &bayer->y_offset[2 * y];
+    uint8_t yw = bayer->y_weight[y];
+
+    if (out->type == IMAGE_GRAYSCALE) {
+      uint8_t *row = &((uint8_t *)out->buf)[y * bayer->out_w];
+      for (x = 0; x < bayer->out_w; x++) {
+        row[x] = bayer_sample_plane(py, &xo[2 * x], xw[x], yo, yw, bilinear);
+      }
+    } else {
+      // The macropixels get the mean U and V of their pixels
+      uint8_t *row = &((uint8_t *)out->buf)[y * bayer->out_w * 2];
+      for (x = 0; x + 1 < bayer->out_w; x += 2) {
+        uint16_t u = bayer_sample_plane(pu, &xo[2 * x], xw[x], yo, yw, bilinear) +
+                     bayer_sample_plane(pu, &xo[2 * x + 2], xw[x + 1], yo, yw, bilinear);
+        uint16_t v = bayer_sample_plane(pv, &xo[2 * x], xw[x], yo, yw, bilinear) +
+                     bayer_sample_plane(pv, &xo[2 * x + 2], xw[x + 1], yo, yw, bilinear);
+        row[2 * x] = (u + 1) >> 1;
+        row[2 * x + 1] = bayer_sample_plane(py, &xo[2 * x], xw[x], yo, yw, bilinear);
+        row[2 * x + 2] = (v + 1) >> 1;
+        row[2 * x + 3] = bayer_sample_plane(py, &xo[2 * x + 2], xw[x + 1], yo, yw, bilinear);
+      }
+    }
+  }
+}
+
+/**
+ * Fill the sample tables of an output axis
+ * The output position o samples the rotated half resolution image at (o + 0.5) * size / out_size - 0.5.
+ * @param[in] *bayer The debayering
+ * @param[in] out_size The size of the output axis
+ * @param[in] size The size of the rotated half resolution image along the axis
+ * @param[in] start The plane offset of rotated position 0
+ * @param[in] step The plane offset between rotated positions
+ * @param[out] *offset The plane offsets of the sample and the next sample per output position
+ * @param[out] *weight The weights of the next sample per output position
+ */
+static void bayer_axis(struct bayer_t *bayer, uint16_t out_size, uint16_t size, int32_t start, int32_t step,
+                       int32_t *offset, uint8_t *weight)
+{
+  int64_t pos;
+  int32_t r0, r1;
+
+  for (uint16_t o = 0; o < out_size; o++) {
+    if (bayer->interpolation == BAYER_SAMPLE_BILINEAR) {
+      // The position in 1/256 of a quad
+      pos = ((2 * (int64_t)o + 1) * size * 256) / (2 * out_size) - 128;
+      pos = (pos < 0) ? 0 : pos;
+      r0 = pos >> 8;
+      weight[o] = pos & 0xFF;
+      if (r0 >= size - 1) {
+        r0 = size - 1;
+        weight[o] = 0;
+      }
+      r1 = (r0 + 1 < size) ? r0 + 1 : r0;
+    } else {
+      r0 = r1 = ((2 * (int64_t)o + 1) * size) / (2 * out_size);
+      weight[o] = 0;
+    }
+    offset[2 * o] = start + r0 * step;
+    offset[2 * o + 1] = start + r1 * step;
+  }
+}
+
+/**
+ * Prepare the debayering of raw images of one size to output images of one size
+ * The output is the half resolution image rotated clockwise and scaled to the output size.
+ * @param[out] *bayer The debayering
+ * @param[in] in_w The width of the raw images
+ * @param[in] in_h The height of the raw images
+ * @param[in] format The sample format of the raw images (the width is a multiple of 4 for RAW10 and of 2 for RAW12)
+ * @param[in] out_w The width of the output images (even for YUV422)
+ * @param[in] out_h The height of the output images
+ * @param[in] red_x The column of the green pixel of the first quad, which has red right of it and blue below it
+ * @param[in] red_y The row of the green pixel of the first quad
+ * @param[in] rotation The clockwise rotation of the output
+ * @param[in] interpolation The sampling of the half resolution image
+ * @param[in] n_bands The amount of row bands, which run on threads (1 up to BAYER_MAX_BANDS)
+ * @return True when the memory could be allocated and the raw image has at least one quad of a supported format
+ */
+bool bayer_init(struct bayer_t *bayer, uint16_t in_w, uint16_t in_h, enum bayer_format format, uint16_t out_w,
+                uint16_t out_h, uint8_t red_x, uint8_t red_y, enum bayer_rotation rotation,
+                enum bayer_interpolation interpolation, uint8_t n_bands)
+{
+  memset(bayer, 0, sizeof(struct bayer_t));
+  bayer->in_w = in_w;
+  bayer->in_h = in_h;
+  bayer->out_w = out_w;
+  bayer->out_h = out_h;
+  bayer->red_x = red_x;
+  bayer->red_y = red_y;
+  bayer->format = format;
+  bayer->rotation = rotation;
+  bayer->interpolation = interpolation;
+  bayer->n_bands = (n_bands < 1) ? 1 : ((n_bands > BAYER_MAX_BANDS) ? BAYER_MAX_BANDS : n_bands);
+  bayer->quad_w = (in_w > red_x) ? (in_w - red_x) / 2 : 0;
+  bayer->quad_h = (in_h > red_y) ? (in_h - red_y) / 2 : 0;
+  if (bayer->quad_w == 0 || bayer->quad_h == 0 || out_w == 0 || out_h == 0) {
+    return false;
+  }
+  switch (format) {
+    case BAYER_RAW16:
+      bayer->in_stride = 2 * in_w;
+      break;
+    case BAYER_RAW10:
+      bayer->in_stride = in_w / 4 * 5;
+      break;
+    case BAYER_RAW12:
+      bayer->in_stride = in_w / 2 * 3;
+      break;
+    default:
+      return false;
+  }
+  if ((format == BAYER_RAW10 && in_w % 4 != 0) || (format == BAYER_RAW12 && in_w % 2 != 0)) {
+    return false;
+  }
+
+  bayer->planes = malloc(3 * bayer->quad_w * bayer->quad_h);
+  bayer->x_offset = malloc(sizeof(int32_t) * 2 * out_w);
+  bayer->y_offset = malloc(sizeof(int32_t) * 2 * out_h);
+  bayer->x_weight = malloc(out_w);
+  bayer->y_weight = malloc(out_h);
+  if (format != BAYER_RAW16) {
+    bayer->rows = malloc(bayer->n_bands * 2 * in_w);
+  }
+  if (bayer->planes == NULL || bayer->x_offset == NULL || bayer->y_offset == NULL || bayer->x_weight == NULL ||
+      bayer->y_weight == NULL || (format != BAYER_RAW16 && bayer->rows == NULL)) {
+    bayer_free(bayer);
+    return false;
+  }
+
+  // The plane offsets of the rotated image along the output columns and rows
+  int32_t qw = bayer->quad_w, qh = bayer->quad_h;
+  switch (rotation) {
+    case BAYER_ROTATE_90:
+      bayer_axis(bayer, out_w, qh, (qh - 1) * qw, -qw, bayer->x_offset, bayer->x_weight);
+      bayer_axis(bayer, out_h, qw, 0, 1, bayer->y_offset, bayer->y_weight);
+      break;
+    case BAYER_ROTATE_180:
+      bayer_axis(bayer, out_w, qw, qw - 1, -1, bayer->x_offset, bayer->x_weight);
+      bayer_axis(bayer, out_h, qh, (qh - 1) * qw, -qw, bayer->y_offset, bayer->y_weight);
+      break;
+    case BAYER_ROTATE_270:
+      bayer_axis(bayer, out_w, qh, 0, qw, bayer->x_offset, bayer->x_weight);
+      bayer_axis(bayer, out_h, qw, qw - 1, -1, bayer->y_offset, bayer->y_weight);
+      break;
+    default:
+      bayer_axis(bayer, out_w, qw, 0, 1, bayer->x_offset, bayer->x_weight);
+      bayer_axis(bayer, out_h, qh, 0, qw, bayer->y_offset, bayer->y_weight);
+      break;
+  }
+  return true;
+}
+
+/**
+ * Free the memory of a debayering
+ * @param[in] *bayer The debayering
+ */
+void bayer_free(struct bayer_t *bayer)
+{
+  free(bayer->planes);
+  free(bayer->rows);
+  free(bayer->x_offset);
+  free(bayer->y_offset);
+  free(bayer->x_weight);
+  free(bayer->y_weight);
+  bayer->planes = bayer->rows = NULL;
+  bayer->x_offset = bayer->y_offset = NULL;
+  bayer->x_weight = bayer->y_weight = NULL;
+}
+
+/* A band of one of the steps of bayer_convert */
+struct bayer_band_t {
+  struct bayer_t *bayer;
+  struct image_t *in;
+  struct image_t *out;
+  uint8_t band;
+  bool quads;             ///< The band of bayer_quads, otherwise of bayer_sample
+};
+
+/**
+ * Run a band of one of the steps of bayer_convert
+ * @param[in] *data The band
+ * @return NULL
+ */
+static void *bayer_band_thread(void *data)
+{
+  struct bayer_band_t *band = (struct bayer_band_t *)data;
+  struct bayer_t *bayer = band->bayer;
+  uint16_t rows = band->quads ? bayer->quad_h : bayer->out_h;
+  uint16_t r0 = band->band * rows / bayer->n_bands;
+  uint16_t r1 = (band->band + 1) * rows / bayer->n_bands;
+
+  if (band->quads) {
+    bayer_quads(bayer, band->in, band->band, r0, r1);
+  } else {
+    bayer_sample(bayer, band->out, r0, r1);
+  }
+  return NULL;
+}
+
+/**
+ * Run one of the steps of bayer_convert in bands
+ * The first band runs on the calling thread, every other band on a thread of its own.
+ * @param[in] *bayer The debayering
+ * @param[in] *in The raw image
+ * @param[out] *out The output image
+ * @param[in] quads Run bayer_quads, otherwise bayer_sample
+ */
+static void bayer_run_bands(struct bayer_t *bayer, struct image_t *in, struct image_t *out, bool quads)
+{
+  struct bayer_band_t bands[BAYER_MAX_BANDS];
+  pthread_t threads[BAYER_MAX_BANDS];
+  bool started[BAYER_MAX_BANDS];
+
+  for (uint8_t b = 0; b < bayer->n_bands; b++) {
+    bands[b].bayer = bayer;
+    bands[b].in = in;
+    bands[b].out = out;
+    bands[b].band = b;
+    bands[b].quads = quads;
+    started[b] = false;
+  }
+  for (uint8_t b = 1; b < bayer->n_bands; b++) {
+    started[b] = (pthread_create(&threads[b], NULL, bayer_band_thread, &bands[b]) == 0);
+    if (!started[b]) {
+      // No thread, so the band runs here
+      bayer_band_thread(&bands[b]);
+    }
+  }
+  bayer_band_thread(&bands[0]);
+  for (uint8_t b = 1; b < bayer->n_bands; b++) {
+    if (started[b]) {
+      pthread_join(threads[b], NULL);
+    }
+  }
+}
+
+/**
+ * Debayer a raw image to a YUV422 or grayscale image
+ * @param[in] *bayer The debayering (see bayer_init)
+ * @param[in] *in The raw image of in_w x in_h pixels in the format of the debayering
+ * @param[out] *out The output image of out_w x out_h pixels, YUV422 or grayscale
+ */
+void bayer_convert(struct bayer_t *bayer, struct image_t *in, struct image_t *out)
+{
+  uint32_t out_size = bayer->out_w * bayer->out_h * ((out->type == IMAGE_YUV422) ? 2 : 1);
+  if (bayer->planes == NULL || in->w != bayer->in_w || in->h != bayer->in_h ||
+      in->buf_size < bayer->in_stride * bayer->in_h || out->buf_size < out_size || (out->type != IMAGE_YUV422 && out->type != IMAGE_GRAYSCALE)) {
+    return;
+  }
+  out->w = bayer->out_w;
+  out->h = bayer->out_h;
+  out->ts = in->ts;
+  out->pprz_ts = in->pprz_ts;
+
+  if (bayer->n_bands == 1) {
+    bayer_quads(bayer, in, 0, 0, bayer->quad_h);
+    bayer_sample(bayer, out, 0, bayer->out_h);
+  } else {
+    bayer_run_bands(bayer, in, out, true);
+    bayer_run_bands(bayer, in, out, false);
+  }
+}
@@ -22,81 +22,72 @@
 
 /**
  * @file modules/computer_vision/lib/vision/bayer.h
+ * Fixed-point debayering of raw Bayer images (16 bit or MIPI packed RAW10/RAW12) to UYVY or grayscale
+ *
+ * Every 2x2 block of the Bayer pattern (a quad, with green at the top left, red
+ * at the top right and blue below the green pixel) becomes one pixel of a half
+ * resolution color image. That image is rotated and scaled to the output size
+ * with nearest or bilinear sampling.
  */
 
 #ifndef Bayer_H
 #define Bayer_H
 
-#include "lib/vision/image.h"
-
-static inline uint8_t clip(uint16_t x)
-{
-  if (x < 0) {
-    return 0;
-  }
-  if (x > 255) {
-    return 255;
-  }
-  return (uint8_t) x;
-}
-
-
-void BayerToYUV(struct image_t *Input, struct image_t *out,
-                 int RedX, int RedY);
-
-
-/**
- * @brief Decode Bayer Pattern
- * @param RedX, RedY the coordinates of the upper-rightmost green pixel
- *        which has a red pixel next to it and a blue underneath
- *
- */
-
-void BayerToYUV(struct image_t *in, struct image_t *out,
-                 int RedX, int RedY)
-{
-  uint16_t *ii = (uint16_t *) in->buf;
-  uint8_t *oi = (uint8_t *) out->buf;
-  int x, y;
-
-
-  for (y = 0; y < out->h; y++) {
-    for (x = 0; x < out->w; x += 2) {
-      /* RGB Bayer:
-       * RBRBRBRBRBRBRBRB
-       * GRGRGRGRGRGRGRGR
-       */
-      int i = 2 * (out->h - y) + RedX;
-      int j = 2 * x + RedY;
-      if ((i < in->w) && (j < in->h)) {
-        uint16_t G1 = ii[i + j * in->w] / 2;
-        uint16_t R1 = ii[i + j * in->w + 1] / 2;
-        uint16_t B1 = ii[i + (j + 1) * in->w] / 2;
-        j += 2;
-        uint16_t G2 = ii[i + j * in->w] / 2;
-        uint16_t R2 = ii[i + j * in->w + 1] / 2;
-        uint16_t B2 = ii[i + (j + 1) * in->w] / 2;
-
-        uint32_t u, my1, v, my2;
-
-        my1 = (0.256788 * R1 + 0.504129 * G1 + 0.097906 * B1) / 128 +  16;
-        my2 = (0.256788 * R2 + 0.504129 * G2 + 0.097906 * B2) / 128 +  16;
-        u = (-0.148223 * (R1 + R2) - 0.290993 * (G1 + G2) + 0.439216 * (B1 + B2)) / 256 + 128;
-        v = (0.439216 * (R1 + R2) - 0.367788 * (G1 + G2) - 0.071427 * (B1 + B2)) / 256 + 128;
-
-
-        oi[(x + y * out->w) * 2] = clip(u);
-        oi[(x + y * out->w) * 2 + 1] = clip(my1);
-        oi[(x + y * out->w) * 2 + 2] = clip(v);
-        oi[(x + y * out->w) * 2 + 3] = clip(my2);
-      } else {
-        oi[(x + y * out->w) * 2] = 0;
-        oi[(x + y * out->w) * 2 + 1] = 0;
-        oi[(x + y * out->w) * 2 + 2] = 0;
-        oi[(x + y * out->w) * 2 + 3] = 0;
-      }
-    }
-  }
-}
+#include "std.h"
+#include "image.h"
+
+#define BAYER_MAX_BANDS 8     ///< Maximum amount of row bands (threads) of the debayering
+
+/* Clockwise rotation of the debayered image */
+enum bayer_rotation {
+  BAYER_ROTATE_0,
+  BAYER_ROTATE_90,
+  BAYER_ROTATE_180,
+  BAYER_ROTATE_270
+};
+
+/* Sample format of the raw images, the 8 most significant bits of every sample are used */
+enum bayer_format {
+  BAYER_RAW16,            ///< A uint16_t per sample, with the sample in the most significant bits
+  BAYER_RAW10,            ///< MIPI packed 10 bit, 4 samples in 5 bytes (4 MSB bytes and a byte of LSBs)
+  BAYER_RAW12             ///< MIPI packed 12 bit, 2 samples in 3 bytes (2 MSB bytes and a byte of LSBs)
+};
+
+/* Sampling of the half resolution color image */
+enum bayer_interpolation {
+  BAYER_SAMPLE_NEAREST,   ///< The nearest quad
+  BAYER_SAMPLE_BILINEAR   ///< Bilinear interpolation between the 4 nearest quads
+};
+
+/* Debayering of raw images of one size to output images of one size, see bayer_init */
+struct bayer_t {
+  uint16_t in_w;          ///< Width of the raw image
+  uint16_t in_h;          ///< Height of the raw image
+  uint16_t out_w;         ///< Width of the output image
+  uint16_t out_h;         ///< Height of the output image
+  uint8_t red_x;          ///< Column of the green pixel of the first quad
+  uint8_t red_y;          ///< Row of the green pixel of the first quad
+  enum bayer_format format;
+  uint32_t in_stride;     ///< Bytes per raw image row
+  enum bayer_rotation rotation;
+  enum bayer_interpolation interpolation;
+  uint8_t n_bands;        ///< Amount of row bands, every band but the first runs on a thread of its own
+  uint16_t quad_w;        ///< Width of the half resolution image
+  uint16_t quad_h;        ///< Height of the half resolution image
+  uint8_t *planes;        ///< Y, U and V planes of the half resolution image
+  uint8_t *rows;          ///< Per band two raw rows unpacked to 8 bit (packed formats only)
+  int32_t *x_offset;      ///< Per output column the plane offset of its sample and of the next sample
+  int32_t *y_offset;      ///< Per output row the plane offset of its sample and of the next sample
+  uint8_t *x_weight;      ///< Per output column the bilinear weight of the next sample (of 256)
+  uint8_t *y_weight;      ///< Per output row the bilinear weight of the next sample (of 256)
+};
+
+bool bayer_init(struct bayer_t *bayer, uint16_t in_w, uint16_t in_h, enum bayer_format format, uint16_t out_w,
+                uint16_t out_h, uint8_t red_x, uint8_t red_y, enum bayer_rotation rotation,
+                enum bayer_interpolation interpolation, uint8_t n_bands);
+void bayer_free(struct bayer_t *bayer);
+void bayer_convert(struct bayer_t *bayer, struct image_t *in, struct image_t *out);
+void bayer_quads(struct bayer_t *bayer, struct image_t *in, uint8_t band, uint16_t qy0, uint16_t qy1);
+void bayer_sample(struct bayer_t *bayer, struct image_t *out, uint16_t y0, uint16_t y1);
 
 #endif /* Bayer_H */
@@ -14,6 +14,8 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include "jpeg.h"
+#include <string.h>
+#include "simd.h"
 
 /**
  * @file modules/computer_vision/lib/encoding/jpeg.c
@@ -60,48 +62,7 @@ int jpeg_create_svs_header(unsigned char *jpegbuf, int32_t size, int w)
 }
 
 
-#define JPEG_BLOCK_SIZE 64
-
-
-typedef struct JPEG_ENCODER_STRUCTURE {
-
-  // Encoder
-  uint16_t    mcu_width;
-  uint16_t    mcu_height;
-  uint16_t    horizontal_mcus;
-  uint16_t    vertical_mcus;
-  uint16_t    cols_in_right_mcus;
-  uint16_t    rows_in_bottom_mcus;
-
-  uint16_t    rows;
-  uint16_t    cols;
-
-  uint16_t    length_minus_mcu_width;
-  uint16_t    length_minus_width;
-  uint16_t    incr;
-  uint16_t    mcu_width_size;
-  uint16_t    offset;
-
-  int16_t ldc1;
-  int16_t ldc2;
-  int16_t ldc3;
-
-  // Tables
-  uint8_t    Lqt [JPEG_BLOCK_SIZE];
-  uint8_t    Cqt [JPEG_BLOCK_SIZE];
-  uint16_t   ILqt [JPEG_BLOCK_SIZE];
-  uint16_t   ICqt [JPEG_BLOCK_SIZE];
-
-  int16_t    Y1 [JPEG_BLOCK_SIZE];
-  int16_t    Y2 [JPEG_BLOCK_SIZE];
-  int16_t    CB [JPEG_BLOCK_SIZE];
-  int16_t    CR [JPEG_BLOCK_SIZE];
-  int16_t    Temp [JPEG_BLOCK_SIZE];
-
-  uint32_t   lcode;
-  uint16_t   bitindex;
-
-} JPEG_ENCODER_STRUCTURE;
+typedef struct jpeg_encoder_t JPEG_ENCODER_STRUCTURE;
 
 
 static void jpeg_initialization(JPEG_ENCODER_STRUCTURE *, uint32_t, uint32_t, uint32_t);
@@ -110,13 +71,16 @@ static uint8_t *jpeg_write_markers(JPEG_ENCODER_STRUCTURE *, uint8_t *, uint32_t
 
 static void jpeg_read_400_format(JPEG_ENCODER_STRUCTURE *, uint8_t *);
 static void jpeg_read_422_format(JPEG_ENCODER_STRUCTURE *, uint8_t *);
+static void jpeg_read_420_format(JPEG_ENCODER_STRUCTURE *, struct image_t *, uint16_t, uint16_t);
 
 static uint8_t *jpeg_encodeMCU(JPEG_ENCODER_STRUCTURE *, uint32_t, uint8_t *);
 
+#if !defined(CV_SIMD)
 static void jpeg_levelshift(int16_t *);
 static void jpeg_DCT(int16_t *);
-
 static void jpeg_quantization(JPEG_ENCODER_STRUCTURE *, int16_t *, uint16_t *);
+#endif
+static void jpeg_block(JPEG_ENCODER_STRUCTURE *, int16_t *, uint16_t *);
 static uint8_t *jpeg_huffman(JPEG_ENCODER_STRUCTURE *, uint16_t, uint8_t *);
 
 static uint8_t *jpeg_close_bitstream(JPEG_ENCODER_STRUCTURE *, uint8_t *);
@@ -283,15 +247,10 @@ static const uint8_t zigzag_table [] = {
 };
 
 
-void (*read_format)(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, uint8_t *input_ptr);
-
 static void jpeg_initialization(JPEG_ENCODER_STRUCTURE *jpeg, uint32_t image_format, uint32_t image_width, uint32_t image_height)
 {
   uint16_t mcu_width, mcu_height, bytes_per_pixel;
 
-  jpeg->lcode = 0;
-  jpeg->bitindex = 0;
-
   if (image_format == FOUR_ZERO_ZERO) {
     jpeg->mcu_width = mcu_width = 8;
     jpeg->mcu_height = mcu_height = 8;
@@ -300,7 +259,15 @@ static void jpeg_initialization(JPEG_ENCODER_STRUCTURE *jpeg, uint32_t image_for
     jpeg->vertical_mcus = (uint16_t)((image_height + mcu_height - 1) >> 3);
 
     bytes_per_pixel = 1;
-    read_format = jpeg_read_400_format;
+    jpeg->read_format = jpeg_read_400_format;
+  } else if (image_format == FOUR_TWO_ZERO) {
+    // The planes are read by position (jpeg_read_420_format), so the input steps are not used
+    jpeg->mcu_width = mcu_width = 16;
+    jpeg->horizontal_mcus = (uint16_t)((image_width + mcu_width - 1) >> 4);
+
+    jpeg->mcu_height = mcu_height = 16;
+    jpeg->vertical_mcus = (uint16_t)((image_height + mcu_height - 1) >> 4);
+    bytes_per_pixel = 1;
   } else {
     jpeg->mcu_width = mcu_width = 16;
     jpeg->horizontal_mcus = (uint16_t)((image_width + mcu_width - 1) >> 4);
@@ -308,7 +275,7 @@ static void jpeg_initialization(JPEG_ENCODER_STRUCTURE *jpeg, uint32_t image_for
     jpeg->mcu_height = mcu_height = 8;
     jpeg->vertical_mcus = (uint16_t)((image_height + mcu_height - 1) >> 3);
     bytes_per_pixel = 2;
-    read_format = jpeg_read_422_format;
+    jpeg->read_format = jpeg_read_422_format;
   }
 
   jpeg->rows_in_bottom_mcus = (uint16_t)(image_height - (jpeg->vertical_mcus - 1) * mcu_height);
@@ -320,13 +287,6 @@ static void jpeg_initialization(JPEG_ENCODER_STRUCTURE *jpeg, uint32_t image_for
   jpeg->mcu_width_size = (uint16_t)(mcu_width * bytes_per_pixel);
 
   jpeg->offset = (uint16_t)((image_width * (mcu_height - 1) - (mcu_width - jpeg->cols_in_right_mcus)) * bytes_per_pixel);
-
-  jpeg->ldc1 = 0;
-  jpeg->ldc2 = 0;
-  jpeg->ldc3 = 0;
-
-  jpeg->lcode = 0;
-  jpeg->bitindex = 0;
 }
 
 /////////////////////////////////////////////////////////////
@@ -399,13 +359,28 @@ void MakeTables(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, int q)
 }
 
 /**
- * Encode an YUV422 image
+ * Prepare a JPEG encoder
+ * The tables, the MCU geometry and the markers are made at the first frame and
+ * kept until the quality factor, the size or the format of the frames changes.
+ * @param[out] *jpeg The encoder
+ */
+void jpeg_encoder_init(struct jpeg_encoder_t *jpeg)
+{
+  memset(jpeg, 0, sizeof(struct jpeg_encoder_t));
+  jpeg->quality = -1;
+}
+
+/**
+ * Encode an YUV422, grayscale, NV12 or I420 image
+ * NV12 and I420 are encoded as 4:2:0, with 4 Y blocks per MCU.
+ * @param[in] *jpeg_encoder_structure The encoder (see jpeg_encoder_init)
  * @param[in] *in The input image
  * @param[out] *out The output JPEG image
  * @param[in] quality_factor Quality factor of the encoding (0-99)
  * @param[in] add_dri_header Add the DRI header (needed for full JPEG)
  */
-void jpeg_encode_image(struct image_t *in, struct image_t *out, uint32_t quality_factor, bool add_dri_header)
+void jpeg_encoder_encode(struct jpeg_encoder_t *jpeg_encoder_structure, struct image_t *in, struct image_t *out,
+                         uint32_t quality_factor, bool add_dri_header)
 {
   uint16_t i, j;
   uint8_t *output_ptr = out->buf;
@@ -418,23 +393,44 @@ void jpeg_encode_image(struct image_t *in, struct image_t *out, uint32_t quality
   else if (in->type == IMAGE_GRAYSCALE) {
       image_format = FOUR_ZERO_ZERO;
   }
+  else if (in->type == IMAGE_NV12 || in->type == IMAGE_I420) {
+    image_format = FOUR_TWO_ZERO;
+  }
 
-  JPEG_ENCODER_STRUCTURE JpegStruct;
-  JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure = &JpegStruct;
-
-  /* Initialization of JPEG control structure */
-  jpeg_initialization(jpeg_encoder_structure, image_format, in->w, in->h);
-
-  /* Quantization Table Initialization */
-  //jpeg_initialize_quantization_tables (quality_factor);
+  /* Initialization of the MCU geometry when the size or format changed */
+  if (jpeg_encoder_structure->image_format != image_format || jpeg_encoder_structure->image_width != in->w ||
+      jpeg_encoder_structure->image_height != in->h) {
+    jpeg_initialization(jpeg_encoder_structure, image_format, in->w, in->h);
+    jpeg_encoder_structure->image_format = image_format;
+    jpeg_encoder_structure->image_width = in->w;
+    jpeg_encoder_structure->image_height = in->h;
+    jpeg_encoder_structure->markers_size = 0;
+  }
 
-  MakeTables(jpeg_encoder_structure, quality_factor);
+  /* Quantization Table Initialization when the quality changed */
+  if (jpeg_encoder_structure->quality != (int32_t)quality_factor) {
+    MakeTables(jpeg_encoder_structure, quality_factor);
+    jpeg_encoder_structure->quality = quality_factor;
+    jpeg_encoder_structure->markers_size = 0;
+  }
 
-  /* Writing Marker Data */
+  /* Writing Marker Data, which is only made again after a change */
   if (add_dri_header) {
-    output_ptr = jpeg_write_markers(jpeg_encoder_structure, output_ptr, image_format, in->w, in->h);
+    if (jpeg_encoder_structure->markers_size == 0) {
+      jpeg_encoder_structure->markers_size = jpeg_write_markers(jpeg_encoder_structure, jpeg_encoder_structure->markers,
+                                             image_format, in->w, in->h) - jpeg_encoder_structure->markers;
+    }
+    memcpy(output_ptr, jpeg_encoder_structure->markers, jpeg_encoder_structure->markers_size);
+    output_ptr += jpeg_encoder_structure->markers_size;
   }
 
+  /* The DC predictions and the bit buffer start empty at every frame */
+  jpeg_encoder_structure->ldc1 = 0;
+  jpeg_encoder_structure->ldc2 = 0;
+  jpeg_encoder_structure->ldc3 = 0;
+  jpeg_encoder_structure->lcode = 0;
+  jpeg_encoder_structure->bitindex = 0;
+
   for (i = 1; i <= jpeg_encoder_structure->vertical_mcus; i++) {
     if (i < jpeg_encoder_structure->vertical_mcus) {
       jpeg_encoder_structure->rows = jpeg_encoder_structure->mcu_height;
@@ -451,7 +447,11 @@ void jpeg_encode_image(struct image_t *in, struct image_t *out, uint32_t quality
         jpeg_encoder_structure->incr = jpeg_encoder_structure->length_minus_width;
       }
 
-      read_format(jpeg_encoder_structure, input_ptr);
+      if (image_format == FOUR_TWO_ZERO) {
+        jpeg_read_420_format(jpeg_encoder_structure, in, (j - 1) * 16, (i - 1) * 16);
+      } else {
+        jpeg_encoder_structure->read_format(jpeg_encoder_structure, input_ptr);
+      }
 
       /* Encode the data in MCU */
       output_ptr = jpeg_encodeMCU(jpeg_encoder_structure, image_format, output_ptr);
@@ -469,32 +469,48 @@ void jpeg_encode_image(struct image_t *in, struct image_t *out, uint32_t quality
   out->buf_size = output_ptr - (uint8_t *)out->buf;
 }
 
+/**
+ * Encode an YUV422, grayscale, NV12 or I420 image with a new encoder
+ * Streams should keep a jpeg_encoder_t over the frames instead (see jpeg_encoder_encode).
+ * @param[in] *in The input image
+ * @param[out] *out The output JPEG image
+ * @param[in] quality_factor Quality factor of the encoding (0-99)
+ * @param[in] add_dri_header Add the DRI header (needed for full JPEG)
+ */
+void jpeg_encode_image(struct image_t *in, struct image_t *out, uint32_t quality_factor, bool add_dri_header)
+{
+  struct jpeg_encoder_t jpeg;
+  jpeg_encoder_init(&jpeg);
+  jpeg_encoder_encode(&jpeg, in, out, quality_factor, add_dri_header);
+}
+
 static uint8_t *jpeg_encodeMCU(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, uint32_t image_format, uint8_t *output_ptr)
 {
-  jpeg_levelshift(jpeg_encoder_structure->Y1);
-  jpeg_DCT(jpeg_encoder_structure->Y1);
-  jpeg_quantization(jpeg_encoder_structure, jpeg_encoder_structure->Y1, jpeg_encoder_structure->ILqt);
+  jpeg_block(jpeg_encoder_structure, jpeg_encoder_structure->Y1, jpeg_encoder_structure->ILqt);
   output_ptr = jpeg_huffman(jpeg_encoder_structure, 1, output_ptr);
 
-  if (image_format == FOUR_TWO_TWO) {
-    jpeg_levelshift(jpeg_encoder_structure->Y2);
-    jpeg_DCT(jpeg_encoder_structure->Y2);
-    jpeg_quantization(jpeg_encoder_structure, jpeg_encoder_structure->Y2, jpeg_encoder_structure->ILqt);
+  if (image_format == FOUR_TWO_TWO || image_format == FOUR_TWO_ZERO) {
+    jpeg_block(jpeg_encoder_structure, jpeg_encoder_structure->Y2, jpeg_encoder_structure->ILqt);
     output_ptr = jpeg_huffman(jpeg_encoder_structure, 1, output_ptr);
 
-    jpeg_levelshift(jpeg_encoder_structure->CB);
-    jpeg_DCT(jpeg_encoder_structure->CB);
-    jpeg_quantization(jpeg_encoder_structure, jpeg_encoder_structure->CB, jpeg_encoder_structure->ICqt);
+    if (image_format == FOUR_TWO_ZERO) {
+      jpeg_block(jpeg_encoder_structure, jpeg_encoder_structure->Y3, jpeg_encoder_structure->ILqt);
+      output_ptr = jpeg_huffman(jpeg_encoder_structure, 1, output_ptr);
+
+      jpeg_block(jpeg_encoder_structure, jpeg_encoder_structure->Y4, jpeg_encoder_structure->ILqt);
+      output_ptr = jpeg_huffman(jpeg_encoder_structure, 1, output_ptr);
+    }
+
+    jpeg_block(jpeg_encoder_structure, jpeg_encoder_structure->CB, jpeg_encoder_structure->ICqt);
     output_ptr = jpeg_huffman(jpeg_encoder_structure, 2, output_ptr);
 
-    jpeg_levelshift(jpeg_encoder_structure->CR);
-    jpeg_DCT(jpeg_encoder_structure->CR);
-    jpeg_quantization(jpeg_encoder_structure, jpeg_encoder_structure->CR, jpeg_encoder_structure->ICqt);
+    jpeg_block(jpeg_encoder_structure, jpeg_encoder_structure->CR, jpeg_encoder_structure->ICqt);
     output_ptr = jpeg_huffman(jpeg_encoder_structure, 3, output_ptr);
   }
   return output_ptr;
 }
 
+#if !defined(CV_SIMD)
 /* Level shifting to get 8 bit SIGNED values for the data  */
 static void jpeg_levelshift(int16_t *const data)
 {
@@ -593,6 +609,7 @@ static void jpeg_DCT(int16_t *data)
     data++;
   }
 }
+#endif
 
 #define PUTBITS    \
   {    \
@@ -823,6 +840,8 @@ static uint8_t *jpeg_write_markers(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structur
 
     if (image_format == FOUR_TWO_TWO) {
       *output_ptr++ = 0x21;
+    } else if (image_format == FOUR_TWO_ZERO) {
+      *output_ptr++ = 0x22;
     } else {
       *output_ptr++ = 0x11;
     }
@@ -928,6 +947,7 @@ static uint8_t *jpeg_write_markers(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structur
   }
 }*/
 
+#if !defined(CV_SIMD)
 /* multiply DCT Coefficients with Quantization table and store in ZigZag location */
 static void jpeg_quantization(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, int16_t *const data, uint16_t *const quant_table_ptr)
 {
@@ -941,6 +961,225 @@ static void jpeg_quantization(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, in
     jpeg_encoder_structure->Temp [zigzag_table [i]] = (int16_t) value;
   }
 }
+#endif
+
+#if defined(CV_SIMD_SSE2)
+/**
+ * The sum of the products of 4 rows with constants, shifted right (a * ka + b * kb + c * kc + d * kd) >> shift
+ * The products and sums are 32 bit, like those of jpeg_DCT.
+ */
+CV_INLINE __m128i jpeg_dct_mul_sse2(__m128i a, __m128i b, __m128i c, __m128i d, int16_t ka, int16_t kb, int16_t kc,
+                                    int16_t kd, int shift)
+{
+  __m128i kab = _mm_set_epi16(kb, ka, kb, ka, kb, ka, kb, ka);
+  __m128i kcd = _mm_set_epi16(kd, kc, kd, kc, kd, kc, kd, kc);
+  __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), kab), _mm_madd_epi16(_mm_unpacklo_epi16(c, d), kcd));
+  __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), kab), _mm_madd_epi16(_mm_unpackhi_epi16(c, d), kcd));
+  return _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+}
+
+/* Transpose 8 rows of 8 int16 values */
+CV_INLINE void jpeg_transpose_sse2(__m128i *r)
+{
+  __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]);
+  __m128i t1 = _mm_unpackhi_epi16(r[0], r[1]);
+  __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]);
+  __m128i t3 = _mm_unpackhi_epi16(r[2], r[3]);
+  __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]);
+  __m128i t5 = _mm_unpackhi_epi16(r[4], r[5]);
+  __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]);
+  __m128i t7 = _mm_unpackhi_epi16(r[6], r[7]);
+  __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+  __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+  __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+  __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+  __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+  __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+  __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+  __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+  r[0] = _mm_unpacklo_epi64(u0, u4);
+  r[1] = _mm_unpackhi_epi64(u0, u4);
+  r[2] = _mm_unpacklo_epi64(u1, u5);
+  r[3] = _mm_unpackhi_epi64(u1, u5);
+  r[4] = _mm_unpacklo_epi64(u2, u6);
+  r[5] = _mm_unpackhi_epi64(u2, u6);
+  r[6] = _mm_unpacklo_epi64(u3, u7);
+  r[7] = _mm_unpackhi_epi64(u3, u7);
+}
+
+/**
+ * One pass of jpeg_DCT on 8 lanes, the DCT of r[0] up to r[7] per lane
+ * @param[in,out] *r The 8 inputs and then the 8 coefficients
+ * @param[in] s_dc The shift of coefficients 0 and 4
+ * @param[in] s The shift of the other coefficients
+ */
+CV_INLINE void jpeg_dct_pass_sse2(__m128i *r, int s_dc, int s)
+{
+  __m128i x8 = _mm_add_epi16(r[0], r[7]);
+  __m128i x0 = _mm_sub_epi16(r[0], r[7]);
+  __m128i x7 = _mm_add_epi16(r[1], r[6]);
+  __m128i x1 = _mm_sub_epi16(r[1], r[6]);
+  __m128i x6 = _mm_add_epi16(r[2], r[5]);
+  __m128i x2 = _mm_sub_epi16(r[2], r[5]);
+  __m128i x5 = _mm_add_epi16(r[3], r[4]);
+  __m128i x3 = _mm_sub_epi16(r[3], r[4]);
+  __m128i x4 = _mm_add_epi16(x8, x5);
+  __m128i zero = _mm_setzero_si128();
+  x8 = _mm_sub_epi16(x8, x5);
+  x5 = _mm_add_epi16(x7, x6);
+  x7 = _mm_sub_epi16(x7, x6);
+
+  r[0] = _mm_srai_epi16(_mm_add_epi16(x4, x5), s_dc);
+  r[4] = _mm_srai_epi16(_mm_sub_epi16(x4, x5), s_dc);
+  r[2] = jpeg_dct_mul_sse2(x8, x7, zero, zero, 1338, 554, 0, 0, s);
+  r[6] = jpeg_dct_mul_sse2(x8, x7, zero, zero, 554, -1338, 0, 0, s);
+  r[7] = jpeg_dct_mul_sse2(x0, x1, x2, x3, 283, -805, 1204, -1420, s);
+  r[5] = jpeg_dct_mul_sse2(x0, x1, x2, x3, 805, -1420, 283, 1204, s);
+  r[3] = jpeg_dct_mul_sse2(x0, x1, x2, x3, 1204, -283, -1420, -805, s);
+  r[1] = jpeg_dct_mul_sse2(x0, x1, x2, x3, 1420, 1204, 805, 283, s);
+}
+#elif defined(CV_SIMD_NEON)
+/**
+ * The sum of the products of 4 rows with constants, shifted right (a * ka + b * kb + c * kc + d * kd) >> shift
+ * The products and sums are 32 bit, like those of jpeg_DCT.
+ */
+CV_INLINE int16x8_t jpeg_dct_mul_neon(int16x8_t a, int16x8_t b, int16x8_t c, int16x8_t d, int16_t ka, int16_t kb,
+                                      int16_t kc, int16_t kd, int shift)
+{
+  int32x4_t lo = vmull_n_s16(vget_low_s16(a), ka);
+  int32x4_t hi = vmull_n_s16(vget_high_s16(a), ka);
+  int32x4_t sh = vdupq_n_s32(-shift);
+  lo = vmlal_n_s16(lo, vget_low_s16(b), kb);
+  hi = vmlal_n_s16(hi, vget_high_s16(b), kb);
+  lo = vmlal_n_s16(lo, vget_low_s16(c), kc);
+  hi = vmlal_n_s16(hi, vget_high_s16(c), kc);
+  lo = vmlal_n_s16(lo, vget_low_s16(d), kd);
+  hi = vmlal_n_s16(hi, vget_high_s16(d), kd);
+  return vcombine_s16(vmovn_s32(vshlq_s32(lo, sh)), vmovn_s32(vshlq_s32(hi, sh)));
+}
+
+/* Transpose 8 rows of 8 int16 values */
+CV_INLINE void jpeg_transpose_neon(int16x8_t *r)
+{
+  int16x8x2_t a01 = vtrnq_s16(r[0], r[1]);
+  int16x8x2_t a23 = vtrnq_s16(r[2], r[3]);
+  int16x8x2_t a45 = vtrnq_s16(r[4], r[5]);
+  int16x8x2_t a67 = vtrnq_s16(r[6], r[7]);
+  int32x4x2_t b02 = vtrnq_s32(vreinterpretq_s32_s16(a01.val[0]), vreinterpretq_s32_s16(a23.val[0]));
+  int32x4x2_t b13 = vtrnq_s32(vreinterpretq_s32_s16(a01.val[1]), vreinterpretq_s32_s16(a23.val[1]));
+  int32x4x2_t b46 = vtrnq_s32(vreinterpretq_s32_s16(a45.val[0]), vreinterpretq_s32_s16(a67.val[0]));
+  int32x4x2_t b57 = vtrnq_s32(vreinterpretq_s32_s16(a45.val[1]), vreinterpretq_s32_s16(a67.val[1]));
+  r[0] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b02.val[0]), vget_low_s32(b46.val[0])));
+  r[1] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b13.val[0]), vget_low_s32(b57.val[0])));
+  r[2] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b02.val[1]), vget_low_s32(b46.val[1])));
+  r[3] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b13.val[1]), vget_low_s32(b57.val[1])));
+  r[4] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b02.val[0]), vget_high_s32(b46.val[0])));
+  r[5] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b13.val[0]), vget_high_s32(b57.val[0])));
+  r[6] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b02.val[1]), vget_high_s32(b46.val[1])));
+  r[7] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b13.val[1]), vget_high_s32(b57.val[1])));
+}
+
+/**
+ * One pass of jpeg_DCT on 8 lanes, the DCT of r[0] up to r[7] per lane
+ * @param[in,out] *r The 8 inputs and then the 8 coefficients
+ * @param[in] s_dc The shift of coefficients 0 and 4
+ * @param[in] s The shift of the other coefficients
+ */
+CV_INLINE void jpeg_dct_pass_neon(int16x8_t *r, int s_dc, int s)
+{
+  int16x8_t x8 = vaddq_s16(r[0], r[7]);
+  int16x8_t x0 = vsubq_s16(r[0], r[7]);
+  int16x8_t x7 = vaddq_s16(r[1], r[6]);
+  int16x8_t x1 = vsubq_s16(r[1], r[6]);
+  int16x8_t x6 = vaddq_s16(r[2], r[5]);
+  int16x8_t x2 = vsubq_s16(r[2], r[5]);
+  int16x8_t x5 = vaddq_s16(r[3], r[4]);
+  int16x8_t x3 = vsubq_s16(r[3], r[4]);
+  int16x8_t x4 = vaddq_s16(x8, x5);
+  int16x8_t zero = vdupq_n_s16(0);
+  int16x8_t sh_dc = vdupq_n_s16(-s_dc);
+  x8 = vsubq_s16(x8, x5);
+  x5 = vaddq_s16(x7, x6);
+  x7 = vsubq_s16(x7, x6);
+
+  r[0] = vshlq_s16(vaddq_s16(x4, x5), sh_dc);
+  r[4] = vshlq_s16(vsubq_s16(x4, x5), sh_dc);
+  r[2] = jpeg_dct_mul_neon(x8, x7, zero, zero, 1338, 554, 0, 0, s);
+  r[6] = jpeg_dct_mul_neon(x8, x7, zero, zero, 554, -1338, 0, 0, s);
+  r[7] = jpeg_dct_mul_neon(x0, x1, x2, x3, 283, -805, 1204, -1420, s);
+  r[5] = jpeg_dct_mul_neon(x0, x1, x2, x3, 805, -1420, 283, 1204, s);
+  r[3] = jpeg_dct_mul_neon(x0, x1, x2, x3, 1204, -283, -1420, -805, s);
+  r[1] = jpeg_dct_mul_neon(x0, x1, x2, x3, 1420, 1204, 805, 283, s);
+}
+#endif
+
+/**
+ * Level shift, DCT, quantize and zigzag one block into Temp
+ * The SIMD paths do jpeg_DCT with the rows in 8 lanes: the rows are
+ * transformed after a transpose and the columns after a second one, with
+ * the same 32 bit products and shifts, so all paths give the same output.
+ * The quantization multiplies by the reciprocals (0x8000 / q) and keeps the
+ * high part of the product, rounded.
+ * @param[in] *jpeg_encoder_structure The encoder
+ * @param[in] *data The block (8 bit values in int16_t)
+ * @param[in] *quant_table_ptr The reciprocals of the quantization table
+ */
+static void jpeg_block(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, int16_t *data, uint16_t *quant_table_ptr)
+{
+#if defined(CV_SIMD_SSE2)
+  __m128i r[8];
+  int16_t coeff[JPEG_BLOCK_SIZE];
+  uint8_t i;
+
+  for (i = 0; i < 8; i++) {
+    r[i] = _mm_sub_epi16(_mm_loadu_si128((__m128i *)&data[8 * i]), _mm_set1_epi16(128));
+  }
+  jpeg_transpose_sse2(r);
+  jpeg_dct_pass_sse2(r, 0, 10);
+  jpeg_transpose_sse2(r);
+  jpeg_dct_pass_sse2(r, 3, 13);
+
+  // The reciprocals are unsigned, so the signed high part is the unsigned one minus the reciprocal for negative values
+  for (i = 0; i < 8; i++) {
+    __m128i q = _mm_loadu_si128((__m128i *)&quant_table_ptr[8 * i]);
+    __m128i lo = _mm_mullo_epi16(r[i], q);
+    __m128i hi = _mm_sub_epi16(_mm_mulhi_epu16(r[i], q), _mm_and_si128(_mm_srai_epi16(r[i], 15), q));
+    __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), _mm_set1_epi32(0x4000)), 15);
+    __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), _mm_set1_epi32(0x4000)), 15);
+    _mm_storeu_si128((__m128i *)&coeff[8 * i], _mm_packs_epi32(p0, p1));
+  }
+  for (i = 0; i < JPEG_BLOCK_SIZE; i++) {
+    jpeg_encoder_structure->Temp [zigzag_table [i]] = coeff[i];
+  }
+#elif defined(CV_SIMD_NEON)
+  int16x8_t r[8];
+  int16_t coeff[JPEG_BLOCK_SIZE];
+  uint8_t i;
+
+  for (i = 0; i < 8; i++) {
+    r[i] = vsubq_s16(vld1q_s16(&data[8 * i]), vdupq_n_s16(128));
+  }
+  jpeg_transpose_neon(r);
+  jpeg_dct_pass_neon(r, 0, 10);
+  jpeg_transpose_neon(r);
+  jpeg_dct_pass_neon(r, 3, 13);
+
+  // The reciprocals need 16 unsigned bits, so the products are widened to 32 bit before the rounded shift
+  for (i = 0; i < 8; i++) {
+    uint16x8_t q = vld1q_u16(&quant_table_ptr[8 * i]);
+    int32x4_t p0 = vmulq_s32(vmovl_s16(vget_low_s16(r[i])), vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(q))));
+    int32x4_t p1 = vmulq_s32(vmovl_s16(vget_high_s16(r[i])), vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(q))));
+    vst1q_s16(&coeff[8 * i], vcombine_s16(vqrshrn_n_s32(p0, 15), vqrshrn_n_s32(p1, 15)));
+  }
+  for (i = 0; i < JPEG_BLOCK_SIZE; i++) {
+    jpeg_encoder_structure->Temp [zigzag_table [i]] = coeff[i];
+  }
+#else
+  jpeg_levelshift(data);
+  jpeg_DCT(data);
+  jpeg_quantization(jpeg_encoder_structure, data, quant_table_ptr);
+#endif
+}
 
 static void jpeg_read_400_format(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, uint8_t *input_ptr)
 {
@@ -1044,3 +1283,34 @@ static void jpeg_read_422_format(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure,
   }
 }
 
+/* Read a 16x16 MCU of an NV12 or I420 image at (x0, y0), pixels outside the image repeat the last row and column */
+static void jpeg_read_420_format(JPEG_ENCODER_STRUCTURE *jpeg_encoder_structure, struct image_t *in, uint16_t x0,
+                                 uint16_t y0)
+{
+  int32_t i, j, x, y;
+  uint8_t *y_plane, *u_plane, *v_plane, step;
+  uint16_t chroma_w = (in->w + 1) / 2;
+  uint16_t chroma_h = (in->h + 1) / 2;
+  int16_t *blocks[4] = {jpeg_encoder_structure->Y1, jpeg_encoder_structure->Y2, jpeg_encoder_structure->Y3,
+                        jpeg_encoder_structure->Y4
+                       };
+
+  image_yuv420_planes(in, &y_plane, &u_plane, &v_plane, &step);
+
+  for (i = 0; i < 16; i++) {
+    y = (y0 + i < in->h) ? y0 + i : in->h - 1;
+    for (j = 0; j < 16; j++) {
+      x = (x0 + j < in->w) ? x0 + j : in->w - 1;
+      blocks[(i >> 3) * 2 + (j >> 3)][(i & 7) * 8 + (j & 7)] = y_plane[y * in->w + x];
+    }
+  }
+
+  for (i = 0; i < 8; i++) {
+    y = (y0 / 2 + i < chroma_h) ? y0 / 2 + i : chroma_h - 1;
+    for (j = 0; j < 8; j++) {
+      x = (x0 / 2 + j < chroma_w) ? x0 / 2 + j : chroma_w - 1;
+      jpeg_encoder_structure->CB[i * 8 + j] = u_plane[(y * chroma_w + x) * step];
+      jpeg_encoder_structure->CR[i * 8 + j] = v_plane[(y * chroma_w + x) * step];
+    }
+  }
+}
@@ -31,6 +31,67 @@
 #define FOUR_FOUR_FOUR          3
 #define RGB                     4
 
+#define JPEG_BLOCK_SIZE 64
+#define JPEG_MARKERS_SIZE 608     ///< Maximum size of the markers before the scan data
+
+/* A JPEG encoder, which keeps its tables and markers over the frames (see jpeg_encoder_init) */
+struct jpeg_encoder_t {
+
+  // Encoder
+  uint16_t    mcu_width;
+  uint16_t    mcu_height;
+  uint16_t    horizontal_mcus;
+  uint16_t    vertical_mcus;
+  uint16_t    cols_in_right_mcus;
+  uint16_t    rows_in_bottom_mcus;
+
+  uint16_t    rows;
+  uint16_t    cols;
+
+  uint16_t    length_minus_mcu_width;
+  uint16_t    length_minus_width;
+  uint16_t    incr;
+  uint16_t    mcu_width_size;
+  uint16_t    offset;
+
+  int16_t ldc1;
+  int16_t ldc2;
+  int16_t ldc3;
+
+  void (*read_format)(struct jpeg_encoder_t *jpeg, uint8_t *input_ptr);
+
+  // Cache
+  uint32_t    image_format;         ///< Format of the geometry and markers
+  uint16_t    image_width;          ///< Width of the geometry and markers (0 when there is none)
+  uint16_t    image_height;         ///< Height of the geometry and markers
+  int32_t     quality;              ///< Quality factor of the tables (-1 when there are none)
+  uint16_t    markers_size;         ///< Size of the markers (0 when they have to be written again)
+  uint8_t     markers [JPEG_MARKERS_SIZE];
+
+  // Tables
+  uint8_t    Lqt [JPEG_BLOCK_SIZE];
+  uint8_t    Cqt [JPEG_BLOCK_SIZE];
+  uint16_t   ILqt [JPEG_BLOCK_SIZE];
+  uint16_t   ICqt [JPEG_BLOCK_SIZE];
+
+  int16_t    Y1 [JPEG_BLOCK_SIZE];
+  int16_t    Y2 [JPEG_BLOCK_SIZE];
+  int16_t    Y3 [JPEG_BLOCK_SIZE];
+  int16_t    Y4 [JPEG_BLOCK_SIZE];
+  int16_t    CB [JPEG_BLOCK_SIZE];
+  int16_t    CR [JPEG_BLOCK_SIZE];
+  int16_t    Temp [JPEG_BLOCK_SIZE];
+
+  uint32_t   lcode;
+  uint16_t   bitindex;
+
+};
+
+/* JPEG encode an image with an encoder that is kept over the frames */
+void jpeg_encoder_init(struct jpeg_encoder_t *jpeg);
+void jpeg_encoder_encode(struct jpeg_encoder_t *jpeg, struct image_t *in, struct image_t *out, uint32_t quality_factor,
+                         bool add_dri_header);
+
 /* JPEG encode an image */
 void jpeg_encode_image(struct image_t *in, struct image_t *out, uint32_t quality_factor, bool add_dri_header);
 
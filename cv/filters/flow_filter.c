@@ -0,0 +1,272 @@
+/*
+ * flow_filter.c
+ *
+ *  Streaming moving-average and moving-median filters for optical flow signals.
+ *
+ *  All state lives in the filter, so any number of independent signals (for instance
+ *  the flow of every region in the image) can be filtered side by side. Both filters
+ *  keep the samples in a ring buffer in order of arrival:
+ *  - the average keeps a running sum, which is re-summed every time the ring wraps
+ *    to keep the rounding error from accumulating;
+ *  - the median keeps the ring indexes in a double heap (a max-heap of the lower half
+ *    and a min-heap of the upper half around the median) together with the heap
+ *    position of every ring sample, so the oldest sample is replaced in place in
+ *    O(log n) instead of sorting the window for every new sample.
+ */
+
+#include "flow_filter.h"
+#include <stdlib.h>
+
+/* Number of samples in the min- and max-heap of the median */
+#define flow_min_count(f) (((f)->count - 1) / 2)
+#define flow_max_count(f) ((f)->count / 2)
+
+static inline bool flow_heap_less(struct flow_filter_t *f, int32_t i, int32_t j)
+{
+  return f->ring[f->heap[i]] < f->ring[f->heap[j]];
+}
+
+/* Swaps heap nodes i and j if the value at i is smaller than at j */
+static inline bool flow_heap_exchange(struct flow_filter_t *f, int32_t i, int32_t j)
+{
+  if (!flow_heap_less(f, i, j)) {
+    return false;
+  }
+
+  int32_t t = f->heap[i];
+  f->heap[i] = f->heap[j];
+  f->heap[j] = t;
+  f->pos[f->heap[i]] = i;
+  f->pos[f->heap[j]] = j;
+  return true;
+}
+
+static void flow_min_sort_down(struct flow_filter_t *f, int32_t i)
+{
+  for (; i <= flow_min_count(f); i *= 2) {
+    if (i > 1 && i < flow_min_count(f) && flow_heap_less(f, i + 1, i)) {
+      i++;
+    }
+    if (!flow_heap_exchange(f, i, i / 2)) {
+      break;
+    }
+  }
+}
+
+static void flow_max_sort_down(struct flow_filter_t *f, int32_t i)
+{
+  for (; i >= -flow_max_count(f); i *= 2) {
+    if (i < -1 && i > -flow_max_count(f) && flow_heap_less(f, i, i - 1)) {
+      i--;
+    }
+    if (!flow_heap_exchange(f, i / 2, i)) {
+      break;
+    }
+  }
+}
+
+/* Moves node i up the min-heap, returns true when it ended up at the median */
+static bool flow_min_sort_up(struct flow_filter_t *f, int32_t i)
+{
+  while (i > 0 && flow_heap_exchange(f, i, i / 2)) {
+    i /= 2;
+  }
+  return i == 0;
+}
+
+/* Moves node i up the max-heap, returns true when it ended up at the median */
+static bool flow_max_sort_up(struct flow_filter_t *f, int32_t i)
+{
+  while (i < 0 && flow_heap_exchange(f, i / 2, i)) {
+    i /= 2;
+  }
+  return i == 0;
+}
+
+/**
+ * Initialize a filter
+ * @param[out] *filter The filter to initialize
+ * @param[in] type The type of filter
+ * @param[in] size The length of the window in samples
+ * @return False when the size is zero or the buffers could not be allocated
+ */
+bool flow_filter_init(struct flow_filter_t *filter, enum flow_filter_type type, uint16_t size)
+{
+  filter->type = type;
+  filter->size = size;
+  filter->ring = NULL;
+  filter->pos = NULL;
+  filter->heap = NULL;
+
+  if (size == 0 || (type != FLOW_FILTER_AVERAGE && type != FLOW_FILTER_MEDIAN)) {
+    return false;
+  }
+
+  filter->ring = malloc(sizeof(float) * size);
+  if (type == FLOW_FILTER_MEDIAN) {
+    filter->pos = malloc(sizeof(int32_t) * size);
+    filter->heap = malloc(sizeof(int32_t) * size);
+  }
+
+  if (filter->ring == NULL || (type == FLOW_FILTER_MEDIAN && (filter->pos == NULL || filter->heap == NULL))) {
+    flow_filter_free(filter);
+    return false;
+  }
+
+  // The heap is indexed from -size/2 up to (size-1)/2
+  if (filter->heap != NULL) {
+    filter->heap += size / 2;
+  }
+
+  flow_filter_reset(filter);
+  return true;
+}
+
+/**
+ * Free the buffers of a filter
+ * @param[in] *filter The filter to free
+ */
+void flow_filter_free(struct flow_filter_t *filter)
+{
+  free(filter->ring);
+  free(filter->pos);
+  if (filter->heap != NULL) {
+    free(filter->heap - filter->size / 2);
+  }
+
+  filter->ring = NULL;
+  filter->pos = NULL;
+  filter->heap = NULL;
+  filter->count = 0;
+}
+
+/**
+ * Empty the window of a filter
+ * @param[in] *filter The filter to reset
+ */
+void flow_filter_reset(struct flow_filter_t *filter)
+{
+  filter->count = 0;
+  filter->idx = 0;
+  filter->sum = 0;
+
+  if (filter->type != FLOW_FILTER_MEDIAN) {
+    return;
+  }
+
+  // Fill pattern of the heap: median, max, min, max, min, ...
+  for (int32_t i = 0; i < filter->size; i++) {
+    filter->pos[i] = ((i + 1) / 2) * ((i & 1) ? -1 : 1);
+    filter->heap[filter->pos[i]] = i;
+  }
+}
+
+/**
+ * Fill the complete window of a filter with one value
+ * @param[in] *filter The filter to fill
+ * @param[in] value The value of every sample in the window
+ */
+void flow_filter_fill(struct flow_filter_t *filter, float value)
+{
+  // With equal samples every heap order is valid
+  flow_filter_reset(filter);
+  for (uint16_t i = 0; i < filter->size; i++) {
+    filter->ring[i] = value;
+  }
+  filter->count = filter->size;
+  filter->sum = (double)value * filter->size;
+}
+
+/**
+ * Add a sample to a filter, replacing the oldest one when the window is full
+ * @param[in] *filter The filter to update
+ * @param[in] value The new sample
+ * @return The filtered value of the window after adding the sample
+ */
+float flow_filter_update(struct flow_filter_t *filter, float value)
+{
+  bool is_new = (filter->count < filter->size);
+  uint16_t idx = filter->idx;
+  float old = filter->ring[idx];
+
+  filter->ring[idx] = value;
+  filter->idx = (idx + 1 == filter->size) ? 0 : idx + 1;
+  if (is_new) {
+    filter->count++;
+  }
+
+  if (filter->type == FLOW_FILTER_AVERAGE) {
+    if (filter->idx == 0) {
+      // Re-sum once every window to get rid of the accumulated rounding error
+      filter->sum = 0;
+      for (uint16_t i = 0; i < filter->count; i++) {
+        filter->sum += filter->ring[i];
+      }
+    } else {
+      filter->sum += (double)value - (is_new ? 0 : old);
+    }
+    return flow_filter_value(filter);
+  }
+
+  // Restore the heap order around the replaced sample
+  int32_t p = filter->pos[idx];
+  if (p > 0) {
+    if (!is_new && old < value) {
+      flow_min_sort_down(filter, p * 2);
+    } else if (flow_min_sort_up(filter, p)) {
+      flow_max_sort_down(filter, -1);
+    }
+  } else if (p < 0) {
+    if (!is_new && value < old) {
+      flow_max_sort_down(filter, p * 2);
+    } else if (flow_max_sort_up(filter, p)) {
+      flow_min_sort_down(filter, 1);
+    }
+  } else {
+    if (flow_max_count(filter)) {
+      flow_max_sort_down(filter, -1);
+    }
+    if (flow_min_count(filter)) {
+      flow_min_sort_down(filter, 1);
+    }
+  }
+
+  return flow_filter_value(filter);
+}
+
+/**
+ * Get the filtered value of a filter without adding a sample
+ * @param[in] *filter The filter
+ * @return The mean or median of the window, 0 when the window is empty.
+ * The median of an even number of samples is the mean of the two middle samples.
+ */
+float flow_filter_value(struct flow_filter_t *filter)
+{
+  if (filter->count == 0) {
+    return 0;
+  }
+
+  if (filter->type == FLOW_FILTER_AVERAGE) {
+    return (float)(filter->sum / filter->count);
+  }
+
+  float median = filter->ring[filter->heap[0]];
+  if ((filter->count & 1) == 0) {
+    median = (median + filter->ring[filter->heap[-1]]) / 2;
+  }
+  return median;
+}
+
+/**
+ * Add one sample to each of a set of independent filters
+ * @param[in] *filters The filters, one for every signal
+ * @param[in] *values The new sample of every signal
+ * @param[out] *out The filtered value of every signal (may be the same as values)
+ * @param[in] n The number of signals
+ */
+void flow_filter_update_array(struct flow_filter_t *filters, float *values, float *out, uint16_t n)
+{
+  for (uint16_t i = 0; i < n; i++) {
+    out[i] = flow_filter_update(&filters[i], values[i]);
+  }
+}
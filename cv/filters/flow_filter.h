@@ -0,0 +1,38 @@
+/*
+ * flow_filter.h
+ *
+ *  Streaming moving-average and moving-median filters for optical flow signals.
+ */
+
+#ifndef FLOW_FILTER_H_
+#define FLOW_FILTER_H_
+
+#include "std.h"
+
+/* The filter types, the values match the OF_FilterType of OFfilter() */
+enum flow_filter_type {
+  FLOW_FILTER_AVERAGE = 1,    ///< Mean of the window, running sum
+  FLOW_FILTER_MEDIAN = 2      ///< Median of the window, double heap
+};
+
+/* A filter over the last size samples of a single signal */
+struct flow_filter_t {
+  enum flow_filter_type type; ///< The type of filter
+  uint16_t size;              ///< Length of the window
+  uint16_t count;             ///< Number of samples in the window
+  uint16_t idx;               ///< Ring position the next sample is written to
+  float *ring;                ///< The samples in order of arrival
+  double sum;                 ///< Running sum of the ring (average)
+  int32_t *pos;               ///< Heap position of every ring sample (median)
+  int32_t *heap;              ///< Ring indexes, max-heap at [-1..], median at [0], min-heap at [1..] (median)
+};
+
+bool flow_filter_init(struct flow_filter_t *filter, enum flow_filter_type type, uint16_t size);
+void flow_filter_free(struct flow_filter_t *filter);
+void flow_filter_reset(struct flow_filter_t *filter);
+void flow_filter_fill(struct flow_filter_t *filter, float value);
+float flow_filter_update(struct flow_filter_t *filter, float value);
+float flow_filter_value(struct flow_filter_t *filter);
+void flow_filter_update_array(struct flow_filter_t *filters, float *values, float *out, uint16_t n);
+
+#endif /* FLOW_FILTER_H_ */
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "math.h"
+#include "simd.h"
 
 #ifdef LINUX
 /**
@@ -35,7 +36,7 @@
  * @param[out] *img The output image
  * @param[in] width The width of the image
  * @param[in] height The height of the image
- * @param[in] type The type of image (YUV422 or grayscale)
+ * @param[in] type The type of image (YUV422, grayscale, NV12 or I420, or JPEG or gradient)
  */
 void image_create(struct image_t *img, uint16_t width, uint16_t height, enum image_type type)
 {
@@ -51,6 +52,9 @@ void image_create(struct image_t *img, uint16_t width, uint16_t height, enum ima
     img->buf_size = sizeof(uint8_t) * 2 * width * height;  // At maximum quality this is enough
   } else if (type == IMAGE_GRADIENT) {
     img->buf_size = sizeof(int16_t) * width * height;
+  } else if (type == IMAGE_NV12 || type == IMAGE_I420) {
+    // A chroma sample for every 2x2 pixels, rounded up at odd sizes
+    img->buf_size = sizeof(uint8_t) * (width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2));
   } else {
     img->buf_size = sizeof(uint8_t) * width * height;
   }
@@ -115,128 +119,1753 @@ void image_switch(struct image_t *a, struct image_t *b)
 /**
  * Convert an image to grayscale.
  * Depending on the output type the U/V bytes are removed
- * @param[in] *input The input image (Needs to be YUV422)
+ * @param[in] *input The input image (YUV422, NV12 or I420)
  * @param[out] *output The output image
  */
 void image_to_grayscale(struct image_t *input, struct image_t *output)
 {
   uint8_t *source = input->buf;
   uint8_t *dest = output->buf;
-  source++;
+  uint8_t step = 1;
+
+  // The Y of NV12 and I420 is the first plane, the Y of YUV422 every second byte
+  if (input->type == IMAGE_YUV422) {
+    source++;
+    step = 2;
+  }
+
+  // Copy the creation timestamp (stays the same)
+  output->ts = input->ts;
+
+  // Copy the pixels
+  for (int y = 0; y < output->h; y++) {
+    for (int x = 0; x < output->w; x++) {
+      if (output->type == IMAGE_YUV422) {
+        *dest++ = 127;  // U / V
+      }
+      *dest++ = *source;    // Y
+      source += step;
+    }
+  }
+}
+
+/**
+ * Filter colors in an YUV422 image
+ * @param[in] *input The input image to filter
+ * @param[out] *output The filtered output image
+ * @param[in] y_m The Y minimum value
+ * @param[in] y_M The Y maximum value
+ * @param[in] u_m The U minimum value
+ * @param[in] u_M The U maximum value
+ * @param[in] v_m The V minimum value
+ * @param[in] v_M The V maximum value
+ * @return The amount of filtered pixels
+ */
+uint16_t image_yuv422_colorfilt(struct image_t *input, struct image_t *output, uint8_t y_m, uint8_t y_M, uint8_t u_m,
+                                uint8_t u_M, uint8_t v_m, uint8_t v_M)
+{
+  uint16_t cnt = 0;
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+
+  // Copy the creation timestamp (stays the same)
+  output->ts = input->ts;
+
+  // Go through all the pixels
+  for (uint16_t y = 0; y < input->h; y++) {
+    for (uint16_t x = 0; x < input->w; x += 2) {
+      // Check if the color is inside the specified values
+      if ( (source[0] >= u_m)
+        && (source[0] <= u_M)
+        && (source[2] >= v_m)
+        && (source[2] <= v_M)
+      ) {
+        // UYVY
+        if (source[1] >= y_m && source[1] <= y_M){
+          dest[0] = source[0];  // U
+        } else {
+          dest[0] = 127;        // U
+        }
+        if (source[3] >= y_m && source[3] <= y_M){
+          dest[2] = source[2];  // V
+        } else {
+          dest[2] = 127;        // V
+        }
+      } else {
+        // UYVY
+        dest[0] = 127;        // U
+        dest[2] = 127;        // V
+      }
+
+      dest[1] = source[1];  // Y1
+      dest[3] = source[3];  // Y2
+
+      // Go to the next 2 pixels
+      dest += 4;
+      source += 4;
+    }
+  }
+  return cnt;
+}
+
+/**
+* Simplified high-speed low CPU downsample function without averaging
+*  downsample factor must be 1, 2, 4, 8 ... 2^X
+*  image of typ UYVY expected. Only one color UV per 2 pixels
+*
+*  we keep the UV color of the first pixel pair
+*  and sample the intensity evenly 1-3-5-7-... or 1-5-9-...
+*
+*  input:         u1y1 v1y2 u3y3 v3y4 u5y5 v5y6 u7y7 v7y8 ...
+*  downsample=1   u1y1 v1y2 u3y3 v3y4 u5y5 v5y6 u7y7 v7y8 ...
+*  downsample=2   u1y1v1 (skip2) y3 (skip2) u5y5v5 (skip2 y7 (skip2) ...
+*  downsample=4   u1y1v1 (skip6) y5 (skip6) ...
+* @param[in] *input The input YUV422 image
+* @param[out] *output The downscaled YUV422 image
+* @param[in] downsample The downsample factor (must be downsample=2^X)
+*/
+void image_yuv422_downsample(struct image_t *input, struct image_t *output, uint16_t downsample)
+{
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint16_t pixelskip = (downsample - 1) * 2;
+
+  // Copy the creation timestamp (stays the same)
+  output->ts = input->ts;
+
+  // Go trough all the pixels
+  for (uint16_t y = 0; y < output->h; y++) {
+    for (uint16_t x = 0; x < output->w; x += 2) {
+      // YUYV
+      *dest++ = *source++; // U
+      *dest++ = *source++; // Y
+      *dest++ = *source++; // V
+      source += pixelskip;
+      *dest++ = *source++; // Y
+      source += pixelskip;
+    }
+    // read 1 in every 'downsample' rows, so skip (downsample-1) rows after reading the first
+    source += (downsample - 1) * input->w * 2;
+  }
+}
+
+/**
+* Downscale function with averaging, in a single pass over the input
+*  downscale factor must be 1, 2, 4, 8 or 16
+*  image of typ UYVY expected, the output size is set by the caller
+*  and should be at most the input size divided by the factor
+*
+*  Every output pixel gets the mean Y of a factor x factor block of input pixels,
+*  every output pixel pair the mean U and V of its two blocks.
+* @param[in] *input The input YUV422 image
+* @param[out] *output The downscaled YUV422 image
+* @param[in] downscale The downscale factor (must be downscale=2^X)
+*/
+void image_yuv422_downscale(struct image_t *input, struct image_t *output, uint8_t downscale)
+{
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint16_t *sum;
+  uint8_t shift = 0;
+
+  // Copy the creation timestamp (stays the same)
+  output->ts = input->ts;
+
+  // The means are divided by a shift, a block has downscale * downscale pixels
+  while ((1 << shift) < downscale) {
+    shift++;
+  }
+  sum = malloc(output->w * 2 * sizeof(uint16_t));
+  if (sum == NULL) {
+    return;
+  }
+
+  for (uint16_t y = 0; y < output->h; y++) {
+    memset(sum, 0, output->w * 2 * sizeof(uint16_t));
+
+    // Sum the rows of the block into the UYVY bytes of the output row
+    for (uint16_t r = 0; r < downscale; r++) {
+      uint8_t *row = source + (y * downscale + r) * input->w * 2;
+      for (uint16_t x = 0; x < output->w; x += 2) {
+        uint8_t *in = row + x * downscale * 2;
+        uint16_t *s = &sum[x * 2];
+        for (uint16_t i = 0; i < downscale; i++) {
+          s[0] += in[i * 4];                      // U
+          s[2] += in[i * 4 + 2];                  // V
+          s[1] += in[i * 2 + 1];                  // Y of the first block
+          s[3] += in[(i + downscale) * 2 + 1];    // Y of the second block
+        }
+      }
+    }
+
+    for (uint16_t x = 0; x < output->w * 2; x++) {
+      dest[x] = sum[x] >> (2 * shift);
+    }
+    dest += output->w * 2;
+  }
+  free(sum);
+}
+
+/**
+ * Get the planes of an NV12 or I420 image
+ * The chroma planes have (w + 1) / 2 x (h + 1) / 2 samples. The U and V of NV12 are interleaved,
+ * so their samples are chroma_step bytes apart.
+ * @param[in] *img The NV12 or I420 image
+ * @param[out] **y The Y plane
+ * @param[out] **u The first U sample
+ * @param[out] **v The first V sample
+ * @param[out] *chroma_step The bytes between the U (and V) samples
+ */
+void image_yuv420_planes(struct image_t *img, uint8_t **y, uint8_t **u, uint8_t **v, uint8_t *chroma_step)
+{
+  uint32_t chroma_size = ((img->w + 1) / 2) * ((img->h + 1) / 2);
+
+  *y = (uint8_t *)img->buf;
+  *u = *y + img->w * img->h;
+  if (img->type == IMAGE_NV12) {
+    *v = *u + 1;
+    *chroma_step = 2;
+  } else {
+    *v = *u + chroma_size;
+    *chroma_step = 1;
+  }
+}
+
+/**
+ * Downscale a plane by averaging blocks of downscale x downscale samples
+ * Blocks that stick out of the input plane repeat its last row and column.
+ * @param[in] *input The first input sample
+ * @param[in] input_w The width of the input plane
+ * @param[in] input_h The height of the input plane
+ * @param[out] *output The first output sample
+ * @param[in] w The width of the output plane
+ * @param[in] h The height of the output plane
+ * @param[in] step The bytes between the samples of both planes
+ * @param[in] downscale The downscale factor (1, 2, 4, 8 or 16)
+ * @param[in] shift The log2 of the downscale factor
+ * @param[in] *sum A buffer of w sums
+ */
+static void image_plane_downscale(uint8_t *input, uint16_t input_w, uint16_t input_h, uint8_t *output, uint16_t w,
+                                  uint16_t h, uint8_t step, uint8_t downscale, uint8_t shift, uint16_t *sum)
+{
+  for (uint16_t y = 0; y < h; y++) {
+    memset(sum, 0, w * sizeof(uint16_t));
+
+    for (uint16_t r = 0; r < downscale; r++) {
+      uint16_t row_y = (y * downscale + r < input_h) ? y * downscale + r : input_h - 1;
+      uint8_t *row = input + row_y * input_w * step;
+      for (uint16_t x = 0; x < w; x++) {
+        for (uint16_t i = 0; i < downscale; i++) {
+          uint16_t col = (x * downscale + i < input_w) ? x * downscale + i : input_w - 1;
+          sum[x] += row[col * step];
+        }
+      }
+    }
+
+    for (uint16_t x = 0; x < w; x++) {
+      output[(y * w + x) * step] = sum[x] >> (2 * shift);
+    }
+  }
+}
+
+/**
+* Downscale function with averaging for NV12 and I420 images
+*  downscale factor must be 1, 2, 4, 8 or 16
+*  the output has the type of the input, its size is set by the caller
+*  and should be at most the input size divided by the factor
+*
+*  Every output pixel gets the mean Y of a factor x factor block of input pixels,
+*  every output chroma sample the mean of a factor x factor block of input chroma samples.
+* @param[in] *input The input NV12 or I420 image
+* @param[out] *output The downscaled image
+* @param[in] downscale The downscale factor (must be downscale=2^X)
+*/
+void image_yuv420_downscale(struct image_t *input, struct image_t *output, uint8_t downscale)
+{
+  uint8_t *in_y, *in_u, *in_v, *out_y, *out_u, *out_v;
+  uint8_t step, shift = 0;
+  uint16_t *sum;
+
+  if (input->type != output->type || (input->type != IMAGE_NV12 && input->type != IMAGE_I420)) {
+    return;
+  }
 
   // Copy the creation timestamp (stays the same)
   output->ts = input->ts;
 
-  // Copy the pixels
-  for (int y = 0; y < output->h; y++) {
-    for (int x = 0; x < output->w; x++) {
-      if (output->type == IMAGE_YUV422) {
-        *dest++ = 127;  // U / V
+  while ((1 << shift) < downscale) {
+    shift++;
+  }
+  sum = malloc(output->w * sizeof(uint16_t));
+  if (sum == NULL) {
+    return;
+  }
+
+  image_yuv420_planes(input, &in_y, &in_u, &in_v, &step);
+  image_yuv420_planes(output, &out_y, &out_u, &out_v, &step);
+  image_plane_downscale(in_y, input->w, input->h, out_y, output->w, output->h, 1, downscale, shift, sum);
+  image_plane_downscale(in_u, (input->w + 1) / 2, (input->h + 1) / 2, out_u, (output->w + 1) / 2,
+                        (output->h + 1) / 2, step, downscale, shift, sum);
+  image_plane_downscale(in_v, (input->w + 1) / 2, (input->h + 1) / 2, out_v, (output->w + 1) / 2,
+                        (output->h + 1) / 2, step, downscale, shift, sum);
+  free(sum);
+}
+
+/**
+ * Get the Y plane of an image as a grayscale image, without copying it
+ * The output shares the buffer of the input, so it should not be freed and it is only valid as long as the input is.
+ * @param[in] *input The input image (grayscale, NV12 or I420)
+ * @param[out] *output The grayscale image
+ */
+void image_grayscale_view(struct image_t *input, struct image_t *output)
+{
+  if (input->type != IMAGE_GRAYSCALE && input->type != IMAGE_NV12 && input->type != IMAGE_I420) {
+    return;
+  }
+
+  output->type = IMAGE_GRAYSCALE;
+  output->w = input->w;
+  output->h = input->h;
+  output->ts = input->ts;
+  output->eulers = input->eulers;
+  output->pprz_ts = input->pprz_ts;
+  output->buf_idx = input->buf_idx;
+  output->buf_size = input->w * input->h;
+  output->buf = input->buf;
+}
+
+/**
+ * Crop an image
+ * The crop is clipped to the input. For YUV422 the x and width are rounded down to whole
+ * macropixels, for NV12 and I420 also the y and height to whole chroma samples.
+ * @param[in] *input The input image (YUV422, grayscale, gradient, NV12 or I420)
+ * @param[out] *output The cropped image of the same type, its buffer should fit the cropped size
+ * @param[in] *crop The area to crop
+ */
+void image_crop(struct image_t *input, struct image_t *output, struct crop_t *crop)
+{
+  bool yuv420 = (input->type == IMAGE_NV12 || input->type == IMAGE_I420);
+  uint8_t pixel_width = (input->type == IMAGE_YUV422 || input->type == IMAGE_GRADIENT) ? 2 : 1;
+  uint16_t x = crop->x, y = crop->y, w, h;
+  uint32_t size;
+
+  if (input->type != output->type || input->type == IMAGE_JPEG || x >= input->w || y >= input->h) {
+    return;
+  }
+  if (input->type == IMAGE_YUV422 || yuv420) {
+    x &= ~1;
+  }
+  if (yuv420) {
+    y &= ~1;
+  }
+  w = (crop->w < input->w - x) ? crop->w : input->w - x;
+  h = (crop->h < input->h - y) ? crop->h : input->h - y;
+  if (input->type == IMAGE_YUV422 || yuv420) {
+    w &= ~1;
+  }
+  if (yuv420) {
+    h &= ~1;
+  }
+  size = w * h * pixel_width + (yuv420 ? w * h / 2 : 0);
+  if (w == 0 || h == 0 || output->buf_size < size) {
+    return;
+  }
+
+  output->w = w;
+  output->h = h;
+  output->ts = input->ts;
+  output->eulers = input->eulers;
+  output->pprz_ts = input->pprz_ts;
+
+  // The pixels, or the Y plane
+  for (uint16_t r = 0; r < h; r++) {
+    memcpy((uint8_t *)output->buf + r * w * pixel_width,
+           (uint8_t *)input->buf + ((y + r) * input->w + x) * pixel_width, w * pixel_width);
+  }
+
+  if (yuv420) {
+    uint8_t *in_y, *in_u, *in_v, *out_y, *out_u, *out_v;
+    uint8_t step;
+    uint16_t in_cw = (input->w + 1) / 2;
+
+    image_yuv420_planes(input, &in_y, &in_u, &in_v, &step);
+    image_yuv420_planes(output, &out_y, &out_u, &out_v, &step);
+    for (uint16_t r = 0; r < h / 2; r++) {
+      uint32_t in_offset = ((y / 2 + r) * in_cw + x / 2) * step;
+      memcpy(out_u + r * (w / 2) * step, in_u + in_offset, (w / 2) * step);
+      if (input->type == IMAGE_I420) {
+        memcpy(out_v + r * (w / 2), in_v + in_offset, w / 2);
+      }
+    }
+  }
+}
+
+/* Output pixels per side of the tiles of image_rotate_rows, so the input rows of a tile stay in the cache */
+#define IMAGE_ROTATE_TILE 64
+
+/**
+ * Get the size of a rotated or mirrored image
+ * @param[in] *input The input image
+ * @param[in] orientation The rotation or mirror
+ * @param[out] *size The size of the output image
+ */
+void image_rotate_size(struct image_t *input, enum image_orientation orientation, struct img_size_t *size)
+{
+  if (orientation == IMAGE_ROTATE_90 || orientation == IMAGE_ROTATE_270 || orientation == IMAGE_TRANSPOSE) {
+    size->w = input->h;
+    size->h = input->w;
+  } else {
+    size->w = input->w;
+    size->h = input->h;
+  }
+}
+
+/**
+ * Copy an output pixel of a rotation or mirror from its input pixel
+ * A YUV422 output pixel pair gets the U of the input pixel pair of its first pixel and the V of the one of its
+ * second pixel.
+ * @param[in] *input The input image (grayscale or YUV422)
+ * @param[out] *output The output image
+ * @param[in] orientation The rotation or mirror
+ * @param[in] x The output column
+ * @param[in] y The output row
+ */
+static inline void image_rotate_pixel(struct image_t *input, struct image_t *output, enum image_orientation orientation,
+                                      uint16_t x, uint16_t y)
+{
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint16_t sx, sy;
+
+  switch (orientation) {
+    case IMAGE_ROTATE_90:
+      sx = y;
+      sy = input->h - 1 - x;
+      break;
+    case IMAGE_ROTATE_180:
+      sx = input->w - 1 - x;
+      sy = input->h - 1 - y;
+      break;
+    case IMAGE_ROTATE_270:
+      sx = input->w - 1 - y;
+      sy = x;
+      break;
+    case IMAGE_FLIP_HORIZONTAL:
+      sx = input->w - 1 - x;
+      sy = y;
+      break;
+    case IMAGE_FLIP_VERTICAL:
+      sx = x;
+      sy = input->h - 1 - y;
+      break;
+    case IMAGE_TRANSPOSE:
+      sx = y;
+      sy = x;
+      break;
+    default:
+      sx = x;
+      sy = y;
+      break;
+  }
+
+  if (input->type == IMAGE_YUV422) {
+    dest[(y * output->w + x) * 2] = source[(sy * input->w + (sx & ~1)) * 2 + (x & 1) * 2];  // U / V
+    dest[(y * output->w + x) * 2 + 1] = source[(sy * input->w + sx) * 2 + 1];              // Y
+  } else {
+    dest[y * output->w + x] = source[sy * input->w + sx];
+  }
+}
+
+/**
+ * Transpose a block of 8x8 grayscale pixels
+ * Output row j is column j of the input rows.
+ * @param[in] **rows The 8 input rows
+ * @param[out] **output The 8 output rows
+ */
+CV_INLINE void image_transpose_8x8_u8(uint8_t **rows, uint8_t **output)
+{
+#if defined(CV_SIMD_SSE2)
+  __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)rows[0]), _mm_loadl_epi64((__m128i *)rows[1]));
+  __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)rows[2]), _mm_loadl_epi64((__m128i *)rows[3]));
+  __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)rows[4]), _mm_loadl_epi64((__m128i *)rows[5]));
+  __m128i a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)rows[6]), _mm_loadl_epi64((__m128i *)rows[7]));
+  __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+  __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+  __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+  __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+
+  // Every register holds two output rows
+  __m128i c[4] = {_mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2), _mm_unpacklo_epi32(b1, b3),
+                  _mm_unpackhi_epi32(b1, b3)
+                 };
+  for (uint8_t j = 0; j < 4; j++) {
+    _mm_storel_epi64((__m128i *)output[2 * j], c[j]);
+    _mm_storel_epi64((__m128i *)output[2 * j + 1], _mm_unpackhi_epi64(c[j], c[j]));
+  }
+#elif defined(CV_SIMD_NEON)
+  uint8x8x2_t a0 = vtrn_u8(vld1_u8(rows[0]), vld1_u8(rows[1]));
+  uint8x8x2_t a1 = vtrn_u8(vld1_u8(rows[2]), vld1_u8(rows[3]));
+  uint8x8x2_t a2 = vtrn_u8(vld1_u8(rows[4]), vld1_u8(rows[5]));
+  uint8x8x2_t a3 = vtrn_u8(vld1_u8(rows[6]), vld1_u8(rows[7]));
+  uint16x4x2_t b0 = vtrn_u16(vreinterpret_u16_u8(a0.val[0]), vreinterpret_u16_u8(a1.val[0]));
+  uint16x4x2_t b1 = vtrn_u16(vreinterpret_u16_u8(a0.val[1]), vreinterpret_u16_u8(a1.val[1]));
+  uint16x4x2_t b2 = vtrn_u16(vreinterpret_u16_u8(a2.val[0]), vreinterpret_u16_u8(a3.val[0]));
+  uint16x4x2_t b3 = vtrn_u16(vreinterpret_u16_u8(a2.val[1]), vreinterpret_u16_u8(a3.val[1]));
+
+  // The columns j and j + 4
+  uint32x2x2_t c0 = vtrn_u32(vreinterpret_u32_u16(b0.val[0]), vreinterpret_u32_u16(b2.val[0]));
+  uint32x2x2_t c1 = vtrn_u32(vreinterpret_u32_u16(b1.val[0]), vreinterpret_u32_u16(b3.val[0]));
+  uint32x2x2_t c2 = vtrn_u32(vreinterpret_u32_u16(b0.val[1]), vreinterpret_u32_u16(b2.val[1]));
+  uint32x2x2_t c3 = vtrn_u32(vreinterpret_u32_u16(b1.val[1]), vreinterpret_u32_u16(b3.val[1]));
+  vst1_u8(output[0], vreinterpret_u8_u32(c0.val[0]));
+  vst1_u8(output[1], vreinterpret_u8_u32(c1.val[0]));
+  vst1_u8(output[2], vreinterpret_u8_u32(c2.val[0]));
+  vst1_u8(output[3], vreinterpret_u8_u32(c3.val[0]));
+  vst1_u8(output[4], vreinterpret_u8_u32(c0.val[1]));
+  vst1_u8(output[5], vreinterpret_u8_u32(c1.val[1]));
+  vst1_u8(output[6], vreinterpret_u8_u32(c2.val[1]));
+  vst1_u8(output[7], vreinterpret_u8_u32(c3.val[1]));
+#else
+  for (uint8_t j = 0; j < 8; j++) {
+    for (uint8_t i = 0; i < 8; i++) {
+      output[j][i] = rows[i][j];
+    }
+  }
+#endif
+}
+
+/**
+ * Transpose a block of 8x8 YUV422 pixels
+ * Output row j is column j of the input rows, the first input column is even. The output pixel pairs get the
+ * U and V of the input pixel pair of their first and second pixel.
+ * @param[in] **rows The 8 input rows
+ * @param[out] **output The 8 output rows
+ */
+CV_INLINE void image_transpose_8x8_yuv422(uint8_t **rows, uint8_t **output)
+{
+#if defined(CV_SIMD_SSE2)
+  __m128i a[8], b[8];
+  for (uint8_t i = 0; i < 4; i++) {
+    __m128i r0 = _mm_loadu_si128((__m128i *)rows[2 * i]);
+    __m128i r1 = _mm_loadu_si128((__m128i *)rows[2 * i + 1]);
+    a[2 * i] = _mm_unpacklo_epi16(r0, r1);
+    a[2 * i + 1] = _mm_unpackhi_epi16(r0, r1);
+  }
+  // The columns of input rows 0-3 in b[0-3] and of rows 4-7 in b[4-7], two columns per register
+  for (uint8_t h = 0; h < 8; h += 4) {
+    b[h] = _mm_unpacklo_epi32(a[h], a[h + 2]);
+    b[h + 1] = _mm_unpackhi_epi32(a[h], a[h + 2]);
+    b[h + 2] = _mm_unpacklo_epi32(a[h + 1], a[h + 3]);
+    b[h + 3] = _mm_unpackhi_epi32(a[h + 1], a[h + 3]);
+  }
+
+  // An even column has the U and the next column the V of every pixel pair, the output pixel pairs take one of each
+  __m128i odd = _mm_set_epi16(0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0);
+  __m128i even = _mm_set_epi16(0, 0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF);
+  for (uint8_t m = 0; m < 4; m++) {
+    __m128i u = _mm_unpacklo_epi64(b[m], b[m + 4]);
+    __m128i v = _mm_unpackhi_epi64(b[m], b[m + 4]);
+    _mm_storeu_si128((__m128i *)output[2 * m], _mm_or_si128(_mm_andnot_si128(odd, u), _mm_and_si128(odd, v)));
+    _mm_storeu_si128((__m128i *)output[2 * m + 1], _mm_or_si128(_mm_andnot_si128(even, v), _mm_and_si128(even, u)));
+  }
+#elif defined(CV_SIMD_NEON)
+  uint16x8x2_t a[4];
+  uint32x4x2_t b[4];
+  for (uint8_t i = 0; i < 4; i++) {
+    a[i] = vtrnq_u16(vld1q_u16((uint16_t *)rows[2 * i]), vld1q_u16((uint16_t *)rows[2 * i + 1]));
+  }
+  // The columns j and j + 4 of input rows 0-3 in b[0-1] and of rows 4-7 in b[2-3]
+  b[0] = vtrnq_u32(vreinterpretq_u32_u16(a[0].val[0]), vreinterpretq_u32_u16(a[1].val[0]));
+  b[1] = vtrnq_u32(vreinterpretq_u32_u16(a[0].val[1]), vreinterpretq_u32_u16(a[1].val[1]));
+  b[2] = vtrnq_u32(vreinterpretq_u32_u16(a[2].val[0]), vreinterpretq_u32_u16(a[3].val[0]));
+  b[3] = vtrnq_u32(vreinterpretq_u32_u16(a[2].val[1]), vreinterpretq_u32_u16(a[3].val[1]));
+
+  // Column 2 * m + k of input rows 0-3 is in b[k].val[m % 2] and of rows 4-7 in b[k + 2].val[m % 2], in the high
+  // halves for m >= 2
+  static const uint8_t odd_bytes[16] = {0, 0, 0xFF, 0, 0, 0, 0xFF, 0, 0, 0, 0xFF, 0, 0, 0, 0xFF, 0};
+  static const uint8_t even_bytes[16] = {0xFF, 0, 0, 0, 0xFF, 0, 0, 0, 0xFF, 0, 0, 0, 0xFF, 0, 0, 0};
+  uint8x16_t odd = vld1q_u8(odd_bytes);
+  uint8x16_t even = vld1q_u8(even_bytes);
+  for (uint8_t m = 0; m < 4; m++) {
+    uint32x4_t lo_u = b[0].val[m % 2], hi_u = b[2].val[m % 2];
+    uint32x4_t lo_v = b[1].val[m % 2], hi_v = b[3].val[m % 2];
+    uint8x16_t u = vreinterpretq_u8_u32((m < 2) ? vcombine_u32(vget_low_u32(lo_u), vget_low_u32(hi_u)) :
+                                        vcombine_u32(vget_high_u32(lo_u), vget_high_u32(hi_u)));
+    uint8x16_t v = vreinterpretq_u8_u32((m < 2) ? vcombine_u32(vget_low_u32(lo_v), vget_low_u32(hi_v)) :
+                                        vcombine_u32(vget_high_u32(lo_v), vget_high_u32(hi_v)));
+    vst1q_u8(output[2 * m], vbslq_u8(odd, v, u));
+    vst1q_u8(output[2 * m + 1], vbslq_u8(even, u, v));
+  }
+#else
+  for (uint8_t j = 0; j < 8; j++) {
+    for (uint8_t i = 0; i < 8; i++) {
+      output[j][2 * i] = rows[i][(j & ~1) * 2 + (i & 1) * 2];   // U / V
+      output[j][2 * i + 1] = rows[i][2 * j + 1];                // Y
+    }
+  }
+#endif
+}
+
+/**
+ * Reverse the pixels of a row
+ * The YUV422 pixel pairs are reversed as a whole, so they keep their U and V.
+ * @param[in] *input The input row
+ * @param[out] *output The output row
+ * @param[in] w The amount of pixels (even for YUV422)
+ * @param[in] yuv422 The pixels are YUV422, otherwise grayscale
+ */
+static void image_reverse_row(uint8_t *input, uint8_t *output, uint16_t w, bool yuv422)
+{
+  uint16_t x = 0;
+
+  if (!yuv422) {
+#if defined(CV_SIMD_SSE2)
+    for (; x + 16 <= w; x += 16) {
+      __m128i v = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&input[w - 16 - x]), _MM_SHUFFLE(0, 1, 2, 3));
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+      _mm_storeu_si128((__m128i *)&output[x], _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(CV_SIMD_NEON)
+    for (; x + 16 <= w; x += 16) {
+      uint8x16_t v = vrev64q_u8(vld1q_u8(&input[w - 16 - x]));
+      vst1q_u8(&output[x], vcombine_u8(vget_high_u8(v), vget_low_u8(v)));
+    }
+#endif
+    for (; x < w; x++) {
+      output[x] = input[w - 1 - x];
+    }
+    return;
+  }
+
+  // Reverse the pixel pairs (U Y V Y) and swap their Y
+#if defined(CV_SIMD_SSE2)
+  __m128i uv = _mm_set1_epi32(0x00FF00FF);
+  __m128i y0 = _mm_set1_epi32(0xFF000000);
+  __m128i y1 = _mm_set1_epi32(0x0000FF00);
+  for (; x + 8 <= w; x += 8) {
+    __m128i v = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&input[(w - 8 - x) * 2]), _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_or_si128(_mm_and_si128(v, uv),
+                     _mm_or_si128(_mm_and_si128(_mm_slli_epi32(v, 16), y0), _mm_and_si128(_mm_srli_epi32(v, 16), y1)));
+    _mm_storeu_si128((__m128i *)&output[x * 2], v);
+  }
+#elif defined(CV_SIMD_NEON)
+  uint32x4_t uv = vdupq_n_u32(0x00FF00FF);
+  uint32x4_t y0 = vdupq_n_u32(0xFF000000);
+  uint32x4_t y1 = vdupq_n_u32(0x0000FF00);
+  for (; x + 8 <= w; x += 8) {
+    uint32x4_t v = vrev64q_u32(vld1q_u32((uint32_t *)&input[(w - 8 - x) * 2]));
+    v = vcombine_u32(vget_high_u32(v), vget_low_u32(v));
+    v = vorrq_u32(vandq_u32(v, uv), vorrq_u32(vandq_u32(vshlq_n_u32(v, 16), y0), vandq_u32(vshrq_n_u32(v, 16), y1)));
+    vst1q_u32((uint32_t *)&output[x * 2], v);
+  }
+#endif
+  for (; x < w; x += 2) {
+    uint8_t *pair = &input[(w - 2 - x) * 2];
+    output[x * 2] = pair[0];
+    output[x * 2 + 1] = pair[3];
+    output[x * 2 + 2] = pair[2];
+    output[x * 2 + 3] = pair[1];
+  }
+}
+
+/**
+ * Rotate or mirror the output rows y0 up to y1 of an image
+ * The rotations and the transpose run in tiles of 8x8 blocks, so both the input and the output stay in the cache.
+ * Bands of rows can run on threads of their own, or follow the stage that produces the input rows they need.
+ * @param[in] *input The input image (grayscale or YUV422)
+ * @param[out] *output The output image of the same type and the size of image_rotate_size
+ * @param[in] orientation The rotation or mirror
+ * @param[in] y0 The first output row (even for YUV422)
+ * @param[in] y1 The end of the output rows
+ */
+void image_rotate_rows(struct image_t *input, struct image_t *output, enum image_orientation orientation, uint16_t y0,
+                       uint16_t y1)
+{
+  bool yuv422 = (input->type == IMAGE_YUV422);
+  uint8_t pixel_width = yuv422 ? 2 : 1;
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint16_t x, y;
+
+  // The rows of the mirrors and the rotation by 180 degrees are input rows, as a whole or reversed
+  if (orientation != IMAGE_ROTATE_90 && orientation != IMAGE_ROTATE_270 && orientation != IMAGE_TRANSPOSE) {
+    for (y = y0; y < y1; y++) {
+      bool flip_y = (orientation == IMAGE_ROTATE_180 || orientation == IMAGE_FLIP_VERTICAL);
+      uint8_t *row = &source[(flip_y ? input->h - 1 - y : y) * input->w * pixel_width];
+      if (orientation == IMAGE_ROTATE_180 || orientation == IMAGE_FLIP_HORIZONTAL) {
+        image_reverse_row(row, &dest[y * output->w * pixel_width], output->w, yuv422);
+      } else {
+        memcpy(&dest[y * output->w * pixel_width], row, output->w * pixel_width);
+      }
+    }
+    return;
+  }
+
+  // The blocks of 8x8 pixels, in tiles
+  uint16_t block_y1 = y0 + (y1 - y0) / 8 * 8;
+  uint16_t block_x1 = output->w / 8 * 8;
+  uint8_t *rows[8], *out[8];
+  for (uint16_t ty = y0; ty < block_y1; ty += IMAGE_ROTATE_TILE) {
+    for (uint16_t tx = 0; tx < block_x1; tx += IMAGE_ROTATE_TILE) {
+      for (y = ty; y < ty + IMAGE_ROTATE_TILE && y < block_y1; y += 8) {
+        for (x = tx; x < tx + IMAGE_ROTATE_TILE && x < block_x1; x += 8) {
+          // The input rows of the output columns x up to x + 8, and the output rows of the input columns
+          for (uint8_t i = 0; i < 8; i++) {
+            if (orientation == IMAGE_ROTATE_90) {
+              rows[i] = &source[((input->h - 1 - x - i) * input->w + y) * pixel_width];
+              out[i] = &dest[((y + i) * output->w + x) * pixel_width];
+            } else if (orientation == IMAGE_ROTATE_270) {
+              rows[i] = &source[((x + i) * input->w + input->w - 8 - y) * pixel_width];
+              out[i] = &dest[((y + 7 - i) * output->w + x) * pixel_width];
+            } else {
+              rows[i] = &source[((x + i) * input->w + y) * pixel_width];
+              out[i] = &dest[((y + i) * output->w + x) * pixel_width];
+            }
+          }
+          if (yuv422) {
+            image_transpose_8x8_yuv422(rows, out);
+          } else {
+            image_transpose_8x8_u8(rows, out);
+          }
+        }
+      }
+    }
+  }
+
+  // The pixels right of and below the blocks
+  for (y = y0; y < y1; y++) {
+    for (x = (y < block_y1) ? block_x1 : 0; x < output->w; x++) {
+      image_rotate_pixel(input, output, orientation, x, y);
+    }
+  }
+}
+
+/**
+ * Rotate or mirror an image
+ * Rotations are clockwise. For YUV422 both the input and the output width have to be even.
+ * @param[in] *input The input image (grayscale or YUV422)
+ * @param[out] *output The output image of the same type, its buffer should fit the image
+ * @param[in] orientation The rotation or mirror
+ */
+void image_rotate(struct image_t *input, struct image_t *output, enum image_orientation orientation)
+{
+  struct img_size_t size;
+  uint8_t pixel_width = (input->type == IMAGE_YUV422) ? 2 : 1;
+
+  image_rotate_size(input, orientation, &size);
+  if (input->type != output->type || (input->type != IMAGE_YUV422 && input->type != IMAGE_GRAYSCALE) ||
+      output->buf_size < size.w * size.h * pixel_width ||
+      (input->type == IMAGE_YUV422 && (input->w % 2 != 0 || size.w % 2 != 0))) {
+    return;
+  }
+
+  output->w = size.w;
+  output->h = size.h;
+  output->ts = input->ts;
+  output->eulers = input->eulers;
+  output->pprz_ts = input->pprz_ts;
+  image_rotate_rows(input, output, orientation, 0, size.h);
+}
+
+/* Columns per tile of the separable filters, so the rows of the horizontal pass stay in the cache */
+#define IMAGE_FILTER_TILE 1024
+
+/* Run the statement for the taps k = 0 up to taps (at most 7). The amount of taps is a constant in the specialized
+ * passes, so this unrolls the taps and leaves out the ones that are not used. */
+#define IMAGE_FILTER_UNROLL(k, taps, ...) do {    \
+    k = 0; if (k < (taps)) { __VA_ARGS__ }        \
+    k = 1; if (k < (taps)) { __VA_ARGS__ }        \
+    k = 2; if (k < (taps)) { __VA_ARGS__ }        \
+    k = 3; if (k < (taps)) { __VA_ARGS__ }        \
+    k = 4; if (k < (taps)) { __VA_ARGS__ }        \
+    k = 5; if (k < (taps)) { __VA_ARGS__ }        \
+    k = 6; if (k < (taps)) { __VA_ARGS__ }        \
+  } while (0)
+
+/**
+ * Get the pixel that a position outside the image takes its value from
+ * @param[in] x The position
+ * @param[in] size The size of the image in this direction
+ * @param[in] border The border handling
+ * @return The position of the pixel in the image, -1 for a zero pixel
+ */
+static inline int32_t image_filter_index(int32_t x, int32_t size, enum image_border border)
+{
+  if (x >= 0 && x < size) {
+    return x;
+  }
+  if (border == IMAGE_BORDER_ZERO) {
+    return -1;
+  }
+  if (border == IMAGE_BORDER_MIRROR) {
+    x = (x < 0) ? -x - 1 : 2 * size - x - 1;
+  }
+  return (x < 0) ? 0 : ((x >= size) ? size - 1 : x);
+}
+
+/**
+ * Round, shift and saturate the weighted sum of a filter pass to int16
+ * @param[in] sum The weighted sum
+ * @param[in] shift The right shift
+ * @return The rounded and saturated result
+ */
+static inline int16_t image_filter_normalize(int32_t sum, uint8_t shift)
+{
+  if (shift > 0) {
+    sum = (sum + (1 << (shift - 1))) >> shift;
+  }
+  return (sum > INT16_MAX) ? INT16_MAX : ((sum < INT16_MIN) ? INT16_MIN : sum);
+}
+
+#if defined(CV_SIMD_SSE2)
+/**
+ * Weighted sum of 8 int16 pixels of taps rows in 32 bits, rounded, shifted and saturated to int16
+ * This is the vertical pass when rows[k] are image rows and the int16 horizontal pass when rows[k] = input + k.
+ * @param[in] **rows The taps input rows
+ * @param[in] x The start position in the rows
+ * @param[in] taps The amount of taps
+ * @param[in] *weights The weights of the taps
+ * @param[in] shift The right shift
+ * @return The 8 results
+ */
+CV_INLINE __m128i image_filter_vec_i16(int16_t **rows, int32_t x, uint8_t taps, const int16_t *weights,
+                                       uint8_t shift)
+{
+  __m128i lo = _mm_set1_epi32(shift > 0 ? 1 << (shift - 1) : 0);
+  __m128i hi = lo;
+  int32_t k;
+  IMAGE_FILTER_UNROLL(k, taps,
+    if (weights[k] != 0) {
+      __m128i v = _mm_loadu_si128((__m128i *)&rows[k][x]);
+      __m128i wk = _mm_set1_epi16(weights[k]);
+      __m128i pl = _mm_mullo_epi16(v, wk);
+      __m128i ph = _mm_mulhi_epi16(v, wk);
+      lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(pl, ph));
+      hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(pl, ph));
+    }
+  );
+  return _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+}
+#elif defined(CV_SIMD_NEON)
+CV_INLINE int16x8_t image_filter_vec_i16(int16_t **rows, int32_t x, uint8_t taps, const int16_t *weights,
+                                         uint8_t shift)
+{
+  int32x4_t lo = vdupq_n_s32(0);
+  int32x4_t hi = lo;
+  int32x4_t vshift = vdupq_n_s32(-shift);
+  int32_t k;
+  IMAGE_FILTER_UNROLL(k, taps,
+    if (weights[k] != 0) {
+      int16x8_t v = vld1q_s16(&rows[k][x]);
+      lo = vmlal_n_s16(lo, vget_low_s16(v), weights[k]);
+      hi = vmlal_n_s16(hi, vget_high_s16(v), weights[k]);
+    }
+  );
+  // The rounding shift adds 1 << (shift - 1) first
+  return vcombine_s16(vqmovn_s32(vrshlq_s32(lo, vshift)), vqmovn_s32(vrshlq_s32(hi, vshift)));
+}
+#endif
+
+/**
+ * Horizontal pass of a separable filter over the output pixels x0 up to x1 of a uint8 row
+ * The amount of taps is a constant in the callers, so the loops are specialized for it.
+ * @param[in] *input The input row, at the channel of the first pixel
+ * @param[in] step The bytes between the pixels (1 for grayscale, 2 for a channel of UYVY)
+ * @param[out] *output The output row, output[0] is pixel x0
+ * @param[in] w The width of the row
+ * @param[in] x0 The first output pixel
+ * @param[in] x1 The end of the output pixels
+ * @param[in] *filter The filter
+ * @param[in] taps The amount of horizontal taps
+ */
+CV_INLINE void image_filter_row_u8_taps(uint8_t *input, uint8_t step, int16_t *output, uint16_t w, int32_t x0,
+    int32_t x1, const struct image_filter_t *filter, const uint8_t taps)
+{
+  const int16_t *weights = filter->row;
+  uint8_t shift = filter->row_shift;
+  int32_t R = taps / 2;
+  int32_t x, k, i, x_start, x_end, sum;
+
+  // Vectorized interior, where no pixels are outside the row. A UYVY channel reads one byte past the last pixel.
+  x_start = (x0 > R) ? x0 : R;
+  x = x_start;
+#if defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  __m128i mask = _mm_set1_epi16(0x00FF);
+  __m128i round = _mm_set1_epi16(shift > 0 ? 1 << (shift - 1) : 0);
+  for (; x + 8 <= x1 && x + 8 + R + (step > 1) <= w; x += 8) {
+    __m128i acc = round;
+    IMAGE_FILTER_UNROLL(k, taps,
+      if (weights[k] != 0) {
+        __m128i v = (step > 1) ? _mm_and_si128(_mm_loadu_si128((__m128i *)&input[(x + k - R) * 2]), mask) :
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&input[x + k - R]), zero);
+        acc = _mm_add_epi16(acc, _mm_mullo_epi16(v, _mm_set1_epi16(weights[k])));
+      }
+    );
+    _mm_storeu_si128((__m128i *)&output[x - x0], _mm_srai_epi16(acc, shift));
+  }
+#elif defined(CV_SIMD_NEON)
+  int16x8_t vshift = vdupq_n_s16(-shift);
+  for (; x + 8 <= x1 && x + 8 + R + (step > 1) <= w; x += 8) {
+    int16x8_t acc = vdupq_n_s16(0);
+    IMAGE_FILTER_UNROLL(k, taps,
+      if (weights[k] != 0) {
+        uint8x8_t v = (step > 1) ? vld2_u8(&input[(x + k - R) * 2]).val[0] : vld1_u8(&input[x + k - R]);
+        acc = vmlaq_n_s16(acc, vreinterpretq_s16_u16(vmovl_u8(v)), weights[k]);
+      }
+    );
+    vst1q_s16(&output[x - x0], vrshlq_s16(acc, vshift));
+  }
+#endif
+  x_end = x;
+
+  // The borders and the pixels left by the vectorized loop
+  for (x = x0; x < x1; x++) {
+    if (x == x_start && x < x_end) {
+      x = x_end;
+      if (x >= x1) {
+        break;
+      }
+    }
+    sum = 0;
+    for (k = 0; k < taps; k++) {
+      i = image_filter_index(x + k - R, w, filter->border);
+      if (i >= 0) {
+        sum += weights[k] * input[i * step];
+      }
+    }
+    output[x - x0] = image_filter_normalize(sum, shift);
+  }
+}
+
+/**
+ * Horizontal pass of a separable filter over the output pixels x0 up to x1 of an int16 row
+ * @param[in] *input The input row
+ * @param[out] *output The output row, output[0] is pixel x0
+ * @param[in] w The width of the row
+ * @param[in] x0 The first output pixel
+ * @param[in] x1 The end of the output pixels
+ * @param[in] *filter The filter
+ * @param[in] taps The amount of horizontal taps
+ */
+CV_INLINE void image_filter_row_i16_taps(int16_t *input, int16_t *output, uint16_t w, int32_t x0, int32_t x1,
+    const struct image_filter_t *filter, const uint8_t taps)
+{
+  int32_t R = taps / 2;
+  int32_t x, k, i, x_start, x_end, sum;
+
+  // Vectorized interior, where no pixels are outside the row
+  x_start = (x0 > R) ? x0 : R;
+  x = x_start;
+#if defined(CV_SIMD)
+  int16_t *rows[7];
+  for (k = 0; k < taps; k++) {
+    rows[k] = &input[k - R];
+  }
+  for (; x + 8 <= x1 && x + 8 + R <= w; x += 8) {
+#if defined(CV_SIMD_SSE2)
+    _mm_storeu_si128((__m128i *)&output[x - x0], image_filter_vec_i16(rows, x, taps, filter->row, filter->row_shift));
+#else
+    vst1q_s16(&output[x - x0], image_filter_vec_i16(rows, x, taps, filter->row, filter->row_shift));
+#endif
+  }
+#endif
+  x_end = x;
+
+  // The borders and the pixels left by the vectorized loop
+  for (x = x0; x < x1; x++) {
+    if (x == x_start && x < x_end) {
+      x = x_end;
+      if (x >= x1) {
+        break;
+      }
+    }
+    sum = 0;
+    for (k = 0; k < taps; k++) {
+      i = image_filter_index(x + k - R, w, filter->border);
+      if (i >= 0) {
+        sum += filter->row[k] * input[i];
+      }
+    }
+    output[x - x0] = image_filter_normalize(sum, filter->row_shift);
+  }
+}
+
+/**
+ * Vertical pass of a separable filter
+ * @param[in] **rows The taps rows of the horizontal pass around the output row (top to bottom)
+ * @param[out] *output_u8 The uint8 output row, or NULL
+ * @param[out] *output_i16 The int16 output row, or NULL
+ * @param[in] w The width of the row
+ * @param[in] *filter The filter
+ * @param[in] taps The amount of vertical taps
+ * @param[in] narrow The weighted sums (plus the rounding) are known to fit in an int16
+ */
+CV_INLINE void image_filter_col_taps(int16_t **rows, uint8_t *output_u8, int16_t *output_i16, uint16_t w,
+    const struct image_filter_t *filter, const uint8_t taps, bool narrow)
+{
+  const int16_t *weights = filter->col;
+  uint8_t shift = filter->col_shift;
+  int32_t x = 0, k, sum;
+  int16_t v;
+
+#if defined(CV_SIMD_SSE2)
+  __m128i round = _mm_set1_epi16(shift > 0 ? 1 << (shift - 1) : 0);
+  for (; x + 8 <= w; x += 8) {
+    __m128i r;
+    if (narrow) {
+      r = round;
+      IMAGE_FILTER_UNROLL(k, taps,
+        if (weights[k] != 0) {
+          r = _mm_add_epi16(r, _mm_mullo_epi16(_mm_loadu_si128((__m128i *)&rows[k][x]), _mm_set1_epi16(weights[k])));
+        }
+      );
+      r = _mm_srai_epi16(r, shift);
+    } else {
+      r = image_filter_vec_i16(rows, x, taps, weights, shift);
+    }
+    if (output_u8 != NULL) {
+      _mm_storel_epi64((__m128i *)&output_u8[x], _mm_packus_epi16(r, r));
+    } else {
+      _mm_storeu_si128((__m128i *)&output_i16[x], r);
+    }
+  }
+#elif defined(CV_SIMD_NEON)
+  int16x8_t vshift = vdupq_n_s16(-shift);
+  for (; x + 8 <= w; x += 8) {
+    int16x8_t r;
+    if (narrow) {
+      r = vdupq_n_s16(0);
+      IMAGE_FILTER_UNROLL(k, taps,
+        if (weights[k] != 0) {
+          r = vmlaq_n_s16(r, vld1q_s16(&rows[k][x]), weights[k]);
+        }
+      );
+      r = vrshlq_s16(r, vshift);
+    } else {
+      r = image_filter_vec_i16(rows, x, taps, weights, shift);
+    }
+    if (output_u8 != NULL) {
+      vst1_u8(&output_u8[x], vqmovun_s16(r));
+    } else {
+      vst1q_s16(&output_i16[x], r);
+    }
+  }
+#else
+  (void)narrow;
+#endif
+
+  for (; x < w; x++) {
+    sum = 0;
+    IMAGE_FILTER_UNROLL(k, taps, sum += weights[k] * rows[k][x];);
+    v = image_filter_normalize(sum, shift);
+    if (output_u8 != NULL) {
+      output_u8[x] = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+    } else {
+      output_i16[x] = v;
+    }
+  }
+}
+
+/**
+ * Horizontal pass over a range of a uint8 or int16 row, specialized for the amount of taps of the filter
+ * @param[in] *input_u8 The uint8 input row, or NULL
+ * @param[in] step The bytes between the pixels of the uint8 input
+ * @param[in] *input_i16 The int16 input row, or NULL
+ * @param[out] *output The output row, output[0] is pixel x0
+ * @param[in] w The width of the row
+ * @param[in] x0 The first output pixel
+ * @param[in] x1 The end of the output pixels
+ * @param[in] *filter The filter
+ */
+static void image_filter_row_range(uint8_t *input_u8, uint8_t step, int16_t *input_i16, int16_t *output, uint16_t w,
+                                   int32_t x0, int32_t x1, const struct image_filter_t *filter)
+{
+  if (input_u8 != NULL) {
+    switch (filter->row_taps) {
+      case 1: image_filter_row_u8_taps(input_u8, step, output, w, x0, x1, filter, 1); break;
+      case 3: image_filter_row_u8_taps(input_u8, step, output, w, x0, x1, filter, 3); break;
+      case 5: image_filter_row_u8_taps(input_u8, step, output, w, x0, x1, filter, 5); break;
+      default: image_filter_row_u8_taps(input_u8, step, output, w, x0, x1, filter, 7); break;
+    }
+  } else {
+    switch (filter->row_taps) {
+      case 1: image_filter_row_i16_taps(input_i16, output, w, x0, x1, filter, 1); break;
+      case 3: image_filter_row_i16_taps(input_i16, output, w, x0, x1, filter, 3); break;
+      case 5: image_filter_row_i16_taps(input_i16, output, w, x0, x1, filter, 5); break;
+      default: image_filter_row_i16_taps(input_i16, output, w, x0, x1, filter, 7); break;
+    }
+  }
+}
+
+/**
+ * Vertical pass to a uint8 or int16 row, specialized for the amount of taps of the filter
+ * @param[in] **rows The taps rows of the horizontal pass around the output row (top to bottom)
+ * @param[out] *output_u8 The uint8 output row, or NULL
+ * @param[out] *output_i16 The int16 output row, or NULL
+ * @param[in] w The width of the row
+ * @param[in] *filter The filter
+ * @param[in] narrow The weighted sums (plus the rounding) are known to fit in an int16
+ */
+static void image_filter_col(int16_t **rows, uint8_t *output_u8, int16_t *output_i16, uint16_t w,
+                             const struct image_filter_t *filter, bool narrow)
+{
+  switch (filter->col_taps) {
+    case 1: image_filter_col_taps(rows, output_u8, output_i16, w, filter, 1, narrow); break;
+    case 3: image_filter_col_taps(rows, output_u8, output_i16, w, filter, 3, narrow); break;
+    case 5: image_filter_col_taps(rows, output_u8, output_i16, w, filter, 5, narrow); break;
+    default: image_filter_col_taps(rows, output_u8, output_i16, w, filter, 7, narrow); break;
+  }
+}
+
+/**
+ * Check if the vertical pass of a filter for a uint8 image fits in 16 bits
+ * @param[in] *filter The filter
+ * @return True when the weighted sums of the vertical pass (plus the rounding) fit in an int16
+ */
+static bool image_filter_narrow(const struct image_filter_t *filter)
+{
+  int32_t row_max = 0, col_sum = 0;
+  uint8_t k;
+
+  for (k = 0; k < filter->row_taps; k++) {
+    row_max += abs(filter->row[k]) * 255;
+  }
+  for (k = 0; k < filter->col_taps; k++) {
+    col_sum += abs(filter->col[k]);
+  }
+  if (filter->row_shift > 0) {
+    row_max = (row_max + (1 << (filter->row_shift - 1))) >> filter->row_shift;
+  }
+  return col_sum * row_max + (filter->col_shift > 0 ? 1 << (filter->col_shift - 1) : 0) <= INT16_MAX;
+}
+
+/**
+ * Check if a filter is supported by the separable filter engine
+ * @param[in] *filter The filter
+ * @return True for 1, 3, 5 or 7 taps in both directions
+ */
+static inline bool image_filter_valid(const struct image_filter_t *filter)
+{
+  return (filter->row_taps & 1) && filter->row_taps <= 7 && (filter->col_taps & 1) && filter->col_taps <= 7;
+}
+
+/**
+ * Horizontal pass of a separable filter for a uint8 row
+ * For uint8 input the sum of the absolute row weights times 255 (plus the rounding) has to fit in an int16.
+ * @param[in] *input The input row, at the channel of the first pixel
+ * @param[in] step The bytes between the pixels (1 for grayscale, 2 for a channel of UYVY)
+ * @param[out] *output The output row
+ * @param[in] w The width of the row
+ * @param[in] *filter The filter
+ */
+void image_filter_row_u8(uint8_t *input, uint8_t step, int16_t *output, uint16_t w, const struct image_filter_t *filter)
+{
+  if (image_filter_valid(filter)) {
+    image_filter_row_range(input, step, NULL, output, w, 0, w, filter);
+  }
+}
+
+/**
+ * Horizontal pass of a separable filter for an int16 row
+ * @param[in] *input The input row
+ * @param[out] *output The output row
+ * @param[in] w The width of the row
+ * @param[in] *filter The filter
+ */
+void image_filter_row_i16(int16_t *input, int16_t *output, uint16_t w, const struct image_filter_t *filter)
+{
+  if (image_filter_valid(filter)) {
+    image_filter_row_range(NULL, 1, input, output, w, 0, w, filter);
+  }
+}
+
+/**
+ * Vertical pass of a separable filter to a uint8 row (saturated)
+ * @param[in] **rows The col_taps rows of the horizontal pass around the output row (top to bottom)
+ * @param[out] *output The output row
+ * @param[in] w The width of the row
+ * @param[in] *filter The filter
+ */
+void image_filter_col_u8(int16_t **rows, uint8_t *output, uint16_t w, const struct image_filter_t *filter)
+{
+  if (image_filter_valid(filter)) {
+    image_filter_col(rows, output, NULL, w, filter, false);
+  }
+}
+
+/**
+ * Vertical pass of a separable filter to an int16 row (saturated)
+ * @param[in] **rows The col_taps rows of the horizontal pass around the output row (top to bottom)
+ * @param[out] *output The output row
+ * @param[in] w The width of the row
+ * @param[in] *filter The filter
+ */
+void image_filter_col_i16(int16_t **rows, int16_t *output, uint16_t w, const struct image_filter_t *filter)
+{
+  if (image_filter_valid(filter)) {
+    image_filter_col(rows, NULL, output, w, filter, false);
+  }
+}
+
+/**
+ * Start filtering the columns x0 up to x1 of an image row by row
+ * @param[out] *rows The row state
+ * @param[in] *filter The filter
+ * @param[in] *input_u8 The uint8 input image, at the channel of the first pixel, or NULL
+ * @param[in] step The bytes between the pixels of the uint8 input
+ * @param[in] *input_i16 The int16 input image, or NULL
+ * @param[in] w The width of the image
+ * @param[in] h The height of the image
+ * @param[in] x0 The first column
+ * @param[in] x1 The end of the columns
+ * @return True when the filter is valid and the memory could be allocated
+ */
+static bool image_filter_rows_range(struct image_filter_rows_t *rows, const struct image_filter_t *filter,
+                                    uint8_t *input_u8, uint8_t step, int16_t *input_i16, uint16_t w, uint16_t h,
+                                    uint16_t x0, uint16_t x1)
+{
+  rows->filter = filter;
+  rows->input_u8 = input_u8;
+  rows->input_i16 = input_i16;
+  rows->step = step;
+  rows->w = w;
+  rows->h = h;
+  rows->x0 = x0;
+  rows->x1 = x1;
+  rows->next = 0;
+  rows->ring = NULL;
+  rows->narrow = (input_u8 != NULL) && image_filter_narrow(filter);
+  if (!image_filter_valid(filter)) {
+    return false;
+  }
+
+  // A ring of col_taps horizontally filtered rows and a zero row for IMAGE_BORDER_ZERO
+  rows->ring = calloc((filter->col_taps + 1) * (x1 - x0), sizeof(int16_t));
+  return rows->ring != NULL;
+}
+
+/**
+ * Start filtering an image row by row, without storing the filtered image
+ * Only col_taps rows of the horizontal pass are kept in a ring.
+ * @param[out] *rows The row state
+ * @param[in] *filter The filter
+ * @param[in] *input The uint8 input image, at the channel of the first pixel
+ * @param[in] step The bytes between the pixels (1 for grayscale, 2 for a channel of UYVY)
+ * @param[in] w The width of the image
+ * @param[in] h The height of the image
+ * @return True when the filter is valid and the memory could be allocated
+ */
+bool image_filter_rows_init(struct image_filter_rows_t *rows, const struct image_filter_t *filter, uint8_t *input,
+                            uint8_t step, uint16_t w, uint16_t h)
+{
+  return image_filter_rows_range(rows, filter, input, step, NULL, w, h, 0, w);
+}
+
+/**
+ * Get the rows of the horizontal pass around an output row, for the vertical pass
+ * The horizontal pass is done for the rows that are needed for the first time.
+ * @param[in,out] *rows The row state
+ * @param[in] y The output row
+ * @param[out] **window The col_taps rows around the output row (top to bottom)
+ */
+static void image_filter_rows_window(struct image_filter_rows_t *rows, uint16_t y, int16_t **window)
+{
+  const struct image_filter_t *filter = rows->filter;
+  uint8_t taps = filter->col_taps;
+  int32_t R = taps / 2;
+  int32_t tw = rows->x1 - rows->x0;
+  int32_t k, r;
+
+  // Rows above the window are skipped, row r is stored at (r % taps)
+  if (rows->next + R < y) {
+    rows->next = y - R;
+  }
+  for (; rows->next <= y + R && rows->next < rows->h; rows->next++) {
+    int16_t *out = &rows->ring[(rows->next % taps) * tw];
+    if (rows->input_u8 != NULL) {
+      image_filter_row_range(&rows->input_u8[rows->next * rows->w * rows->step], rows->step, NULL, out, rows->w,
+                             rows->x0, rows->x1, filter);
+    } else {
+      image_filter_row_range(NULL, 1, &rows->input_i16[rows->next * rows->w], out, rows->w, rows->x0, rows->x1, filter);
+    }
+  }
+  for (k = -R; k <= R; k++) {
+    r = image_filter_index(y + k, rows->h, filter->border);
+    window[k + R] = (r < 0) ? &rows->ring[taps * tw] : &rows->ring[(r % taps) * tw];
+  }
+}
+
+/**
+ * Filter the next output row of an image that is filtered row by row, to uint8 (saturated)
+ * The output rows have to be requested from top to bottom, rows can be skipped.
+ * @param[in,out] *rows The row state
+ * @param[in] y The output row
+ * @param[out] *output The filtered row
+ */
+void image_filter_rows_u8(struct image_filter_rows_t *rows, uint16_t y, uint8_t *output)
+{
+  int16_t *window[7];
+  image_filter_rows_window(rows, y, window);
+  image_filter_col(window, output, NULL, rows->x1 - rows->x0, rows->filter, rows->narrow);
+}
+
+/**
+ * Filter the next output row of an image that is filtered row by row, to int16 (saturated)
+ * The output rows have to be requested from top to bottom, rows can be skipped.
+ * @param[in,out] *rows The row state
+ * @param[in] y The output row
+ * @param[out] *output The filtered row
+ */
+void image_filter_rows_i16(struct image_filter_rows_t *rows, uint16_t y, int16_t *output)
+{
+  int16_t *window[7];
+  image_filter_rows_window(rows, y, window);
+  image_filter_col(window, NULL, output, rows->x1 - rows->x0, rows->filter, rows->narrow);
+}
+
+/**
+ * Free the memory of filtering an image row by row
+ * @param[in] *rows The row state
+ */
+void image_filter_rows_free(struct image_filter_rows_t *rows)
+{
+  free(rows->ring);
+  rows->ring = NULL;
+}
+
+/**
+ * Filter a plane with a separable filter, in tiles of IMAGE_FILTER_TILE columns so the rows of the
+ * horizontal pass stay in the cache for wide images
+ * @param[in] *input_u8 The uint8 input plane, at the channel of the first pixel, or NULL
+ * @param[in] step The bytes between the pixels of the uint8 input
+ * @param[in] *input_i16 The int16 input plane, or NULL
+ * @param[out] *output_u8 The uint8 output plane, or NULL
+ * @param[out] *output_i16 The int16 output plane, or NULL
+ * @param[in] w The width of the plane
+ * @param[in] h The height of the plane
+ * @param[in] *filter The filter
+ */
+static void image_filter_plane(uint8_t *input_u8, uint8_t step, int16_t *input_i16, uint8_t *output_u8,
+                               int16_t *output_i16, uint16_t w, uint16_t h, const struct image_filter_t *filter)
+{
+  struct image_filter_rows_t rows;
+  uint16_t x0, x1, y;
+
+  for (x0 = 0; x0 < w; x0 = x1) {
+    x1 = (w - x0 > IMAGE_FILTER_TILE) ? x0 + IMAGE_FILTER_TILE : w;
+    if (!image_filter_rows_range(&rows, filter, input_u8, step, input_i16, w, h, x0, x1)) {
+      image_filter_rows_free(&rows);
+      return;
+    }
+    for (y = 0; y < h; y++) {
+      if (output_u8 != NULL) {
+        image_filter_rows_u8(&rows, y, &output_u8[y * w + x0]);
+      } else {
+        image_filter_rows_i16(&rows, y, &output_i16[y * w + x0]);
+      }
+    }
+    image_filter_rows_free(&rows);
+  }
+}
+
+/**
+ * Filter a uint8 plane (or a channel of UYVY) with a separable fixed-point filter to a uint8 plane
+ * @param[in] *input The input plane, at the channel of the first pixel
+ * @param[in] step The bytes between the input pixels (1 for grayscale, 2 for a channel of UYVY)
+ * @param[out] *output The output plane (can not be the input plane)
+ * @param[in] w The width of the plane
+ * @param[in] h The height of the plane
+ * @param[in] *filter The filter
+ */
+void image_filter_u8(uint8_t *input, uint8_t step, uint8_t *output, uint16_t w, uint16_t h,
+                     const struct image_filter_t *filter)
+{
+  image_filter_plane(input, step, NULL, output, NULL, w, h, filter);
+}
+
+/**
+ * Filter a uint8 plane (or a channel of UYVY) with a separable fixed-point filter to an int16 plane
+ * @param[in] *input The input plane, at the channel of the first pixel
+ * @param[in] step The bytes between the input pixels (1 for grayscale, 2 for a channel of UYVY)
+ * @param[out] *output The output plane
+ * @param[in] w The width of the plane
+ * @param[in] h The height of the plane
+ * @param[in] *filter The filter
+ */
+void image_filter_u8_i16(uint8_t *input, uint8_t step, int16_t *output, uint16_t w, uint16_t h,
+                         const struct image_filter_t *filter)
+{
+  image_filter_plane(input, step, NULL, NULL, output, w, h, filter);
+}
+
+/**
+ * Filter an int16 plane with a separable fixed-point filter to an int16 plane
+ * @param[in] *input The input plane
+ * @param[out] *output The output plane (can not be the input plane)
+ * @param[in] w The width of the plane
+ * @param[in] h The height of the plane
+ * @param[in] *filter The filter
+ */
+void image_filter_i16(int16_t *input, int16_t *output, uint16_t w, uint16_t h, const struct image_filter_t *filter)
+{
+  image_filter_plane(NULL, 1, input, NULL, output, w, h, filter);
+}
+
+/* The kernels of image_smooth for the separable filter engine, indexed by (taps - 3) / 2. The Gaussian kernels are
+ * the binomial [1 2 1], [1 4 6 4 1] and [1 6 15 20 15 6 1], which sum to 1 << (2 * i + 2). For uint8 planes the
+ * horizontal pass keeps 2 bits more precision than the input. The box kernels divide by taps with a reciprocal weight
+ * and shift, which is the exactly rounded mean for uint8 planes and for int16 planes with a mean magnitude below 2340. */
+static const struct image_filter_t image_smooth_gauss_u8[3] = {
+  {3, 3, {1, 2, 1}, {1, 2, 1}, 0, 4, IMAGE_BORDER_CLAMP},
+  {5, 5, {1, 4, 6, 4, 1}, {1, 4, 6, 4, 1}, 2, 6, IMAGE_BORDER_CLAMP},
+  {7, 7, {1, 6, 15, 20, 15, 6, 1}, {1, 6, 15, 20, 15, 6, 1}, 4, 8, IMAGE_BORDER_CLAMP}
+};
+static const struct image_filter_t image_smooth_gauss_i16[3] = {
+  {3, 3, {1, 2, 1}, {1, 2, 1}, 2, 2, IMAGE_BORDER_CLAMP},
+  {5, 5, {1, 4, 6, 4, 1}, {1, 4, 6, 4, 1}, 4, 4, IMAGE_BORDER_CLAMP},
+  {7, 7, {1, 6, 15, 20, 15, 6, 1}, {1, 6, 15, 20, 15, 6, 1}, 6, 6, IMAGE_BORDER_CLAMP}
+};
+static const struct image_filter_t image_smooth_box_u8[3] = {
+  {3, 3, {1, 1, 1}, {3641, 3641, 3641}, 0, 15, IMAGE_BORDER_CLAMP},
+  {5, 5, {1, 1, 1, 1, 1}, {5243, 5243, 5243, 5243, 5243}, 0, 17, IMAGE_BORDER_CLAMP},
+  {7, 7, {1, 1, 1, 1, 1, 1, 1}, {2675, 2675, 2675, 2675, 2675, 2675, 2675}, 0, 17, IMAGE_BORDER_CLAMP}
+};
+static const struct image_filter_t image_smooth_box_i16[3] = {
+  {3, 3, {10923, 10923, 10923}, {10923, 10923, 10923}, 15, 15, IMAGE_BORDER_CLAMP},
+  {5, 5, {13107, 13107, 13107, 13107, 13107}, {13107, 13107, 13107, 13107, 13107}, 16, 16, IMAGE_BORDER_CLAMP},
+  {
+    7, 7, {4681, 4681, 4681, 4681, 4681, 4681, 4681}, {4681, 4681, 4681, 4681, 4681, 4681, 4681}, 15, 15,
+    IMAGE_BORDER_CLAMP
+  }
+};
+
+/**
+ * Get the filter of a smoothing kernel
+ * @param[in] taps The amount of filter taps (3, 5 or 7)
+ * @param[in] kernel The smoothing kernel
+ * @param[in] u8 The filter is for a uint8 plane, else for an int16 plane
+ * @return The filter, NULL for an unsupported amount of taps
+ */
+static const struct image_filter_t *image_smooth_filter(uint8_t taps, enum image_smooth_kernel kernel, bool u8)
+{
+  if (taps != 3 && taps != 5 && taps != 7) {
+    return NULL;
+  }
+  if (kernel == IMAGE_SMOOTH_GAUSSIAN) {
+    return u8 ? &image_smooth_gauss_u8[(taps - 3) / 2] : &image_smooth_gauss_i16[(taps - 3) / 2];
+  }
+  return u8 ? &image_smooth_box_u8[(taps - 3) / 2] : &image_smooth_box_i16[(taps - 3) / 2];
+}
+
+/**
+ * Smooth a uint8 plane with a separable fixed-point Gaussian or box filter
+ * @param[in] *input The input plane
+ * @param[out] *output The output plane (can not be the input plane)
+ * @param[in] w The width of the plane
+ * @param[in] h The height of the plane
+ * @param[in] taps The amount of filter taps (3, 5 or 7)
+ * @param[in] kernel The smoothing kernel
+ */
+void image_smooth_u8(uint8_t *input, uint8_t *output, uint16_t w, uint16_t h, uint8_t taps,
+                     enum image_smooth_kernel kernel)
+{
+  const struct image_filter_t *filter = image_smooth_filter(taps, kernel, true);
+  if (filter != NULL) {
+    image_filter_u8(input, 1, output, w, h, filter);
+  }
+}
+
+/**
+ * Smooth an int16 plane with a separable fixed-point Gaussian or box filter
+ * @param[in] *input The input plane
+ * @param[out] *output The output plane (can not be the input plane)
+ * @param[in] w The width of the plane
+ * @param[in] h The height of the plane
+ * @param[in] taps The amount of filter taps (3, 5 or 7)
+ * @param[in] kernel The smoothing kernel
+ */
+void image_smooth_i16(int16_t *input, int16_t *output, uint16_t w, uint16_t h, uint8_t taps,
+                      enum image_smooth_kernel kernel)
+{
+  const struct image_filter_t *filter = image_smooth_filter(taps, kernel, false);
+  if (filter != NULL) {
+    image_filter_i16(input, output, w, h, filter);
+  }
+}
+
+/**
+ * Smooth a grayscale or gradient image with a separable fixed-point Gaussian or box filter
+ * The borders are extended by replicating the edge pixels.
+ * @param[in] *input The input image (grayscale or gradient)
+ * @param[out] *output The output image of the same type and size
+ * @param[in] taps The amount of filter taps (3, 5 or 7)
+ * @param[in] kernel The smoothing kernel
+ */
+void image_smooth(struct image_t *input, struct image_t *output, uint8_t taps, enum image_smooth_kernel kernel)
+{
+  if (output->buf_size < input->buf_size || output->type != input->type) {
+    return;
+  }
+  output->w = input->w;
+  output->h = input->h;
+
+  if (input->type == IMAGE_GRAYSCALE) {
+    image_smooth_u8((uint8_t *)input->buf, (uint8_t *)output->buf, input->w, input->h, taps, kernel);
+  } else if (input->type == IMAGE_GRADIENT) {
+    image_smooth_i16((int16_t *)input->buf, (int16_t *)output->buf, input->w, input->h, taps, kernel);
+  }
+}
+
+/**
+ * Create an integral image (summed-area table) for an image
+ * @param[out] *ii The output integral image
+ * @param[in] w The width of the image
+ * @param[in] h The height of the image
+ * @param[in] squared Also keep the sums of the squared pixels (for the box variance)
+ * @return True when the tables could be allocated
+ */
+bool image_integral_create(struct image_integral_t *ii, uint16_t w, uint16_t h, bool squared)
+{
+  uint32_t size = sizeof(uint32_t) * (w + 1) * (h + 1);
+
+  ii->w = w;
+  ii->h = h;
+  ii->rows = 0;
+  ii->sum = malloc(size);
+  ii->sum_sq = squared ? malloc(size) : NULL;
+  if (ii->sum == NULL || (squared && ii->sum_sq == NULL)) {
+    image_integral_free(ii);
+    return false;
+  }
+
+  // The first row is zero
+  memset(ii->sum, 0, sizeof(uint32_t) * (w + 1));
+  if (squared) {
+    memset(ii->sum_sq, 0, sizeof(uint32_t) * (w + 1));
+  }
+  return true;
+}
+
+/**
+ * Free the tables of an integral image
+ * @param[in] *ii The integral image to free
+ */
+void image_integral_free(struct image_integral_t *ii)
+{
+  free(ii->sum);
+  free(ii->sum_sq);
+  ii->sum = NULL;
+  ii->sum_sq = NULL;
+}
+
+/**
+ * Calculate one row of an integral image: the prefix sum of the row plus the row above
+ * The prefix sum is vectorized over 4 pixels at a time: two shifted adds make the sums within
+ * the vector, to which the last sum of the previous vector is added.
+ * @param[in] *input The input row (grayscale or UYVY)
+ * @param[in] yuv The input row is UYVY, of which the Y is used
+ * @param[in] w The width of the row
+ * @param[in] *above The row above in the sum table (w + 1 values)
+ * @param[out] *sum The output row in the sum table (w + 1 values)
+ * @param[in] *above_sq The row above in the squared sum table, NULL when there is none
+ * @param[out] *sum_sq The output row in the squared sum table, NULL when there is none
+ */
+static void image_integral_row(uint8_t *input, bool yuv, uint16_t w, uint32_t *above, uint32_t *sum,
+                               uint32_t *above_sq, uint32_t *sum_sq)
+{
+  uint32_t x = 0, s = 0, s_sq = 0, v;
+
+  sum[0] = 0;
+  if (sum_sq != NULL) {
+    sum_sq[0] = 0;
+  }
+
+#if defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  __m128i carry = zero, carry_sq = zero;
+  for (; x + 8 <= w; x += 8) {
+    __m128i v16;
+    if (yuv) {
+      v16 = _mm_srli_epi16(_mm_loadu_si128((__m128i *)&input[x * 2]), 8);
+    } else {
+      v16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&input[x]), zero);
+    }
+    for (uint8_t half = 0; half < 2; half++) {
+      __m128i v32 = half ? _mm_unpackhi_epi16(v16, zero) : _mm_unpacklo_epi16(v16, zero);
+      uint32_t *out = &sum[x + 4 * half + 1];
+      uint32_t *up = &above[x + 4 * half + 1];
+      __m128i p = _mm_add_epi32(v32, _mm_slli_si128(v32, 4));
+      p = _mm_add_epi32(p, _mm_slli_si128(p, 8));
+      p = _mm_add_epi32(p, carry);
+      carry = _mm_shuffle_epi32(p, 0xFF);
+      _mm_storeu_si128((__m128i *)out, _mm_add_epi32(p, _mm_loadu_si128((__m128i *)up)));
+      if (sum_sq != NULL) {
+        // The upper 16 bits of every lane are zero, so madd gives the square
+        __m128i q = _mm_madd_epi16(v32, v32);
+        out = &sum_sq[x + 4 * half + 1];
+        up = &above_sq[x + 4 * half + 1];
+        q = _mm_add_epi32(q, _mm_slli_si128(q, 4));
+        q = _mm_add_epi32(q, _mm_slli_si128(q, 8));
+        q = _mm_add_epi32(q, carry_sq);
+        carry_sq = _mm_shuffle_epi32(q, 0xFF);
+        _mm_storeu_si128((__m128i *)out, _mm_add_epi32(q, _mm_loadu_si128((__m128i *)up)));
       }
-      *dest++ = *source;    // Y
-      source += 2;
+    }
+  }
+  s = _mm_cvtsi128_si32(carry);
+  s_sq = _mm_cvtsi128_si32(carry_sq);
+#elif defined(CV_SIMD_NEON)
+  uint32x4_t zero = vdupq_n_u32(0);
+  uint32x4_t carry = zero, carry_sq = zero;
+  for (; x + 8 <= w; x += 8) {
+    uint16x8_t v16;
+    if (yuv) {
+      v16 = vmovl_u8(vld2_u8(&input[x * 2]).val[1]);
+    } else {
+      v16 = vmovl_u8(vld1_u8(&input[x]));
+    }
+    for (uint8_t half = 0; half < 2; half++) {
+      uint16x4_t h16 = half ? vget_high_u16(v16) : vget_low_u16(v16);
+      uint32x4_t p = vmovl_u16(h16);
+      p = vaddq_u32(p, vextq_u32(zero, p, 3));
+      p = vaddq_u32(p, vextq_u32(zero, p, 2));
+      p = vaddq_u32(p, carry);
+      carry = vdupq_n_u32(vgetq_lane_u32(p, 3));
+      vst1q_u32(&sum[x + 4 * half + 1], vaddq_u32(p, vld1q_u32(&above[x + 4 * half + 1])));
+      if (sum_sq != NULL) {
+        uint32x4_t q = vmull_u16(h16, h16);
+        q = vaddq_u32(q, vextq_u32(zero, q, 3));
+        q = vaddq_u32(q, vextq_u32(zero, q, 2));
+        q = vaddq_u32(q, carry_sq);
+        carry_sq = vdupq_n_u32(vgetq_lane_u32(q, 3));
+        vst1q_u32(&sum_sq[x + 4 * half + 1], vaddq_u32(q, vld1q_u32(&above_sq[x + 4 * half + 1])));
+      }
+    }
+  }
+  s = vgetq_lane_u32(carry, 0);
+  s_sq = vgetq_lane_u32(carry_sq, 0);
+#endif
+
+  // The pixels left by the vectorized loop
+  for (; x < w; x++) {
+    v = yuv ? input[x * 2 + 1] : input[x];
+    s += v;
+    sum[x + 1] = above[x + 1] + s;
+    if (sum_sq != NULL) {
+      s_sq += v * v;
+      sum_sq[x + 1] = above_sq[x + 1] + s_sq;
     }
   }
 }
 
 /**
- * Filter colors in an YUV422 image
- * @param[in] *input The input image to filter
- * @param[out] *output The filtered output image
- * @param[in] y_m The Y minimum value
- * @param[in] y_M The Y maximum value
- * @param[in] u_m The U minimum value
- * @param[in] u_M The U maximum value
- * @param[in] v_m The V minimum value
- * @param[in] v_M The V maximum value
- * @return The amount of filtered pixels
+ * Calculate the next rows of an integral image (incremental mode)
+ * The rows from ii->rows up to (not including) rows are added, so a caller that only needs the top
+ * of the image only pays for those rows. Set ii->rows to 0 to start with a new image.
+ * @param[in] *input The input image (grayscale or YUV422, of which the Y is used)
+ * @param[in,out] *ii The integral image of the same size
+ * @param[in] rows The amount of image rows that have to be in the integral image
  */
-uint16_t image_yuv422_colorfilt(struct image_t *input, struct image_t *output, uint8_t y_m, uint8_t y_M, uint8_t u_m,
-                                uint8_t u_M, uint8_t v_m, uint8_t v_M)
+void image_integral_update(struct image_t *input, struct image_integral_t *ii, uint16_t rows)
 {
-  uint16_t cnt = 0;
   uint8_t *source = input->buf;
-  uint8_t *dest = output->buf;
+  bool yuv = (input->type == IMAGE_YUV422);
+  uint32_t stride = ii->w + 1;
 
-  // Copy the creation timestamp (stays the same)
-  output->ts = input->ts;
+  if (rows > ii->h) {
+    rows = ii->h;
+  }
 
-  // Go through all the pixels
-  for (uint16_t y = 0; y < input->h; y++) {
-    for (uint16_t x = 0; x < input->w; x += 2) {
-      // Check if the color is inside the specified values
-      if ( (source[0] >= u_m)
-        && (source[0] <= u_M)
-        && (source[2] >= v_m)
-        && (source[2] <= v_M)
-      ) {
-        // UYVY
-        if (source[1] >= y_m && source[1] <= y_M){
-          dest[0] = source[0];  // U
-        } else {
-          dest[0] = 127;        // U
-        }
-        if (source[3] >= y_m && source[3] <= y_M){
-          dest[2] = source[2];  // V
-        } else {
-          dest[2] = 127;        // V
-        }
-      } else {
-        // UYVY
-        dest[0] = 127;        // U
-        dest[2] = 127;        // V
-      }
+  for (uint16_t y = ii->rows; y < rows; y++) {
+    uint8_t *row = yuv ? &source[y * input->w * 2] : &source[y * input->w];
+    uint32_t *above_sq = (ii->sum_sq != NULL) ? &ii->sum_sq[y * stride] : NULL;
+    uint32_t *sum_sq = (ii->sum_sq != NULL) ? &ii->sum_sq[(y + 1) * stride] : NULL;
+    image_integral_row(row, yuv, ii->w, &ii->sum[y * stride], &ii->sum[(y + 1) * stride], above_sq, sum_sq);
+  }
+  if (rows > ii->rows) {
+    ii->rows = rows;
+  }
+}
 
-      dest[1] = source[1];  // Y1
-      dest[3] = source[3];  // Y2
+/**
+ * Add the next row to an integral image from a row of 8 bit values
+ * This is for values that are not the pixels of an image, like the mean luma of a macropixel or
+ * the chroma of every pixel. Set ii->rows to 0 to start with a new image.
+ * @param[in,out] *ii The integral image, with less than h rows
+ * @param[in] *row The w values of the next row
+ */
+void image_integral_add_row(struct image_integral_t *ii, uint8_t *row)
+{
+  uint32_t stride = ii->w + 1;
+  uint16_t y = ii->rows;
 
-      // Go to the next 2 pixels
-      dest += 4;
-      source += 4;
-    }
+  if (y >= ii->h) {
+    return;
   }
-  return cnt;
+  uint32_t *above_sq = (ii->sum_sq != NULL) ? &ii->sum_sq[y * stride] : NULL;
+  uint32_t *sum_sq = (ii->sum_sq != NULL) ? &ii->sum_sq[(y + 1) * stride] : NULL;
+  image_integral_row(row, false, ii->w, &ii->sum[y * stride], &ii->sum[(y + 1) * stride], above_sq, sum_sq);
+  ii->rows = y + 1;
 }
 
 /**
-* Simplified high-speed low CPU downsample function without averaging
-*  downsample factor must be 1, 2, 4, 8 ... 2^X
-*  image of typ UYVY expected. Only one color UV per 2 pixels
-*
-*  we keep the UV color of the first pixel pair
-*  and sample the intensity evenly 1-3-5-7-... or 1-5-9-...
-*
-*  input:         u1y1 v1y2 u3y3 v3y4 u5y5 v5y6 u7y7 v7y8 ...
-*  downsample=1   u1y1 v1y2 u3y3 v3y4 u5y5 v5y6 u7y7 v7y8 ...
-*  downsample=2   u1y1v1 (skip2) y3 (skip2) u5y5v5 (skip2 y7 (skip2) ...
-*  downsample=4   u1y1v1 (skip6) y5 (skip6) ...
-* @param[in] *input The input YUV422 image
-* @param[out] *output The downscaled YUV422 image
-* @param[in] downsample The downsample factor (must be downsample=2^X)
-*/
-void image_yuv422_downsample(struct image_t *input, struct image_t *output, uint16_t downsample)
+ * Calculate the integral image of a whole image
+ * @param[in] *input The input image (grayscale or YUV422, of which the Y is used)
+ * @param[out] *ii The integral image of the same size
+ */
+void image_integral(struct image_t *input, struct image_integral_t *ii)
 {
-  uint8_t *source = input->buf;
-  uint8_t *dest = output->buf;
-  uint16_t pixelskip = (downsample - 1) * 2;
+  ii->rows = 0;
+  image_integral_update(input, ii, ii->h);
+}
 
-  // Copy the creation timestamp (stays the same)
-  output->ts = input->ts;
+/**
+ * Get the sum of the pixels in a box of an integral image
+ * The box has to lie within the rows that are calculated.
+ * @param[in] *ii The integral image
+ * @param[in] x The left of the box
+ * @param[in] y The top of the box
+ * @param[in] w The width of the box
+ * @param[in] h The height of the box
+ * @return The sum of the pixels in the box
+ */
+uint32_t image_integral_box_sum(struct image_integral_t *ii, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+  uint32_t stride = ii->w + 1;
+  uint32_t *top = &ii->sum[y * stride + x];
+  uint32_t *bottom = &ii->sum[(y + h) * stride + x];
 
-  // Go trough all the pixels
-  for (uint16_t y = 0; y < output->h; y++) {
-    for (uint16_t x = 0; x < output->w; x += 2) {
-      // YUYV
-      *dest++ = *source++; // U
-      *dest++ = *source++; // Y
-      *dest++ = *source++; // V
-      source += pixelskip;
-      *dest++ = *source++; // Y
-      source += pixelskip;
-    }
-    // read 1 in every 'downsample' rows, so skip (downsample-1) rows after reading the first
-    source += (downsample - 1) * input->w * 2;
+  // The tables wrap around, which cancels out in the difference
+  return bottom[w] - bottom[0] - top[w] + top[0];
+}
+
+/**
+ * Get the variance of the pixels in a box of an integral image
+ * The squared sums wrap around, so the result is exact for boxes up to 66051 pixels (257 x 257).
+ * @param[in] *ii The integral image, with the squared sums
+ * @param[in] x The left of the box
+ * @param[in] y The top of the box
+ * @param[in] w The width of the box
+ * @param[in] h The height of the box
+ * @return The variance of the pixels in the box (rounded down), 0 without squared sums
+ */
+uint32_t image_integral_box_variance(struct image_integral_t *ii, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+  uint32_t stride = ii->w + 1;
+  uint64_t n = (uint64_t)w * h;
+  uint64_t sum, sum_sq;
+
+  if (ii->sum_sq == NULL || n == 0) {
+    return 0;
   }
+  uint32_t *top = &ii->sum_sq[y * stride + x];
+  uint32_t *bottom = &ii->sum_sq[(y + h) * stride + x];
+  sum = image_integral_box_sum(ii, x, y, w, h);
+  sum_sq = (uint32_t)(bottom[w] - bottom[0] - top[w] + top[0]);
+
+  // E[I^2] - E[I]^2 with n^2 as common denominator
+  return (n * sum_sq - sum * sum) / (n * n);
 }
 
 #ifdef LINUX
@@ -284,8 +1913,9 @@ void image_add_border(struct image_t *input, struct image_t *output, uint8_t bor
 /**
  * This function takes previous padded pyramid level and outputs next level of pyramid without padding.
  * For calculating new pixel value 5x5 filter matrix suggested by Bouguet is used:
- * [1/16 1/8 3/4 1/8 1/16]' x [1/16 1/8 3/4 1/8 1/16]
- * To avoid decimal numbers, all coefficients are multiplied by 10000.
+ * [1/16 1/4 3/8 1/4 1/16]' x [1/16 1/4 3/8 1/4 1/16]
+ * To avoid floating point operations, all elements are multiplied with 10000 and truncated, the result is
+ * truncated as well. See pyramid_next_level_binomial for the exact filter with rounding.
  *
  * @param[in]  *input  - input image (grayscale only)
  * @param[out] *output - the output image
@@ -329,6 +1959,50 @@ void pyramid_next_level(struct image_t *input, struct image_t *output, uint8_t b
   }
 }
 
+/* The 5x5 binomial filter of the pyramid, the horizontal pass keeps 2 bits more than the input */
+static const struct image_filter_t pyramid_filter = {
+  5, 5, {1, 4, 6, 4, 1}, {1, 4, 6, 4, 1}, 2, 6, IMAGE_BORDER_CLAMP
+};
+
+/**
+ * Same as pyramid_next_level, with the exact separable 5x5 binomial filter and a rounded result:
+ * [1/16 1/4 3/8 1/4 1/16]' x [1/16 1/4 3/8 1/4 1/16]
+ * The pixels can be one higher than those of pyramid_next_level, which truncates the weights and the result.
+ * Only the rows of the output pyramid level are filtered vertically.
+ *
+ * @param[in]  *input  - input image (grayscale only)
+ * @param[out] *output - the output image
+ * @param[in]  border_size  - amount of padding around image. Padding is made by reflecting image elements at the edge
+ *                  Example: f e d c b a | a b c d e f | f e d c b a
+ */
+void pyramid_next_level_binomial(struct image_t *input, struct image_t *output, uint8_t border_size)
+{
+  // Create output image, new image size is half the size of input image without padding (border)
+  image_create(output, (input->w + 1 - 2 * border_size) / 2, (input->h + 1 - 2 * border_size) / 2, input->type);
+
+  uint8_t *input_buf = (uint8_t *)input->buf;
+  uint8_t *output_buf = (uint8_t *)output->buf;
+
+  uint16_t row; // row of the central pixel in the input image
+  uint8_t *filtered = malloc(sizeof(uint8_t) * input->w);
+  struct image_filter_rows_t rows;
+  bool valid = image_filter_rows_init(&rows, &pyramid_filter, input_buf, 1, input->w, input->h);
+
+  if (valid && filtered != NULL) {
+    for (uint16_t i = 0; i != output->h; i++) {
+      row = border_size + 2 * i; // First skip border, then every second pixel
+      image_filter_rows_u8(&rows, row, filtered);
+
+      for (uint16_t j = 0; j != output->w; j++) {
+        output_buf[i * output->w + j] = filtered[border_size + 2 * j];
+      }
+    }
+  }
+
+  image_filter_rows_free(&rows);
+  free(filtered);
+}
+
 /**
  * This function populates given array of image_t structs with wanted number of padded pyramids based on given input.
  * @param[in]  *input  - input image (grayscale only)
@@ -416,42 +2090,43 @@ void image_subpixel_window(struct image_t *input, struct image_t *output, struct
   }
 }
 
+/* The simple gradients dx = [-1 0 1] * IMG and dy = [-1 0 1]' * IMG */
+static const struct image_filter_t image_gradient_dx = {3, 1, {-1, 0, 1}, {1}, 0, 0, IMAGE_BORDER_CLAMP};
+static const struct image_filter_t image_gradient_dy = {1, 3, {1}, {-1, 0, 1}, 0, 0, IMAGE_BORDER_CLAMP};
+
+/* The amount of pixels of a row of which image_2d_magnitude keeps the gradients at once */
+#define IMAGE_GRADIENT_CHUNK 256
+
 /**
  * Calculate the  gradients using the following matrix:
  * dx = [0 0 0; -1 0 1; 0 0 0] and dy = [0 -1 0; 0 0 0; 0 1 0]
+ * The first and last column of dx and the first and last row of dy are 0.
  * @param[in] *input Input grayscale image
  * @param[out] *dx Output gradient in the X direction
  * @param[out] *dy Output gradient in the Y direction
  */
 void image_gradients(struct image_t *input, struct image_t *dx, struct image_t *dy)
 {
-  if (dx->buf_size < input->buf_size || dy->buf_size < input->buf_size){
+  uint32_t size = input->w * input->h;
+  if (dx->buf_size < size * sizeof(int16_t) || dy->buf_size < size * sizeof(int16_t) || size == 0) {
     return;
   }
 
   // Fetch the buffers in the correct format
   uint8_t *input_buf = (uint8_t *)input->buf;
-  uint8_t *dx_buf = (int8_t *)dx->buf;
-  uint8_t *dy_buf = (int8_t *)dy->buf;
-
-  uint32_t idx;
-  uint32_t size = input->w * input->h;
-
-  // Go through all pixels except the borders
-  // split computation of x and y to two loops to optimize run time performance
-  for (idx = 1; idx < size - 1; idx++) {
-    dx_buf[idx] = (int16_t)input_buf[idx + 1] - (int16_t)input_buf[idx - 1];
-  }
+  int16_t *dx_buf = (int16_t *)dx->buf;
+  int16_t *dy_buf = (int16_t *)dy->buf;
 
-  // overwrite incorrect pixels
-  for (idx = dx->w-1; idx < size; idx+=dx->w) {
-    dx_buf[idx] = 0;
-    dx_buf[idx + 1] = 0;
-  }
+  image_filter_u8_i16(input_buf, 1, dx_buf, input->w, input->h, &image_gradient_dx);
+  image_filter_u8_i16(input_buf, 1, dy_buf, input->w, input->h, &image_gradient_dy);
 
-  for (idx = dy->w; idx < size - input->w; idx++) {
-    dy_buf[idx] = (int16_t)input_buf[idx + input->w] - (int16_t)input_buf[idx - input->w];
+  // overwrite the pixels without both neighbours
+  for (uint16_t y = 0; y < input->h; y++) {
+    dx_buf[y * input->w] = 0;
+    dx_buf[y * input->w + input->w - 1] = 0;
   }
+  memset(dy_buf, 0, sizeof(int16_t) * input->w);
+  memset(&dy_buf[size - input->w], 0, sizeof(int16_t) * input->w);
 }
 
 /* Integer implementation of square root using Netwon's method
@@ -460,7 +2135,7 @@ void image_gradients(struct image_t *input, struct image_t *dx, struct image_t *
 uint8_t sqrti(int32_t num)
 {
 #ifdef LINUX
-  uint32_t root = (uint32_t)sqrtf(float(num));
+  uint32_t root = (uint32_t)sqrtf((float)num);
 #else
 
   static const uint8_t max_iter = 100;
@@ -492,56 +2167,202 @@ uint8_t sqrti(int32_t num)
 }
 
 /**
- * Calculate the  gradients using the following matrix:
- * d = |[0 -1 0; -1 0 1; 0 1 0] * IMG|
- * @param[in] *input Input grayscale image
- * @param[out] *d Output mean gradient
+ * Get the L2 magnitude with a bitwise integer square root: the largest root of which the square is not
+ * above num, rounded to the nearest integer. Same as sqrt rounded, saturated at 255.
+ * @param[in] num The sum of the squared gradients
+ * @return The rounded square root of num, 255 when it is above 255
  */
-void image_2d_gradients(struct image_t *input, struct image_t *d)
+static inline uint8_t image_magnitude_l2(uint32_t num)
 {
-  if (d->buf_size < input->buf_size){
-    return;
-  }
+  uint32_t root = 0, c;
 
-  // Fetch the buffers in the correct format
-  uint8_t *input_buf = (uint8_t *)input->buf;
-  uint8_t *d_buf = (uint8_t *)d->buf;
+  if (num >= 65025) {
+    return 255;
+  }
+  for (uint32_t bit = 128; bit > 0; bit >>= 1) {
+    c = root | bit;
+    if (c * c <= num) {
+      root = c;
+    }
+  }
+  // (root + 0.5)^2 = root^2 + root + 0.25
+  return (num > root * root + root) ? root + 1 : root;
+}
 
-  uint32_t idx, idx1;
-  uint32_t size = input->w * input->h;
-  int32_t temp1, temp2;
+/**
+ * Calculate the magnitude of a row of gradients
+ * The absolute gradients are saturated at 255 first, which does not change a result below 255.
+ * L1 is |dx| + |dy|, L2 is sqrt(dx^2 + dy^2) rounded and alpha-max-beta-min approximates L2 with
+ * max(max, 15/16 * max + 15/32 * min), which is within 6.25% of it. The result saturates at 255.
+ * @param[in] *dx The gradients in the x direction
+ * @param[in] *dy The gradients in the y direction
+ * @param[out] *output The magnitudes
+ * @param[in] w The width of the row
+ * @param[in] method The magnitude (approximation)
+ */
+void image_magnitude_row(int16_t *dx, int16_t *dy, uint8_t *output, uint16_t w, enum image_magnitude method)
+{
+  int32_t x = 0;
+  int16_t ax, ay, mx, mn;
+
+#if defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  __m128i max_value = _mm_set1_epi16(255);
+  for (; x + 8 <= w; x += 8) {
+    __m128i vx = _mm_loadu_si128((__m128i *)&dx[x]);
+    __m128i vy = _mm_loadu_si128((__m128i *)&dy[x]);
+    __m128i m;
+    vx = _mm_min_epi16(_mm_max_epi16(vx, _mm_sub_epi16(zero, vx)), max_value);
+    vy = _mm_min_epi16(_mm_max_epi16(vy, _mm_sub_epi16(zero, vy)), max_value);
+    if (method == IMAGE_MAGNITUDE_L1) {
+      m = _mm_add_epi16(vx, vy);
+    } else if (method == IMAGE_MAGNITUDE_L2) {
+      // dx^2 + dy^2 in 32 bits, the square root of an integer is never exactly halfway, so it rounds correctly
+      __m128i lo = _mm_unpacklo_epi16(vx, vy);
+      __m128i hi = _mm_unpackhi_epi16(vx, vy);
+      lo = _mm_cvtps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(lo, lo))));
+      hi = _mm_cvtps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(hi, hi))));
+      m = _mm_packs_epi32(lo, hi);
+    } else {
+      __m128i vmax = _mm_max_epi16(vx, vy);
+      __m128i vmin = _mm_min_epi16(vx, vy);
+      m = _mm_srli_epi16(_mm_mullo_epi16(_mm_add_epi16(_mm_add_epi16(vmax, vmax), vmin), _mm_set1_epi16(15)), 5);
+      m = _mm_max_epi16(m, vmax);
+    }
+    _mm_storel_epi64((__m128i *)&output[x], _mm_packus_epi16(m, m));
+  }
+#elif defined(CV_SIMD_NEON)
+  int16x8_t max_value = vdupq_n_s16(255);
+  for (; x + 8 <= w; x += 8) {
+    int16x8_t vx = vminq_s16(vabsq_s16(vld1q_s16(&dx[x])), max_value);
+    int16x8_t vy = vminq_s16(vabsq_s16(vld1q_s16(&dy[x])), max_value);
+    uint16x8_t m;
+    if (method == IMAGE_MAGNITUDE_L1) {
+      m = vreinterpretq_u16_s16(vaddq_s16(vx, vy));
+    } else if (method == IMAGE_MAGNITUDE_L2) {
+      // sqrt(s) = s / sqrt(s), from the reciprocal square root estimate with two Newton steps
+      uint16x4_t r[2];
+      for (uint8_t half = 0; half < 2; half++) {
+        int16x4_t hx = half ? vget_high_s16(vx) : vget_low_s16(vx);
+        int16x4_t hy = half ? vget_high_s16(vy) : vget_low_s16(vy);
+        float32x4_t sum = vcvtq_f32_s32(vmlal_s16(vmull_s16(hx, hx), hy, hy));
+        float32x4_t safe = vmaxq_f32(sum, vdupq_n_f32(1e-10f));
+        float32x4_t e = vrsqrteq_f32(safe);
+        e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(safe, e), e));
+        e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(safe, e), e));
+        r[half] = vqmovn_u32(vcvtq_u32_f32(vaddq_f32(vmulq_f32(safe, e), vdupq_n_f32(0.5f))));
+      }
+      m = vcombine_u16(r[0], r[1]);
+    } else {
+      int16x8_t vmax = vmaxq_s16(vx, vy);
+      int16x8_t vmin = vminq_s16(vx, vy);
+      int16x8_t t = vshrq_n_s16(vmulq_n_s16(vaddq_s16(vaddq_s16(vmax, vmax), vmin), 15), 5);
+      m = vreinterpretq_u16_s16(vmaxq_s16(t, vmax));
+    }
+    vst1_u8(&output[x], vqmovn_u16(m));
+  }
+#endif
 
-  // Go through all pixels except the borders
-  for (idx = d->w + 1; idx < size - d->w - 1; idx++) {
-    temp1 = (int32_t)input_buf[idx + 1] - (int32_t)input_buf[idx - 1];
-    temp2 = (int32_t)input_buf[idx + input->w] - (int32_t)input_buf[idx - input->w];
-    d_buf[idx] = sqrti(temp1*temp1 + temp2*temp2);
+  // The pixels left by the vectorized loop
+  for (; x < w; x++) {
+    ax = abs(dx[x]);
+    ay = abs(dy[x]);
+    ax = (ax > 255) ? 255 : ax;
+    ay = (ay > 255) ? 255 : ay;
+    if (method == IMAGE_MAGNITUDE_L1) {
+      mx = ax + ay;
+    } else if (method == IMAGE_MAGNITUDE_L2) {
+      mx = image_magnitude_l2(ax * ax + ay * ay);
+    } else {
+      mx = (ax > ay) ? ax : ay;
+      mn = (ax > ay) ? ay : ax;
+      mx = ((15 * (2 * mx + mn)) >> 5 > mx) ? (15 * (2 * mx + mn)) >> 5 : mx;
+    }
+    output[x] = (mx > 255) ? 255 : mx;
   }
+}
 
-  // set x gradient for first and last row
-  for (idx = 1, idx1 = size - d->w + 1; idx1 < size - 1; idx++, idx1++) {
-    d_buf[idx] = (uint8_t)abs((int16_t)input_buf[idx + 1] - (int16_t)input_buf[idx - 1]);
-    d_buf[idx1] = (uint8_t)abs((int16_t)input_buf[idx1 + 1] - (int16_t)input_buf[idx1 - 1]);
+/**
+ * Calculate the x and y gradients of the pixels 1 to n of a row
+ * Simple: dx = [-1 0 1] * IMG, dy = [-1 0 1]' * IMG
+ * Sobel: dx = [-1 0 1; -2 0 2; -1 0 1] * IMG, dy = [-1 -2 -1; 0 0 0; 1 2 1] * IMG
+ * @param[in] *up The row above
+ * @param[in] *row The row
+ * @param[in] *down The row below
+ * @param[out] *dx The x gradients of pixel 1 to n
+ * @param[out] *dy The y gradients of pixel 1 to n
+ * @param[in] n The amount of pixels
+ * @param[in] sobel Use the Sobel operator
+ */
+static void image_2d_gradient_row(uint8_t *up, uint8_t *row, uint8_t *down, int16_t *dx, int16_t *dy, uint16_t n,
+                                  bool sobel)
+{
+  int32_t x = 0;
+
+#if defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  for (; x + 8 <= n; x += 8) {
+    __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&row[x]), zero);
+    __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&row[x + 2]), zero);
+    __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&up[x + 1]), zero);
+    __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&down[x + 1]), zero);
+    __m128i gx = _mm_sub_epi16(r, l);
+    __m128i gy = _mm_sub_epi16(d, u);
+    if (sobel) {
+      __m128i ul = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&up[x]), zero);
+      __m128i ur = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&up[x + 2]), zero);
+      __m128i dl = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&down[x]), zero);
+      __m128i dr = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&down[x + 2]), zero);
+      gx = _mm_add_epi16(_mm_add_epi16(gx, gx), _mm_add_epi16(_mm_sub_epi16(ur, ul), _mm_sub_epi16(dr, dl)));
+      gy = _mm_add_epi16(_mm_add_epi16(gy, gy), _mm_add_epi16(_mm_sub_epi16(dl, ul), _mm_sub_epi16(dr, ur)));
+    }
+    _mm_storeu_si128((__m128i *)&dx[x], gx);
+    _mm_storeu_si128((__m128i *)&dy[x], gy);
+  }
+#elif defined(CV_SIMD_NEON)
+  for (; x + 8 <= n; x += 8) {
+    int16x8_t gx = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(&row[x + 2]), vld1_u8(&row[x])));
+    int16x8_t gy = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(&down[x + 1]), vld1_u8(&up[x + 1])));
+    if (sobel) {
+      uint8x8_t ul = vld1_u8(&up[x]);
+      uint8x8_t ur = vld1_u8(&up[x + 2]);
+      uint8x8_t dl = vld1_u8(&down[x]);
+      uint8x8_t dr = vld1_u8(&down[x + 2]);
+      gx = vaddq_s16(vaddq_s16(gx, gx), vaddq_s16(vreinterpretq_s16_u16(vsubl_u8(ur, ul)),
+                                                  vreinterpretq_s16_u16(vsubl_u8(dr, dl))));
+      gy = vaddq_s16(vaddq_s16(gy, gy), vaddq_s16(vreinterpretq_s16_u16(vsubl_u8(dl, ul)),
+                                                  vreinterpretq_s16_u16(vsubl_u8(dr, ur))));
+    }
+    vst1q_s16(&dx[x], gx);
+    vst1q_s16(&dy[x], gy);
   }
+#endif
 
-  // set y gradient for first and last col
-  for (idx = d->w, idx1 = 2*d->w-1; idx1 < size - input->w; idx+=input->w, idx1+=input->w) {
-    d_buf[idx] = (uint8_t)abs((int16_t)input_buf[idx + input->w] - (int16_t)input_buf[idx - input->w]);
-    d_buf[idx1] = (uint8_t)abs((int16_t)input_buf[idx1 + input->w] - (int16_t)input_buf[idx1 - input->w]);
+  // The pixels left by the vectorized loop
+  for (; x < n; x++) {
+    dx[x] = (int16_t)row[x + 2] - (int16_t)row[x];
+    dy[x] = (int16_t)down[x + 1] - (int16_t)up[x + 1];
+    if (sobel) {
+      dx[x] = 2 * dx[x] + (int16_t)up[x + 2] - (int16_t)up[x] + (int16_t)down[x + 2] - (int16_t)down[x];
+      dy[x] = 2 * dy[x] + (int16_t)down[x] - (int16_t)up[x] + (int16_t)down[x + 2] - (int16_t)up[x + 2];
+    }
   }
 }
 
 /**
- * Calculate the  gradients using the following matrix:
- * dx = [-1 0 1; -2 0 2; -1 0 1] * IMG
- * dy = [-1 -2 -1; 0 0 0; 1 2 1] * IMG
- * d = sqrt(dx*dx + dy*dy)
+ * Calculate the gradient magnitude of a grayscale image
+ * The inside of the image gets the magnitude of the simple or Sobel gradients, the first and last row
+ * get |[-1 0 1] * IMG| and the first and last column |[-1 0 1]' * IMG|.
+ * Both gradients come from the same 3x3 window (see image_2d_gradient_row) and are turned into magnitudes
+ * per chunk of IMAGE_GRADIENT_CHUNK pixels, so they stay in a buffer on the stack.
  * @param[in] *input Input grayscale image
- * @param[out] *d Output mean gradient
+ * @param[out] *d Output gradient magnitude
+ * @param[in] sobel Use the Sobel operator
+ * @param[in] method The magnitude (approximation)
  */
-void image_2d_sobel(struct image_t *input, struct image_t *d)
+static void image_2d_magnitude(struct image_t *input, struct image_t *d, bool sobel, enum image_magnitude method)
 {
-  if (d->buf_size < input->buf_size){
+  if (d->buf_size < input->buf_size || input->w < 3 || input->h < 3) {
     return;
   }
 
@@ -551,17 +2372,18 @@ void image_2d_sobel(struct image_t *input, struct image_t *d)
 
   uint32_t idx, idx1;
   uint32_t size = input->w * input->h;
-  int32_t temp1, temp2;
-
-  // Go through all pixels except the borders
-  for (idx = d->w + 1; idx < size - d->w - 1; idx++) {
-    temp1 = 2*((int32_t)input_buf[idx + 1] - (int32_t)input_buf[idx - 1])
-         + (int32_t)input_buf[idx + 1 - input->w] - (int32_t)input_buf[idx - 1 - input->w]
-         + (int32_t)input_buf[idx + 1 + input->w] - (int32_t)input_buf[idx - 1 + input->w];
-    temp2 = 2*((int32_t)input_buf[idx + input->w] - (int32_t)input_buf[idx - input->w])
-        + (int32_t)input_buf[idx - 1 + input->w] - (int32_t)input_buf[idx - 1 - input->w]
-        + (int32_t)input_buf[idx + 1 + input->w] - (int32_t)input_buf[idx + 1 - input->w];
-    d_buf[idx] = sqrti(temp1*temp1 + temp2*temp2);
+  uint16_t n = input->w - 2;
+  uint16_t x, cnt;
+  int16_t dx[IMAGE_GRADIENT_CHUNK], dy[IMAGE_GRADIENT_CHUNK];
+
+  // Go through all pixels except the borders, one row at a time
+  for (uint16_t y = 1; y < input->h - 1; y++) {
+    uint8_t *row = &input_buf[y * input->w];
+    for (x = 0; x < n; x += cnt) {
+      cnt = (n - x > IMAGE_GRADIENT_CHUNK) ? IMAGE_GRADIENT_CHUNK : n - x;
+      image_2d_gradient_row(&row[x - input->w], &row[x], &row[x + input->w], dx, dy, cnt, sobel);
+      image_magnitude_row(dx, dy, &d_buf[y * input->w + 1 + x], cnt, method);
+    }
   }
 
   // set x gradient for first and last row
@@ -577,6 +2399,52 @@ void image_2d_sobel(struct image_t *input, struct image_t *d)
   }
 }
 
+/**
+ * Calculate the  gradients using the following matrix:
+ * d = |[0 -1 0; -1 0 1; 0 1 0] * IMG|
+ * @param[in] *input Input grayscale image
+ * @param[out] *d Output mean gradient
+ */
+void image_2d_gradients(struct image_t *input, struct image_t *d)
+{
+  image_2d_magnitude(input, d, false, IMAGE_MAGNITUDE_L2);
+}
+
+/**
+ * Same as image_2d_gradients, with a selectable magnitude
+ * @param[in] *input Input grayscale image
+ * @param[out] *d Output gradient magnitude
+ * @param[in] method The magnitude (approximation)
+ */
+void image_2d_gradients_magnitude(struct image_t *input, struct image_t *d, enum image_magnitude method)
+{
+  image_2d_magnitude(input, d, false, method);
+}
+
+/**
+ * Calculate the  gradients using the following matrix:
+ * dx = [-1 0 1; -2 0 2; -1 0 1] * IMG
+ * dy = [-1 -2 -1; 0 0 0; 1 2 1] * IMG
+ * d = sqrt(dx*dx + dy*dy)
+ * @param[in] *input Input grayscale image
+ * @param[out] *d Output mean gradient
+ */
+void image_2d_sobel(struct image_t *input, struct image_t *d)
+{
+  image_2d_magnitude(input, d, true, IMAGE_MAGNITUDE_L2);
+}
+
+/**
+ * Same as image_2d_sobel, with a selectable magnitude
+ * @param[in] *input Input grayscale image
+ * @param[out] *d Output gradient magnitude
+ * @param[in] method The magnitude (approximation)
+ */
+void image_2d_sobel_magnitude(struct image_t *input, struct image_t *d, enum image_magnitude method)
+{
+  image_2d_magnitude(input, d, true, method);
+}
+
 /**
  * Calculate the G vector of an image gradient
  * This is used for optical flow calculation.
@@ -35,7 +35,9 @@ enum image_type {
   IMAGE_YUV422,     ///< UYVY format (uint16 per pixel)
   IMAGE_GRAYSCALE,  ///< Grayscale image with only the Y part (uint8 per pixel)
   IMAGE_JPEG,       ///< An JPEG encoded image (not per pixel encoded)
-  IMAGE_GRADIENT    ///< An image gradient (int16 per pixel)
+  IMAGE_GRADIENT,   ///< An image gradient (int16 per pixel)
+  IMAGE_NV12,       ///< Y plane followed by an interleaved UV plane at half the width and height (4:2:0)
+  IMAGE_I420        ///< Y plane followed by a U and a V plane at half the width and height (4:2:0)
 };
 
 /**
@@ -47,6 +49,37 @@ struct FloatEulers {
   float psi; ///< in radians
 };
 
+/* Kernels of the separable smoothing filters */
+enum image_smooth_kernel {
+  IMAGE_SMOOTH_GAUSSIAN,  ///< Binomial approximation of a Gaussian ([1 2 1], [1 4 6 4 1] or [1 6 15 20 15 6 1])
+  IMAGE_SMOOTH_BOX        ///< Box (mean) filter
+};
+
+/* Gradient magnitudes of image_magnitude_row */
+enum image_magnitude {
+  IMAGE_MAGNITUDE_L1,             ///< |dx| + |dy|
+  IMAGE_MAGNITUDE_L2,             ///< sqrt(dx^2 + dy^2), rounded
+  IMAGE_MAGNITUDE_ALPHA_MAX_BETA_MIN  ///< Alpha max plus beta min approximation of L2 (within 6.25%)
+};
+
+/* Border handling of the separable filters (image_filter_*) */
+enum image_border {
+  IMAGE_BORDER_CLAMP,     ///< Replicate the edge pixels (aaa|abc)
+  IMAGE_BORDER_MIRROR,    ///< Mirror the image including the edge pixels (cba|abc)
+  IMAGE_BORDER_ZERO       ///< Pixels outside the image are 0
+};
+
+/* Rotations (clockwise) and mirrors of image_rotate */
+enum image_orientation {
+  IMAGE_ROTATE_0,
+  IMAGE_ROTATE_90,
+  IMAGE_ROTATE_180,
+  IMAGE_ROTATE_270,
+  IMAGE_FLIP_HORIZONTAL,  ///< Mirror the columns
+  IMAGE_FLIP_VERTICAL,    ///< Mirror the rows
+  IMAGE_TRANSPOSE         ///< Mirror in the diagonal from the top left
+};
+
 /* Main image structure */
 struct image_t {
   enum image_type type;   ///< The image type
@@ -88,6 +121,42 @@ struct crop_t {
   uint16_t h;    ///< height of the cropped area
 };
 
+/* Integral image (summed-area table) of a grayscale image or the Y of a YUV422 image */
+struct image_integral_t {
+  uint16_t w;             ///< Image width
+  uint16_t h;             ///< Image height
+  uint16_t rows;          ///< The amount of image rows that are in the tables (see image_integral_update)
+  uint32_t *sum;          ///< (w + 1) x (h + 1) sums of the pixels above and left, the first row and column are 0
+  uint32_t *sum_sq;       ///< The same for the squared pixels (modulo 2^32), NULL when not used
+};
+
+/* Separable fixed-point filter: the horizontal weights, then the vertical weights (1, 3, 5 or 7 taps each).
+ * Both passes round their weighted sum and shift it right by the shift of the pass. */
+struct image_filter_t {
+  uint8_t row_taps;           ///< The amount of horizontal taps
+  uint8_t col_taps;           ///< The amount of vertical taps
+  int16_t row[7];             ///< The horizontal weights (left to right)
+  int16_t col[7];             ///< The vertical weights (top to bottom)
+  uint8_t row_shift;          ///< The right shift after the horizontal pass
+  uint8_t col_shift;          ///< The right shift after the vertical pass
+  enum image_border border;   ///< The border handling
+};
+
+/* State of filtering an image row by row (see image_filter_rows_init) */
+struct image_filter_rows_t {
+  const struct image_filter_t *filter;  ///< The filter
+  uint8_t *input_u8;          ///< The uint8 input image, or NULL
+  int16_t *input_i16;         ///< The int16 input image, or NULL
+  uint8_t step;               ///< The bytes between the pixels of the uint8 input
+  uint16_t w;                 ///< Image width
+  uint16_t h;                 ///< Image height
+  uint16_t x0;                ///< The first filtered column
+  uint16_t x1;                ///< The end of the filtered columns
+  uint16_t next;              ///< The next input row of the horizontal pass
+  bool narrow;                ///< The vertical pass fits in 16 bits
+  int16_t *ring;              ///< col_taps rows of the horizontal pass and a zero row
+};
+
 /* Usefull image functions */
 #ifdef LINUX
 void image_create(struct image_t *img, uint16_t width, uint16_t height, enum image_type type);
@@ -100,6 +169,34 @@ void image_to_grayscale(struct image_t *input, struct image_t *output);
 uint16_t image_yuv422_colorfilt(struct image_t *input, struct image_t *output, uint8_t y_m, uint8_t y_M, uint8_t u_m,
                                 uint8_t u_M, uint8_t v_m, uint8_t v_M);
 void image_yuv422_downsample(struct image_t *input, struct image_t *output, uint16_t downsample);
+void image_yuv422_downscale(struct image_t *input, struct image_t *output, uint8_t downscale);
+void image_yuv420_planes(struct image_t *img, uint8_t **y, uint8_t **u, uint8_t **v, uint8_t *chroma_step);
+void image_yuv420_downscale(struct image_t *input, struct image_t *output, uint8_t downscale);
+void image_grayscale_view(struct image_t *input, struct image_t *output);
+void image_crop(struct image_t *input, struct image_t *output, struct crop_t *crop);
+void image_rotate_size(struct image_t *input, enum image_orientation orientation, struct img_size_t *size);
+void image_rotate(struct image_t *input, struct image_t *output, enum image_orientation orientation);
+void image_rotate_rows(struct image_t *input, struct image_t *output, enum image_orientation orientation, uint16_t y0,
+                       uint16_t y1);
+void image_smooth(struct image_t *input, struct image_t *output, uint8_t taps, enum image_smooth_kernel kernel);
+void image_smooth_u8(uint8_t *input, uint8_t *output, uint16_t w, uint16_t h, uint8_t taps,
+                     enum image_smooth_kernel kernel);
+void image_smooth_i16(int16_t *input, int16_t *output, uint16_t w, uint16_t h, uint8_t taps,
+                      enum image_smooth_kernel kernel);
+void image_filter_u8(uint8_t *input, uint8_t step, uint8_t *output, uint16_t w, uint16_t h,
+                     const struct image_filter_t *filter);
+void image_filter_u8_i16(uint8_t *input, uint8_t step, int16_t *output, uint16_t w, uint16_t h,
+                         const struct image_filter_t *filter);
+void image_filter_i16(int16_t *input, int16_t *output, uint16_t w, uint16_t h, const struct image_filter_t *filter);
+void image_filter_row_u8(uint8_t *input, uint8_t step, int16_t *output, uint16_t w, const struct image_filter_t *filter);
+void image_filter_row_i16(int16_t *input, int16_t *output, uint16_t w, const struct image_filter_t *filter);
+void image_filter_col_u8(int16_t **rows, uint8_t *output, uint16_t w, const struct image_filter_t *filter);
+void image_filter_col_i16(int16_t **rows, int16_t *output, uint16_t w, const struct image_filter_t *filter);
+bool image_filter_rows_init(struct image_filter_rows_t *rows, const struct image_filter_t *filter, uint8_t *input,
+                            uint8_t step, uint16_t w, uint16_t h);
+void image_filter_rows_u8(struct image_filter_rows_t *rows, uint16_t y, uint8_t *output);
+void image_filter_rows_i16(struct image_filter_rows_t *rows, uint16_t y, int16_t *output);
+void image_filter_rows_free(struct image_filter_rows_t *rows);
 void image_subpixel_window(struct image_t *input, struct image_t *output, struct point_t *center,
                            uint32_t subpixel_factor, uint8_t border_size);
 void image_gradients(struct image_t *input, struct image_t *dx, struct image_t *dy);
@@ -114,10 +211,22 @@ void image_draw_circle(struct image_t *img, struct point_t *center, uint16_t rad
 uint8_t sqrti(int32_t num);
 void image_2d_gradients(struct image_t *input, struct image_t *d);
 void image_2d_sobel(struct image_t *input, struct image_t *d);
+void image_2d_gradients_magnitude(struct image_t *input, struct image_t *d, enum image_magnitude method);
+void image_2d_sobel_magnitude(struct image_t *input, struct image_t *d, enum image_magnitude method);
+void image_magnitude_row(int16_t *dx, int16_t *dy, uint8_t *output, uint16_t w, enum image_magnitude method);
+
+bool image_integral_create(struct image_integral_t *ii, uint16_t w, uint16_t h, bool squared);
+void image_integral_free(struct image_integral_t *ii);
+void image_integral(struct image_t *input, struct image_integral_t *ii);
+void image_integral_update(struct image_t *input, struct image_integral_t *ii, uint16_t rows);
+void image_integral_add_row(struct image_integral_t *ii, uint8_t *row);
+uint32_t image_integral_box_sum(struct image_integral_t *ii, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+uint32_t image_integral_box_variance(struct image_integral_t *ii, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
 
 #ifdef LINUX
 void image_add_border(struct image_t *input, struct image_t *output, uint8_t border_size);
 void pyramid_next_level(struct image_t *input, struct image_t *output, uint8_t border_size);
+void pyramid_next_level_binomial(struct image_t *input, struct image_t *output, uint8_t border_size);
 void pyramid_build(struct image_t *input, struct image_t *output_array, uint8_t pyr_level, uint8_t border_size);
 #endif
 
@@ -28,6 +28,7 @@
  */
 
 #include <lib/vision/edge_flow.h>
+#include <lib/vision/simd.h>
 /**
  * Calc_previous_frame_nr; adaptive Time Horizon
  * @param[in] *opticflow The opticalflow structure
@@ -88,16 +89,153 @@ void  calc_previous_frame_nr(struct opticflow_result_t *result, struct opticflow
 void calculate_edge_histogram(struct image_t *img, int32_t edge_histogram[],
                               char direction, uint16_t edge_threshold)
 {
-  uint8_t *img_buf = (uint8_t *)img->buf;
+  calculate_edge_histogram_offset(img, edge_histogram, direction, edge_threshold, 1);
+}
 
-  // TODO use arm_conv_q31()
-  int32_t sobel_sum = 0;
-  int32_t Sobel[3] = { -1, 0, 1};
+/* The [-1 0 1] edge filter of the x direction */
+static const struct image_filter_t edge_filter_x = {3, 1, {-1, 0, 1}, {1}, 0, 0, IMAGE_BORDER_CLAMP};
 
-  uint32_t y = 0, x = 0;
-  int32_t c = 0;
+/* The [-1 0 1] edge filter of the y direction, its horizontal pass only widens the pixels */
+static const struct image_filter_t edge_filter_y = {1, 3, {1}, {-1, 0, 1}, 0, 0, IMAGE_BORDER_CLAMP};
+
+/* The amount of columns of which the x edges are filtered at once (in a buffer on the stack) */
+#define EDGE_FLOW_ROW_CHUNK 128
 
-  uint32_t idx = 0;
+/**
+ * Add the x edges of an image row to an edge histogram, except for the first and last column.
+ * The row is filtered in chunks of EDGE_FLOW_ROW_CHUNK columns together with the column left and right of the chunk.
+ * @param[in] *row  The first pixel of the row
+ * @param[in] interlace  The bytes between the pixels
+ * @param[in] image_width  The width of the row
+ * @param[in] edge_threshold  A threshold if a gradient is considered a edge or not
+ * @param[in,out] *hist  The edge histogram of the row (image_width long)
+ */
+static void edge_histogram_row_x(uint8_t *row, uint32_t interlace, uint16_t image_width, uint16_t edge_threshold,
+                                 int32_t *hist)
+{
+  int16_t gradients[EDGE_FLOW_ROW_CHUNK + 2];
+  int32_t sobel_sum;
+  uint32_t x0, x, n;
+
+  for (x0 = 1; x0 + 1 < image_width; x0 += n) {
+    n = image_width - 1 - x0;
+    if (n > EDGE_FLOW_ROW_CHUNK) {
+      n = EDGE_FLOW_ROW_CHUNK;
+    }
+    image_filter_row_u8(&row[interlace * (x0 - 1)], interlace, gradients, n + 2, &edge_filter_x);
+    for (x = 0; x < n; x++) {
+      sobel_sum = abs(gradients[x + 1]);
+      if (sobel_sum > edge_threshold) {
+        hist[x0 + x] += sobel_sum;
+      }
+    }
+  }
+}
+
+/**
+ * Sum the absolute gradients that are above a threshold
+ * @param[in] *gradients  The gradients
+ * @param[in] n  The amount of gradients
+ * @param[in] edge_threshold  A threshold if a gradient is considered a edge or not
+ * @return The sum of the edges above the threshold
+ */
+static int32_t edge_sum_threshold(int16_t *gradients, uint32_t n, uint16_t edge_threshold)
+{
+  int32_t sobel_sum, sum = 0;
+  uint32_t x = 0;
+
+#if defined(CV_SIMD_SSE2)
+  __m128i threshold = _mm_set1_epi16((int16_t)(edge_threshold > INT16_MAX ? INT16_MAX : edge_threshold));
+  __m128i ones = _mm_set1_epi16(1), zero = _mm_setzero_si128(), acc = _mm_setzero_si128(), g;
+  for (; x + 8 <= n; x += 8) {
+    g = _mm_loadu_si128((__m128i *)&gradients[x]);
+    g = _mm_max_epi16(g, _mm_sub_epi16(zero, g));
+    g = _mm_and_si128(g, _mm_cmpgt_epi16(g, threshold));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(g, ones));
+  }
+  acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+  acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+  sum = _mm_cvtsi128_si32(acc);
+#elif defined(CV_SIMD_NEON)
+  int16x8_t threshold = vdupq_n_s16((int16_t)(edge_threshold > INT16_MAX ? INT16_MAX : edge_threshold));
+  int32x4_t acc = vdupq_n_s32(0);
+  int16x8_t g;
+  for (; x + 8 <= n; x += 8) {
+    g = vabsq_s16(vld1q_s16(&gradients[x]));
+    g = vandq_s16(g, vreinterpretq_s16_u16(vcgtq_s16(g, threshold)));
+    acc = vpadalq_s16(acc, g);
+  }
+  sum = vgetq_lane_s32(acc, 0) + vgetq_lane_s32(acc, 1) + vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3);
+#endif
+  for (; x < n; x++) {
+    sobel_sum = abs(gradients[x]);
+    if (sobel_sum > edge_threshold) {
+      sum += sobel_sum;
+    }
+  }
+  return sum;
+}
+
+/**
+ * Add the y edges of a range of columns to an edge histogram, except for the first and last row.
+ * The columns are filtered in chunks of EDGE_FLOW_ROW_CHUNK: the horizontal pass widens every image row once into
+ * a ring of three rows, the vertical pass takes the difference of the row below and above.
+ * @param[in] *img_buf  The first pixel of the image
+ * @param[in] interlace  The bytes between the pixels
+ * @param[in] image_width  The width of the image
+ * @param[in] image_height  The height of the image
+ * @param[in] x0  The first column
+ * @param[in] x1  The end of the columns
+ * @param[in] edge_threshold  A threshold if a gradient is considered a edge or not
+ * @param[in,out] *hist  The edge histogram of the columns (image_height long)
+ */
+static void edge_histogram_cols_y(uint8_t *img_buf, uint32_t interlace, uint16_t image_width, uint16_t image_height,
+                                  uint32_t x0, uint32_t x1, uint16_t edge_threshold, int32_t *hist)
+{
+  int16_t ring[3][EDGE_FLOW_ROW_CHUNK];
+  int16_t gradients[EDGE_FLOW_ROW_CHUNK];
+  int16_t *rows[3];
+  uint32_t y, n;
+  uint8_t k;
+
+  if (image_height < 3) {
+    return;
+  }
+  for (; x0 < x1; x0 += n) {
+    n = x1 - x0;
+    if (n > EDGE_FLOW_ROW_CHUNK) {
+      n = EDGE_FLOW_ROW_CHUNK;
+    }
+    image_filter_row_u8(&img_buf[interlace * x0], interlace, ring[0], n, &edge_filter_y);
+    image_filter_row_u8(&img_buf[interlace * (image_width + x0)], interlace, ring[1], n, &edge_filter_y);
+    for (y = 1; y + 1 < image_height; y++) {
+      image_filter_row_u8(&img_buf[interlace * (image_width * (y + 1) + x0)], interlace, ring[(y + 1) % 3], n,
+                          &edge_filter_y);
+      for (k = 0; k < 3; k++) {
+        rows[k] = ring[(y - 1 + k) % 3];
+      }
+      image_filter_col_i16(rows, gradients, n, &edge_filter_y);
+      hist[y] += edge_sum_threshold(gradients, n, edge_threshold);
+    }
+  }
+}
+
+/**
+ * Calculate a edge/gradient histogram of one of the interlaced channels of the image.
+ * For a YUV422 image offset 1 selects the Y channel, while for interlaced stereo images
+ * offset 0 and 1 select the left and right image.
+ * @param[in] *img  The image frame to calculate the edge histogram from
+ * @param[out] *edge_histogram  The edge histogram from the current frame_step
+ * @param[in] direction  Indicating if the histogram is made in either x or y direction
+ * @param[in] edge_threshold  A threshold if a gradient is considered a edge or not
+ * @param[in] offset  The byte offset of the channel within a pixel
+ */
+void calculate_edge_histogram_offset(struct image_t *img, int32_t edge_histogram[],
+                                     char direction, uint16_t edge_threshold, uint8_t offset)
+{
+  uint8_t *img_buf = (uint8_t *)img->buf + offset;
+
+  uint32_t y = 0, x = 0;
 
   uint16_t image_width = img->w;
   uint16_t image_height = img->h;
@@ -111,50 +249,120 @@ void calculate_edge_histogram(struct image_t *img, int32_t edge_histogram[],
       while (1);   // hang to show user something isn't right
   }
 
-
   // compute edge histogram
   if (direction == 'x') {
     // set values that are not visited
     edge_histogram[0] = edge_histogram[image_width - 1] = 0;
     for (x = 1; x < image_width - 1; x++) {
       edge_histogram[x] = 0;
-      for (y = 0; y < image_height; y++) {
-        sobel_sum = 0;
-
-        for (c = -1; c <= 1; c++) {
-          idx = interlace * (image_width * y + (x + c)); // 2 for interlace
-
-          sobel_sum += Sobel[c + 1] * (int32_t)img_buf[idx + 1];
-        }
-        sobel_sum = abs(sobel_sum);
-        if (sobel_sum > edge_threshold) {
-          edge_histogram[x] += sobel_sum;
-        }
-      }
+    }
+    for (y = 0; y < image_height; y++) {
+      edge_histogram_row_x(&img_buf[interlace * image_width * y], interlace, image_width, edge_threshold,
+                           edge_histogram);
     }
   } else if (direction == 'y') {
-    // set values that are not visited
-    edge_histogram[0] = edge_histogram[image_height - 1] = 0;
-    for (y = 1; y < image_height - 1; y++) {
-      edge_histogram[y] = 0;
-      for (x = 0; x < image_width; x++) {
-        sobel_sum = 0;
+    memset(edge_histogram, 0, sizeof(int32_t) * image_height);
+    edge_histogram_cols_y(img_buf, interlace, image_width, image_height, 0, image_width, edge_threshold,
+                          edge_histogram);
+  } else
+    while (1);  // hang to show user something isn't right
+}
+
+/**
+ * Calculate partial edge histograms for a number of bands of the image in a single pass.
+ * For the x direction the image is split into horizontal bands (rows), for the y direction into
+ * vertical bands (columns). Band t is stored at edge_histogram[t * size], with size the image width
+ * for the x direction and the image height for the y direction. Summing the bands gives the
+ * histogram of calculate_edge_histogram.
+ * @param[in] *img  The image frame to calculate the edge histograms from
+ * @param[out] *edge_histogram  The n_tiles edge histograms from the current frame_step
+ * @param[in] direction  Indicating if the histogram is made in either x or y direction
+ * @param[in] edge_threshold  A threshold if a gradient is considered a edge or not
+ * @param[in] n_tiles  The amount of bands the image is split in (at most EDGEFLOW_MAX_TILES)
+ */
+void calculate_edge_histogram_tiles(struct image_t *img, int32_t *edge_histogram,
+                                    char direction, uint16_t edge_threshold, uint8_t n_tiles)
+{
+  uint8_t *img_buf = (uint8_t *)img->buf + 1;
 
-        for (c = -1; c <= 1; c++) {
-          idx = interlace * (image_width * (y + c) + x); // 2 for interlace
+  uint32_t y = 0, x0 = 0;
+  uint8_t t = 0;
 
-          sobel_sum += Sobel[c + 1] * (int32_t)img_buf[idx + 1];
-        }
-        sobel_sum = abs(sobel_sum);
-        if (sobel_sum > edge_threshold) {
-          edge_histogram[y] += sobel_sum;
-        }
-      }
+  uint16_t image_width = img->w;
+  uint16_t image_height = img->h;
+  uint32_t interlace;
+  if (img->type == IMAGE_GRAYSCALE) {
+    interlace = 1;
+  } else {
+    if (img->type == IMAGE_YUV422) {
+      interlace = 2;
+    } else
+      while (1);   // hang to show user something isn't right
+  }
+
+  if (n_tiles < 1 || n_tiles > EDGEFLOW_MAX_TILES) {
+    while (1);   // hang to show user something isn't right
+  }
+
+  // compute the partial edge histograms row by row
+  if (direction == 'x') {
+    memset(edge_histogram, 0, sizeof(int32_t) * image_width * n_tiles);
+    for (y = 0; y < image_height; y++) {
+      int32_t *hist = &edge_histogram[(y * n_tiles / image_height) * image_width];
+      edge_histogram_row_x(&img_buf[interlace * image_width * y], interlace, image_width, edge_threshold, hist);
+    }
+  } else if (direction == 'y') {
+    memset(edge_histogram, 0, sizeof(int32_t) * image_height * n_tiles);
+    for (x0 = 0, t = 0; t < n_tiles; x0 = (t + 1) * image_width / n_tiles, t++) {
+      edge_histogram_cols_y(img_buf, interlace, image_width, image_height, x0, (t + 1) * image_width / n_tiles,
+                            edge_threshold, &edge_histogram[t * image_height]);
     }
   } else
     while (1);  // hang to show user something isn't right
 }
 
+/**
+ * Sum the partial edge histograms of calculate_edge_histogram_tiles into the edge histogram of the full image
+ * @param[in] *edge_histogram_tiles  The n_tiles partial edge histograms
+ * @param[out] *edge_histogram  The edge histogram of the full image
+ * @param[in] size  The size of a single edge histogram
+ * @param[in] n_tiles  The amount of partial edge histograms
+ */
+void edge_histogram_merge_tiles(int32_t *edge_histogram_tiles, int32_t *edge_histogram, uint16_t size, uint8_t n_tiles)
+{
+  uint16_t x;
+  uint8_t t;
+
+  memcpy(edge_histogram, edge_histogram_tiles, sizeof(int32_t) * size);
+  for (t = 1; t < n_tiles; t++) {
+    for (x = 0; x < size; x++) {
+      edge_histogram[x] += edge_histogram_tiles[t * size + x];
+    }
+  }
+}
+
+/**
+ * Sum of absolute differences between a window of the current edge histogram and
+ * a shifted window of the previous edge histogram
+ * @param[in] *edge_histogram  The edge histogram from the current frame_step
+ * @param[in] *edge_histogram_prev  The edge histogram from the previous frame_step
+ * @param[in] x  Center of the window in the current histogram
+ * @param[in] W  Half the window size
+ * @param[in] shift  Shift of the window in the previous histogram
+ * @return The SAD of the two windows
+ */
+static inline uint32_t edge_window_sad(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t x, int32_t W,
+                                       int32_t shift)
+{
+  uint32_t sad = 0;
+  int32_t r;
+
+  for (r = -W; r <= W; r++) {
+    sad += abs(edge_histogram[x + r] - edge_histogram_prev[x + r + shift]);
+  }
+  return sad;
+}
+
 /**
  * Calculate_displacement calculates the displacement between two histograms
  * @param[in] *edge_histogram  The edge histogram from the current frame_step
@@ -169,7 +377,7 @@ void calculate_edge_displacement(int32_t *edge_histogram, int32_t *edge_histogra
                                  uint16_t size,
                                  uint8_t window, uint8_t disp_range, int32_t der_shift)
 {
-  int32_t c = 0, r = 0;
+  int32_t c = 0;
   uint32_t x = 0;
   uint32_t SAD_temp[2 * DISP_RANGE_MAX + 1]; // size must be at least 2*D + 1
 
@@ -182,8 +390,9 @@ void calculate_edge_displacement(int32_t *edge_histogram, int32_t *edge_histogra
 
   int32_t border[2];
 
+  // the previous histogram is read from x - W - D + der_shift up to x + W + D + der_shift
   if (der_shift < 0) {
-    border[0] =  W + D + der_shift;
+    border[0] =  W + D - der_shift;
     border[1] = size - W - D;
   } else if (der_shift > 0) {
     border[0] =  W + D;
@@ -193,7 +402,7 @@ void calculate_edge_displacement(int32_t *edge_histogram, int32_t *edge_histogra
     border[1] = size - W - D;
   }
 
-  if (border[0] >= border[1] || abs(der_shift) >= 10) {
+  if (border[0] >= border[1] || abs(der_shift) >= 10 || D > DISP_RANGE_MAX) {
     SHIFT_TOO_FAR = 1;
   }
   {
@@ -202,10 +411,7 @@ void calculate_edge_displacement(int32_t *edge_histogram, int32_t *edge_histogra
       displacement[x] = 0;
       if (!SHIFT_TOO_FAR) {
         for (c = -D; c <= D; c++) {
-          SAD_temp[c + D] = 0;
-          for (r = -W; r <= W; r++) {
-            SAD_temp[c + D] += abs(edge_histogram[x + r] - edge_histogram_prev[x + r + c + der_shift]);
-          }
+          SAD_temp[c + D] = edge_window_sad(edge_histogram, edge_histogram_prev, x, W, c + der_shift);
         }
         displacement[x] = (int32_t)getMinimum(SAD_temp, 2 * D + 1) - D;
       } else {
@@ -215,6 +421,164 @@ void calculate_edge_displacement(int32_t *edge_histogram, int32_t *edge_histogra
 
 }
 
+/**
+ * Calculate_displacement_range matches two histograms over an arbitrary range of shifts.
+ * For every x the window around edge_histogram[x] is compared with the windows around
+ * edge_histogram_ref[x + shift] for shift_min <= shift <= shift_max, and the shift with the
+ * lowest SAD is returned. Positions for which the search would leave the histogram are set to 0.
+ * @param[in] *edge_histogram  The edge histogram to match
+ * @param[in] *edge_histogram_ref  The reference edge histogram (previous frame or other camera)
+ * @param[out] *displacement  The best shift per position in 1/subpixel_factor pixels
+ * @param[in] size  Indicating the size of the displacement array
+ * @param[in] window Indicating the search window size
+ * @param[in] shift_min  The smallest shift to search
+ * @param[in] shift_max  The largest shift to search (at most shift_min + 2 * DISP_RANGE_MAX)
+ * @param[in] subpixel_factor  The amount of subpixels per pixel, 1 for integer shifts
+ */
+void calculate_edge_displacement_range(int32_t *edge_histogram, int32_t *edge_histogram_ref, int32_t *displacement,
+                                       uint16_t size, uint8_t window, int32_t shift_min, int32_t shift_max,
+                                       uint16_t subpixel_factor)
+{
+  int32_t c = 0;
+  int32_t x = 0;
+  uint32_t SAD_temp[2 * DISP_RANGE_MAX + 1];
+
+  int32_t W = window;
+  int32_t start = W - ((shift_min < 0) ? shift_min : 0);
+  int32_t end = size - W - ((shift_max > 0) ? shift_max : 0);
+
+  memset(displacement, 0, sizeof(int32_t)*size);
+
+  if (shift_max < shift_min || shift_max - shift_min > 2 * DISP_RANGE_MAX) {
+    return;
+  }
+
+  for (x = start; x < end; x++) {
+    for (c = shift_min; c <= shift_max; c++) {
+      SAD_temp[c - shift_min] = edge_window_sad(edge_histogram, edge_histogram_ref, x, W, c);
+    }
+    displacement[x] = getMinimumSubpixel(SAD_temp, shift_max - shift_min + 1, subpixel_factor)
+                      + shift_min * subpixel_factor;
+  }
+}
+
+/**
+ * Calculate_displacement_subpixel calculates the displacement between two histograms with subpixel accuracy.
+ * The block matching is the same as in calculate_edge_displacement, after which a parabola is fitted
+ * through the SAD minimum and its two neighbours.
+ * @param[in] *edge_histogram  The edge histogram from the current frame_step
+ * @param[in] *edge_histogram_prev  The edge histogram from the previous frame_step
+ * @param[out] *displacement array with the displacement in 1/subpixel_factor pixels
+ * @param[in] size  Indicating the size of the displacement array
+ * @param[in] window Indicating the search window size
+ * @param[in] disp_range  Indicating the maximum disparity range for the block matching
+ * @param[in] der_shift  The pixel shift estimated by the angle rate of the IMU
+ * @param[in] subpixel_factor  The amount of subpixels per pixel
+ */
+void calculate_edge_displacement_subpixel(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
+    uint16_t size, uint8_t window, uint8_t disp_range, int32_t der_shift, uint16_t subpixel_factor)
+{
+  int32_t c = 0;
+  int32_t x = 0;
+  uint32_t SAD_temp[2 * DISP_RANGE_MAX + 1]; // size must be at least 2*D + 1
+
+  int32_t W = window;
+  int32_t D = disp_range;
+  int32_t border[2];
+
+  memset(displacement, 0, sizeof(int32_t)*size);
+
+  // the previous histogram is read from x - W - D + der_shift up to x + W + D + der_shift
+  border[0] = W + D - ((der_shift < 0) ? der_shift : 0);
+  border[1] = size - W - D - ((der_shift > 0) ? der_shift : 0);
+
+  if (border[0] >= border[1] || abs(der_shift) >= 10 || D > DISP_RANGE_MAX) {
+    return;
+  }
+
+  for (x = border[0]; x < border[1]; x++) {
+    for (c = -D; c <= D; c++) {
+      SAD_temp[c + D] = edge_window_sad(edge_histogram, edge_histogram_prev, x, W, c + der_shift);
+    }
+    displacement[x] = getMinimumSubpixel(SAD_temp, 2 * D + 1, subpixel_factor) - D * subpixel_factor;
+  }
+}
+
+/**
+ * Downsample an edge histogram by a factor 2 by summing neighbouring bins
+ * @param[in] *edge_histogram  The edge histogram at full resolution
+ * @param[out] *edge_histogram_coarse  The coarse edge histogram (size / 2 bins)
+ * @param[in] size  The size of the full resolution edge histogram
+ */
+void edge_histogram_downsample(int32_t *edge_histogram, int32_t *edge_histogram_coarse, uint16_t size)
+{
+  uint16_t x;
+
+  for (x = 0; x < size / 2; x++) {
+    edge_histogram_coarse[x] = edge_histogram[2 * x] + edge_histogram[2 * x + 1];
+  }
+}
+
+/**
+ * Calculate_displacement_pyramid calculates the displacement between two histograms coarse-to-fine.
+ * The histograms are first matched at half resolution with the given disparity range, after which
+ * every displacement is refined at full resolution in a small range around the coarse estimate and
+ * interpolated to subpixel accuracy. This doubles the maximum displacement at the same search cost.
+ * @param[in] *edge_histogram  The edge histogram from the current frame_step
+ * @param[in] *edge_histogram_prev  The edge histogram from the previous frame_step
+ * @param[out] *displacement array with the displacement in 1/subpixel_factor pixels
+ * @param[in] size  Indicating the size of the displacement array, at most EDGEFLOW_MAX_SIZE
+ * @param[in] window Indicating the search window size (at full resolution)
+ * @param[in] disp_range  Indicating the maximum disparity range for the block matching at the coarse level
+ * @param[in] der_shift  The pixel shift estimated by the angle rate of the IMU
+ * @param[in] subpixel_factor  The amount of subpixels per pixel
+ */
+void calculate_edge_displacement_pyramid(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
+    uint16_t size, uint8_t window, uint8_t disp_range, int32_t der_shift, uint16_t subpixel_factor)
+{
+  int32_t c = 0;
+  int32_t x = 0;
+  uint32_t SAD_temp[2 * EDGEFLOW_REFINE_RANGE + 1];
+
+  int32_t W = window;
+  int32_t R = EDGEFLOW_REFINE_RANGE;
+  uint16_t size_coarse = size / 2;
+  uint8_t window_coarse = (window > 1) ? window / 2 : 1;
+
+  // Coarse level histograms and displacement
+  int32_t hist_coarse[EDGEFLOW_MAX_SIZE / 2];
+  int32_t hist_prev_coarse[EDGEFLOW_MAX_SIZE / 2];
+  int32_t disp_coarse[EDGEFLOW_MAX_SIZE / 2];
+
+  memset(displacement, 0, sizeof(int32_t)*size);
+  if (size > EDGEFLOW_MAX_SIZE) {
+    return;
+  }
+
+  edge_histogram_downsample(edge_histogram, hist_coarse, size);
+  edge_histogram_downsample(edge_histogram_prev, hist_prev_coarse, size);
+  calculate_edge_displacement(hist_coarse, hist_prev_coarse, disp_coarse, size_coarse, window_coarse, disp_range,
+                              der_shift / 2);
+
+  if (abs(der_shift) < 10) {
+    for (x = W; x < size - W; x++) {
+      int32_t guess = 2 * disp_coarse[x / 2] + der_shift;
+
+      // Only refine when the whole search range lies inside the histogram
+      if (x - W + guess - R < 0 || x + W + guess + R >= size) {
+        displacement[x] = (guess - der_shift) * subpixel_factor;
+        continue;
+      }
+
+      for (c = -R; c <= R; c++) {
+        SAD_temp[c + R] = edge_window_sad(edge_histogram, edge_histogram_prev, x, W, guess + c);
+      }
+      displacement[x] = getMinimumSubpixel(SAD_temp, 2 * R + 1, subpixel_factor)
+                        + (guess - der_shift - R) * subpixel_factor;
+    }
+  }
+}
+
 /**
  * Calculate minimum of an array
  * @param[in] *a Array containing values
@@ -238,6 +602,33 @@ uint32_t getMinimum(uint32_t *a, uint32_t n)
   return min_ind;
 }
 
+/**
+ * Calculate the minimum of an array with subpixel accuracy
+ * A parabola is fitted through the minimum and its two neighbours, unless the
+ * minimum lies on the border of the array.
+ * @param[in] *a Array containing values
+ * @param[in] n The size of the array
+ * @param[in] subpixel_factor The amount of subpixels per index
+ * @return The index of the smallest value of the array in 1/subpixel_factor units
+ */
+int32_t getMinimumSubpixel(uint32_t *a, uint32_t n, uint16_t subpixel_factor)
+{
+  uint32_t min_ind = getMinimum(a, n);
+  int32_t min_sub = (int32_t)min_ind * subpixel_factor;
+
+  if (min_ind > 0 && min_ind < n - 1) {
+    int64_t left = a[min_ind - 1];
+    int64_t right = a[min_ind + 1];
+    int64_t curv = left - 2 * (int64_t)a[min_ind] + right;
+
+    // Vertex of the parabola, which is always within half an index of the minimum
+    if (curv > 0) {
+      min_sub += (int32_t)((subpixel_factor * (left - right)) / (2 * curv));
+    }
+  }
+  return min_sub;
+}
+
 
 /**
  * Fits a linear model to an array with pixel displacements with least squares
@@ -291,6 +682,105 @@ void line_fit(int32_t *displacement, int32_t *divergence, int32_t *flow, uint32_
   }
 }
 
+/**
+ * Calculate the flow and divergence of every tile along one dimension from the partial edge histograms.
+ * The displacement is computed once per band over its full length, so that tiles in the middle of the
+ * image can use the histogram of their neighbours, after which a line is fitted per tile. Only the
+ * part of a tile with a valid displacement (at least window + disp_range from the image border) is fitted,
+ * and the resulting flow is the value of that line at the centre of the whole tile.
+ * @param[in] *edge_histogram  The partial edge histograms from the current frame_step
+ * @param[in] *edge_histogram_prev  The partial edge histograms from the previous frame_step
+ * @param[out] *displacement  Scratch array of at least size elements
+ * @param[in] size  The size of a single edge histogram
+ * @param[in] n_tiles  The amount of bands and tiles per band
+ * @param[in] window Indicating the search window size
+ * @param[in] disp_range  Indicating the maximum disparity range for the block matching
+ * @param[in] der_shift  The pixel shift estimated by the angle rate of the IMU
+ * @param[in] RES  Resolution of the line fit
+ * @param[out] *flow  The flow at the centre of each tile, indexed as [band * n_tiles + tile]
+ * @param[out] *divergence  The divergence per tile, indexed as [band * n_tiles + tile]
+ */
+void edge_flow_tiles_fit(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
+                         uint16_t size, uint8_t n_tiles, uint8_t window, uint8_t disp_range, int32_t der_shift,
+                         uint16_t RES, int32_t *flow, int32_t *divergence)
+{
+  uint8_t band, tile;
+  int32_t border = window + disp_range;
+
+  for (band = 0; band < n_tiles; band++) {
+    calculate_edge_displacement(&edge_histogram[band * size], &edge_histogram_prev[band * size], displacement,
+                                size, window, disp_range, der_shift);
+
+    for (tile = 0; tile < n_tiles; tile++) {
+      int32_t start = tile * size / n_tiles;
+      int32_t end = (tile + 1) * size / n_tiles;
+      int32_t centre = (start + end) / 2;
+      uint8_t idx = band * n_tiles + tile;
+
+      if (start < border) {
+        start = border;
+      }
+      if (end > size - border) {
+        end = size - border;
+      }
+
+      flow[idx] = 0;
+      divergence[idx] = 0;
+      if (end - start > 1) {
+        line_fit(&displacement[start], &divergence[idx], &flow[idx], end - start, 0, RES);
+        // the fit starts at the first valid pixel, move its intercept to the tile centre
+        flow[idx] += divergence[idx] * (centre - start);
+      }
+    }
+  }
+}
+
+/**
+ * Calculate the EdgeFlow of a grid of n_tiles x n_tiles image regions from the partial edge histograms
+ * @param[in] *edge_hist  The partial edge histograms (x and y) from the current frame_step
+ * @param[in] *edge_hist_prev_x  The partial edge histograms in x from the previous frame_step
+ * @param[in] *edge_hist_prev_y  The partial edge histograms in y from the previous frame_step
+ * @param[out] *displacement  Scratch array of at least max(image_width, image_height) elements
+ * @param[in] image_width  The width of the image
+ * @param[in] image_height  The height of the image
+ * @param[in] n_tiles  The amount of tiles in each dimension
+ * @param[in] window Indicating the search window size
+ * @param[in] disp_range  Indicating the maximum disparity range for the block matching
+ * @param[in] der_shift_x  The pixel shift in x estimated by the angle rate of the IMU
+ * @param[in] der_shift_y  The pixel shift in y estimated by the angle rate of the IMU
+ * @param[in] RES  Resolution of the line fit
+ * @param[out] *edgeflow  The flow per region, row-major as [row * n_tiles + column]
+ */
+void calculate_edge_flow_tiles(struct edge_hist_t *edge_hist, int32_t *edge_hist_prev_x, int32_t *edge_hist_prev_y,
+                               int32_t *displacement, uint16_t image_width, uint16_t image_height, uint8_t n_tiles,
+                               uint8_t window, uint8_t disp_range, int32_t der_shift_x, int32_t der_shift_y,
+                               uint16_t RES, struct edge_flow_t *edgeflow)
+{
+  int32_t flow[EDGEFLOW_MAX_TILES * EDGEFLOW_MAX_TILES];
+  int32_t divergence[EDGEFLOW_MAX_TILES * EDGEFLOW_MAX_TILES];
+  uint8_t row, col;
+
+  // Horizontal flow: bands are rows of tiles, tiles within a band are columns
+  edge_flow_tiles_fit(edge_hist->x, edge_hist_prev_x, displacement, image_width, n_tiles, window, disp_range,
+                      der_shift_x, RES, flow, divergence);
+  for (row = 0; row < n_tiles; row++) {
+    for (col = 0; col < n_tiles; col++) {
+      edgeflow[row * n_tiles + col].flow_x = flow[row * n_tiles + col];
+      edgeflow[row * n_tiles + col].div_x = divergence[row * n_tiles + col];
+    }
+  }
+
+  // Vertical flow: bands are columns of tiles, tiles within a band are rows
+  edge_flow_tiles_fit(edge_hist->y, edge_hist_prev_y, displacement, image_height, n_tiles, window, disp_range,
+                      der_shift_y, RES, flow, divergence);
+  for (row = 0; row < n_tiles; row++) {
+    for (col = 0; col < n_tiles; col++) {
+      edgeflow[row * n_tiles + col].flow_y = flow[col * n_tiles + row];
+      edgeflow[row * n_tiles + col].div_y = divergence[col * n_tiles + row];
+    }
+  }
+}
+
 /**
  * Draws edgehistogram, displacement and linefit directly on the image for debugging (only for edgeflow in horizontal direction!!)
  * @param[out] *img The image structure where will be drawn on
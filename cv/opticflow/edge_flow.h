@@ -54,6 +54,15 @@
 #ifndef MAX_WINDOW_SIZE
 #define MAX_WINDOW_SIZE 20
 #endif
+#ifndef EDGEFLOW_REFINE_RANGE
+#define EDGEFLOW_REFINE_RANGE 2   ///< Search range at full resolution around the coarse displacement
+#endif
+#ifndef EDGEFLOW_MAX_SIZE
+#define EDGEFLOW_MAX_SIZE 1280    ///< Maximum size of an edge histogram for calculate_edge_displacement_pyramid
+#endif
+#ifndef EDGEFLOW_MAX_TILES
+#define EDGEFLOW_MAX_TILES 5      ///< Maximum amount of tiles per dimension for the multi-region EdgeFlow
+#endif
 #ifndef OPTICFLOW_FOV_W
 #define OPTICFLOW_FOV_W 0.89360857702
 #endif
@@ -88,14 +97,35 @@ void calc_previous_frame_nr(struct opticflow_result_t *result, struct opticflow_
                             uint8_t *previous_frame_offset, uint8_t *previous_frame_nr);
 void calculate_edge_histogram(struct image_t *img, int32_t edge_histogram[],
                               char direction, uint16_t edge_threshold);
+void calculate_edge_histogram_offset(struct image_t *img, int32_t edge_histogram[],
+                                     char direction, uint16_t edge_threshold, uint8_t offset);
 void calculate_edge_displacement(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
                                  uint16_t size,
                                  uint8_t window, uint8_t disp_range, int32_t der_shift);
+void calculate_edge_displacement_range(int32_t *edge_histogram, int32_t *edge_histogram_ref, int32_t *displacement,
+                                       uint16_t size, uint8_t window, int32_t shift_min, int32_t shift_max,
+                                       uint16_t subpixel_factor);
+void calculate_edge_displacement_subpixel(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
+    uint16_t size, uint8_t window, uint8_t disp_range, int32_t der_shift, uint16_t subpixel_factor);
+void calculate_edge_displacement_pyramid(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
+    uint16_t size, uint8_t window, uint8_t disp_range, int32_t der_shift, uint16_t subpixel_factor);
+void edge_histogram_downsample(int32_t *edge_histogram, int32_t *edge_histogram_coarse, uint16_t size);
+void calculate_edge_histogram_tiles(struct image_t *img, int32_t *edge_histogram,
+                                    char direction, uint16_t edge_threshold, uint8_t n_tiles);
+void edge_histogram_merge_tiles(int32_t *edge_histogram_tiles, int32_t *edge_histogram, uint16_t size, uint8_t n_tiles);
+void edge_flow_tiles_fit(int32_t *edge_histogram, int32_t *edge_histogram_prev, int32_t *displacement,
+                         uint16_t size, uint8_t n_tiles, uint8_t window, uint8_t disp_range, int32_t der_shift,
+                         uint16_t RES, int32_t *flow, int32_t *divergence);
+void calculate_edge_flow_tiles(struct edge_hist_t *edge_hist, int32_t *edge_hist_prev_x, int32_t *edge_hist_prev_y,
+                               int32_t *displacement, uint16_t image_width, uint16_t image_height, uint8_t n_tiles,
+                               uint8_t window, uint8_t disp_range, int32_t der_shift_x, int32_t der_shift_y,
+                               uint16_t RES, struct edge_flow_t *edgeflow);
 
 // Local assisting functions (only used here)
 // TODO: find a way to incorperate/find these functions in paparazzi
 uint32_t timeval_diff2(struct timeval *starttime, struct timeval *finishtime);
 uint32_t getMinimum(uint32_t *a, uint32_t n);
+int32_t getMinimumSubpixel(uint32_t *a, uint32_t n, uint16_t subpixel_factor);
 void line_fit(int32_t *displacement, int32_t *divergence, int32_t *flow, uint32_t size, uint32_t border,
               uint16_t RES);
 uint32_t getAmountPeaks(int32_t *edgehist, uint32_t median, int32_t size);
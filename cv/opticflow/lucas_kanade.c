@@ -34,6 +34,7 @@
 #include <math.h>
 #include <string.h>
 #include "lucas_kanade.h"
+#include "lucas_kanade_core.h"
 
 
 /**
@@ -69,6 +70,7 @@
  *   + [c] calculate the 'b'-vector
  *   + [d] calculate the additional flow step and possibly terminate the iteration
  * - (5) use calculated flow as initial flow estimation for next level of pyramid
+ * Steps (1) to (4) are done by lk_track_point.
  */
 struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, struct point_t *points,
                            uint16_t *points_cnt, uint16_t half_window_size,
@@ -85,9 +87,28 @@ struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, str
   // Allocate some memory for returning the vectors
   struct flow_t *vectors = malloc(sizeof(struct flow_t) * max_points);
 
-  // Determine patch sizes and initialize neighborhoods
+  // Initialize the tracker, the step is divided by the full determinant. The iterations of this tracker used to
+  // count down, so the occlusion test starts at the step where the remaining iterations drop below the half.
+  struct lk_params params = {
+    .half_window_size = half_window_size,
+    .subpixel_factor = subpixel_factor,
+    .max_iterations = max_iterations,
+    .step_threshold = step_threshold,
+    .gradient_div = 1,
+    .error_div = 1,
+    .occlusion_start = max_iterations - max_iterations / 2,
+    .max_step_norm = false,
+    .precise_step = true
+  };
+  struct lk_context lk;
+  if (!lk_init(&lk, &params)) {
+    // Without the buffers of the tracker no point is tracked
+    *points_cnt = 0;
+    return vectors;
+  }
+
+  // Determine patch sizes
   uint16_t patch_size = 2 * half_window_size + 1;
-  uint32_t error_threshold = (25 * 25) * (patch_size * patch_size);
   uint16_t padded_patch_size = patch_size + 2;
   uint8_t border_size = padded_patch_size / 2 + 2; // amount of padding added to images
 
@@ -99,20 +120,21 @@ struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, str
   pyramid_build(old_img, pyramid_old, pyramid_level, border_size);
   pyramid_build(new_img, pyramid_new, pyramid_level, border_size);
 
-  // Create the window images
-  struct image_t window_I, window_J, window_DX, window_DY, window_diff;
-  image_create(&window_I, padded_patch_size, padded_patch_size, IMAGE_GRAYSCALE);
-  image_create(&window_J, patch_size, patch_size, IMAGE_GRAYSCALE);
-  image_create(&window_DX, patch_size, patch_size, IMAGE_GRADIENT);
-  image_create(&window_DY, patch_size, patch_size, IMAGE_GRADIENT);
-  image_create(&window_diff, patch_size, patch_size, IMAGE_GRADIENT);
-
   // Iterate through pyramid levels
   for (int8_t LVL = pyramid_level; LVL != -1; LVL--) {
     uint16_t points_orig = *points_cnt;
     *points_cnt = 0;
     uint16_t new_p = 0;
 
+    // The points are tracked in the padded images, but may not go outside the original image
+    struct lk_image lvl_old = {pyramid_old[LVL].buf, pyramid_old[LVL].w, pyramid_old[LVL].h, LK_GRAYSCALE};
+    struct lk_image lvl_new = {pyramid_new[LVL].buf, pyramid_new[LVL].w, pyramid_new[LVL].h, LK_GRAYSCALE};
+    int32_t border = border_size * subpixel_factor;
+    lk.params.min_x = border;
+    lk.params.max_x = (pyramid_new[LVL].w - 1 - border_size) * subpixel_factor;
+    lk.params.min_y = border;
+    lk.params.max_y = (pyramid_new[LVL].h - 1 - border_size) * subpixel_factor;
+
     // Calculate the amount of points to skip
     float skip_points = (points_orig > max_points) ? (float)points_orig / max_points : 1;
 
@@ -135,81 +157,16 @@ struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, str
         vectors[new_p].flow_y = vectors[p].flow_y << 1;
       }
 
-      // If the pixel is outside original image, do not track it
-      if ((((int32_t) vectors[new_p].pos.x + vectors[new_p].flow_x) < 0)
-          || ((vectors[new_p].pos.x + vectors[new_p].flow_x) > ((pyramid_new[LVL].w - 1 - 2 * border_size)* subpixel_factor))
-          || (((int32_t) vectors[new_p].pos.y + vectors[new_p].flow_y) < 0)
-          || ((vectors[new_p].pos.y + vectors[new_p].flow_y) > ((pyramid_new[LVL].h - 1 - 2 * border_size)* subpixel_factor))) {
-        continue;
-      }
-
-
-      // (1) determine the subpixel neighborhood in the old image
-      image_subpixel_window(&pyramid_old[LVL], &window_I, &vectors[new_p].pos, subpixel_factor, border_size);
-
-      // (2) get the x- and y- gradients
-      image_gradients(&window_I, &window_DX, &window_DY);
-
-      // (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
-      int32_t G[4];
-      image_calculate_g(&window_DX, &window_DY, G);
-
-      // calculate G's determinant in subpixel units:
-      int32_t Det = (G[0] * G[3] - G[1] * G[2]);
-
-      // Check if the determinant is bigger than 1
-      if (Det < 1) {
-        continue;
-      }
-
-      // (4) iterate over taking steps in the image to minimize the error:
-      bool tracked = true;
-
-      for (uint8_t it = max_iterations; it--;) {
-        struct point_t new_point = { vectors[new_p].pos.x  + vectors[new_p].flow_x,
-                 vectors[new_p].pos.y + vectors[new_p].flow_y
-        };
-
-
-        // If the pixel is outside original image, do not track it
-        if ((((int32_t)vectors[new_p].pos.x  + vectors[new_p].flow_x) < 0)
-            || (new_point.x > ((pyramid_new[LVL].w - 1 - 2 * border_size)*subpixel_factor))
-            || (((int32_t)vectors[new_p].pos.y  + vectors[new_p].flow_y) < 0)
-            || (new_point.y > ((pyramid_new[LVL].h - 1 - 2 * border_size)*subpixel_factor))) {
-          tracked = false;
-          break;
-        }
-
-        //     [a] get the subpixel neighborhood in the new image
-        image_subpixel_window(&pyramid_new[LVL], &window_J, &new_point, subpixel_factor, border_size);
-
-        //     [b] determine the image difference between the two neighborhoods
-        uint32_t error = image_difference(&window_I, &window_J, &window_diff);
-
-        if (error > error_threshold && it < max_iterations / 2) {
-          tracked = false;
-          break;
-        }
-
-        int32_t b_x = image_multiply(&window_diff, &window_DX, NULL) / 255;
-        int32_t b_y = image_multiply(&window_diff, &window_DY, NULL) / 255;
-
-
-        //     [d] calculate the additional flow step and possibly terminate the iteration
-        int16_t step_x = (((int64_t) G[3] * b_x - G[1] * b_y) * subpixel_factor) / Det;
-        int16_t step_y = (((int64_t) G[0] * b_y - G[2] * b_x) * subpixel_factor) / Det;
-
-        vectors[new_p].flow_x = vectors[new_p].flow_x + step_x;
-        vectors[new_p].flow_y = vectors[new_p].flow_y + step_y;
-
-        // Check if we exceeded the treshold CHANGED made this better for 0.03
-        if ((abs(step_x) + abs(step_y)) < step_threshold) {
-          break;
-        }
-      } // lucas kanade step iteration
+      // Track the point, points outside the original image are not tracked
+      int32_t flow_x = vectors[new_p].flow_x;
+      int32_t flow_y = vectors[new_p].flow_y;
+      bool tracked = lk_track_point(&lk, &lvl_old, &lvl_new, vectors[new_p].pos.x + border, vectors[new_p].pos.y + border,
+                                    &flow_x, &flow_y);
 
       // If we tracked the point we update the index and the count
       if (tracked) {
+        vectors[new_p].flow_x = flow_x;
+        vectors[new_p].flow_y = flow_y;
         new_p++;
         (*points_cnt)++;
       }
@@ -217,19 +174,15 @@ struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, str
 
   } // LVL of pyramid
 
-  // Free the images
-  image_free(&window_I);
-  image_free(&window_J);
-  image_free(&window_DX);
-  image_free(&window_DY);
-  image_free(&window_diff);
+  // Free the tracker
+  lk_free(&lk);
 
   for (int8_t i = pyramid_level; i != -1; i--) {
     image_free(&pyramid_old[i]);
     image_free(&pyramid_new[i]);
   }
-  pyramid_old = NULL;
-  pyramid_new = NULL;
+  free(pyramid_old);
+  free(pyramid_new);
 
   // Return the vectors
   return vectors;
@@ -269,18 +222,29 @@ struct flow_t *opticFlowLK_flat(struct image_t *new_img, struct image_t *old_img
   uint16_t points_orig = *points_cnt;
   *points_cnt = 0;
 
-  // determine patch sizes and initialize neighborhoods
-  uint16_t patch_size = 2 * half_window_size;
-  uint32_t error_threshold = (25 * 25) *(patch_size *patch_size);
-  uint16_t padded_patch_size = patch_size + 2;
-
-  // Create the window images
-  struct image_t window_I, window_J, window_DX, window_DY, window_diff;
-  image_create(&window_I, padded_patch_size, padded_patch_size, IMAGE_GRAYSCALE);
-  image_create(&window_J, patch_size, patch_size, IMAGE_GRAYSCALE);
-  image_create(&window_DX, patch_size, patch_size, IMAGE_GRADIENT);
-  image_create(&window_DY, patch_size, patch_size, IMAGE_GRADIENT);
-  image_create(&window_diff, patch_size, patch_size, IMAGE_GRADIENT);
+  // Initialize the tracker, points are only tracked when they are at least half_window_size pixels inside the image
+  struct lk_params params = {
+    .half_window_size = half_window_size,
+    .subpixel_factor = subpixel_factor,
+    .max_iterations = max_iterations,
+    .step_threshold = step_threshold,
+    .gradient_div = 1,
+    .error_div = 1,
+    .occlusion_start = max_iterations / 2 + 1,
+    .max_step_norm = false,
+    .precise_step = false,
+    .min_x = half_window_size * subpixel_factor,
+    .max_x = (old_img->w - half_window_size + 1) * subpixel_factor - 1,
+    .min_y = half_window_size * subpixel_factor,
+    .max_y = (old_img->h - half_window_size + 1) * subpixel_factor - 1
+  };
+  struct lk_context lk;
+  if (!lk_init(&lk, &params)) {
+    // Without the buffers of the tracker no point is tracked
+    return vectors;
+  }
+  struct lk_image lk_old = {old_img->buf, old_img->w, old_img->h, LK_GRAYSCALE};
+  struct lk_image lk_new = {new_img->buf, new_img->w, new_img->h, LK_GRAYSCALE};
 
   // Calculate the amount of points to skip
   float skip_points = (points_orig > max_points) ? points_orig / max_points : 1;
@@ -289,93 +253,26 @@ struct flow_t *opticFlowLK_flat(struct image_t *new_img, struct image_t *old_img
   for (uint16_t i = 0; i < max_points && i < points_orig; i++) {
     uint16_t p = i * skip_points;
 
-    // If the pixel is outside ROI, do not track it
-    if (points[p].x < half_window_size || (old_img->w - points[p].x) < half_window_size
-        || points[p].y < half_window_size || (old_img->h - points[p].y) < half_window_size) {
-      continue;
-    }
-
     // Convert the point to a subpixel coordinate
     vectors[new_p].pos.x = points[p].x * subpixel_factor;
     vectors[new_p].pos.y = points[p].y * subpixel_factor;
-    vectors[new_p].flow_x = 0;
-    vectors[new_p].flow_y = 0;
-
-    // (1) determine the subpixel neighborhood in the old image
-    image_subpixel_window(old_img, &window_I, &vectors[new_p].pos, subpixel_factor, 0);
-
-    // (2) get the x- and y- gradients
-    image_gradients(&window_I, &window_DX, &window_DY);
-
-    // (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
-    int32_t G[4];
-    image_calculate_g(&window_DX, &window_DY, G);
-
-    // calculate G's determinant in subpixel units:
-    int32_t Det = (G[0] * G[3] - G[1] * G[2]) / subpixel_factor;
 
-    // Check if the determinant is bigger than 1
-    if (Det < 1) {
-      continue;
-    }
-
-    // a * (Ax - Bx) + (1-a) * (Ax+1 - Bx+1)
-    // a * Ax - a * Bx + (1-a) * Ax+1 - (1-a) * Bx+1
-    // (a * Ax + (1-a) * Ax+1)  - (a * Bx + (1-a) * Bx+1)
-
-    // (4) iterate over taking steps in the image to minimize the error:
-    bool tracked = TRUE;
-    for (uint8_t it = 0; it < max_iterations; it++) {
-      struct point_t new_point =  {
-        vectors[new_p].pos.x + vectors[new_p].flow_x,
-        vectors[new_p].pos.y + vectors[new_p].flow_y
-      };
-      // If the pixel is outside ROI, do not track it
-      if (new_point.x / subpixel_factor < half_window_size || (old_img->w - new_point.x / subpixel_factor) < half_window_size
-          || new_point.y / subpixel_factor < half_window_size || (old_img->h - new_point.y / subpixel_factor) < half_window_size) {
-        tracked = FALSE;
-        break;
-      }
-
-      //     [a] get the subpixel neighborhood in the new image
-      image_subpixel_window(new_img, &window_J, &new_point, subpixel_factor, 0);
-
-      //     [b] determine the image difference between the two neighborhoods
-      // TODO: also give this error back, so that it can be used for reliability
-      uint32_t error = image_difference(&window_I, &window_J, &window_diff);
-      if (error > error_threshold && it > max_iterations / 2) {
-        tracked = FALSE;
-        break;
-      }
-
-      int32_t b_x = image_multiply(&window_diff, &window_DX, NULL) / 255;
-      int32_t b_y = image_multiply(&window_diff, &window_DY, NULL) / 255;
-
-      //     [d] calculate the additional flow step and possibly terminate the iteration
-      int16_t step_x = (G[3] * b_x - G[1] * b_y) / Det;
-      int16_t step_y = (G[0] * b_y - G[2] * b_x) / Det;
-      vectors[new_p].flow_x += step_x;
-      vectors[new_p].flow_y += step_y;
-
-      // Check if we exceeded the treshold
-      if ((abs(step_x) + abs(step_y)) < step_threshold) {
-        break;
-      }
-    }
+    // Track the point, points outside the ROI are not tracked
+    int32_t flow_x = 0;
+    int32_t flow_y = 0;
+    bool tracked = lk_track_point(&lk, &lk_old, &lk_new, vectors[new_p].pos.x, vectors[new_p].pos.y, &flow_x, &flow_y);
 
     // If we tracked the point we update the index and the count
     if (tracked) {
+      vectors[new_p].flow_x = flow_x;
+      vectors[new_p].flow_y = flow_y;
       new_p++;
       (*points_cnt)++;
     }
   }
 
-  // Free the images
-  image_free(&window_I);
-  image_free(&window_J);
-  image_free(&window_DX);
-  image_free(&window_DY);
-  image_free(&window_diff);
+  // Free the tracker
+  lk_free(&lk);
 
   // Return the vectors
   return vectors;
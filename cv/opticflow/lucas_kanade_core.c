@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2014 G. de Croon
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/lucas_kanade_core.c
+ * @brief fixed-point Lucas-Kanade tracking of a single point
+ *
+ * - Initial fixed-point C implementation by G. de Croon
+ * - Algorithm: Lucas-Kanade by Yves Bouguet
+ * - Publication: http://robots.stanford.edu/cs223b04/algo_tracking.pdf
+ *
+ * All windows are int16 and stored row by row, so the sums over a window are
+ * plain dot products. The buffers are allocated once per context instead of
+ * once per point.
+ */
+
+#include <stdlib.h>
+#include "lucas_kanade_core.h"
+#include "simd.h"
+
+/**
+ * Reciprocal used to replace the division by subpixel_factor^2 of the bilinear blend
+ * The blend is at most 255 * norm, for which (blend * recip) >> 32 is exact as long
+ * as norm^2 < 2^32 / 255.
+ * @param[in] norm The divisor (subpixel_factor^2)
+ * @return The reciprocal, or 0 when a normal division has to be used
+ */
+static inline uint32_t lk_reciprocal(uint32_t norm)
+{
+  if (norm < 2 || norm > 4096) {
+    return 0;
+  }
+  return (uint32_t)(((uint64_t)1 << 32) / norm) + 1;
+}
+
+static inline int16_t lk_normalize(uint32_t blend, uint32_t norm, uint32_t recip)
+{
+  if (recip == 0) {
+    return blend / norm;
+  }
+  return ((uint64_t)blend * recip) >> 32;
+}
+
+/* The luminance of pixel (x, y) */
+static inline int16_t lk_luma(struct lk_image *img, int32_t x, int32_t y)
+{
+  if (img->format == LK_YUV422) {
+    uint32_t ix = ((y * img->w + x) * 2) & 0xFFFFFFFC;
+    return (img->buf[ix + 1] + img->buf[ix + 3]) >> 1;
+  }
+  return img->buf[y * img->w + x];
+}
+
+/* Bilinear blend at subpixel coordinate (x, y), which should lie inside the image */
+static inline int16_t lk_blend(struct lk_image *img, int32_t x, int32_t y, uint16_t subpixel_factor,
+                               uint32_t norm, uint32_t recip)
+{
+  int32_t x_0 = x / subpixel_factor;
+  int32_t y_0 = y / subpixel_factor;
+  uint32_t alpha_x = x - x_0 * subpixel_factor;
+  uint32_t alpha_y = y - y_0 * subpixel_factor;
+
+  if (alpha_x == 0 && alpha_y == 0) {
+    return lk_luma(img, x_0, y_0);
+  }
+
+  // Pixels with a zero weight are not read, they can be outside the image
+  int32_t x_1 = alpha_x ? x_0 + 1 : x_0;
+  int32_t y_1 = alpha_y ? y_0 + 1 : y_0;
+  uint32_t blend = (subpixel_factor - alpha_x) * (subpixel_factor - alpha_y) * lk_luma(img, x_0, y_0);
+  blend += alpha_x * (subpixel_factor - alpha_y) * lk_luma(img, x_1, y_0);
+  blend += (subpixel_factor - alpha_x) * alpha_y * lk_luma(img, x_0, y_1);
+  blend += alpha_x * alpha_y * lk_luma(img, x_1, y_1);
+  return lk_normalize(blend, norm, recip);
+}
+
+/**
+ * Get a window with the bilinear interpolated luminance around a subpixel coordinate
+ * Coordinates outside the image are clamped to the image border.
+ * @param[in] *img The image
+ * @param[out] *window The window of size * size pixels
+ * @param[in] size The window size in pixels
+ * @param[in] x The x coordinate of the window center in subpixels
+ * @param[in] y The y coordinate of the window center in subpixels
+ * @param[in] subpixel_factor Subpixels per pixel
+ */
+void lk_subpixel_window(struct lk_image *img, int16_t *window, uint16_t size, int32_t x, int32_t y,
+                        uint16_t subpixel_factor)
+{
+  int32_t half = size / 2;
+  int32_t max_x = (img->w - 1) * subpixel_factor;
+  int32_t max_y = (img->h - 1) * subpixel_factor;
+  int32_t x_start = x - half * subpixel_factor;
+  int32_t y_start = y - half * subpixel_factor;
+  uint32_t norm = subpixel_factor * subpixel_factor;
+  uint32_t recip = lk_reciprocal(norm);
+
+  // Near the border every coordinate is clamped separately
+  if (x_start < 0 || y_start < 0 || x_start + (size - 1) * subpixel_factor > max_x
+      || y_start + (size - 1) * subpixel_factor > max_y) {
+    for (int32_t j = 0; j < size; j++) {
+      int32_t y_j = y_start + j * subpixel_factor;
+      y_j = (y_j < 0) ? 0 : ((y_j > max_y) ? max_y : y_j);
+      for (int32_t i = 0; i < size; i++) {
+        int32_t x_i = x_start + i * subpixel_factor;
+        x_i = (x_i < 0) ? 0 : ((x_i > max_x) ? max_x : x_i);
+        window[j * size + i] = lk_blend(img, x_i, y_j, subpixel_factor, norm, recip);
+      }
+    }
+    return;
+  }
+
+  // Inside the image all pixels of the window have the same blend weights
+  int32_t x_0 = x_start / subpixel_factor;
+  int32_t y_0 = y_start / subpixel_factor;
+  uint32_t alpha_x = x_start - x_0 * subpixel_factor;
+  uint32_t alpha_y = y_start - y_0 * subpixel_factor;
+
+  if (alpha_x == 0 && alpha_y == 0) {
+    for (int32_t j = 0; j < size; j++) {
+      if (img->format == LK_GRAYSCALE) {
+        uint8_t *row = &img->buf[(y_0 + j) * img->w + x_0];
+        for (int32_t i = 0; i < size; i++) {
+          window[j * size + i] = row[i];
+        }
+      } else {
+        for (int32_t i = 0; i < size; i++) {
+          window[j * size + i] = lk_luma(img, x_0 + i, y_0 + j);
+        }
+      }
+    }
+    return;
+  }
+
+  uint32_t w_tl = (subpixel_factor - alpha_x) * (subpixel_factor - alpha_y);
+  uint32_t w_tr = alpha_x * (subpixel_factor - alpha_y);
+  uint32_t w_bl = (subpixel_factor - alpha_x) * alpha_y;
+  uint32_t w_br = alpha_x * alpha_y;
+  int32_t dx = alpha_x ? 1 : 0;
+  int32_t dy = alpha_y ? 1 : 0;
+
+  for (int32_t j = 0; j < size; j++) {
+    if (img->format == LK_GRAYSCALE) {
+      uint8_t *top = &img->buf[(y_0 + j) * img->w + x_0];
+      uint8_t *bottom = top + dy * img->w;
+      for (int32_t i = 0; i < size; i++) {
+        uint32_t blend = w_tl * top[i] + w_tr * top[i + dx] + w_bl * bottom[i] + w_br * bottom[i + dx];
+        window[j * size + i] = lk_normalize(blend, norm, recip);
+      }
+    } else {
+      for (int32_t i = 0; i < size; i++) {
+        uint32_t blend = w_tl * lk_luma(img, x_0 + i, y_0 + j) + w_tr * lk_luma(img, x_0 + i + dx, y_0 + j)
+                         + w_bl * lk_luma(img, x_0 + i, y_0 + j + dy) + w_br * lk_luma(img, x_0 + i + dx, y_0 + j + dy);
+        window[j * size + i] = lk_normalize(blend, norm, recip);
+      }
+    }
+  }
+}
+
+/* Sum of a[i] * b[i], the products of two int16 values fit in an int32 */
+static int32_t lk_dot(int16_t *a, int16_t *b, uint32_t n)
+{
+  int32_t sum = 0;
+  uint32_t i = 0;
+#if defined(CV_SIMD_SSE2)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i va = _mm_loadu_si128((__m128i *)&a[i]);
+    __m128i vb = _mm_loadu_si128((__m128i *)&b[i]);
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  sum = _mm_cvtsi128_si32(acc);
+#elif defined(CV_SIMD_NEON)
+  int32x4_t acc = vdupq_n_s32(0);
+  for (; i + 4 <= n; i += 4) {
+    acc = vmlal_s16(acc, vld1_s16(&a[i]), vld1_s16(&b[i]));
+  }
+  int32x2_t acc2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+  sum = vget_lane_s32(vpadd_s32(acc2, acc2), 0);
+#endif
+  for (; i < n; i++) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+/**
+ * Compare the window I with J in one pass
+ * @param[in] *ctx The context with the windows I, J, DX and DY
+ * @param[out] *b_x Sum of (I - J) * DX
+ * @param[out] *b_y Sum of (I - J) * DY
+ * @return The sum of the squared difference (I - J)^2
+ */
+static uint32_t lk_difference(struct lk_context *ctx, int32_t *b_x, int32_t *b_y)
+{
+  int16_t *I = ctx->I, *J = ctx->J, *DX = ctx->DX, *DY = ctx->DY;
+  uint32_t n = ctx->patch_size * ctx->patch_size;
+  int32_t error = 0, sum_x = 0, sum_y = 0;
+  uint32_t i = 0;
+
+#if defined(CV_SIMD_SSE2)
+  __m128i acc_e = _mm_setzero_si128();
+  __m128i acc_x = _mm_setzero_si128();
+  __m128i acc_y = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i diff = _mm_sub_epi16(_mm_loadu_si128((__m128i *)&I[i]), _mm_loadu_si128((__m128i *)&J[i]));
+    acc_e = _mm_add_epi32(acc_e, _mm_madd_epi16(diff, diff));
+    acc_x = _mm_add_epi32(acc_x, _mm_madd_epi16(diff, _mm_loadu_si128((__m128i *)&DX[i])));
+    acc_y = _mm_add_epi32(acc_y, _mm_madd_epi16(diff, _mm_loadu_si128((__m128i *)&DY[i])));
+  }
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, acc_e);
+  error = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm_storeu_si128((__m128i *)lanes, acc_x);
+  sum_x = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm_storeu_si128((__m128i *)lanes, acc_y);
+  sum_y = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(CV_SIMD_NEON)
+  int32x4_t acc_e = vdupq_n_s32(0);
+  int32x4_t acc_x = vdupq_n_s32(0);
+  int32x4_t acc_y = vdupq_n_s32(0);
+  for (; i + 4 <= n; i += 4) {
+    int16x4_t diff = vsub_s16(vld1_s16(&I[i]), vld1_s16(&J[i]));
+    acc_e = vmlal_s16(acc_e, diff, diff);
+    acc_x = vmlal_s16(acc_x, diff, vld1_s16(&DX[i]));
+    acc_y = vmlal_s16(acc_y, diff, vld1_s16(&DY[i]));
+  }
+  error = vgetq_lane_s32(acc_e, 0) + vgetq_lane_s32(acc_e, 1) + vgetq_lane_s32(acc_e, 2) + vgetq_lane_s32(acc_e, 3);
+  sum_x = vgetq_lane_s32(acc_x, 0) + vgetq_lane_s32(acc_x, 1) + vgetq_lane_s32(acc_x, 2) + vgetq_lane_s32(acc_x, 3);
+  sum_y = vgetq_lane_s32(acc_y, 0) + vgetq_lane_s32(acc_y, 1) + vgetq_lane_s32(acc_y, 2) + vgetq_lane_s32(acc_y, 3);
+#endif
+  for (; i < n; i++) {
+    int32_t diff = I[i] - J[i];
+    error += diff * diff;
+    sum_x += diff * DX[i];
+    sum_y += diff * DY[i];
+  }
+
+  *b_x = sum_x;
+  *b_y = sum_y;
+  return error;
+}
+
+/**
+ * Initialize a tracker context
+ * @param[out] *ctx The context
+ * @param[in] *params The settings of the tracker, copied into the context
+ * @return False when the buffers could not be allocated
+ */
+bool lk_init(struct lk_context *ctx, struct lk_params *params)
+{
+  ctx->params = *params;
+  ctx->patch_size = 2 * params->half_window_size + 1;
+  ctx->error_threshold = (25 * 25) * (ctx->patch_size * ctx->patch_size);
+
+  uint32_t padded_size = (ctx->patch_size + 2) * (ctx->patch_size + 2);
+  uint32_t size = ctx->patch_size * ctx->patch_size;
+  ctx->padded = malloc(sizeof(int16_t) * padded_size);
+  ctx->I = malloc(sizeof(int16_t) * size);
+  ctx->J = malloc(sizeof(int16_t) * size);
+  ctx->DX = malloc(sizeof(int16_t) * size);
+  ctx->DY = malloc(sizeof(int16_t) * size);
+
+  if (ctx->padded == NULL || ctx->I == NULL || ctx->J == NULL || ctx->DX == NULL || ctx->DY == NULL) {
+    lk_free(ctx);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Free the buffers of a tracker context
+ * @param[in] *ctx The context
+ */
+void lk_free(struct lk_context *ctx)
+{
+  free(ctx->padded);
+  free(ctx->I);
+  free(ctx->J);
+  free(ctx->DX);
+  free(ctx->DY);
+  ctx->padded = NULL;
+  ctx->I = NULL;
+  ctx->J = NULL;
+  ctx->DX = NULL;
+  ctx->DY = NULL;
+}
+
+static inline bool lk_inside(struct lk_params *params, int32_t x, int32_t y)
+{
+  return x >= params->min_x && x <= params->max_x && y >= params->min_y && y <= params->max_y;
+}
+
+/**
+ * Track a single point from the old to the new image
+ * - (1) determine the subpixel neighborhood in the old image
+ * - (2) get the x- and y- gradients
+ * - (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
+ * - (4) iterate over taking steps in the image to minimize the error:
+ *   + [a] get the subpixel neighborhood in the new image
+ *   + [b] determine the image difference between the two neighborhoods
+ *   + [c] calculate the 'b'-vector
+ *   + [d] calculate the additional flow step and possibly terminate the iteration
+ * @param[in] *ctx The tracker context
+ * @param[in] *old_img The old image
+ * @param[in] *new_img The new image
+ * @param[in] x The x coordinate of the point in the old image in subpixels
+ * @param[in] y The y coordinate of the point in the old image in subpixels
+ * @param[in,out] *flow_x The x flow in subpixels, the initial value is the first estimate
+ * @param[in,out] *flow_y The y flow in subpixels, the initial value is the first estimate
+ * @return True when the point is tracked, the flow is also set when it is lost
+ */
+bool lk_track_point(struct lk_context *ctx, struct lk_image *old_img, struct lk_image *new_img, int32_t x, int32_t y,
+                    int32_t *flow_x, int32_t *flow_y)
+{
+  struct lk_params *params = &ctx->params;
+  uint16_t subpixel_factor = params->subpixel_factor;
+  uint16_t patch_size = ctx->patch_size;
+  uint16_t padded_size = patch_size + 2;
+
+  if (!lk_inside(params, x, y)) {
+    return false;
+  }
+
+  // (1) determine the subpixel neighborhood in the old image, with a border for the gradients
+  lk_subpixel_window(old_img, ctx->padded, padded_size, x, y, subpixel_factor);
+
+  // (2) get the x- and y- gradients, [0 0 0; -1 0 1; 0 0 0] and [0 -1 0; 0 0 0; 0 1 0]
+  for (uint16_t j = 0; j < patch_size; j++) {
+    int16_t *above = &ctx->padded[j * padded_size + 1];
+    int16_t *row = above + padded_size;
+    int16_t *below = row + padded_size;
+    for (uint16_t i = 0; i < patch_size; i++) {
+      ctx->I[j * patch_size + i] = row[i];
+      ctx->DX[j * patch_size + i] = (row[i + 1] - row[i - 1]) / params->gradient_div;
+      ctx->DY[j * patch_size + i] = (below[i] - above[i]) / params->gradient_div;
+    }
+  }
+
+  // (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
+  uint32_t n = patch_size * patch_size;
+  int32_t G[4];
+  G[0] = lk_dot(ctx->DX, ctx->DX, n) / 255;
+  G[1] = lk_dot(ctx->DX, ctx->DY, n) / 255;
+  G[2] = G[1];
+  G[3] = lk_dot(ctx->DY, ctx->DY, n) / 255;
+
+  // calculate G's determinant, possibly in subpixel units
+  int64_t Det = (int64_t)G[0] * G[3] - (int64_t)G[1] * G[2];
+  if (!params->precise_step) {
+    Det /= subpixel_factor;
+  }
+  if (Det < 1) {
+    return false;
+  }
+
+  // (4) iterate over taking steps in the image to minimize the error:
+  for (uint8_t it = 0; it < params->max_iterations; it++) {
+    int32_t new_x = x + *flow_x;
+    int32_t new_y = y + *flow_y;
+    if (!lk_inside(params, new_x, new_y)) {
+      return false;
+    }
+
+    //     [a] get the subpixel neighborhood in the new image
+    lk_subpixel_window(new_img, ctx->J, patch_size, new_x, new_y, subpixel_factor);
+
+    //     [b] determine the image difference between the two neighborhoods
+    //     [c] calculate the 'b'-vector
+    int32_t b_x, b_y;
+    uint32_t error = lk_difference(ctx, &b_x, &b_y) / params->error_div;
+    if (error > ctx->error_threshold && it >= params->occlusion_start) {
+      return false;
+    }
+    b_x /= 255;
+    b_y /= 255;
+
+    //     [d] calculate the additional flow step and possibly terminate the iteration
+    int64_t num_x = (int64_t)G[3] * b_x - (int64_t)G[1] * b_y;
+    int64_t num_y = (int64_t)G[0] * b_y - (int64_t)G[2] * b_x;
+    if (params->precise_step) {
+      num_x *= subpixel_factor;
+      num_y *= subpixel_factor;
+    }
+    int32_t step_x = num_x / Det;
+    int32_t step_y = num_y / Det;
+    *flow_x += step_x;
+    *flow_y += step_y;
+
+    if (params->max_step_norm) {
+      if (abs(step_x) < params->step_threshold && abs(step_y) < params->step_threshold) {
+        break;
+      }
+    } else if (abs(step_x) + abs(step_y) < params->step_threshold) {
+      break;
+    }
+  }
+
+  return true;
+}
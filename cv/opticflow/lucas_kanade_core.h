@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014 G. de Croon
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/lucas_kanade_core.h
+ * @brief fixed-point Lucas-Kanade tracking of a single point
+ *
+ * The core shared by the image_t tracker in lucas_kanade.c and the int based
+ * trackers of optic_flow_gdc.c and optic_flow_ardrone.c. The differences between
+ * those trackers (pixel format, gradient scaling, stop criterion, ...) are
+ * described by the lk_params.
+ */
+
+#ifndef LUCAS_KANADE_CORE_H
+#define LUCAS_KANADE_CORE_H
+
+#include "std.h"
+
+/* Pixel layout of the images the core samples from */
+enum lk_pixel_format {
+  LK_GRAYSCALE,           ///< One byte per pixel
+  LK_YUV422               ///< UYVY, a pixel has the mean Y value of its macropixel
+};
+
+/* An image to track in, only the luminance is used */
+struct lk_image {
+  uint8_t *buf;           ///< The image buffer
+  uint16_t w;             ///< Image width
+  uint16_t h;             ///< Image height
+  enum lk_pixel_format format;
+};
+
+/* Settings of the tracker, all positions and steps are in subpixels */
+struct lk_params {
+  uint16_t half_window_size;  ///< The window is 2 * half_window_size + 1 pixels wide
+  uint16_t subpixel_factor;   ///< Subpixels per pixel
+  uint8_t max_iterations;     ///< Maximum amount of steps per point
+  uint8_t step_threshold;     ///< Stop iterating when the step is smaller than this
+  uint8_t gradient_div;       ///< Divisor of the central differences
+  uint8_t error_div;          ///< Divisor of the squared error before the occlusion test
+  uint8_t occlusion_start;    ///< First step at which a point with a large error is considered occluded
+  bool max_step_norm;         ///< Compare the largest step component instead of the L1 norm of the step
+  bool precise_step;          ///< Divide by the full determinant of G instead of the determinant / subpixel_factor
+  int32_t min_x;              ///< Inclusive bounds of the tracked position
+  int32_t max_x;
+  int32_t min_y;
+  int32_t max_y;
+};
+
+/* Buffers of the tracker, use one context per thread */
+struct lk_context {
+  struct lk_params params;
+  uint16_t patch_size;        ///< Window size in pixels
+  uint32_t error_threshold;   ///< Squared error above which a point is considered occluded
+  int16_t *padded;            ///< Window in the old image with a border of 1 pixel for the gradients
+  int16_t *I;                 ///< Window in the old image
+  int16_t *J;                 ///< Window in the new image
+  int16_t *DX;                ///< Horizontal gradient of I
+  int16_t *DY;                ///< Vertical gradient of I
+};
+
+bool lk_init(struct lk_context *ctx, struct lk_params *params);
+void lk_free(struct lk_context *ctx);
+void lk_subpixel_window(struct lk_image *img, int16_t *window, uint16_t size, int32_t x, int32_t y,
+                        uint16_t subpixel_factor);
+bool lk_track_point(struct lk_context *ctx, struct lk_image *old_img, struct lk_image *new_img, int32_t x, int32_t y,
+                    int32_t *flow_x, int32_t *flow_y);
+
+#endif /* LUCAS_KANADE_CORE_H */
@@ -1,18 +1,47 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include "optic_flow_gdc.h"
+#include "image.h"
+#include "lucas_kanade_core.h"
+#include "simd.h"
 
 #define int_index(x,y) (y * IMG_WIDTH + x)
 #define uint_index(xx, yy) (((yy * IMG_WIDTH + xx) * 2) & 0xFFFFFFFC)
 #define NO_MEMORY -1
 #define OK 0
-#define N_VISUAL_INPUTS 51
-#define N_ACTIONS 3
+#define INVALID_WEIGHTS -2
 
 unsigned int IMG_WIDTH, IMG_HEIGHT;
-int weights[153] = {-78, -46, 18, 59, 0, 100, 0, 0, 100, -29, -45, 0, 15, -30, 59, -100, -99, -100, -47, 0, -100, -100, 2, -78, 0, 10, -68, 53, 0, 0, -61, -28, 51, 0, -86, -73, 10, -65, -100, 98, -19, 63, -100, -42, -83, 21, 0, 3, 7, 0, -100, 24, -100, -99, -40, -100, 91, 0, 0, 54, 0, -90, -22, 13, 6, 31, 0, 100, -58, -31, 100, 5, 21, -100, 37, -100, 57, 100, -96, -3, -74, -3, -64, -68, 6, -100, -71, -81, 100, 13, 100, 0, -100, -57, 77, -100, -61, -100, 0, 37, -100, -100, -100, 10, -36, -100, 62, 8, 0, 21, 2, -61, -5, 32, -64, 15, -100, -90, -74, -18, -22, -28, 42, -92, 0, 3, -3, -13, 100, -5, 88, 0, 7, -100, 90, 73, -53, 100, 0, 2, 0, -95, -60, -62, 0, -6, 82, 0, -79, -69, 73, -38, 100};
 
-void getVisualInputs(unsigned char *frame_buf, int x, int y, int* visual_inputs, unsigned int half_patch);
-void applyNeuralNetwork(int* visual_inputs, int* actions, int RESOLUTION);
+// the perceptron used by findActiveCorners, the built-in weights per action padded with a zero:
+struct perceptron active_corner_perceptron = {
+  {
+    {
+      -78, -46, 18, 59, 0, 100, 0, 0, 100, -29, -45, 0, 15,
+      -30, 59, -100, -99, -100, -47, 0, -100, -100, 2, -78, 0, 10,
+      -68, 53, 0, 0, -61, -28, 51, 0, -86, -73, 10, -65, -100,
+      98, -19, 63, -100, -42, -83, 21, 0, 3, 7, 0, -100, 0
+    },
+    {
+      24, -100, -99, -40, -100, 91, 0, 0, 54, 0, -90, -22, 13,
+      6, 31, 0, 100, -58, -31, 100, 5, 21, -100, 37, -100, 57,
+      100, -96, -3, -74, -3, -64, -68, 6, -100, -71, -81, 100, 13,
+      100, 0, -100, -57, 77, -100, -61, -100, 0, 37, -100, -100, 0
+    },
+    {
+      -100, 10, -36, -100, 62, 8, 0, 21, 2, -61, -5, 32, -64,
+      15, -100, -90, -74, -18, -22, -28, 42, -92, 0, 3, -3, -13,
+      100, -5, 88, 0, 7, -100, 90, 73, -53, 100, 0, 2, 0,
+      -95, -60, -62, 0, -6, 82, 0, -79, -69, 73, -38, 100, 0
+    }
+  }
+};
+
+// the masks [0 0 0; -1 0 1; 0 0 0] and [0 -1 0; 0 0 0; 0 1 0] of getGradientPixelWH, the borders are repeated:
+static const struct image_filter_t gradient_dx = {3, 1, {-1, 0, 1}, {1}, 0, 0, IMAGE_BORDER_CLAMP};
+static const struct image_filter_t gradient_dy = {1, 3, {1}, {-1, 0, 1}, 0, 0, IMAGE_BORDER_CLAMP};
+// the [1 2 1] / 4 smoothing of the gradient products in both directions, as image_smooth_i16 with 3 Gaussian taps:
+static const struct image_filter_t harris_smooth = {3, 3, {1, 2, 1}, {1, 2, 1}, 2, 2, IMAGE_BORDER_CLAMP};
 
 
 static inline void bluePixel(unsigned char *frame_buf, unsigned int ip)
@@ -157,21 +186,37 @@ void getGradientPixelWH(unsigned char *frame_buf, int x, int y, int* dx, int* dy
 
 void getSimpleGradient(unsigned char* frame_buf, int* DX, int* DY)
 {
-  unsigned int x,y,ix;
-  int dx,dy;
-  for(x = 0; x < IMG_WIDTH; x++)
+  // the gradients of getGradientPixelWH for the whole luma plane at once:
+  unsigned int x,y,ix,n;
+  unsigned char *luma;
+  short *gradient;
+
+  n = IMG_WIDTH * IMG_HEIGHT;
+  luma = (unsigned char *) malloc(n * sizeof(unsigned char));
+  gradient = (short *) malloc(n * sizeof(short));
+  if(luma == 0 || gradient == 0)
+  {
+    free(luma);
+    free(gradient);
+    return;
+  }
+  for(y = 0; y < IMG_HEIGHT; y++)
   {
-    for(y = 0; y < IMG_HEIGHT; y++)
+    for(x = 0; x < IMG_WIDTH; x++)
     {
-      // get dx, dy for the current position:
-      getGradientPixelWH(frame_buf, x, y, &dx, &dy);
-      // put it in the matrix:
-      ix = int_index(x,y);
-      DX[ix] = dx;
-      DY[ix] = dy;
-
+      ix = uint_index(x,y);
+      luma[int_index(x,y)] = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
     }
   }
+
+  // put them in the matrices:
+  image_filter_u8_i16(luma, 1, gradient, IMG_WIDTH, IMG_HEIGHT, &gradient_dx);
+  for(ix = 0; ix < n; ix++) DX[ix] = gradient[ix];
+  image_filter_u8_i16(luma, 1, gradient, IMG_WIDTH, IMG_HEIGHT, &gradient_dy);
+  for(ix = 0; ix < n; ix++) DY[ix] = gradient[ix];
+
+  free(luma);
+  free(gradient);
 }
 
 void excludeArea(unsigned int* Mask, int x, int y, int suppression_distance_squared)
@@ -344,75 +389,48 @@ void getHarris(int* DXX, int* DXY, int* DYY, int* Harris)
 
 void smoothGaussian(int* Src, int* Dst)
 {
-  int x, y, min_x, min_y, xx, yy, it;
-  unsigned int ix, ixx;
-  int smooth[9]; // = {1,2,1,2,4,2,1,2,1};
-  int smooth_factor_1 = 14; // retain energy
-  int smooth_factor_2 = 255; // for Harris to stay within
-  //int printed = 0;
+  // Separable version of the filter [1,2,1;2,4,2;1,2,1] / (14 * 255), which is applied row by row
+  // without dividing the source samples first. The borders are set to zero.
+  int x, y;
+  int *Row, *Above, *Below, *Tmp;
+  int smooth_factor = 14 * 255; // retain energy, and for Harris to stay within
+
+  // horizontal pass of the three rows around y, kept in a ring:
+  Row = (int *) malloc(3 * IMG_WIDTH * sizeof(int));
+  if(Row == 0) return;
+  Above = &Row[0]; Tmp = &Row[IMG_WIDTH]; Below = &Row[2 * IMG_WIDTH];
 
-  // set the smoothing filter:
-  smooth[0] = 1;
-  smooth[1] = 2;
-  smooth[2] = 1;
-  smooth[3] = 2;
-  smooth[4] = 4;
-  smooth[5] = 2;
-  smooth[6] = 1;
-  smooth[7] = 2;
-  smooth[8] = 1; // in MATLAB-language: [1,2,1;2,4,2;1,2,1]
-
-  // is the following necessary, or is it already filled with zeros?
-  // fill the borders with zeros:
-  for(x = 0; x < (int)IMG_WIDTH; x += (int)IMG_WIDTH-1)
+  for(x = 0; x < (int)IMG_WIDTH; x++)
   {
-    for(y = 0; y < (int)IMG_HEIGHT; y++)
-    {
-      ix = int_index(x,y);
-      Dst[ix] = 0;
-    }
+    Dst[int_index(x,0)] = 0;
+    Dst[int_index(x,(IMG_HEIGHT-1))] = 0;
   }
-  for(y = 0; y < (int)IMG_HEIGHT; y += (int)IMG_HEIGHT-1)
+  for(x = 1; x < (int)IMG_WIDTH-1; x++)
   {
-    for(x = 0; x < (int)IMG_WIDTH; x++)
-    {
-      ix = int_index(x,y);
-      Dst[ix] = 0;
-    }
+    Above[x] = Src[int_index((x-1),0)] + 2 * Src[int_index(x,0)] + Src[int_index((x+1),0)];
+    Tmp[x] = Src[int_index((x-1),1)] + 2 * Src[int_index(x,1)] + Src[int_index((x+1),1)];
   }
 
-  for(x = 1; x < (int)IMG_WIDTH-1; x++)
+  for(y = 1; y < (int)IMG_HEIGHT-1; y++)
   {
-    for(y = 1; y < (int)IMG_HEIGHT-1; y++)
+    for(x = 1; x < (int)IMG_WIDTH-1; x++)
     {
-      min_x = x - 1;
-      min_y = y - 1;
-      ix = int_index(x,y);
-      Dst[ix] = 0;
-      // use the patch to determine dx2, dxy, and dy2
-      it = 0;
-      for(yy = min_y; yy < min_y + 3; yy++)
-      {
-        for(xx = min_x; xx < min_x + 3; xx++)
-        {
-          ixx = int_index(xx,yy);
-
-          Dst[ix] += smooth[it] * (Src[ixx] / smooth_factor_1);
-
-          /*if(printed < 9 && x > 30 && y > 30)
-					{
-						printf("SG: it = %d, s = %d, src = %d, src / sf = %d, filtered = %d, Dst = %d\n\r", it, smooth[it], Src[ixx], Src[ixx] / smooth_factor_1, smooth[it] * (Src[ixx] / smooth_factor_1), Dst[ix]);
-						printed += 1;
-					}*/
-
-          // update iterator of the smoothing filter:
-          it++;
-        }
-      }
+      Below[x] = Src[int_index((x-1),(y+1))] + 2 * Src[int_index(x,(y+1))] + Src[int_index((x+1),(y+1))];
+    }
 
-      Dst[ix] /= smooth_factor_2;
+    Dst[int_index(0,y)] = 0;
+    Dst[int_index((IMG_WIDTH-1),y)] = 0;
+    for(x = 1; x < (int)IMG_WIDTH-1; x++)
+    {
+      Dst[int_index(x,y)] = (Above[x] + 2 * Tmp[x] + Below[x]) / smooth_factor;
     }
+
+    // shift the ring:
+    int *Swap = Above;
+    Above = Tmp; Tmp = Below; Below = Swap;
   }
+
+  free((char*) Row);
 }
 
 void thresholdImage(int* Harris, int max_val, int max_factor)
@@ -435,165 +453,237 @@ void thresholdImage(int* Harris, int max_val, int max_factor)
   //printf("Remaining points = %d\n\r", n_remaining);
 }
 
-int findCorners(unsigned char *frame_buf, int MAX_POINTS, int *x, int *y, int suppression_distance_squared, int* n_found_points, int mark_points, int imW, int imH)
+// index of the macropixel containing pixel (x,y) in an image of the given width:
+#define ctx_uint_index(ctx, xx, yy) ((((yy) * (ctx)->width + (xx)) * 2) & 0xFFFFFFFC)
+
+int initHarrisContext(struct harris_context* ctx, int imW, int imH)
 {
-  // Algorithmic steps:
-  // (1) get the dx, dy gradients in the image
-  // (2) determine dxx, dxy, dyy
-  // (3) smooth dxx, dxy, dyy
-  // (4) determine the Harris values
-  // (5) find maximal values (with suppression of points close by)
-  // (6) mark the points green in the image
-
-  int max_val, error, p, i, j; // min_val,
+  // All per-frame memory is allocated once: a ring of 3 rows per stage and a list of candidate corners.
+  ctx->width = imW;
+  ctx->height = imH;
+  ctx->luma = (unsigned char *) malloc(3 * imW * sizeof(unsigned char));
+  ctx->DXX = (short *) malloc(3 * imW * sizeof(short));
+  ctx->DXY = (short *) malloc(3 * imW * sizeof(short));
+  ctx->DYY = (short *) malloc(3 * imW * sizeof(short));
+  ctx->Harris = (int *) malloc(3 * imW * sizeof(int));
+  ctx->row = (short *) malloc(3 * imW * sizeof(short));
+  ctx->max_candidates = imW;
+  ctx->n_candidates = 0;
+  ctx->candidates = (struct harris_candidate *) malloc(ctx->max_candidates * sizeof(struct harris_candidate));
+  if(ctx->luma == 0 || ctx->DXX == 0 || ctx->DXY == 0 || ctx->DYY == 0 || ctx->Harris == 0 || ctx->row == 0 || ctx->candidates == 0)
+  {
+    freeHarrisContext(ctx);
+    return NO_MEMORY;
+  }
+  return OK;
+}
+
+void freeHarrisContext(struct harris_context* ctx)
+{
+  free(ctx->luma); free(ctx->DXX); free(ctx->DXY); free(ctx->DYY);
+  free(ctx->Harris); free(ctx->row); free(ctx->candidates);
+  ctx->luma = 0; ctx->DXX = 0; ctx->DXY = 0; ctx->DYY = 0;
+  ctx->Harris = 0; ctx->row = 0; ctx->candidates = 0;
+  ctx->n_candidates = 0; ctx->max_candidates = 0;
+}
+
+// fill a row of the luma ring with the Y value of every pixel (the average of its macropixel):
+static void harrisLumaRow(struct harris_context* ctx, unsigned char *frame_buf, int y)
+{
+  int x;
   unsigned int ix;
-  unsigned int im_size;
-  int* DX; int* DY; int* DXX; int* DXY; int* DYY;
-  int* SDXX; int* SDXY; int* SDYY; int* Harris;
-  // for debugging:
-  //int n_rows, n_cols, x_center, y_center;
+  unsigned char *luma = &ctx->luma[(y % 3) * ctx->width];
+  for(x = 0; x < ctx->width; x++)
+  {
+    ix = ctx_uint_index(ctx, x, y);
+    luma[x] = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
+  }
+}
 
-  IMG_WIDTH = imW;
-  IMG_HEIGHT = imH;
-  im_size = IMG_WIDTH * IMG_HEIGHT;
-  // for debugging:
-  //n_rows = 20; n_cols = 20;
-  //x_center = IMG_WIDTH / 2;
-  //y_center = IMG_HEIGHT / 2;
-
-  // (1) get the dx, dy gradients in the image
-  DX = (int *) malloc(im_size * sizeof(int));
-  DY = (int *) malloc(im_size * sizeof(int));
-  if(DX == 0 || DY == 0) return NO_MEMORY;
-  getSimpleGradient(frame_buf, DX, DY);
-
-  // DEBUGGING:
-  //i_center = int_index(x_center, y_center);
-  /*printf("DX = ");
-	printIntMatrixPart(DX, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-	printf("DY = ");
-	printIntMatrixPart(DY, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-   */
-  //max_val = getMaximum(DX);
-  //min_val = getMinimum(DX);
-  //printf("DX[center] = %d, max = %d, min = %d\n\r", DX[i_center], max_val, min_val);
-
-  // (2) determine dxx, dxy, dyy
-
-  // form DXX and DXY
-  DXX = (int *) malloc(im_size * sizeof(int));
-  DXY = (int *) malloc(im_size * sizeof(int));
-  if(DXX == 0 || DXY == 0) return NO_MEMORY;
-  multiplyImages(DX, DX, DXX, IMG_WIDTH, IMG_HEIGHT);
-  multiplyImages(DX, DY, DXY, IMG_WIDTH, IMG_HEIGHT);
-  // free DX
-  free((char*) DX);
-
-  // DEBUGGING:
-  /*	printf("DXY = ");
-	printIntMatrixPart(DXY, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-	printf("DXX = ");
-	printIntMatrixPart(DXX, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-   */
-  //max_val = getMaximum(DXX);
-  //min_val = getMinimum(DXX);
-  //printf("DXX[center] = %d, max = %d, min = %d\n\r", DXX[i_center], max_val, min_val);
-
-  // form DYY
-  DYY = (int *) malloc(im_size * sizeof(int));
-  if(DYY == 0) return NO_MEMORY;
-  multiplyImages(DY, DY, DYY, IMG_WIDTH, IMG_HEIGHT);
-  // free DY
-  free((char*) DY);
-
-  // (3) smooth dxx, dxy, dyy
-  // unfortunately, this smoothing is quite necessary:
-
-  SDXX = (int *) malloc(im_size * sizeof(int));
-  if(SDXX == 0) return NO_MEMORY;
-  smoothGaussian(DXX, SDXX);
-
-  // free DXX
-  free((char*) DXX);
-
-  // DEBUGGING:
-  /*	printf("DYY = ");
-	printIntMatrixPart(DYY, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-	printf("SDXX = ");
-	printIntMatrixPart(SDXX, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-   */
-  //max_val = getMaximum(SDXX);
-  //min_val = getMinimum(SDXX);
-  //printf("SDXX[center] = %d, max = %d, min = %d\n\r", SDXX[i_center], max_val, min_val);
-
-  SDXY = (int *) malloc(im_size * sizeof(int));
-  if(SDXY == 0) return NO_MEMORY;
-  smoothGaussian(DXY, SDXY);
-
-
-  // free DXY
-  free((char*) DXY);
-
-  SDYY = (int *) malloc(im_size * sizeof(int));
-  smoothGaussian(DYY, SDYY);
-  /*
-	printf("SDYY = ");
-	printIntMatrixPart(SDYY, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-	printf("SDXY = ");
-	printIntMatrixPart(SDXY, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-   */
-  if(SDXX == 0 || SDXY == 0 || SDYY == 0) return NO_MEMORY;
-  // free DYY
-  free((char*) DYY);
-
-  // (4) determine the Harris values
-  Harris = (int *) malloc(im_size * sizeof(int));
-  if(Harris == 0) return NO_MEMORY;
-  getHarris(SDXX, SDXY, SDYY, Harris);
-  //printf("Harris1 = ");
-  //printIntMatrixPart(Harris, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-
-  // free SDXX, SDYY, SDXY:
-  free((char*)SDXX); free((char*)SDYY); free((char*)SDXY);
-
-  // DEBUGGING:
-  //max_val = getMaximum(Harris);
-  //min_val = getMinimum(Harris);
-  //printf("Harris[center] = %d, max = %d, min = %d\n\r", Harris[i_center], max_val, min_val);
-
-  // (5) find maximal values (with suppression of points close by)
-  // (a) find the maximum
-  max_val = getMaximum(Harris);
-  // (b) threshold the image on the basis of the found (approximative) maximum:
-  thresholdImage(Harris, max_val, 5);
-  //printf("Harris2 = ");
-  //printIntMatrixPart(Harris, IMG_WIDTH, IMG_HEIGHT, n_cols, n_rows, x_center, y_center);
-  // (c) find local maxima
-  error = findLocalMaxima(Harris, max_val, MAX_POINTS, x, y, suppression_distance_squared, n_found_points);
-  if(error == NO_MEMORY) return NO_MEMORY;
-  // free Harris:
-  free((char*) Harris);
-
-  // DEBUGGING:
-  // printf("Points found: %d\n\r", (*n_found_points));
-
-  // (6) mark the points green in the image
-  if(mark_points > 0)
+// determine the gradient products of a row, divided by 4 so that they fit in a short, and smooth them horizontally:
+static void harrisGradientRow(struct harris_context* ctx, int y)
+{
+  int x, x_min, x_max, dx, dy;
+  int w = ctx->width;
+  int row = (y % 3) * w;
+  short *PXX = &ctx->row[0]; short *PXY = &ctx->row[w]; short *PYY = &ctx->row[2 * w];
+  unsigned char *luma = &ctx->luma[row];
+  unsigned char *luma_up = &ctx->luma[((y > 0) ? (y - 1) % 3 : 0) * w];
+  unsigned char *luma_down = &ctx->luma[((y < ctx->height - 1) ? (y + 1) % 3 : y % 3) * w];
+  for(x = 0; x < w; x++)
   {
-    // printf("IMG_WIDTH = %d, IMG_HEIGHT = %d\n\r", IMG_WIDTH, IMG_HEIGHT);
+    x_min = (x > 0) ? x - 1 : 0;
+    x_max = (x < w - 1) ? x + 1 : w - 1;
+    dx = (int)luma[x_max] - (int)luma[x_min];
+    dy = (int)luma_down[x] - (int)luma_up[x];
+    PXX[x] = (dx * dx) / 4;
+    PXY[x] = (dx * dy) / 4;
+    PYY[x] = (dy * dy) / 4;
+  }
+  image_filter_row_i16(PXX, &ctx->DXX[row], w, &harris_smooth);
+  image_filter_row_i16(PXY, &ctx->DXY[row], w, &harris_smooth);
+  image_filter_row_i16(PYY, &ctx->DYY[row], w, &harris_smooth);
+}
+
+// smooth the gradient products around row y vertically and determine the Harris values:
+static void harrisResponseRow(struct harris_context* ctx, int y)
+{
+  int x, sxx, sxy, syy, sumDXXDYY;
+  int w = ctx->width;
+  int *Harris = &ctx->Harris[(y % 3) * w];
+  short *SXX = &ctx->row[0]; short *SXY = &ctx->row[w]; short *SYY = &ctx->row[2 * w];
+  short *rows[3];
+
+  // the borders are zero:
+  Harris[0] = 0;
+  Harris[w - 1] = 0;
+  if(y == 0 || y == ctx->height - 1)
+  {
+    for(x = 1; x < w - 1; x++) Harris[x] = 0;
+    return;
+  }
 
+  rows[0] = &ctx->DXX[((y - 1) % 3) * w]; rows[1] = &ctx->DXX[(y % 3) * w]; rows[2] = &ctx->DXX[((y + 1) % 3) * w];
+  image_filter_col_i16(rows, SXX, w, &harris_smooth);
+  rows[0] = &ctx->DXY[((y - 1) % 3) * w]; rows[1] = &ctx->DXY[(y % 3) * w]; rows[2] = &ctx->DXY[((y + 1) % 3) * w];
+  image_filter_col_i16(rows, SXY, w, &harris_smooth);
+  rows[0] = &ctx->DYY[((y - 1) % 3) * w]; rows[1] = &ctx->DYY[(y % 3) * w]; rows[2] = &ctx->DYY[((y + 1) % 3) * w];
+  image_filter_col_i16(rows, SYY, w, &harris_smooth);
+
+  for(x = 1; x < w - 1; x++)
+  {
+    // the smoothed products are 16 * 4 / (14 * 255) times the scale of the original 3x3 smoothing:
+    sxx = (SXX[x] * 64) / 3570;
+    sxy = (SXY[x] * 64) / 3570;
+    syy = (SYY[x] * 64) / 3570;
+    sumDXXDYY = sxx + syy;
+    if(sumDXXDYY > 255) sumDXXDYY = 255;
+    Harris[x] = (sxx * syy - sxy * sxy) - (sumDXXDYY * sumDXXDYY) / 25;
+  }
+}
+
+// store the strict local maxima of row y as candidate corners and keep track of the maximum Harris value:
+static int harrisCandidateRow(struct harris_context* ctx, int y, int* max_val)
+{
+  int x, h;
+  int w = ctx->width;
+  int *H0, *H1, *H2;
+  struct harris_candidate* grown;
+
+  H1 = &ctx->Harris[(y % 3) * w];
+  for(x = 0; x < w; x++)
+  {
+    if(H1[x] > (*max_val)) (*max_val) = H1[x];
+  }
+  if(y == 0 || y == ctx->height - 1) return OK;
+  H0 = &ctx->Harris[((y - 1) % 3) * w];
+  H2 = &ctx->Harris[((y + 1) % 3) * w];
+
+  for(x = 1; x < w - 1; x++)
+  {
+    h = H1[x];
+    // Since the threshold is never negative, only positive maxima can survive thresholding
+    if(h <= 0 || h <= H1[x-1] || h <= H1[x+1] || h <= H0[x-1] || h <= H0[x] || h <= H0[x+1]
+       || h <= H2[x-1] || h <= H2[x] || h <= H2[x+1]) continue;
+
+    if(ctx->n_candidates == ctx->max_candidates)
+    {
+      grown = (struct harris_candidate *) realloc(ctx->candidates, 2 * ctx->max_candidates * sizeof(struct harris_candidate));
+      if(grown == 0) return NO_MEMORY;
+      ctx->candidates = grown;
+      ctx->max_candidates *= 2;
+    }
+    ctx->candidates[ctx->n_candidates].x = x;
+    ctx->candidates[ctx->n_candidates].y = y;
+    ctx->candidates[ctx->n_candidates].value = h;
+    ctx->n_candidates++;
+  }
+  return OK;
+}
+
+// order candidates column-major, the order in which findLocalMaxima visits the pixels:
+static int compareCandidates(const void* a, const void* b)
+{
+  const struct harris_candidate* ca = (const struct harris_candidate*) a;
+  const struct harris_candidate* cb = (const struct harris_candidate*) b;
+  if(ca->x != cb->x) return ca->x - cb->x;
+  return ca->y - cb->y;
+}
+
+int findCornersContext(struct harris_context* ctx, unsigned char *frame_buf, int MAX_POINTS, int *x, int *y, int suppression_distance_squared, int* n_found_points, int mark_points)
+{
+  // Algorithmic steps, streaming over the rows of the image:
+  // (1) get the dx, dy gradients and dxx, dxy, dyy of the next row, and smooth them horizontally
+  // (2) smooth dxx, dxy, dyy vertically and determine the Harris values of the row before
+  // (3) store local maxima of the row before that as candidates, and track the maximal Harris value
+  // (4) threshold the candidates and select them with suppression of points close by
+  // (5) mark the points red in the image
+  // The selection is identical to thresholding and scanning full-frame Harris images.
+
+  int r, c, p, q, i, j, max_val, threshold, n_thresholded, suppressed;
+  unsigned int ix;
+  int s = suppression_distance_squared;
+  struct harris_candidate* cand;
+
+  (*n_found_points) = 0;
+  ctx->n_candidates = 0;
+  max_val = 0; // the zero border is part of the Harris image
+  if(ctx->width < 3 || ctx->height < 3) return OK;
+
+  for(r = 0; r < ctx->height + 3; r++)
+  {
+    if(r < ctx->height) harrisLumaRow(ctx, frame_buf, r);
+    // each stage lags one row behind the previous one, as it needs the rows above and below:
+    if(r >= 1 && r - 1 < ctx->height) harrisGradientRow(ctx, r - 1);
+    if(r >= 2 && r - 2 < ctx->height) harrisResponseRow(ctx, r - 2);
+    if(r >= 3)
+    {
+      if(harrisCandidateRow(ctx, r - 3, &max_val) == NO_MEMORY) return NO_MEMORY;
+    }
+  }
+
+  // (4) threshold the candidates on the basis of the maximum:
+  threshold = max_val / 5;
+  n_thresholded = 0;
+  for(c = 0; c < ctx->n_candidates; c++)
+  {
+    if(ctx->candidates[c].value >= threshold) ctx->candidates[n_thresholded++] = ctx->candidates[c];
+  }
+  qsort(ctx->candidates, n_thresholded, sizeof(struct harris_candidate), compareCandidates);
+
+  // select points that are not too close to an earlier selected point:
+  for(c = 0; c < n_thresholded && (*n_found_points) < MAX_POINTS; c++)
+  {
+    cand = &ctx->candidates[c];
+    suppressed = 0;
+    for(q = 0; q < (*n_found_points); q++)
+    {
+      if(cand->x >= x[q] - s && cand->x <= x[q] + s && cand->y >= y[q] - s && cand->y < y[q] + s)
+      {
+        suppressed = 1;
+        break;
+      }
+    }
+    if(!suppressed)
+    {
+      x[(*n_found_points)] = cand->x;
+      y[(*n_found_points)] = cand->y;
+      (*n_found_points)++;
+    }
+  }
+
+  // (5) mark the points red in the image
+  if(mark_points > 0)
+  {
     for(p = 0; p < (*n_found_points); p++)
     {
-      if(x[p] >= 1 && y[p] >= 1 && x[p] < (int)IMG_WIDTH - 1 && y[p] < (int)IMG_HEIGHT - 1)
+      if(x[p] >= 1 && y[p] >= 1 && x[p] < ctx->width - 1 && y[p] < ctx->height - 1)
       {
-        // printf("(x,y) = (%d,%d)\n\r", x[p],y[p]);
         for(i = -1; i <= 1; i++)
         {
           for(j = -1; j <= 1; j++)
           {
-            // printf("(x+i,y+j) = (%d,%d)\n\r", x[p]+i,y[p]+j);
-            ix = uint_index((unsigned int) (x[p]+i), (unsigned int) (y[p]+j));
-            // printf("ix = %d, ixx = %d\n\r", ix, (((y[p]+j) * IMG_WIDTH + (x[p]+i)) * 2) & 0xFFFFFFFC);
+            ix = ctx_uint_index(ctx, (unsigned int) (x[p]+i), (unsigned int) (y[p]+j));
             redPixel(frame_buf, ix);
           }
         }
@@ -604,6 +694,18 @@ int findCorners(unsigned char *frame_buf, int MAX_POINTS, int *x, int *y, int su
   return OK;
 }
 
+int findCorners(unsigned char *frame_buf, int MAX_POINTS, int *x, int *y, int suppression_distance_squared, int* n_found_points, int mark_points, int imW, int imH)
+{
+  // Convenience wrapper for a single call; keep a harris_context to avoid the allocations per frame.
+  struct harris_context ctx;
+  int error;
+
+  if(initHarrisContext(&ctx, imW, imH) == NO_MEMORY) return NO_MEMORY;
+  error = findCornersContext(&ctx, frame_buf, MAX_POINTS, x, y, suppression_distance_squared, n_found_points, mark_points);
+  freeHarrisContext(&ctx);
+  return error;
+}
+
 int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY_STOPPED, int *x, int *y, int* active, int* n_found_points, int mark_points, int imW, int imH)
 {
   // Algorithmic steps:
@@ -613,8 +715,8 @@ int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY
 
   unsigned int grid_step_x, grid_step_y, border, n_agents, gr, gc, a;
   unsigned int t, n_time_steps, n_active, finished, active_agents;
-  int visual_inputs[N_VISUAL_INPUTS];
-  int actions[N_ACTIONS];
+  struct agent_batch batch;
+  int* actions;
   int dx, dy, MAX_JUMP;
   unsigned int RESOLUTION, half_patch;
   int p, i, j;
@@ -632,6 +734,7 @@ int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY
   // ***********************************
 
   n_agents = GRID_ROWS * GRID_ROWS;
+  if(initAgentBatch(&batch, n_agents) == NO_MEMORY) return NO_MEMORY;
   border = 10;
   grid_step_x = (imW - 2 * border) / (GRID_ROWS-1);
   grid_step_y = (imH - 2 * border) / (GRID_ROWS-1);
@@ -665,57 +768,59 @@ int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY
     // number of agents still active:
     n_active = 0;
 
-    // loop over the agents:
+    // sensing, inputs in [0,255], of all active agents:
+    batch.n_agents = 0;
     for(a = 0; a < n_agents; a++)
     {
-      // only extract inputs and move if still active:
       if(active[a] == 1)
       {
-        // printf("Agent %d at (%d,%d)\n\r", a, x[a], y[a]);
-        n_active++;
+        getVisualInputsBatch(frame_buf, x[a] / RESOLUTION, y[a] / RESOLUTION, &batch, batch.n_agents, half_patch);
+        batch.agent[batch.n_agents] = a;
+        batch.n_agents++;
+      }
+    }
+
+    // determining actions of all active agents at once, in [-RESOLUTION, RESOLUTION]:
+    applyNeuralNetworkBatch(&active_corner_perceptron, &batch, RESOLUTION);
+
+    // loop over the active agents:
+    for(i = 0; i < batch.n_agents; i++)
+    {
+      a = batch.agent[i];
+      actions = &batch.actions[i * N_ACTIONS];
+      n_active++;
 
-        // sensing, inputs in [0,255]:
-        getVisualInputs(frame_buf, x[a] / RESOLUTION, y[a] / RESOLUTION, visual_inputs, half_patch);
+      // possibly stopping:
+      if(actions[2] < 0)
+      {
+        active[a] = 0;
+      }
 
-        // determining actions, in [-RESOLUTION, RESOLUTION]:
-        applyNeuralNetwork(visual_inputs, actions, RESOLUTION);
+      // if moving:
+      if(active[a] == 1)
+      {
+        dx = (actions[0] * MAX_JUMP);
+        dy = (actions[1] * MAX_JUMP);
 
-        // printf("Actions = (%d, %d, %d)\n\r", actions[0], actions[1], actions[2]);
+        x[a] += dx;
+        y[a] += dy;
 
-        // possibly stopping:
-        if(actions[2] < 0)
+        // checking the limits, making the agents go round the image when they leave the image:
+        if(x[a] / RESOLUTION < half_patch + 1) // the + 1 is necessary for the convolution with image filters
         {
-          // printf("Agent %d stopped.\n\r", a);
-          active[a] = 0;
+          x[a] = (IMG_WIDTH - half_patch - 2) * RESOLUTION;
         }
-
-        // if moving:
-        if(active[a] == 1)
+        else if(x[a] / RESOLUTION > IMG_WIDTH - half_patch - 2)
         {
-          dx = (actions[0] * MAX_JUMP);
-          dy = (actions[1] * MAX_JUMP);
-
-          x[a] += dx;
-          y[a] += dy;
-
-          // checking the limits, making the agents go round the image when they leave the image:
-          if(x[a] / RESOLUTION < half_patch + 1) // the + 1 is necessary for the convolution with image filters
-          {
-            x[a] = (IMG_WIDTH - half_patch - 2) * RESOLUTION;
-          }
-          else if(x[a] / RESOLUTION > IMG_WIDTH - half_patch - 2)
-          {
-            x[a] = (half_patch + 1) * RESOLUTION;
-          }
-          if(y[a] / RESOLUTION < half_patch + 1) // the + 1 is necessary for the convolution with image filters
-          {
-            y[a] = (IMG_HEIGHT - half_patch - 2) * RESOLUTION;
-          }
-          else if(y[a] / RESOLUTION > IMG_HEIGHT - half_patch - 2)
-          {
-            y[a] = (half_patch + 1) * RESOLUTION;
-          }
-
+          x[a] = (half_patch + 1) * RESOLUTION;
+        }
+        if(y[a] / RESOLUTION < half_patch + 1) // the + 1 is necessary for the convolution with image filters
+        {
+          y[a] = (IMG_HEIGHT - half_patch - 2) * RESOLUTION;
+        }
+        else if(y[a] / RESOLUTION > IMG_HEIGHT - half_patch - 2)
+        {
+          y[a] = (half_patch + 1) * RESOLUTION;
         }
       }
     }
@@ -729,6 +834,8 @@ int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY
     }
   }
 
+  freeAgentBatch(&batch);
+
   // ***********************************
   // 3) select the points to be returned
   // ***********************************
@@ -792,174 +899,170 @@ int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY
   return 0;
 }
 
-void getVisualInputs(unsigned char *frame_buf, int x, int y, int* visual_inputs, unsigned int half_patch)
+void setPerceptronWeights(struct perceptron* nn, int* w)
 {
+  // weights are stored per action, padded with zeros to an even number of inputs:
+  int a, i;
+  for(a = 0; a < N_ACTIONS; a++)
+  {
+    for(i = 0; i < N_INPUTS_PADDED; i++)
+    {
+      nn->weights[a][i] = (i < N_VISUAL_INPUTS) ? (short) w[a * N_VISUAL_INPUTS + i] : 0;
+    }
+  }
+}
+
+int loadPerceptronWeights(struct perceptron* nn, const char* filename)
+{
+  // The file contains N_ACTIONS * N_VISUAL_INPUTS integers in [-100, 100], separated by white space or commas,
+  // in the same order as the default weights.
+  int w[N_ACTIONS * N_VISUAL_INPUTS];
+  int n = 0;
+  FILE* file = fopen(filename, "r");
+  if(file == 0) return INVALID_WEIGHTS;
+
+  while(n < N_ACTIONS * N_VISUAL_INPUTS)
+  {
+    if(fscanf(file, " %d ,", &w[n]) != 1) break;
+    if(w[n] < -100 || w[n] > 100) break;
+    n++;
+  }
+  fclose(file);
+
+  if(n != N_ACTIONS * N_VISUAL_INPUTS) return INVALID_WEIGHTS;
+  setPerceptronWeights(nn, w);
+  return OK;
+}
+
+int initAgentBatch(struct agent_batch* batch, int max_agents)
+{
+  // round up to a multiple of 4 agents, so full vectors can be processed:
+  batch->max_agents = (max_agents + 3) & ~3;
+  batch->n_agents = 0;
+  batch->inputs = (short *) calloc(N_INPUTS_PADDED * batch->max_agents, sizeof(short));
+  batch->sums = (int *) malloc(N_ACTIONS * batch->max_agents * sizeof(int));
+  batch->actions = (int *) malloc(N_ACTIONS * batch->max_agents * sizeof(int));
+  batch->agent = (int *) malloc(batch->max_agents * sizeof(int));
+  if(batch->inputs == 0 || batch->sums == 0 || batch->actions == 0 || batch->agent == 0)
+  {
+    freeAgentBatch(batch);
+    return NO_MEMORY;
+  }
+  return OK;
+}
+
+void freeAgentBatch(struct agent_batch* batch)
+{
+  free(batch->inputs); free(batch->sums); free(batch->actions); free(batch->agent);
+  batch->inputs = 0; batch->sums = 0; batch->actions = 0; batch->agent = 0;
+  batch->n_agents = 0; batch->max_agents = 0;
+}
+
+// index of input i of agent a: pairs of inputs are interleaved per agent, [i/2][a][i%2]
+#define batch_index(batch, a, i) ((((i) >> 1) * (batch)->max_agents + (a)) * 2 + ((i) & 1))
+
+void getVisualInputsBatch(unsigned char *frame_buf, int x, int y, struct agent_batch* batch, int agent, unsigned int half_patch)
+{
+  // the gradients of the patch around x, y and a bias, stored in the batch:
   int i, dx, dy, half_inputs, xx, yy;
-  // will round off correctly (bias is counted as visual input):
   half_inputs = N_VISUAL_INPUTS / 2;
   i = 0;
   for(xx = x - (int)half_patch; xx <= x + (int)half_patch; xx++)
   {
     for(yy = y - (int)half_patch; yy <= y + (int)half_patch; yy++)
     {
-      //printf("gp(%d, %d), ", xx, yy);
       getGradientPixelWH(frame_buf, xx, yy, &dx, &dy);
-      visual_inputs[i] = dx;
-      visual_inputs[half_inputs+i] = dy;
+      batch->inputs[batch_index(batch, agent, i)] = dx;
+      batch->inputs[batch_index(batch, agent, half_inputs + i)] = dy;
       i++;
     }
   }
   // bias, scaled to the input range:
-  visual_inputs[N_VISUAL_INPUTS-1] = 255;
-
-  /*printf("Visual inputs:\n");
-	for(i = 0; i < N_VISUAL_INPUTS; i++)
-	{
-		printf("%d, ", visual_inputs[i]);
-	}
-	printf("\n\r");*/
-
-  return;
+  batch->inputs[batch_index(batch, agent, N_VISUAL_INPUTS - 1)] = 255;
 }
 
-void applyNeuralNetwork(int* visual_inputs, int* actions, int RESOLUTION)
+void applyNeuralNetworkBatch(struct perceptron* nn, struct agent_batch* batch, int RESOLUTION)
 {
+  // A perceptron with 3 actions of 51 inputs (the last is the bias), evaluated for 4 agents at a time.
+  // Inputs and weights fit in 16 bits, the sums (at most 1,300,500) in 32 bits.
+  int a, i, act, factor;
 
-  int a, i, w, factor;
-
-  //printf("NN\n\r");
+  for(act = 0; act < N_ACTIONS; act++)
+  {
+    short* w = nn->weights[act];
+    int* sums = &batch->sums[act * batch->max_agents];
+    a = 0;
+#if defined(CV_SIMD_SSE2)
+    int p, n_pairs = N_INPUTS_PADDED / 2;
+    for(; a < batch->n_agents; a += 4)
+    {
+      __m128i acc = _mm_setzero_si128();
+      for(p = 0; p < n_pairs; p++)
+      {
+        __m128i in = _mm_loadu_si128((__m128i *)&batch->inputs[(p * batch->max_agents + a) * 2]);
+        __m128i wp = _mm_set1_epi32((int)(unsigned short)w[2 * p] | ((int)w[2 * p + 1] << 16));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(in, wp));
+      }
+      _mm_storeu_si128((__m128i *)&sums[a], acc);
+    }
+#elif defined(CV_SIMD_NEON)
+    int p, n_pairs = N_INPUTS_PADDED / 2;
+    for(; a < batch->n_agents; a += 4)
+    {
+      int32x4_t acc = vdupq_n_s32(0);
+      for(p = 0; p < n_pairs; p++)
+      {
+        int16x4x2_t in = vld2_s16(&batch->inputs[(p * batch->max_agents + a) * 2]);
+        acc = vmlal_n_s16(acc, in.val[0], w[2 * p]);
+        acc = vmlal_n_s16(acc, in.val[1], w[2 * p + 1]);
+      }
+      vst1q_s32(&sums[a], acc);
+    }
+#endif
+    for(; a < batch->n_agents; a++)
+    {
+      sums[a] = 0;
+      for(i = 0; i < N_INPUTS_PADDED; i++)
+      {
+        sums[a] += w[i] * batch->inputs[batch_index(batch, a, i)];
+      }
+    }
+  }
 
-  // inputs in [0,255] weights in [-100,100]
-  // 51 weights per neuron
-  // 25500 * 51 = 1,300,500 (max)
-  // float point:
-  // inputs in [-1, 1] weights in [-1, 1]
-  // 51 weights, 51 (max) (* RESOLUTION = 5100)
-  // but the max are very unlikely, so:
+  // inputs in [0,255] and weights in [-100,100], so the sums are scaled from 25500 to RESOLUTION. The activation
+  // halves the actions, which saturate at RESOLUTION / -RESOLUTION:
   factor = 25500 / RESOLUTION;
-  w = 0;
-  // Perceptron neural network:
-  for(a = 0; a < N_ACTIONS; a++)
+  for(a = 0; a < batch->n_agents; a++)
   {
-    actions[a] = 0;
-
-    for(i = 0; i < N_VISUAL_INPUTS; i++)
+    for(act = 0; act < N_ACTIONS; act++)
     {
-      actions[a] += weights[w] * visual_inputs[i];
-      w++;
+      i = batch->sums[act * batch->max_agents + a] / factor;
+      i /= 2;
+      i = (i > RESOLUTION) ? RESOLUTION : i;
+      i = (i < -RESOLUTION) ? -RESOLUTION : i;
+      batch->actions[a * N_ACTIONS + act] = i;
     }
-
-    //printf("actions[%d] after summing: %d\n\r", a, actions[a]);
-
-    // account for changes in value ranges (25500 vs. 1 -> 1*RESOLUTION)
-    actions[a] /= factor;
-
-    //printf("actions[%d] after factor: %d\n\r", a, actions[a]);
-
-    // activation function:
-    actions[a] /= 2;
-
-    //printf("actions[%d] after /2: %d\n\r", a, actions[a]);
-
-    // saturate at RESOLUTION / -RESOLUTION:
-    actions[a] = (actions[a] > RESOLUTION) ? RESOLUTION : actions[a];
-    actions[a] = (actions[a] < -RESOLUTION) ? -RESOLUTION : actions[a];
-
-    //printf("actions[%d] after saturation: %d\n\r", a, actions[a]);
-
   }
-
-  return;
 }
 
-
-
 void getSubPixel(int* Patch, unsigned char* frame_buf, int center_x, int center_y, int half_window_size, int subpixel_factor)
 {
-  int x, y, x_0, y_0, x_0_or, y_0_or, i, j, window_size, alpha_x, alpha_y, max_x, max_y;
-  //int printed, limit;
-  unsigned int ix1, ix2, Y;
+  int i, window_size;
+  short* window;
+  struct lk_image img = {frame_buf, IMG_WIDTH, IMG_HEIGHT, LK_YUV422};
+
   window_size = half_window_size * 2 + 1;
-  max_x = (IMG_WIDTH-1)*subpixel_factor;
-  max_y = (IMG_HEIGHT-1)*subpixel_factor;
-  //printed = 0; limit = 4;
+  window = (short *) malloc(window_size * window_size * sizeof(short));
+  if(window == 0)
+    return;
 
-  for(i = 0; i < window_size; i++)
+  lk_subpixel_window(&img, window, window_size, center_x, center_y, subpixel_factor);
+  for(i = 0; i < window_size * window_size; i++)
   {
-    for(j = 0; j < window_size; j++)
-    {
-      // index for this position in the patch:
-      ix1 = (j * window_size + i);
-
-      // determine subpixel coordinates of the current pixel:
-      x = center_x + (i - half_window_size) * subpixel_factor;
-      if(x < 0) x = 0;
-      if(x > max_x) x = max_x;
-      y = center_y + (j - half_window_size) * subpixel_factor;
-      if(y < 0) y = 0;
-      if(y > max_y) y = max_y;
-      // pixel to the top left:
-      x_0_or = (x / subpixel_factor);
-      x_0 = x_0_or * subpixel_factor;
-      y_0_or = (y / subpixel_factor);
-      y_0 = y_0_or * subpixel_factor;
-      /*if(printed < limit)
-			{
-				printf("x_0_or = %d, y_0_or = %d;\n\r", x_0_or, y_0_or);
-				printf("x_0 = %d, y_0 = %d\n\r");
-				printed++;
-			}*/
-
-
-      if(x == x_0 && y == y_0)
-      {
-        // simply copy the pixel:
-        ix2 = uint_index(x_0_or, y_0_or);
-        Y = ((unsigned int)frame_buf[ix2+1] + (unsigned int)frame_buf[ix2+3]) >> 1;
-        Patch[ix1] = (int) Y;
-      }
-      else
-      {
-        // blending according to how far the subpixel coordinates are from the pixel coordinates
-        alpha_x = (x - x_0);
-        alpha_y = (y - y_0);
-
-        // the patch pixel is a blend from the four surrounding pixels:
-        ix2 = uint_index(x_0_or, y_0_or);
-        Y = ((unsigned int)frame_buf[ix2+1] + (unsigned int)frame_buf[ix2+3]) >> 1;
-        Patch[ix1] = (subpixel_factor - alpha_x) * (subpixel_factor - alpha_y) * ((int) Y);
-
-        ix2 = uint_index((x_0_or+1), y_0_or);
-        Y = ((unsigned int)frame_buf[ix2+1] + (unsigned int)frame_buf[ix2+3]) >> 1;
-        //if(printed < limit) printf("subpixel: TR = %d\n\r", Y);
-        Patch[ix1] += alpha_x * (subpixel_factor - alpha_y) * ((int) Y);
-
-        ix2 = uint_index(x_0_or, (y_0_or+1));
-        Y = ((unsigned int)frame_buf[ix2+1] + (unsigned int)frame_buf[ix2+3]) >> 1;
-        //if(printed < limit) printf("subpixel: BL = %d\n\r", Y);
-        Patch[ix1] += (subpixel_factor - alpha_x) * alpha_y * ((int) Y);
-
-        ix2 = uint_index((x_0_or+1), (y_0_or+1));
-        Y = ((unsigned int)frame_buf[ix2+1] + (unsigned int)frame_buf[ix2+3]) >> 1;
-        //if(printed < limit) printf("subpixel: BR = %d\n\r", Y);
-        Patch[ix1] += alpha_x * alpha_y * ((int) Y);
-
-        // normalize patch value
-        Patch[ix1] /= (subpixel_factor * subpixel_factor);
-
-        /*if(printed < limit)
-				{
-
-					printf("alpha_x = %d, alpha_y = %d, x_0 = %d, y_0 = %d, x = %d, y = %d, Patch[ix1] = %d\n\r", alpha_x, alpha_y, x_0, y_0, x, y, Patch[ix1]);
-					// printed++;
-				}
-         */
-
-      }
-    }
+    Patch[i] = window[i];
   }
 
-  return;
+  free(window);
 }
 
 void getGradientPatch(int* Patch, int* DX, int* DY, int half_window_size)
@@ -1097,209 +1200,50 @@ int calculateError(int* ImC, int width, int height)
   return error;
 }
 
-int opticFlowLK(unsigned char * new_image_buf, unsigned char * old_image_buf, int* p_x, int* p_y, int n_found_points, int imW, int imH, int* new_x, int* new_y, int* status, int half_window_size, int max_iterations)
+int opticFlowLKYUV422(unsigned char * new_image_buf, unsigned char * old_image_buf, int* p_x, int* p_y, int n_found_points, int imW, int imH, int* new_x, int* new_y, int* status, int half_window_size, int max_iterations)
 {
-  // A straightforward one-level implementation of Lucas-Kanade.
-  // For all points:
-  // (1) determine the subpixel neighborhood in the old image
-  // (2) get the x- and y- gradients
-  // (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
-  // (4) iterate over taking steps in the image to minimize the error:
-  //     [a] get the subpixel neighborhood in the new image
-  //     [b] determine the image difference between the two neighborhoods
-  //     [c] calculate the 'b'-vector
-  //     [d] calculate the additional flow step and possibly terminate the iteration
-  int p, subpixel_factor, x, y, it, step_threshold, step_x, step_y, v_x, v_y, Det;
-  int b_x, b_y, patch_size, padded_patch_size, error, step_size;
-  unsigned int ix1, ix2;
-  int* I_padded_neighborhood; int* I_neighborhood; int* J_neighborhood;
-  int* DX; int* DY; int* ImDiff; int* IDDX; int* IDDY;
-  int G[4];
-  int error_threshold;
+  // A straightforward one-level implementation of Lucas-Kanade, the tracking itself is done by lk_track_point.
+  // Points are only tracked when the window stays inside the ROI, the smallest step is 0.2 pixel (L1).
+  int p, subpixel_factor;
+  int flow_x, flow_y;
+  struct lk_params params;
+  struct lk_context ctx;
+  struct lk_image old_img = {old_image_buf, imW, imH, LK_YUV422};
+  struct lk_image new_img = {new_image_buf, imW, imH, LK_YUV422};
 
   // set the image width and height
   IMG_WIDTH = imW;
   IMG_HEIGHT = imH;
   // spatial resolution of flow is 1 / subpixel_factor
   subpixel_factor = 10;
-  // determine patch sizes and initialize neighborhoods
-  patch_size = (2*half_window_size + 1);
-  error_threshold = (25 * 25) * (patch_size * patch_size);
-
-  padded_patch_size = (2*half_window_size + 3);
-  I_padded_neighborhood = (int *) malloc(padded_patch_size * padded_patch_size * sizeof(int));
-  I_neighborhood = (int *) malloc(patch_size * patch_size * sizeof(int));
-  J_neighborhood = (int *) malloc(patch_size * patch_size * sizeof(int));
-  if(I_padded_neighborhood == 0 || I_neighborhood == 0 || J_neighborhood == 0)
-    return NO_MEMORY;
-  DX = (int *) malloc(patch_size * patch_size * sizeof(int));
-  DY = (int *) malloc(patch_size * patch_size * sizeof(int));
-  IDDX = (int *) malloc(patch_size * patch_size * sizeof(int));
-  IDDY = (int *) malloc(patch_size * patch_size * sizeof(int));
-  ImDiff = (int *) malloc(patch_size * patch_size * sizeof(int));
-  if(DX == 0 || DY == 0 || ImDiff == 0 || IDDX == 0 || IDDY == 0)
+
+  params.half_window_size = half_window_size;
+  params.subpixel_factor = subpixel_factor;
+  params.max_iterations = max_iterations;
+  params.step_threshold = 2;
+  params.gradient_div = 1;
+  params.error_div = 1;
+  params.occlusion_start = max_iterations / 2 + 1;
+  params.max_step_norm = false;
+  params.precise_step = false;
+  params.min_x = (half_window_size + 1) * subpixel_factor + 1;
+  params.max_x = (imW - half_window_size) * subpixel_factor - 1;
+  params.min_y = (half_window_size + 1) * subpixel_factor + 1;
+  params.max_y = (imH - half_window_size) * subpixel_factor - 1;
+  if(!lk_init(&ctx, &params))
     return NO_MEMORY;
 
   for(p = 0; p < n_found_points; p++)
   {
-    //printf("*** NEW POINT ***\n\r");
-    // status: point is not yet lost:
-    status[p] = 1;
-
-    //printf("Normal coordinate: (%d,%d)\n\r", p_x[p], p_y[p]);
-    // We want to be able to take steps in the image of 1 / subpixel_factor:
-    p_x[p] *= subpixel_factor;
-    p_y[p] *= subpixel_factor;
-    //printf("Subpixel coordinate: (%d,%d)\n\r", p_x[p], p_y[p]);
-
-    // if the pixel is outside the ROI in the image, do not track it:
-    if(!(p_x[p] > ((half_window_size+1) * subpixel_factor) && p_x[p] < ((int)IMG_WIDTH-half_window_size) * subpixel_factor && p_y[p] > ((half_window_size+1) * subpixel_factor) && p_y[p] < ((int)IMG_HEIGHT-half_window_size)*subpixel_factor))
-    {
-      //printf("Outside of ROI\n\r");
-      status[p] = 0;
-    }
+    flow_x = 0;
+    flow_y = 0;
+    status[p] = lk_track_point(&ctx, &old_img, &new_img, p_x[p] * subpixel_factor, p_y[p] * subpixel_factor, &flow_x, &flow_y);
 
-
-    // (1) determine the subpixel neighborhood in the old image
-    // we determine a padded neighborhood with the aim of subsequent gradient processing:
-    getSubPixel(I_padded_neighborhood, old_image_buf, p_x[p], p_y[p], half_window_size+1, subpixel_factor);
-    // Also get the original-sized neighborhood
-    for(x = 1; x < padded_patch_size - 1; x++)
-    {
-      for(y = 1; y < padded_patch_size - 1; y++)
-      {
-        ix1 = (y * padded_patch_size + x);
-        ix2 = ((y-1) * patch_size + (x-1));
-        I_neighborhood[ix2] = I_padded_neighborhood[ix1];
-      }
-    }
-
-    // (2) get the x- and y- gradients
-    getGradientPatch(I_padded_neighborhood, DX, DY, half_window_size);
-
-    // (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
-    error = calculateG(G, DX, DY, half_window_size);
-    if(error == NO_MEMORY) return NO_MEMORY;
-
-    for(it = 0; it < 4; it++)
-    {
-      //printf("G[%d] = %d\n\r", it, G[it]);
-      G[it] /= 255; // to keep values in range
-      //printf("G[%d] = %d\n\r", it, G[it]);
-    }
-    // calculate G's determinant:
-    Det = G[0] * G[3] - G[1] * G[2];
-    //printf("Det = %d\n\r", Det);
-    Det = Det / subpixel_factor; // so that the steps will be expressed in subpixel units
-    //printf("Det = %d\n\r", Det);
-    if(Det < 1)
-    {
-      status[p] = 0;
-    }
-
-    // (4) iterate over taking steps in the image to minimize the error:
-    it = 0;
-    step_threshold = 2; // 0.2 as smallest step (L1)
-    v_x = 0;
-    v_y = 0;
-    step_size = step_threshold + 1;
-
-    while(status[p] == 1 && it < max_iterations && step_size >= step_threshold)
-    {
-      //printf("it = %d, (p_x+v_x,p_y+v_y) = (%d,%d)\n\r", it, p_x[p]+v_x, p_y[p]+v_y);
-      //printf("it = %d;", it);
-      // if the pixel goes outside the ROI in the image, stop tracking:
-      if(!(p_x[p]+v_x > ((half_window_size+1) * subpixel_factor) && p_x[p]+v_x < ((int)IMG_WIDTH-half_window_size) * subpixel_factor && p_y[p]+v_y > ((half_window_size+1) * subpixel_factor) && p_y[p]+v_y < ((int)IMG_HEIGHT-half_window_size)*subpixel_factor))
-      {
-        //printf("Outside of ROI\n\r");
-        status[p] = 0;
-        break;
-      }
-
-      //     [a] get the subpixel neighborhood in the new image
-
-
-      // clear J:
-      for(x = 0; x < patch_size; x++)
-      {
-        for(y = 0; y < patch_size; y++)
-        {
-          ix2 = (y * patch_size + x);
-          J_neighborhood[ix2] = 0;
-        }
-      }
-
-
-      getSubPixel(J_neighborhood, new_image_buf, p_x[p]+v_x, p_y[p]+v_y, half_window_size, subpixel_factor);
-      //     [b] determine the image difference between the two neighborhoods
-      //printf("I = ");
-      //printIntMatrix(I_neighborhood, patch_size, patch_size);
-      //printf("J = ");
-      //printIntMatrix(J_neighborhood, patch_size, patch_size);
-      //getSubPixel(J_neighborhood, new_image_buf, subpixel_factor * ((p_x[p]+v_x)/subpixel_factor), subpixel_factor * ((p_y[p]+v_y) / subpixel_factor), half_window_size, subpixel_factor);
-      //printf("J2 = ");
-      //printIntMatrix(J_neighborhood, patch_size, patch_size);
-      //printf("figure(); subplot(1,2,1); imshow(I/255); subplot(1,2,2); imshow(J/255);\n\r");
-      getImageDifference(I_neighborhood, J_neighborhood, ImDiff, patch_size, patch_size);
-      //printf("ImDiff = ");
-      //printIntMatrix(ImDiff, patch_size, patch_size);
-      error = calculateError(ImDiff, patch_size, patch_size);
-      if(error > error_threshold && it > max_iterations / 2)
-      {
-        status[p] = 0;
-        break;
-      }
-      //printf("error(%d) = %d;\n\r", it+1, error);
-      //     [c] calculate the 'b'-vector
-      //printf("DX = ");
-      //printIntMatrix(DX, patch_size, patch_size);
-      multiplyImages(ImDiff, DX, IDDX, patch_size, patch_size);
-      //printf("IDDX = ");
-      //printIntMatrix(IDDX, patch_size, patch_size);
-      multiplyImages(ImDiff, DY, IDDY, patch_size, patch_size);
-      //printf("DY = ");
-      //printIntMatrix(DY, patch_size, patch_size);
-      //printf("IDDY = ");
-      //printIntMatrix(IDDY, patch_size, patch_size);
-      //printf("figure(); subplot(2,3,1); imagesc(ImDiff); subplot(2,3,2); imagesc(DX); subplot(2,3,3); imagesc(DY);");
-      //printf("subplot(2,3,4); imagesc(IDDY); subplot(2,3,5); imagesc(IDDX);\n\r");
-      // division by 255 to keep values in range:
-      b_x = getSumPatch(IDDX, patch_size) / 255;
-      b_y = getSumPatch(IDDY, patch_size) / 255;
-      //printf("b_x = %d; b_y = %d;\n\r", b_x, b_y);
-      //     [d] calculate the additional flow step and possibly terminate the iteration
-      step_x = (G[3] * b_x - G[1] * b_y) / Det;
-      step_y = (G[0] * b_y - G[2] * b_x) / Det;
-      v_x += step_x;
-      v_y += step_y; // - (?) since the origin in the image is in the top left of the image, with y positive pointing down
-      //printf("step = [%d,%d]; v = [%d,%d];\n\r", step_x, step_y, v_x, v_y);
-      //printf("pause(0.5);\n\r");
-      // next iteration
-      it++;
-      step_size = abs(step_x);
-      step_size += abs(step_y);
-      //printf("status = %d, it = %d, step_size = %d\n\r", status[p], it, step_size);
-    } // iteration to find the right window in the new image
-
-    //printf("figure(); plot(error(1:(it+1)));\n\r");
-
-    new_x[p] = (p_x[p] + v_x) / subpixel_factor;
-    new_y[p] = (p_y[p] + v_y) / subpixel_factor;
-    p_x[p] /= subpixel_factor;
-    p_y[p] /= subpixel_factor;
+    new_x[p] = (p_x[p] * subpixel_factor + flow_x) / subpixel_factor;
+    new_y[p] = (p_y[p] * subpixel_factor + flow_y) / subpixel_factor;
   }
 
-
-
-  // free all allocated variables:
-  free((char*) I_padded_neighborhood);
-  free((char*) I_neighborhood);
-  free((char*) J_neighborhood);
-  free((char*) DX);
-  free((char*) DY);
-  free((char*) ImDiff);
-  free((char*) IDDX);
-  free((char*) IDDY);
+  lk_free(&ctx);
   // no errors:
   return OK;
 }
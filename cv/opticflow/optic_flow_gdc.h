@@ -1,6 +1,54 @@
 #ifndef OPTIC
 #define OPTIC
 
+#define N_VISUAL_INPUTS 51
+#define N_INPUTS_PADDED 52  // N_VISUAL_INPUTS rounded up to pairs of inputs
+#define N_ACTIONS 3
+
+// perceptron of the active corner agents, int16 weights in [-100, 100]:
+struct perceptron
+{
+  short weights[N_ACTIONS][N_INPUTS_PADDED];
+};
+
+// visual inputs and actions of a batch of agents, in structure-of-arrays layout:
+struct agent_batch
+{
+  int n_agents;
+  int max_agents;           // multiple of 4
+  short* inputs;            // pairs of inputs interleaved per agent: [N_INPUTS_PADDED/2][max_agents][2]
+  int* sums;                // weighted sums per action: [N_ACTIONS][max_agents]
+  int* actions;             // actions per agent: [max_agents][N_ACTIONS]
+  int* agent;               // index of the agent in the grid
+};
+
+// the perceptron used by findActiveCorners, defaults to the built-in weights:
+extern struct perceptron active_corner_perceptron;
+
+// a local maximum of the Harris response:
+struct harris_candidate
+{
+  int x;
+  int y;
+  int value;
+};
+
+// state of the streaming Harris corner detector, only a few rows of the image are kept:
+struct harris_context
+{
+  int width;
+  int height;
+  unsigned char* luma;      // ring of 3 rows with the Y values
+  short* DXX;               // rings of 3 rows with the horizontally smoothed gradient products / 4
+  short* DXY;
+  short* DYY;
+  short* row;               // 3 rows of temporary products
+  int* Harris;              // ring of 3 rows with the Harris values
+  struct harris_candidate* candidates;
+  int n_candidates;
+  int max_candidates;
+};
+
 int getMaximum(int * Im);
 int getMinimum(int * Im);
 void getGradientPixelWH(unsigned char *frame_buf, int x, int y, int* dx, int* dy);
@@ -15,12 +63,21 @@ void getHarris(int* DXX, int* DXY, int* DYY, int* Harris);
 int findLocalMaxima(int* Harris, int max_val, int MAX_POINTS, int* p_x, int* p_y, int suppression_distance_squared, int* n_found_points);
 void excludeArea(unsigned int* Mask, int x, int y, int suppression_distance_squared);
 void thresholdImage(int* Harris, int max_val, int max_factor);
+int initHarrisContext(struct harris_context* ctx, int imW, int imH);
+void freeHarrisContext(struct harris_context* ctx);
+int findCornersContext(struct harris_context* ctx, unsigned char *frame_buf, int MAX_POINTS, int *x, int *y, int suppression_distance_squared, int* n_found_points, int mark_points);
 int findCorners(unsigned char *frame_buf, int MAX_POINTS, int *x, int *y, int suppression_distance_squared, int* n_found_points, int mark_points, int imW, int imH);
+void setPerceptronWeights(struct perceptron* nn, int* w);
+int loadPerceptronWeights(struct perceptron* nn, const char* filename);
+int initAgentBatch(struct agent_batch* batch, int max_agents);
+void freeAgentBatch(struct agent_batch* batch);
+void getVisualInputsBatch(unsigned char *frame_buf, int x, int y, struct agent_batch* batch, int agent, unsigned int half_patch);
+void applyNeuralNetworkBatch(struct perceptron* nn, struct agent_batch* batch, int RESOLUTION);
 int findActiveCorners(unsigned char *frame_buf, unsigned int GRID_ROWS, int ONLY_STOPPED, int *x, int *y, int* active, int* n_found_points, int mark_points, int imW, int imH);
 void getSubPixel(int* Patch, unsigned char* buf, int center_x, int center_y, int half_window_size, int subpixel_factor);
 int calculateG(int* G, int* DX, int* DY, int half_window_size);
 void getGradientPatch(int* Patch, int* DX, int* DY, int half_window_size);
 int getSumPatch(int* Patch, int size);
 void showFlow(unsigned char * frame_buf, int* x, int* y, int* status, int n_found_points, int* new_x, int* new_y, int imgW, int imgH);
-int opticFlowLK(unsigned char * new_image_buf, unsigned char * old_image_buf, int* p_x, int* p_y, int n_found_points, int imW, int imH, int* new_x, int* new_y, int* status, int half_window_size, int max_iterations);
+int opticFlowLKYUV422(unsigned char * new_image_buf, unsigned char * old_image_buf, int* p_x, int* p_y, int n_found_points, int imW, int imH, int* new_x, int* new_y, int* status, int half_window_size, int max_iterations);
 #endif
@@ -1,14 +1,24 @@
 #include "skysegmentation.h"
+#include "image.h"
+#include "simd.h"
 #include <stdlib.h>     /* abs */
 #include <stdio.h> /* printf */
+#include <string.h> /* memset, memcpy */
+#include <pthread.h>
 #include "trig.h"
 
 /******************Defines********************/
 #define uint8_t unsigned char
 #define N_BINS 10
 #define image_index(xx, yy)  ((yy * imgWidth + xx) * 2) & 0xFFFFFFFC  // always a multiple of 4
+#define sky_index(xx, yy, width)  ((((yy) * (width) + (xx)) * 2) & 0xFFFFFFFC)  // image_index of an image of the given width
+#define SKY_MASK_PIXELS 0xFFFFFFFF
+#define SKY_MASK_MACROPIXELS 0x55555555  // the left pixel of every macropixel
 
 /******************Private global variables********************/
+// the gradient masks [0 0 0; -1 0 1; 0 0 0] and [0 -1 0; 0 0 0; 0 1 0], the borders are repeated:
+static const struct image_filter_t sky_gradient_dx = {3, 1, {-1, 0, 1}, {1}, 0, 0, IMAGE_BORDER_CLAMP};
+static const struct image_filter_t sky_gradient_dy = {1, 3, {1}, {-1, 0, 1}, 0, 0, IMAGE_BORDER_CLAMP};
 const int MAX_ROLL_ANGLE = 60;
 const int MAX_PITCH_ANGLE = 40;
 const int MAX_I2C_BYTE = 254;
@@ -29,17 +39,23 @@ extern int get_FD_CV(unsigned char *frame_buf, int x, int y);
 
 extern void segmentSkyUncertainty2(unsigned char *frame_buf, unsigned char *frame_buf2);
 extern void segment_no_yco(unsigned char *frame_buf, unsigned char *frame_buf2);
+static void skyLumaRow(unsigned char *frame_buf, int width, int y, unsigned char *luma);
 
 
 void getObstacles(unsigned int* obstacles, unsigned int n_bins, unsigned char *frame_buf, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL);
 void getUncertainty(unsigned int* uncertainty, unsigned int n_bins, unsigned char *frame_buf);
 void getObstacles2Way(unsigned int* obstacles, unsigned int n_bins, unsigned char *frame_buf, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle);
+void getObstaclesMask(unsigned int* obstacles, unsigned int n_bins, struct sky_mask* mask, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL);
+void getUncertaintyMask(unsigned int* uncertainty, unsigned int n_bins, struct sky_mask* mask);
+int getObstacles2WayMask(unsigned int* obstacles, unsigned int n_bins, struct sky_mask* mask, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle);
 void horizonToLineParameters(int pitch_pixel, int roll_angle, int* a, int* b);
 
 void drawLine(unsigned char *frame_buf, int a, int b, int resolution);
 
 static inline uint8_t scale_to_range(int x, int min, int max, int range);
+static inline int pitchAngleToPitchPixel(int pitch, unsigned int height);
 static inline int pitch_angle_to_pitch_pixel(int pitch);
+static void freeHorizonCache(struct sky_horizon_cache* cache);
 
 
 
@@ -127,7 +143,7 @@ extern int getPatchTexture(unsigned char *frame_buf, int x, int y, int patch_siz
   x = (x < half_patch_size) ? half_patch_size : x;
   x = (x >= (int)imgWidth - half_patch_size) ? (int)imgWidth - half_patch_size - 1 : x;
   y = (y < half_patch_size) ? half_patch_size : y;
-  y = (y >= (int)imgWidth - half_patch_size) ? (int)imgWidth - half_patch_size - 1 : y;
+  y = (y >= (int)imgHeight - half_patch_size) ? (int)imgHeight - half_patch_size - 1 : y;
 
   ix = image_index(x,y);
   center_pixel = (int)((((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1);
@@ -194,7 +210,7 @@ extern int getPatchMean(unsigned char *frame_buf, int x, int y, int patch_size)
   x = (x < half_patch_size) ? half_patch_size : x;
   x = (x >= (int)imgWidth - half_patch_size) ? (int)imgWidth - half_patch_size - 1 : x;
   y = (y < half_patch_size) ? half_patch_size : y;
-  y = (y >= (int)imgWidth - half_patch_size) ? (int)imgWidth - half_patch_size - 1 : y;
+  y = (y >= (int)imgHeight - half_patch_size) ? (int)imgHeight - half_patch_size - 1 : y;
 
   for(dx = -half_patch_size; dx <= half_patch_size; dx++)
   {
@@ -211,6 +227,91 @@ extern int getPatchMean(unsigned char *frame_buf, int x, int y, int patch_size)
   return mean;
 }
 
+int initSkyIntegral(struct sky_integral* integral, unsigned int width, unsigned int height)
+{
+  memset(integral, 0, sizeof(struct sky_integral));
+  integral->width = width;
+  integral->height = height;
+  integral->row = (unsigned char *) malloc(3 * width);
+  if(integral->row == 0 || !image_integral_create(&integral->luma, width, height, true)
+      || !image_integral_create(&integral->u, width, height, false) || !image_integral_create(&integral->v, width, height, false))
+  {
+    freeSkyIntegral(integral);
+    return SKY_TREE_INVALID;
+  }
+  return SKY_TREE_OK;
+}
+
+void freeSkyIntegral(struct sky_integral* integral)
+{
+  image_integral_free(&integral->luma);
+  image_integral_free(&integral->u);
+  image_integral_free(&integral->v);
+  free(integral->row);
+  integral->row = 0;
+}
+
+void computeSkyIntegral(unsigned char *frame_buf, struct sky_integral* integral)
+{
+  // Every pixel has the luma and chroma of its macropixel, as in getPatchMean. The Y, U and V of a row are written to
+  // the scratch rows and added to the integral images, which make the prefix sums with SIMD.
+  unsigned int x, y, ix;
+  unsigned char *luma = integral->row;
+  unsigned char *u = luma + integral->width;
+  unsigned char *v = u + integral->width;
+
+  integral->luma.rows = integral->u.rows = integral->v.rows = 0;
+  for(y = 0; y < integral->height; y++)
+  {
+    ix = sky_index(0, y, integral->width);
+    for(x = 0; x < integral->width; x++)
+    {
+      luma[x] = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
+      u[x] = frame_buf[ix];
+      v[x] = frame_buf[ix+2];
+      if(x & 1) ix += 4;
+    }
+    image_integral_add_row(&integral->luma, luma);
+    image_integral_add_row(&integral->u, u);
+    image_integral_add_row(&integral->v, v);
+  }
+}
+
+// the patch around x, y, moved into the image as in getPatchMean:
+static void skyIntegralPatch(struct sky_integral* integral, int x, int y, int patch_size, int *x0, int *y0, int *size)
+{
+  int half_patch_size = patch_size / 2;
+  x = (x < half_patch_size) ? half_patch_size : x;
+  x = (x >= (int)integral->width - half_patch_size) ? (int)integral->width - half_patch_size - 1 : x;
+  y = (y < half_patch_size) ? half_patch_size : y;
+  y = (y >= (int)integral->height - half_patch_size) ? (int)integral->height - half_patch_size - 1 : y;
+  (*x0) = x - half_patch_size;
+  (*y0) = y - half_patch_size;
+  (*size) = 2 * half_patch_size + 1;
+}
+
+int getPatchMeanIntegral(struct sky_integral* integral, int x, int y, int patch_size)
+{
+  int x0, y0, size;
+  skyIntegralPatch(integral, x, y, patch_size, &x0, &y0, &size);
+  return (int)image_integral_box_sum(&integral->luma, x0, y0, size, size) / (size * size);
+}
+
+int getPatchVarianceIntegral(struct sky_integral* integral, int x, int y, int patch_size)
+{
+  int x0, y0, size;
+  skyIntegralPatch(integral, x, y, patch_size, &x0, &y0, &size);
+  return (int)image_integral_box_variance(&integral->luma, x0, y0, size, size);
+}
+
+void getPatchChromaIntegral(struct sky_integral* integral, int x, int y, int patch_size, int* u, int* v)
+{
+  int x0, y0, size;
+  skyIntegralPatch(integral, x, y, patch_size, &x0, &y0, &size);
+  (*u) = (int)image_integral_box_sum(&integral->u, x0, y0, size, size) / (size * size);
+  (*v) = (int)image_integral_box_sum(&integral->v, x0, y0, size, size) / (size * size);
+}
+
 extern int getHarrisPixel(unsigned char *frame_buf, int x, int y)
 {
   int dx, dy, dx2, dxy, dy2, Harris, min_x, min_y, xx, yy, it;
@@ -339,13 +440,13 @@ extern int getNoblePixel(unsigned char *frame_buf, int x, int y)
 
 
 // This function gives the maximum of a subsampled version of the image
-unsigned int getMaximumY(unsigned char *frame_buf)
+static unsigned int skyMaximumY(unsigned char *frame_buf, unsigned int width, unsigned int height)
 {
   unsigned int ix, y, max_y;
   unsigned int color_channels = 4;
   unsigned int step = 5 * color_channels;
   max_y = 0;
-  for (ix=0; ix<(imgWidth*imgHeight*2); ix+= step)
+  for (ix=0; ix<(width*height*2); ix+= step)
   {
     // we can speed things up by just looking at the first channel:
     y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
@@ -354,6 +455,11 @@ unsigned int getMaximumY(unsigned char *frame_buf)
   return max_y;
 }
 
+unsigned int getMaximumY(unsigned char *frame_buf)
+{
+  return skyMaximumY(frame_buf, imgWidth, imgHeight);
+}
+
 extern unsigned int getMinimumY(unsigned char *frame_buf)
 {
   unsigned int ix, y, min_y;
@@ -374,14 +480,36 @@ extern unsigned int getMinimumY(unsigned char *frame_buf)
 // For computational efficiency, we currently do not use any mask for determining the gradient.
 extern void getGradientImage(unsigned char *frame_buf, unsigned char *frame_buf2, unsigned char *frame_buf3)
 {
-  unsigned int x,y,ix;
+  // The gradients of getGradientPixel for the whole luma plane at once, a macropixel gets the gradient of its right
+  // pixel (its last pixel for an odd width).
+  unsigned int x,y,ix,p;
   int dx,dy;
-  for(x = 0; x < imgWidth; x++)
+  unsigned char *luma;
+  short *gradients;
+
+  luma = (unsigned char *) malloc(imgWidth * imgHeight * sizeof(unsigned char));
+  gradients = (short *) malloc(2 * imgWidth * imgHeight * sizeof(short));
+  if(luma == 0 || gradients == 0)
+  {
+    free(luma);
+    free(gradients);
+    return;
+  }
+  for(y = 0; y < imgHeight; y++)
+  {
+    skyLumaRow(frame_buf, imgWidth, y, &luma[y * imgWidth]);
+  }
+  image_filter_u8_i16(luma, 1, gradients, imgWidth, imgHeight, &sky_gradient_dx);
+  image_filter_u8_i16(luma, 1, &gradients[imgWidth * imgHeight], imgWidth, imgHeight, &sky_gradient_dy);
+
+  for(y = 0; y < imgHeight; y++)
   {
-    for(y = 0; y < imgHeight; y++)
+    for(x = 0; x < imgWidth; x += 2)
     {
       ix = image_index(x,y);
-      getGradientPixel(frame_buf, x, y, &dx, &dy);
+      p = y * imgWidth + ((x + 1 < imgWidth) ? x + 1 : x);
+      dx = gradients[p];
+      dy = gradients[imgWidth * imgHeight + p];
 
       // gradient has to be stored in unsigned format. We prefer to cut the values off at -127 / +127 than to reduce the resolution
       dx = dx + 127;
@@ -396,6 +524,8 @@ extern void getGradientImage(unsigned char *frame_buf, unsigned char *frame_buf2
       frame_buf3[ix+3] = (unsigned int) dy;
     }
   }
+  free(luma);
+  free(gradients);
 }
 
 extern void getGradientPixel(unsigned char *frame_buf, int x, int y, int* dx, int* dy)
@@ -487,596 +617,993 @@ extern int getGradient(unsigned char *frame_buf, int x, int y)
 
 
 
-void segmentSkyUncertainty2(unsigned char *frame_buf, unsigned char *frame_buf2)
+// fill a row of a luma ring with the Y value of every pixel (the average of its macropixel):
+static void skyLumaRow(unsigned char *frame_buf, int width, int y, unsigned char *luma)
 {
-  // use a pre-defined tree to segment the image:
-  // the second buffer (image) stores the uncertainties between 0 and 100.
-  int x, y, threshold, value;
-  unsigned int ix, Y, U, V, maxY;
+  unsigned int ix, Y;
+  int x;
+  ix = sky_index(0, y, width);
+  for(x = 0; x < width; x += 2)
+  {
+    Y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
+    luma[x] = Y;
+    luma[x+1] = Y;
+    ix += 4;
+  }
+}
 
-  // the maximal illuminance is used in almost all sub-branches, so it is better to calculate it immediately once:
-  maxY = getMaximumY(frame_buf);
+#define SKY_PATCH_SIZE 10
+#define SKY_PATCH_ROWS (2 * (SKY_PATCH_SIZE / 2) + 1)
 
-  for(x = 0; x < (int)imgWidth; x++)
+// the textures of getPatchTexture for both pixels of the macropixel at x, rows are the luma rows of the patch
+// around the (corrected) center row. Both pixels of a macropixel have the same luma, so a patch row is summed per
+// macropixel, and the patch of the right pixel is that of the left pixel shifted by one column.
+static void skyPatchTextures(unsigned char **rows, int width, int x, int *texture)
+{
+  int dy, x_left, x_right, center_pixel, sum, sum_right, half_patch_size;
+#if !defined(CV_SIMD)
+  int xx;
+#endif
+  unsigned char *row;
+  half_patch_size = SKY_PATCH_SIZE / 2;
+  // correct coordinates of center pixel if necessary:
+  x_left = (x < half_patch_size) ? half_patch_size : x;
+  x_left = (x_left >= width - half_patch_size) ? width - half_patch_size - 1 : x_left;
+  x_right = (x + 1 < half_patch_size) ? half_patch_size : x + 1;
+  x_right = (x_right >= width - half_patch_size) ? width - half_patch_size - 1 : x_right;
+
+  // the center pixel itself adds nothing to the texture:
+  center_pixel = (int)rows[half_patch_size][x_left];
+#if defined(CV_SIMD_SSE2)
   {
-    for(y = 0; y < (int)imgHeight; y++) // we could divide imgHeight by 2 to speed things up
+    // the sums of absolute differences of the 11 columns of the left and the right patch, the other bytes of the
+    // loads are replaced by the center value so that they add nothing:
+    __m128i center = _mm_set1_epi8((char)center_pixel);
+    __m128i columns = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0);
+    __m128i acc = _mm_setzero_si128(), acc_right = _mm_setzero_si128(), v;
+    for(dy = 0; dy < SKY_PATCH_ROWS; dy++)
     {
-      ix = image_index(x,y);
-
-      threshold = (imgHeight * 41) / 100;
-      if(y <= threshold) // high in the image
-      {
-        value = getGradient(frame_buf, x, y);
-        if(value <= 4) // little gradient
-        {
-          U = (unsigned int)frame_buf[ix];
-
-          if(U <= 137)
-          {
-            Y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
-            if(Y <= (maxY * 30) / 100) // not very bright: was 59, now 30
-            {
-              V = (unsigned int)frame_buf[ix + 2];
-
-              if(V <= 143) // check this one: are the colors right?
-              {
-                threshold = (imgHeight * 29) / 100;
-                if(y <= threshold)
-                {
-                  if(value <= 3) // was 1
-                  {
-                    // sky
-                    // 70.0%
-                    setUncertainty(frame_buf2, ix, 30);
-                  }
-                  else
-                  {
-                    // ground
-                    // 77.6%
-                    groundPixel(frame_buf, ix);
-                    setUncertainty(frame_buf2, ix, 22);
-                  }
-                }
-                else
-                {
-                  // ground:
-                  // 87.76%
-                  groundPixel(frame_buf, ix);
-                  setUncertainty(frame_buf2, ix, 12);
-                }
-              }
-              else
-              {
-                // sky:
-                // 76,53%
-                setUncertainty(frame_buf2, ix, 23);
-              }
-            }
-            else
-            {
-              // sky
-              // 87.37% certainty
-              setUncertainty(frame_buf2, ix, 12);
-            }
-          }
-          else
-          {
-            // sky
-            // 93,45% certainty
-            setUncertainty(frame_buf2, ix, 6);
-          }
-        }
-        else
-        {
-          // more gradient
-          Y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
-          if(Y <= (maxY * 30) / 100) // not very bright: was 59, now 30
-          {
-            U = (unsigned int)frame_buf[ix];
-            if(U <= 141)
-            {
-              // ground:
-              // 92.0%
-              groundPixel(frame_buf, ix);
-              setUncertainty(frame_buf2, ix, 8);
-            }
-            else
-            {
-              if(U <= 152)
-              {
-                threshold = (imgHeight * 21) / 100;
-                if(y <= threshold)
-                {
-                  // sky:
-                  // 67.7%
-                  setUncertainty(frame_buf2, ix, 32);
-                }
-                else
-                {
-                  // ground:
-                  // 80.0%
-                  groundPixel(frame_buf, ix);
-                  setUncertainty(frame_buf2, ix, 20);
-                }
-              }
-              else
-              {
-                // sky
-                // 74.5%
-                setUncertainty(frame_buf2, ix, 25);
-              }
-            }
-          }
-          else
-          {
-            U = (unsigned int)frame_buf[ix];
-            if(U <= 135)
-            {
-              if(value <= 28) // medium gradient:
-              {
-                if(Y <= (maxY * 75) / 100)
-                {
-                  // ground:
-                  // 71.5%
-                  groundPixel(frame_buf, ix);
-                  setUncertainty(frame_buf2, ix, 28);
-                }
-                else
-                {
-                  //sky:
-                  // 74.1% certainty
-                  setUncertainty(frame_buf2, ix, 26);
-                }
-              }
-              else
-              {
-                // high gradient:
-                // ground
-                // 78.6%
-                groundPixel(frame_buf, ix);
-                setUncertainty(frame_buf2, ix, 21);
-              }
-            }
-            else
-            {
-              // sky
-              // 79.5%
-              setUncertainty(frame_buf2, ix, 20);
-            }
-          }
+      row = rows[dy];
+      v = _mm_loadu_si128((__m128i *)&row[x_left - half_patch_size]);
+      v = _mm_or_si128(_mm_and_si128(v, columns), _mm_andnot_si128(columns, center));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, center));
+      v = _mm_loadu_si128((__m128i *)&row[x_left - half_patch_size + 1]);
+      v = _mm_or_si128(_mm_and_si128(v, columns), _mm_andnot_si128(columns, center));
+      acc_right = _mm_add_epi64(acc_right, _mm_sad_epu8(v, center));
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    sum_right = _mm_cvtsi128_si32(acc_right) + _mm_cvtsi128_si32(_mm_srli_si128(acc_right, 8)) - sum;
+    if(x_right == x_left) sum_right = 0;
+  }
+#elif defined(CV_SIMD_NEON)
+  {
+    static const unsigned char patch_columns[16] = {255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0, 0, 0, 0, 0};
+    uint8x16_t center = vdupq_n_u8((unsigned char)center_pixel);
+    uint8x16_t columns = vld1q_u8(patch_columns);
+    uint16x8_t acc = vdupq_n_u16(0), acc_right = vdupq_n_u16(0);
+    uint64x2_t s;
+    for(dy = 0; dy < SKY_PATCH_ROWS; dy++)
+    {
+      row = rows[dy];
+      acc = vpadalq_u8(acc, vandq_u8(vabdq_u8(vld1q_u8(&row[x_left - half_patch_size]), center), columns));
+      acc_right = vpadalq_u8(acc_right, vandq_u8(vabdq_u8(vld1q_u8(&row[x_left - half_patch_size + 1]), center), columns));
+    }
+    s = vpaddlq_u32(vpaddlq_u16(acc));
+    sum = (int)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+    s = vpaddlq_u32(vpaddlq_u16(acc_right));
+    sum_right = (int)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1)) - sum;
+    if(x_right == x_left) sum_right = 0;
+  }
+#else
+  sum = 0;
+  sum_right = 0;
+  for(dy = 0; dy < SKY_PATCH_ROWS; dy++)
+  {
+    row = rows[dy];
+    xx = x_left - half_patch_size;
+    if(xx & 1)
+    {
+      sum += abs((int)row[xx] - center_pixel);
+      xx++;
+    }
+    for(; xx < x_left + half_patch_size; xx += 2)
+    {
+      sum += 2 * abs((int)row[xx] - center_pixel);
+    }
+    if(xx == x_left + half_patch_size)
+    {
+      sum += abs((int)row[xx] - center_pixel);
+    }
+    // x_left is even when the patches differ, so both pixels have the same center value:
+    if(x_right != x_left)
+    {
+      sum_right += abs((int)row[x_left + half_patch_size + 1] - center_pixel) - abs((int)row[x_left - half_patch_size] - center_pixel);
+    }
+  }
+#endif
+  texture[0] = sum / (SKY_PATCH_SIZE * SKY_PATCH_SIZE - 1);
+  texture[1] = (sum + sum_right) / (SKY_PATCH_SIZE * SKY_PATCH_SIZE - 1);
+}
 
-        }
-      }
-      else
-      {
-        threshold = (imgHeight * 57) / 100;
-        if(y <= threshold)
-        {
-          Y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
-          if(Y <= (maxY * 58) / 100)
-          {
-            // ground
-            // 94.5%
-            groundPixel(frame_buf, ix);
-            setUncertainty(frame_buf2, ix, 5);
-          }
-          else
-          {
-            value = getGradient(frame_buf, x, y);
-            if(value <= 16)
-            {
-              V = (unsigned int)frame_buf[ix + 2];
-              if(V <= 118)
-              {
-                // sky
-                // 85.1%
-                setUncertainty(frame_buf2, ix, 15);
-              }
-              else
-              {
-                threshold = (imgHeight * 47) / 100;
-                if(y <= threshold)
-                {
-                  // sky:
-                  // 70.3%
-                  setUncertainty(frame_buf2, ix, 29);
-                }
-                else
-                {
-                  // ground:
-                  // 71.9%
-                  groundPixel(frame_buf, ix);
-                  setUncertainty(frame_buf2, ix, 28);
-                }
-              }
-            }
-            else
-            {
-              // ground
-              // 84.2%
-              groundPixel(frame_buf, ix);
-              setUncertainty(frame_buf2, ix, 16);
-            }
-          }
-        }
-        else
-        {
-          // ground: 98,74%
-          groundPixel(frame_buf, ix);
-          setUncertainty(frame_buf2, ix, 1);
-        }
-      }
+// the luma rows around the row that is segmented and the position of the batch, the data of computeSkyFeature:
+struct sky_tree_rows
+{
+  unsigned char *frame_buf;
+  unsigned char *ring;                  // luma ring of SKY_PATCH_ROWS rows, image row y is kept in y % SKY_PATCH_ROWS
+  int ring_y[SKY_PATCH_ROWS];           // the image row in every row of the ring, -1 if none
+  unsigned char *rows[SKY_PATCH_ROWS];  // patch rows around the (corrected) center row
+  unsigned char *luma;
+  unsigned char *luma_up;
+  unsigned char *luma_down;
+  short *features[SKY_N_FEATURES];      // features of the whole row, except the patch texture
+  struct sky_integral *integral;        // tables of the patch means
+  int done;                             // bit f is set when features[f] holds the current row
+  int x;                                // first pixel of the batch
+  int y;
+  int center_y;                         // the (corrected) center row of the patches
+  int width;
+  int height;
+};
+
+// fill the rows first up to last of the luma ring that it does not hold yet. Luma is only read for the rows that
+// a feature of the tree needs, rows that are classified on their position alone are never read.
+static void skyLumaRows(struct sky_tree_rows *rows, int first, int last)
+{
+  int y;
+  for(y = first; y <= last; y++)
+  {
+    if(rows->ring_y[y % SKY_PATCH_ROWS] != y)
+    {
+      skyLumaRow(rows->frame_buf, rows->width, y, &rows->ring[(y % SKY_PATCH_ROWS) * rows->width]);
+      rows->ring_y[y % SKY_PATCH_ROWS] = y;
     }
   }
 }
 
-extern void segment_no_yco(unsigned char *frame_buf, unsigned char *frame_buf2)
+// widen a row of luma to the feature values:
+static void skyLumaValues(const unsigned char *luma, short *values, int w)
 {
-  // use a pre-defined tree to segment the image:
-  // the second buffer (image) stores the uncertainties between 0 and 100.
-  int x, y, maxY, patch_size, patch_texture;
-  int FD_YCV, FD_CV;
-  unsigned int ix, Y, Cr;
+  int x = 0;
+#if defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  for(; x + 16 <= w; x += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&luma[x]);
+    _mm_storeu_si128((__m128i *)&values[x], _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i *)&values[x + 8], _mm_unpackhi_epi8(v, zero));
+  }
+#elif defined(CV_SIMD_NEON)
+  for(; x + 16 <= w; x += 16)
+  {
+    uint8x16_t v = vld1q_u8(&luma[x]);
+    vst1q_s16(&values[x], vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))));
+    vst1q_s16(&values[x + 8], vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))));
+  }
+#endif
+  for(; x < w; x++) values[x] = luma[x];
+}
 
-  // global variables, so that they are calculated / initialized only once:
-  maxY = getMaximumY(frame_buf);
-  patch_size = 10;
+// the chroma byte at offset (0 for U, 2 for V) of every macropixel of a row, for both of its pixels:
+static void skyChromaValues(const unsigned char *buf, int offset, short *values, int w)
+{
+  int x = 0;
+#if defined(CV_SIMD_SSE2)
+  __m128i byte = _mm_set1_epi32(0xFF);
+  for(; x + 8 <= w; x += 8)
+  {
+    __m128i c = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((__m128i *)&buf[x * 2]), 8 * offset), byte);
+    _mm_storeu_si128((__m128i *)&values[x], _mm_or_si128(c, _mm_slli_epi32(c, 16)));
+  }
+#elif defined(CV_SIMD_NEON)
+  for(; x + 16 <= w; x += 16)
+  {
+    uint8x8x4_t p = vld4_u8(&buf[x * 2]);
+    uint16x8_t c = vmovl_u8(offset == 0 ? p.val[0] : p.val[2]);
+    uint16x8x2_t z = vzipq_u16(c, c);
+    vst1q_s16(&values[x], vreinterpretq_s16_u16(z.val[0]));
+    vst1q_s16(&values[x + 8], vreinterpretq_s16_u16(z.val[1]));
+  }
+#endif
+  for(; x < w; x += 2) values[x] = values[x+1] = buf[x*2 + offset];
+}
 
-  for(x = 0; x < (int)imgWidth; x++)
+// add the vertical gradient |down - up| to the absolute horizontal gradient in values:
+static void skyGradientValues(const unsigned char *up, const unsigned char *down, short *values, int w)
+{
+  int x = 0;
+#if defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  for(; x + 8 <= w; x += 8)
   {
-    for(y = 0; y < (int)imgHeight; y++)
-    {
-      ix =image_index(x,y);
+    __m128i g = _mm_loadu_si128((__m128i *)&values[x]);
+    __m128i u = _mm_loadl_epi64((__m128i *)&up[x]);
+    __m128i d = _mm_loadl_epi64((__m128i *)&down[x]);
+    g = _mm_max_epi16(g, _mm_sub_epi16(zero, g));
+    d = _mm_or_si128(_mm_subs_epu8(u, d), _mm_subs_epu8(d, u));
+    _mm_storeu_si128((__m128i *)&values[x], _mm_add_epi16(g, _mm_unpacklo_epi8(d, zero)));
+  }
+#elif defined(CV_SIMD_NEON)
+  for(; x + 8 <= w; x += 8)
+  {
+    int16x8_t g = vabsq_s16(vld1q_s16(&values[x]));
+    uint8x8_t d = vabd_u8(vld1_u8(&up[x]), vld1_u8(&down[x]));
+    vst1q_s16(&values[x], vaddq_s16(g, vreinterpretq_s16_u16(vmovl_u8(d))));
+  }
+#endif
+  for(; x < w; x++)
+  {
+    values[x] = abs(values[x]) + abs((int)down[x] - (int)up[x]);
+  }
+}
 
-      FD_YCV = get_FD_YCV(frame_buf, x, y);
-      if(FD_YCV <= 10)
+// determine a feature for every pixel of the row, see the feature extraction functions above:
+static void skyFeatureRow(struct sky_tree_rows *rows, int feature)
+{
+  short *values = rows->features[feature];
+  unsigned char *luma = rows->luma;
+  unsigned char *buf = &rows->frame_buf[sky_index(0, rows->y, rows->width)];
+  int x, w, u, v;
+  unsigned int Y, Cb, Cr;
+  w = rows->width;
+
+  if(feature == SKY_FEATURE_Y || feature == SKY_FEATURE_GRADIENT || feature == SKY_FEATURE_FD_YCV)
+  {
+    skyLumaRows(rows, (rows->y > 0) ? rows->y - 1 : 0, (rows->y < rows->height - 1) ? rows->y + 1 : rows->y);
+  }
+  switch(feature)
+  {
+    case SKY_FEATURE_Y:
+      skyLumaValues(luma, values, w);
+      break;
+    case SKY_FEATURE_U:
+      skyChromaValues(buf, 0, values, w);
+      break;
+    case SKY_FEATURE_V:
+      skyChromaValues(buf, 2, values, w);
+      break;
+    case SKY_FEATURE_GRADIENT:
+      // currently we use [0 0 0; -1 0 1; 0 0 0] as mask for dx, the borders are handled as in getGradientPixel:
+      image_filter_row_u8(luma, 1, values, w, &sky_gradient_dx);
+      skyGradientValues(rows->luma_up, rows->luma_down, values, w);
+      break;
+    case SKY_FEATURE_FD_YCV:
+      for(x = 0; x < w; x += 2)
       {
-        Cr = (unsigned int)frame_buf[ix+2];
-        if(Cr <= 153)
-        {
-          FD_YCV = get_FD_YCV(frame_buf, x, y);
-          if(FD_YCV <= -125)
-          {
-            // ground: 98%
-            setUncertainty(frame_buf2, ix, 2);
-            groundPixel(frame_buf, ix);
-          }
-          else
-          {
-            patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-            if(patch_texture <= 4)
-            {
-              Cr = (unsigned int)frame_buf[ix+2];
-              if(Cr <= 129)
-              {
-                // sky: 74%
-                setUncertainty(frame_buf2, ix, 26);
-              }
-              else
-              {
-                // ground: 75%
-                setUncertainty(frame_buf2, ix, 25);
-                groundPixel(frame_buf, ix);
-              }
-            }
-            else
-            {
-              // ground: 90%
-              setUncertainty(frame_buf2, ix, 10);
-              groundPixel(frame_buf, ix);
-            }
-          }
-        }
-        else
-        {
-          patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-          if(patch_texture <= 7)
-          {
-            // sky: 69%
-            setUncertainty(frame_buf2, ix, 31);
-          }
-          else
-          {
-            // ground: 88%
-            setUncertainty(frame_buf2, ix, 12);
-            groundPixel(frame_buf, ix);
-          }
-        }
+        Y = luma[x];
+        Cb = (unsigned int)buf[x*2];
+        Cr = (unsigned int)buf[x*2+2];
+        values[x] = values[x+1] = (860 * (int)Y - 501 * (int) Cr + 2550 * (int) Cb) / 255 - 1545;
       }
-      else
+      break;
+    case SKY_FEATURE_FD_CV:
+      for(x = 0; x < w; x += 2)
       {
-        patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-        if(patch_texture <= 7)
-        {
-          FD_CV = get_FD_CV(frame_buf, x, y);
-          if(FD_CV <= -83)
-          {
-            // ground: 67%
-            setUncertainty(frame_buf2, ix, 33);
-            groundPixel(frame_buf, ix);
-          }
-          else
-          {
-            // sky: 90%
-            setUncertainty(frame_buf2, ix, 10);
-          }
-        }
-        else
-        {
-          FD_YCV = get_FD_YCV(frame_buf, x, y);
-          if(FD_YCV <= 164)
-          {
-            patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-            if(patch_texture <= 13)
-            {
-              FD_CV = get_FD_CV(frame_buf, x, y);
-              if(FD_CV <= -52)
-              {
-                // ground: 79%
-                setUncertainty(frame_buf2, ix, 21);
-                groundPixel(frame_buf, ix);
-              }
-              else
-              {
-                Y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
-                if(Y <= (unsigned int)(maxY * 60) / 100)
-                {
-                  // ground: 76%
-                  setUncertainty(frame_buf2, ix, 24);
-                  groundPixel(frame_buf, ix);
-                }
-                else
-                {
-                  // sky: 71%
-                  setUncertainty(frame_buf2, ix, 29);
-                }
-              }
-            }
-            else
-            {
-              // ground: 84%
-              setUncertainty(frame_buf2, ix, 16);
-              groundPixel(frame_buf, ix);
-            }
-          }
-          else
-          {
-            // sky: 76%
-            setUncertainty(frame_buf2, ix, 24);
-          }
-        }
+        Cb = (unsigned int)buf[x*2];
+        Cr = (unsigned int)buf[x*2+2];
+        values[x] = values[x+1] = (1975 * (int) Cb - 446 * (int) Cr) / 255 - 818;
       }
-    }
+      break;
+    case SKY_FEATURE_PATCH_Y:
+      for(x = 0; x < w; x++)
+      {
+        values[x] = getPatchMeanIntegral(rows->integral, x, rows->y, SKY_PATCH_SIZE);
+      }
+      break;
+    case SKY_FEATURE_PATCH_U:
+    case SKY_FEATURE_PATCH_V:
+      for(x = 0; x < w; x++)
+      {
+        getPatchChromaIntegral(rows->integral, x, rows->y, SKY_PATCH_SIZE, &u, &v);
+        values[x] = (feature == SKY_FEATURE_PATCH_U) ? u : v;
+      }
+      break;
   }
 }
 
-extern void segment_no_yco_AdjustTree(unsigned char *frame_buf, unsigned char *frame_buf2, int adjust_factor)
+// determine a feature for the pixels of a batch. The patch texture is expensive, so it is only determined for the
+// macropixels of the lanes. The other features are determined for the whole row the first time a batch of the row
+// needs them, rows that the tree classifies on their position alone never compute them.
+static void computeSkyFeature(struct sky_tree_batch* batch, int feature, unsigned short lanes)
 {
-  // use a pre-defined tree to segment the image:
-  // the second buffer (image) stores the uncertainties between 0 and 100.
-  int x, y, maxY, adjust_rel_Y, patch_size, patch_texture, adjust_patch_texture, adjust_Cr, FD_YCV, adjust_FD_YCV, FD_CV, adjust_FD_CV;
-  unsigned int ix, Y, Cr;
-
-  // global variables, so that they are calculated / initialized only once:
-  maxY = getMaximumY(frame_buf);
-  patch_size = 10;
-
-  // variables for adjusting thresholds:
-  adjust_Cr = adjust_factor * 3;
-  adjust_rel_Y = adjust_factor * -5;
-  adjust_patch_texture = adjust_factor * 2;
-  adjust_FD_YCV = adjust_factor * -48;
-  adjust_FD_CV = adjust_factor * -48;
+  struct sky_tree_rows *rows = (struct sky_tree_rows *) batch->data;
+  int l, texture[2];
 
-
-  for(x = 0; x < (int)imgWidth; x++)
+  if(feature != SKY_FEATURE_PATCH_TEXTURE)
   {
-    for(y = 0; y < (int)imgHeight; y++)
+    if(!(rows->done & (1 << feature)))
     {
-      ix = image_index(x,y);
+      skyFeatureRow(rows, feature);
+      rows->done |= 1 << feature;
+    }
+    batch->feature[feature] = &rows->features[feature][rows->x];
+    batch->computed[feature] = 0xFFFF;
+    return;
+  }
 
-      FD_YCV = get_FD_YCV(frame_buf, x, y);
-      if(FD_YCV <= 58 + adjust_FD_YCV)
-      {
-        Cr = (unsigned int)frame_buf[ix+2];
-        if(Cr <= 150 + (unsigned int)adjust_Cr)
-        {
-          FD_YCV = get_FD_YCV(frame_buf, x, y);
-          if(FD_YCV <= -77 + adjust_FD_YCV)
-          {
-            // ground: 98%
-            setUncertainty(frame_buf2, ix, 2);
-            groundPixel(frame_buf, ix);
-          }
-          else
-          {
-            patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-            if(patch_texture <= 2 + adjust_patch_texture)
-            {
-              Cr = (unsigned int)frame_buf[ix+2];
-              if(Cr <= 126 + (unsigned int)adjust_Cr)
-              {
-                // sky: 74%
-                setUncertainty(frame_buf2, ix, 26);
-              }
-              else
-              {
-                // ground: 75%
-                setUncertainty(frame_buf2, ix, 25);
-                groundPixel(frame_buf, ix);
-              }
-            }
-            else
-            {
-              // ground: 90%
-              setUncertainty(frame_buf2, ix, 10);
-              groundPixel(frame_buf, ix);
-            }
-          }
-        }
-        else
-        {
-          patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-          if(patch_texture <= 4 + adjust_patch_texture)
-          {
-            // sky: 69%
-            setUncertainty(frame_buf2, ix, 31);
-          }
-          else
-          {
-            // ground: 88%
-            setUncertainty(frame_buf2, ix, 12);
-            groundPixel(frame_buf, ix);
-          }
-        }
-      }
-      else
-      {
-        patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-        if(patch_texture <= 5 + adjust_patch_texture)
-        {
-          FD_CV = get_FD_CV(frame_buf, x, y);
-          if(FD_CV <= -51 + adjust_FD_CV)
-          {
-            // ground: 67%
-            setUncertainty(frame_buf2, ix, 33);
-            groundPixel(frame_buf, ix);
-          }
-          else
-          {
-            // sky: 90%
-            setUncertainty(frame_buf2, ix, 10);
-          }
-        }
-        else
-        {
-          FD_YCV = get_FD_YCV(frame_buf, x, y);
-          if(FD_YCV <= 212 + adjust_FD_YCV)
-          {
-            patch_texture = getPatchTexture(frame_buf, x, y, patch_size);
-            if(patch_texture <= 11 + adjust_patch_texture)
-            {
-              FD_CV = get_FD_CV(frame_buf, x, y);
-              if(FD_CV <= -19 + adjust_FD_CV)
-              {
-                // ground: 79%
-                setUncertainty(frame_buf2, ix, 21);
-                groundPixel(frame_buf, ix);
-              }
-              else
-              {
-                Y = (((unsigned int)frame_buf[ix+1] + (unsigned int)frame_buf[ix+3])) >> 1;
-                if(Y <= (unsigned int)(maxY * 66) / 100 + adjust_rel_Y)
-                {
-                  // ground: 76%
-                  setUncertainty(frame_buf2, ix, 24);
-                  groundPixel(frame_buf, ix);
-                }
-                else
-                {
-                  // sky: 71%
-                  setUncertainty(frame_buf2, ix, 29);
-                }
-              }
-            }
-            else
-            {
-              // ground: 84%
-              setUncertainty(frame_buf2, ix, 16);
-              groundPixel(frame_buf, ix);
-            }
-          }
-          else
-          {
-            // sky: 76%
-            setUncertainty(frame_buf2, ix, 24);
-          }
-        }
-      }
+  if(!(rows->done & (1 << feature)))
+  {
+    skyLumaRows(rows, rows->center_y - SKY_PATCH_SIZE / 2, rows->center_y + SKY_PATCH_SIZE / 2);
+    rows->done |= 1 << feature;
+  }
+  batch->feature[feature] = batch->values[feature];
+  for(l = 0; l < SKY_TREE_BATCH; l += 2)
+  {
+    if(lanes & (3 << l))
+    {
+      skyPatchTextures(rows->rows, rows->width, rows->x + l, texture);
+      batch->values[feature][l] = texture[0];
+      batch->values[feature][l+1] = texture[1];
     }
   }
 }
 
-void getObstacles(unsigned int* obstacles, unsigned int n_bins, unsigned char *frame_buf, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL)
+int initSkyMask(struct sky_mask* mask, unsigned int width, unsigned int height)
 {
-  unsigned int x,y,ix,GRND, bin_size, bin, HALF_HEIGHT, bin_surface;
-  // reset obstacles values
-  for(bin = 0; bin < n_bins; bin++)
+  mask->width = width;
+  mask->height = height;
+  mask->words_per_row = (width + SKY_MASK_WORD_BITS - 1) / SKY_MASK_WORD_BITS;
+  mask->ground = (unsigned int *) calloc(mask->words_per_row * height, sizeof(unsigned int));
+  mask->uncertainty = (unsigned char *) calloc(((width + 1) / 2) * height, sizeof(unsigned char));
+  if(mask->ground == 0 || mask->uncertainty == 0)
   {
-    obstacles[bin] = 0;
+    freeSkyMask(mask);
+    return SKY_TREE_INVALID;
   }
-  bin_size = imgWidth / n_bins;
-  HALF_HEIGHT = imgHeight / 2;
-  bin_surface = bin_size * HALF_HEIGHT;
-  GRND = 0x00;
-  // frame_buf contains the segmented image. All non-zero elements are sky.
-  // This function assumes no pitch and roll.
-  for(x = 0; x < imgWidth; x++)
+  return SKY_TREE_OK;
+}
+
+void freeSkyMask(struct sky_mask* mask)
+{
+  free(mask->ground);
+  free(mask->uncertainty);
+  mask->ground = 0;
+  mask->uncertainty = 0;
+}
+
+// write the uncertainty of the macropixels of a row as setUncertainty does, returns the amount of pixels done:
+static unsigned int skyUncertaintyRow(const unsigned char *uncertainty, unsigned char *pixel, unsigned int width)
+{
+  unsigned int x = 0;
+#if defined(CV_SIMD_SSE2)
+  __m128i gray = _mm_set1_epi8(127), u, uu;
+  for(; x + 32 <= width; x += 32, pixel += 64)
   {
-    for(y = 0; y < HALF_HEIGHT; y++)
+    u = _mm_loadu_si128((__m128i *)&uncertainty[x / 2]);
+    uu = _mm_unpacklo_epi8(u, u);
+    _mm_storeu_si128((__m128i *)pixel, _mm_unpacklo_epi8(gray, uu));
+    _mm_storeu_si128((__m128i *)&pixel[16], _mm_unpackhi_epi8(gray, uu));
+    uu = _mm_unpackhi_epi8(u, u);
+    _mm_storeu_si128((__m128i *)&pixel[32], _mm_unpacklo_epi8(gray, uu));
+    _mm_storeu_si128((__m128i *)&pixel[48], _mm_unpackhi_epi8(gray, uu));
+  }
+#elif defined(CV_SIMD_NEON)
+  uint8x16x2_t p;
+  p.val[0] = vdupq_n_u8(127);
+  for(; x + 32 <= width; x += 32, pixel += 64)
+  {
+    uint8x16x2_t uu = vzipq_u8(vld1q_u8(&uncertainty[x / 2]), vld1q_u8(&uncertainty[x / 2]));
+    p.val[1] = uu.val[0];
+    vst2q_u8(pixel, p);
+    p.val[1] = uu.val[1];
+    vst2q_u8(&pixel[32], p);
+  }
+#endif
+  return x;
+}
+
+void drawSkyMask(unsigned char *frame_buf, unsigned char *frame_buf2, struct sky_mask* mask)
+{
+  // paints the ground black in frame_buf and the uncertainty in frame_buf2, as the segmentation used to do:
+  // The macropixels of a row are walked with the pointers, the ground bits a word at a time: a word that is all
+  // ground is cleared at once and a word without ground is skipped.
+  unsigned int x, y, n, ground;
+  unsigned int *ground_row;
+  unsigned char *uncertainty_row, *pixel, *pixel2;
+
+  for(y = 0; y < mask->height; y++)
+  {
+    ground_row = &mask->ground[y * mask->words_per_row];
+    uncertainty_row = &mask->uncertainty[y * ((mask->width + 1) / 2)];
+    pixel = &frame_buf[sky_index(0, y, mask->width)];
+    pixel2 = &frame_buf2[sky_index(0, y, mask->width)];
+    x = skyUncertaintyRow(uncertainty_row, pixel2, mask->width);
+    for(pixel2 += 2 * x; x < mask->width; x += 2, pixel2 += 4)
     {
-      ix = image_index(x,y);
-      if(frame_buf[ix] == GRND) // Of course, the original image could also use black pixels - of which probably few in the sky
+      setUncertainty(pixel2, 0, uncertainty_row[x / 2]);
+    }
+    for(x = 0; x < mask->width; x += SKY_MASK_WORD_BITS, pixel += 2 * SKY_MASK_WORD_BITS)
+    {
+      ground = ground_row[x / SKY_MASK_WORD_BITS];
+      n = (mask->width - x < SKY_MASK_WORD_BITS) ? mask->width - x : SKY_MASK_WORD_BITS;
+      if(ground == 0xFFFFFFFF)
       {
-        bin = x / bin_size;
-        if(bin >= n_bins)
+        memset(pixel, 0, 2 * n);
+      }
+      else if(ground != 0)
+      {
+        for(n = 0; n < SKY_MASK_WORD_BITS && x + n < mask->width; n += 2)
         {
-          bin = n_bins-1;
+          if(ground & (1u << n)) groundPixel(pixel, 2 * n);
         }
-        obstacles[bin]++;
       }
     }
   }
-  // obstacles[bin] should have a maximum corresponding to MAX_SIGNAL
-  (*max_bin) = 0;
-  (*obstacle_total) = 0;
+}
 
-  for(bin = 0; bin < n_bins; bin++)
+static int initSkySegScratch(struct skyseg_ctx* ctx, unsigned int width, unsigned int height, const struct sky_tree* tree, int n_bands)
+{
+  // the scratch rows of every band, the feature rows are padded to whole batches:
+  memset(ctx, 0, sizeof(struct skyseg_ctx));
+  ctx->width = width;
+  ctx->height = height;
+  ctx->tree = tree;
+  ctx->n_bands = (n_bands < 1) ? 1 : ((n_bands > SKY_SEG_MAX_BANDS) ? SKY_SEG_MAX_BANDS : n_bands);
+  ctx->padded_width = (width + SKY_TREE_BATCH - 1) / SKY_TREE_BATCH * SKY_TREE_BATCH;
+  // the patches read whole vectors, which can reach 16 bytes past the last row of the ring:
+  ctx->luma_rows = (unsigned char *) malloc((ctx->n_bands * SKY_PATCH_ROWS * width + 16) * sizeof(unsigned char));
+  ctx->feature_rows = (short *) calloc(ctx->n_bands * SKY_N_FEATURES * ctx->padded_width, sizeof(short));
+  if(ctx->luma_rows == 0 || ctx->feature_rows == 0)
   {
-    obstacles[bin] *= MAX_SIGNAL;
-    obstacles[bin] /= bin_surface;
-    if(obstacles[bin] > (*max_bin))
-    {
-      (*max_bin) = obstacles[bin];
-    }
-    (*obstacle_total) += obstacles[bin];
+    free(ctx->luma_rows);
+    free(ctx->feature_rows);
+    ctx->luma_rows = 0;
+    ctx->feature_rows = 0;
+    return SKY_TREE_INVALID;
   }
-  (*obstacle_total) /= n_bins;
+  return SKY_TREE_OK;
 }
 
-void horizonToLineParameters(int pitch_pixel, int roll_angle, int* a, int* b)
+static void freeSkySegScratch(struct skyseg_ctx* ctx)
 {
-  (*b) = 1000 * (pitch_pixel + imgHeight / 2);
-  (*a) = -tan_zelf(roll_angle);
+  free(ctx->luma_rows);
+  free(ctx->feature_rows);
+  ctx->luma_rows = 0;
+  ctx->feature_rows = 0;
+  freeSkyIntegral(&ctx->integral);
 }
 
-void getObstacles2Way(unsigned int* obstacles, unsigned int n_bins, unsigned char *frame_buf, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle)
+static void *skysegWorker(void *data);
+
+static void startSkySegWorkers(struct skyseg_ctx* ctx)
 {
-  // procedure:
-  // 1) determine the horizon line on the basis of pitch and roll
-  // 2) determine the central point projected on the horizon line
-  // 3) determine the step_x in order to retain the same bin_size along the horizon line
-  // 4) run over the image from left to right in lines parallel to the horizon line
-  unsigned int ix,bin;
-  int a, b, halfWidth, halfHeight;
-  int i, x, y;
-  int x1, y1, x2, y2, RESOLUTION;
-  int a2, b2, x12, y12, bin_size, step_x;
-  int xx, yy, x_start;
-  int bin_surface;
-  halfWidth = imgWidth / 2;
-  halfHeight = imgHeight / 2;
+  // one worker per band after the first, the calling thread of skyseg_segment takes bands too. When the
+  // synchronisation or a thread cannot be made, the bands without a worker are segmented by the calling thread.
+  int i;
+  ctx->n_workers = 0;
+  if(ctx->n_bands < 2)
+  {
+    return;
+  }
+  if(pthread_mutex_init(&ctx->lock, 0) != 0)
+  {
+    return;
+  }
+  if(pthread_cond_init(&ctx->start, 0) != 0)
+  {
+    pthread_mutex_destroy(&ctx->lock);
+    return;
+  }
+  if(pthread_cond_init(&ctx->done, 0) != 0)
+  {
+    pthread_cond_destroy(&ctx->start);
+    pthread_mutex_destroy(&ctx->lock);
+    return;
+  }
+  for(i = 0; i < ctx->n_bands - 1; i++)
+  {
+    if(pthread_create(&ctx->workers[ctx->n_workers], 0, skysegWorker, ctx) == 0)
+    {
+      ctx->n_workers++;
+    }
+  }
+  if(ctx->n_workers == 0)
+  {
+    pthread_cond_destroy(&ctx->done);
+    pthread_cond_destroy(&ctx->start);
+    pthread_mutex_destroy(&ctx->lock);
+  }
+}
+
+static void stopSkySegWorkers(struct skyseg_ctx* ctx)
+{
+  int i;
+  if(ctx->n_workers == 0)
+  {
+    return;
+  }
+  pthread_mutex_lock(&ctx->lock);
+  ctx->quit = 1;
+  pthread_cond_broadcast(&ctx->start);
+  pthread_mutex_unlock(&ctx->lock);
+  for(i = 0; i < ctx->n_workers; i++)
+  {
+    pthread_join(ctx->workers[i], 0);
+  }
+  pthread_cond_destroy(&ctx->done);
+  pthread_cond_destroy(&ctx->start);
+  pthread_mutex_destroy(&ctx->lock);
+  ctx->n_workers = 0;
+}
+
+int skyseg_init(struct skyseg_ctx* ctx, unsigned int width, unsigned int height, const struct sky_tree* tree, int n_bands)
+{
+  if(initSkySegScratch(ctx, width, height, tree, n_bands) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+  if(initSkyMask(&ctx->mask, width, height) != SKY_TREE_OK)
+  {
+    freeSkySegScratch(ctx);
+    return SKY_TREE_INVALID;
+  }
+  startSkySegWorkers(ctx);
+  return SKY_TREE_OK;
+}
+
+void skyseg_free(struct skyseg_ctx* ctx)
+{
+  stopSkySegWorkers(ctx);
+  freeSkySegScratch(ctx);
+  freeSkyMask(&ctx->mask);
+  freeHorizonCache(&ctx->horizon);
+}
+
+int skyseg_begin_frame(struct skyseg_ctx* ctx, unsigned char *frame_buf, int adjust_factor)
+{
+  // the maximal illuminance is used in almost all trees, so it is calculated once:
+  int n;
+  if(compileSkyTree(ctx->tree, &ctx->compiled, skyMaximumY(frame_buf, ctx->width, ctx->height), ctx->height, adjust_factor) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+  // the patch means come from the summed-area tables of the frame, which are only made for trees that test them:
+  for(n = 0; n < ctx->compiled.n_nodes; n++)
+  {
+    if(ctx->compiled.feature[n] >= SKY_FEATURE_PATCH_Y)
+    {
+      if(ctx->integral.row == 0 && initSkyIntegral(&ctx->integral, ctx->width, ctx->height) != SKY_TREE_OK)
+      {
+        return SKY_TREE_INVALID;
+      }
+      computeSkyIntegral(frame_buf, &ctx->integral);
+      break;
+    }
+  }
+  return SKY_TREE_OK;
+}
+
+void skyseg_segment_band(struct skyseg_ctx* ctx, unsigned char *frame_buf, int band)
+{
+  // The rows of the band are segmented one by one, in batches of SKY_TREE_BATCH pixels. The luma of the rows around
+  // the current row is kept in a ring that is filled when a feature first needs a row. Both pixels of a macropixel
+  // are classified, the macropixel is ground if one of them is ground and gets the uncertainty of the right pixel.
+  int x, y, l, i, n, center_y, y_start, y_end, width, height;
+  int half_patch_size = SKY_PATCH_SIZE / 2;
+  unsigned int *ground_row, ground;
+  unsigned char *uncertainty_row;
+  unsigned short lanes;
+  unsigned char *luma_ring;
+  struct sky_tree_batch batch;
+  struct sky_tree_rows rows;
+
+  width = (int)ctx->width;
+  height = (int)ctx->height;
+  y_start = band * height / ctx->n_bands;
+  y_end = (band + 1) * height / ctx->n_bands;
+  luma_ring = &ctx->luma_rows[band * SKY_PATCH_ROWS * width];
+  for(i = 0; i < SKY_N_FEATURES; i++)
+  {
+    rows.features[i] = &ctx->feature_rows[(band * SKY_N_FEATURES + i) * ctx->padded_width];
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  batch.compute = computeSkyFeature;
+  batch.data = &rows;
+  rows.frame_buf = frame_buf;
+  rows.integral = &ctx->integral;
+  rows.ring = luma_ring;
+  for(i = 0; i < SKY_PATCH_ROWS; i++)
+  {
+    rows.ring_y[i] = -1;
+  }
+  rows.width = width;
+  rows.height = height;
+
+  for(y = y_start; y < y_end; y++)
+  {
+    // the luma rows of the patches, which are read when a feature needs them:
+    center_y = (y < half_patch_size) ? half_patch_size : y;
+    center_y = (center_y >= height - half_patch_size) ? height - half_patch_size - 1 : center_y;
+    for(i = 0; i < SKY_PATCH_ROWS; i++)
+    {
+      rows.rows[i] = &luma_ring[((center_y - half_patch_size + i) % SKY_PATCH_ROWS) * width];
+    }
+    rows.luma = &luma_ring[(y % SKY_PATCH_ROWS) * width];
+    rows.luma_up = (y > 0) ? &luma_ring[((y - 1) % SKY_PATCH_ROWS) * width] : rows.luma;
+    rows.luma_down = (y < height - 1) ? &luma_ring[((y + 1) % SKY_PATCH_ROWS) * width] : rows.luma;
+    rows.y = y;
+    rows.center_y = center_y;
+    rows.done = 0;
+    batch.row = y;
+    ground_row = &ctx->mask.ground[y * ctx->mask.words_per_row];
+    uncertainty_row = &ctx->mask.uncertainty[y * ((width + 1) / 2)];
+    memset(ground_row, 0, ctx->mask.words_per_row * sizeof(unsigned int));
+
+    for(x = 0; x < width; x += SKY_TREE_BATCH)
+    {
+      n = (width - x < SKY_TREE_BATCH) ? width - x : SKY_TREE_BATCH;
+      lanes = (unsigned short)((1 << n) - 1);
+      rows.x = x;
+      // when the previous batch was classified on the row alone, so is this one:
+      if(x == 0 || rows.done != 0)
+      {
+        // the features that are already determined for the row only need to be pointed at:
+        for(i = 0; i < SKY_N_FEATURES; i++)
+        {
+          batch.feature[i] = &rows.features[i][x];
+          batch.computed[i] = (rows.done & (1 << i)) ? 0xFFFF : 0;
+        }
+        batch.computed[SKY_FEATURE_PATCH_TEXTURE] = 0;
+        classifySkyTreeBatch(&ctx->compiled, &batch, lanes);
+      }
+
+      for(l = 0; l < n; l += 2)
+      {
+        uncertainty_row[(x + l) / 2] = batch.uncertainty[l + 1];
+      }
+      // both bits of a macropixel are set when one of its pixels is ground:
+      ground = batch.ground & lanes;
+      ground = (ground | (ground >> 1)) & 0x5555;
+      ground |= ground << 1;
+      ground_row[x / SKY_MASK_WORD_BITS] |= ground << (x % SKY_MASK_WORD_BITS);
+    }
+  }
+}
+
+static void segmentSkySegBands(struct skyseg_ctx* ctx)
+{
+  // takes the bands of the frame that are left, with ctx->lock held, and reports when the last one is done:
+  int band;
+  while(ctx->next_band < ctx->n_bands)
+  {
+    band = ctx->next_band++;
+    pthread_mutex_unlock(&ctx->lock);
+    skyseg_segment_band(ctx, ctx->frame_buf, band);
+    pthread_mutex_lock(&ctx->lock);
+    if(--ctx->pending == 0)
+    {
+      pthread_cond_signal(&ctx->done);
+    }
+  }
+}
+
+static void *skysegWorker(void *data)
+{
+  // waits for a new frame of skyseg_segment and helps with its bands, until skyseg_free:
+  struct skyseg_ctx* ctx = (struct skyseg_ctx *) data;
+  unsigned int frame;
+
+  pthread_mutex_lock(&ctx->lock);
+  frame = ctx->frame;
+  while(1)
+  {
+    while(!ctx->quit && ctx->frame == frame)
+    {
+      pthread_cond_wait(&ctx->start, &ctx->lock);
+    }
+    if(ctx->quit)
+    {
+      break;
+    }
+    frame = ctx->frame;
+    segmentSkySegBands(ctx);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+int skyseg_segment(struct skyseg_ctx* ctx, unsigned char *frame_buf, int adjust_factor)
+{
+  // the bands are handed out to the workers of the context and the calling thread, which waits for the last one:
+  int band;
+
+  if(skyseg_begin_frame(ctx, frame_buf, adjust_factor) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+  if(ctx->n_workers == 0)
+  {
+    for(band = 0; band < ctx->n_bands; band++)
+    {
+      skyseg_segment_band(ctx, frame_buf, band);
+    }
+    return SKY_TREE_OK;
+  }
+  pthread_mutex_lock(&ctx->lock);
+  ctx->frame_buf = frame_buf;
+  ctx->next_band = 0;
+  ctx->pending = ctx->n_bands;
+  ctx->frame++;
+  pthread_cond_broadcast(&ctx->start);
+  segmentSkySegBands(ctx);
+  while(ctx->pending > 0)
+  {
+    pthread_cond_wait(&ctx->done, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return SKY_TREE_OK;
+}
+
+static int segmentSkyMask(unsigned char *frame_buf, struct sky_mask* mask, const struct sky_tree* tree, int adjust_factor)
+{
+  // segments an image of the size of the mask in a single band, with the mask as output:
+  struct skyseg_ctx ctx;
+  int result;
+
+  if(initSkySegScratch(&ctx, mask->width, mask->height, tree, 1) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+  ctx.mask = *mask;
+  result = skyseg_begin_frame(&ctx, frame_buf, adjust_factor);
+  if(result == SKY_TREE_OK)
+  {
+    skyseg_segment_band(&ctx, frame_buf, 0);
+  }
+  freeSkySegScratch(&ctx);
+  return result;
+}
+
+int segmentSkyTreeMask(unsigned char *frame_buf, struct sky_mask* mask, const struct sky_tree* tree, int adjust_factor)
+{
+  if(mask->width != imgWidth || mask->height != imgHeight)
+  {
+    return SKY_TREE_INVALID;
+  }
+  return segmentSkyMask(frame_buf, mask, tree, adjust_factor);
+}
+
+int segmentSkyTree(unsigned char *frame_buf, unsigned char *frame_buf2, const struct sky_tree* tree, int adjust_factor)
+{
+  // segments into a mask, the frame is painted afterwards:
+  struct sky_mask mask;
+  int result;
+
+  if(initSkyMask(&mask, imgWidth, imgHeight) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+  result = segmentSkyTreeMask(frame_buf, &mask, tree, adjust_factor);
+  if(result == SKY_TREE_OK)
+  {
+    drawSkyMask(frame_buf, frame_buf2, &mask);
+  }
+  freeSkyMask(&mask);
+  return result;
+}
+
+int segmentSkyTreeDecimated(unsigned char *frame_buf, struct sky_mask* small_mask, const struct sky_tree* tree, int adjust_factor, int factor)
+{
+  // The frame is downscaled by averaging blocks of factor x factor pixels and segmented at that size.
+  struct image_t input, output;
+  int result;
+
+  if((factor != 1 && factor != 2 && factor != 4 && factor != 8) || small_mask->width != ((imgWidth / factor) & ~1u) || small_mask->height != imgHeight / factor)
+  {
+    return SKY_TREE_INVALID;
+  }
+  input.type = IMAGE_YUV422;
+  input.w = imgWidth;
+  input.h = imgHeight;
+  input.buf = frame_buf;
+  output.type = IMAGE_YUV422;
+  output.w = small_mask->width;
+  output.h = small_mask->height;
+  output.buf = malloc(output.w * output.h * 2);
+  if(output.buf == 0)
+  {
+    return SKY_TREE_INVALID;
+  }
+  image_yuv422_downscale(&input, &output, factor);
+  result = segmentSkyMask((unsigned char *)output.buf, small_mask, tree, adjust_factor);
+
+  free(output.buf);
+  return result;
+}
+
+void upsampleSkyMask(struct sky_mask* small_mask, struct sky_mask* mask, int factor)
+{
+  // every pixel gets the class and uncertainty of the small pixel it lies in, pixels beyond the small mask
+  // get those of its last column or row
+  unsigned int x, y, small_x, small_y, last_y, uncertainty_size, small_uncertainty_size;
+  unsigned int *ground_row, *small_row;
+  unsigned char *uncertainty_row, *small_uncertainty;
+
+  uncertainty_size = (mask->width + 1) / 2;
+  small_uncertainty_size = (small_mask->width + 1) / 2;
+  last_y = 0;
+  for(y = 0; y < mask->height; y++)
+  {
+    small_y = y / factor;
+    if(small_y >= small_mask->height) small_y = small_mask->height - 1;
+    ground_row = &mask->ground[y * mask->words_per_row];
+    uncertainty_row = &mask->uncertainty[y * uncertainty_size];
+    if(y > 0 && small_y == last_y)
+    {
+      // the same small row as the row above:
+      memcpy(ground_row, ground_row - mask->words_per_row, mask->words_per_row * sizeof(unsigned int));
+      memcpy(uncertainty_row, uncertainty_row - uncertainty_size, uncertainty_size);
+      continue;
+    }
+    last_y = small_y;
+
+    small_row = &small_mask->ground[small_y * small_mask->words_per_row];
+    small_uncertainty = &small_mask->uncertainty[small_y * small_uncertainty_size];
+    memset(ground_row, 0, mask->words_per_row * sizeof(unsigned int));
+    for(x = 0; x < mask->width; x++)
+    {
+      small_x = x / factor;
+      if(small_x >= small_mask->width) small_x = small_mask->width - 1;
+      if(small_row[small_x / SKY_MASK_WORD_BITS] & (1u << (small_x % SKY_MASK_WORD_BITS)))
+      {
+        ground_row[x / SKY_MASK_WORD_BITS] |= 1u << (x % SKY_MASK_WORD_BITS);
+      }
+      if(!(x & 1)) uncertainty_row[x / 2] = small_uncertainty[small_x / 2];
+    }
+  }
+}
+
+void segmentSkyUncertainty2(unsigned char *frame_buf, unsigned char *frame_buf2)
+{
+  // use a pre-defined tree to segment the image:
+  // the second buffer (image) stores the uncertainties between 0 and 100.
+  segmentSkyTree(frame_buf, frame_buf2, &sky_tree_uncertainty2, 0);
+}
+
+extern void segment_no_yco(unsigned char *frame_buf, unsigned char *frame_buf2)
+{
+  // use a pre-defined tree to segment the image:
+  // the second buffer (image) stores the uncertainties between 0 and 100.
+  segmentSkyTree(frame_buf, frame_buf2, &sky_tree_no_yco, 0);
+}
+
+extern void segment_no_yco_AdjustTree(unsigned char *frame_buf, unsigned char *frame_buf2, int adjust_factor)
+{
+  // use a pre-defined tree to segment the image:
+  // the second buffer (image) stores the uncertainties between 0 and 100.
+  segmentSkyTree(frame_buf, frame_buf2, &sky_tree_no_yco_adjust, adjust_factor);
+}
+
+static void scaleObstacles(unsigned int* obstacles, unsigned int n_bins, unsigned int bin_surface, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL)
+{
+  unsigned int bin;
+  // obstacles[bin] should have a maximum corresponding to MAX_SIGNAL
+  (*max_bin) = 0;
+  (*obstacle_total) = 0;
+
+  for(bin = 0; bin < n_bins; bin++)
+  {
+    obstacles[bin] *= MAX_SIGNAL;
+    obstacles[bin] /= bin_surface;
+    if(obstacles[bin] > (*max_bin))
+    {
+      (*max_bin) = obstacles[bin];
+    }
+    (*obstacle_total) += obstacles[bin];
+  }
+  (*obstacle_total) /= n_bins;
+}
+
+void getObstacles(unsigned int* obstacles, unsigned int n_bins, unsigned char *frame_buf, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL)
+{
+  unsigned int x,y,ix,GRND, bin_size, bin, HALF_HEIGHT, bin_surface;
+  // reset obstacles values
+  for(bin = 0; bin < n_bins; bin++)
+  {
+    obstacles[bin] = 0;
+  }
   bin_size = imgWidth / n_bins;
+  HALF_HEIGHT = imgHeight / 2;
+  bin_surface = bin_size * HALF_HEIGHT;
+  GRND = 0x00;
+  // frame_buf contains the segmented image. All non-zero elements are sky.
+  // This function assumes no pitch and roll.
+  for(x = 0; x < imgWidth; x++)
+  {
+    for(y = 0; y < HALF_HEIGHT; y++)
+    {
+      ix = image_index(x,y);
+      if(frame_buf[ix] == GRND) // Of course, the original image could also use black pixels - of which probably few in the sky
+      {
+        bin = x / bin_size;
+        if(bin >= n_bins)
+        {
+          bin = n_bins-1;
+        }
+        obstacles[bin]++;
+      }
+    }
+  }
+  scaleObstacles(obstacles, n_bins, bin_surface, max_bin, obstacle_total, MAX_SIGNAL);
+}
+
+static unsigned int countMaskBits(unsigned int *ground_row, unsigned int x_start, unsigned int x_end, unsigned int pattern)
+{
+  // the number of ground pixels in [x_start, x_end) of one row of the mask, only counting the bits in pattern:
+  unsigned int w, w_start, w_end, first, last, count;
+  if(x_end <= x_start) return 0;
+  w_start = x_start / SKY_MASK_WORD_BITS;
+  w_end = (x_end - 1) / SKY_MASK_WORD_BITS;
+  first = ~0u << (x_start % SKY_MASK_WORD_BITS);
+  last = ~0u >> (SKY_MASK_WORD_BITS - 1 - (x_end - 1) % SKY_MASK_WORD_BITS);
+  if(w_start == w_end)
+  {
+    return __builtin_popcount(ground_row[w_start] & pattern & first & last);
+  }
+  count = __builtin_popcount(ground_row[w_start] & pattern & first);
+  for(w = w_start + 1; w < w_end; w++)
+  {
+    count += __builtin_popcount(ground_row[w] & pattern);
+  }
+  count += __builtin_popcount(ground_row[w_end] & pattern & last);
+  return count;
+}
+
+void getObstaclesMask(unsigned int* obstacles, unsigned int n_bins, struct sky_mask* mask, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL)
+{
+  // Same as getObstacles, but counts the ground pixels of a mask a word at a time. The last bin also gets the
+  // columns that are left over when the width is not a multiple of the bin size.
+  unsigned int y, bin, bin_size, HALF_HEIGHT, bin_surface, x_end;
+  unsigned int *ground_row;
 
-  // initialize bins:
   for(bin = 0; bin < n_bins; bin++)
   {
     obstacles[bin] = 0;
   }
+  bin_size = mask->width / n_bins;
+  HALF_HEIGHT = mask->height / 2;
+  bin_surface = bin_size * HALF_HEIGHT;
+  for(y = 0; y < HALF_HEIGHT; y++)
+  {
+    ground_row = &mask->ground[y * mask->words_per_row];
+    for(bin = 0; bin < n_bins; bin++)
+    {
+      x_end = (bin == n_bins - 1) ? mask->width : (bin + 1) * bin_size;
+      obstacles[bin] += countMaskBits(ground_row, bin * bin_size, x_end, SKY_MASK_PIXELS);
+    }
+  }
+  scaleObstacles(obstacles, n_bins, bin_surface, max_bin, obstacle_total, MAX_SIGNAL);
+}
 
-  // 1) determine the horizon line on the basis of pitch and roll
+void horizonToLineParameters(int pitch_pixel, int roll_angle, int* a, int* b)
+{
+  (*b) = 1000 * (pitch_pixel + imgHeight / 2);
+  (*a) = -tan_zelf(roll_angle);
+}
+
+struct horizon_line
+{
+  int a, b;           // y = (a * x + b) / RESOLUTION, with x relative to the image center
+  int y1;             // y at the left border
+  int x12, y12;       // the center of the image projected on the line
+  int step_x;         // width of a bin along the line
+  int x_start;        // start of the first bin
+};
+
+static int horizonLine(unsigned int width, unsigned int height, unsigned int n_bins, int pitch_pixels, int roll_angle, struct horizon_line* line)
+{
+  // steps 1-3 of getObstacles2Way, returns whether the horizon line is entirely visible
+  int a, b, halfWidth, halfHeight;
+  int x1, y1, x2, y2, RESOLUTION;
+  int a2, b2, x12, y12, bin_size, step_x;
+  halfWidth = width / 2;
+  halfHeight = height / 2;
+  bin_size = width / n_bins;
+
+  // 1) determine the horizon line on the basis of pitch and roll, as horizonToLineParameters
   RESOLUTION = 1000;
-  horizonToLineParameters(pitch_pixels, roll_angle, &a, &b);
+  b = 1000 * (pitch_pixels + halfHeight);
+  a = -tan_zelf(roll_angle);
   //printf("Roll: %d, Slope: %d\n",roll_angle,a);
 
   // 2) determine the central point projected on the horizon line:
@@ -1093,25 +1620,62 @@ void getObstacles2Way(unsigned int* obstacles, unsigned int n_bins, unsigned cha
   x12 /= 100;
   y12 = (a * x12 + b) / RESOLUTION;
 
+  line->a = a;
+  line->b = b;
+  line->y1 = y1;
+  line->x12 = x12;
+  line->y12 = y12;
+
   // only further process the image if the horizon line is entirely visible
-  if(y1 >= 0 && y1 < (int)imgHeight && y2 >= 0 && y2 < (int)imgHeight)
+  if(y1 >= 0 && y1 < (int)height && y2 >= 0 && y2 < (int)height)
   {
     // 3) determine the step_x in order to retain the same bin_size along the horizon line
     step_x = (int)isqrt(
         (unsigned int) (bin_size * bin_size) / (((a*a) / (RESOLUTION*RESOLUTION)) + 1)
     );
+    line->step_x = step_x;
+    line->x_start = x12 - (n_bins / 2) * step_x;
+    return 1;
+  }
+  return 0;
+}
 
-    // 4) run over the image from left to right in lines parallel to the horizon line
-    x_start = x12 - (n_bins / 2) * step_x;
+void getObstacles2Way(unsigned int* obstacles, unsigned int n_bins, unsigned char *frame_buf, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle)
+{
+  // procedure:
+  // 1) determine the horizon line on the basis of pitch and roll
+  // 2) determine the central point projected on the horizon line
+  // 3) determine the step_x in order to retain the same bin_size along the horizon line
+  // 4) run over the image from left to right in lines parallel to the horizon line
+  unsigned int ix,bin;
+  int halfWidth, halfHeight;
+  int i, x, y;
+  int RESOLUTION, bin_size;
+  int xx, yy;
+  int bin_surface;
+  struct horizon_line line;
+  halfWidth = imgWidth / 2;
+  halfHeight = imgHeight / 2;
+  bin_size = imgWidth / n_bins;
+  RESOLUTION = 1000;
 
+  // initialize bins:
+  for(bin = 0; bin < n_bins; bin++)
+  {
+    obstacles[bin] = 0;
+  }
+
+  if(horizonLine(imgWidth, imgHeight, n_bins, pitch_pixels, roll_angle, &line))
+  {
+    // 4) run over the image from left to right in lines parallel to the horizon line
     for(i = 0; i > -halfHeight; i--)
     {
-      for(x = x_start; x < halfWidth; x++)
+      for(x = line.x_start; x < halfWidth; x++)
       {
         // determine the appropriate bin:
-        bin = (x - x_start) / step_x;
+        bin = (x - line.x_start) / line.step_x;
         if(bin >= n_bins) bin = n_bins - 1;
-        y = (a * x + b) / RESOLUTION + i;
+        y = (line.a * x + line.b) / RESOLUTION + i;
         // transform to image coordinates:
         xx = x + halfWidth;
         yy = y;
@@ -1132,31 +1696,192 @@ void getObstacles2Way(unsigned int* obstacles, unsigned int n_bins, unsigned cha
 
     // get the variables of interest and transform them to output form
     bin_surface = bin_size * halfHeight;
-    // obstacles[bin] should have a maximum corresponding to MAX_SIGNAL
+    scaleObstacles(obstacles, n_bins, bin_surface, max_bin, obstacle_total, MAX_SIGNAL);
+  }
+  else
+  {
     (*max_bin) = 0;
     (*obstacle_total) = 0;
+  }
+  // 1000 is the resolution of the tan-function
+  drawLine((unsigned char *)frame_buf, line.a, line.y1*RESOLUTION, RESOLUTION);
+  blackDot((unsigned char *)frame_buf, line.x12+halfWidth, line.y12);
+}
 
-    for(bin = 0; bin < n_bins; bin++)
+// the horizon tables of the functions without a context, the decimated functions have a cache per factor (1, 2, 4
+// and 8) so mixing them with the full resolution functions or each other does not drop the tables every frame.
+// Like imgWidth and imgHeight they are shared by all callers, so these functions are for a single thread, threads
+// that segment at the same time each use a skyseg_ctx:
+static struct sky_horizon_cache horizon_cache;
+static struct sky_horizon_cache horizon_cache_decimated[4];
+
+static int addHorizonSpan(struct sky_horizon_table* table, int y, int x, unsigned int bin)
+{
+  // adds the macropixel at x, y to the last span when it continues it
+  struct sky_horizon_span* span;
+  if(table->n_spans > 0)
+  {
+    span = &table->spans[table->n_spans - 1];
+    if(span->y == y && span->bin == bin && span->x_end == x)
     {
-      obstacles[bin] *= MAX_SIGNAL;
-      obstacles[bin] /= bin_surface;
-      if(obstacles[bin] > (*max_bin))
+      span->x_end += 2;
+      return 1;
+    }
+  }
+  if(table->n_spans == table->max_spans)
+  {
+    table->max_spans = (table->max_spans == 0) ? 256 : table->max_spans * 2;
+    span = (struct sky_horizon_span *) realloc(table->spans, table->max_spans * sizeof(struct sky_horizon_span));
+    if(span == 0) return 0;
+    table->spans = span;
+  }
+  span = &table->spans[table->n_spans++];
+  span->y = y;
+  span->x_start = x;
+  span->x_end = x + 2;
+  span->bin = bin;
+  return 1;
+}
+
+static int makeHorizonTable(struct sky_horizon_table* table, unsigned int width, unsigned int height, unsigned int n_bins, int pitch_pixels, int roll_angle)
+{
+  // Walks the lines of getObstacles2Way once and stores the macropixels it counts. The painted frame_buf counts a
+  // macropixel once, as it is red after the first visit, so a pixel is left out when the other pixel of its
+  // macropixel was visited before.
+  unsigned int bin;
+  int halfWidth, halfHeight, RESOLUTION;
+  int i, x, xx, yy, partner_x, partner_i, partner_visited;
+  struct horizon_line line;
+  halfWidth = width / 2;
+  halfHeight = height / 2;
+  RESOLUTION = 1000;
+
+  table->valid = 0;
+  table->pitch_pixels = pitch_pixels;
+  table->roll_angle = roll_angle;
+  table->n_bins = n_bins;
+  table->n_spans = 0;
+  table->visible = horizonLine(width, height, n_bins, pitch_pixels, roll_angle, &line);
+
+  for(i = 0; table->visible && i > -halfHeight; i--)
+  {
+    for(x = line.x_start; x < halfWidth; x++)
+    {
+      bin = (x - line.x_start) / line.step_x;
+      if(bin >= n_bins) bin = n_bins - 1;
+      xx = x + halfWidth;
+      yy = (line.a * x + line.b) / RESOLUTION + i;
+      if(xx >= 0 && xx < (int)width && yy >= 0 && yy < (int)height)
       {
-        (*max_bin) = obstacles[bin];
+        partner_x = (xx & 1) ? x - 1 : x + 1;
+        partner_i = yy - ((line.a * partner_x + line.b) / RESOLUTION);
+        partner_visited = partner_x >= line.x_start && partner_x < halfWidth && partner_i <= 0 && partner_i > -halfHeight
+            && ((xx & 1) ? partner_i >= i : partner_i > i);
+        if(!partner_visited && !addHorizonSpan(table, yy, xx & ~1, bin)) return 0;
       }
-      (*obstacle_total) += obstacles[bin];
     }
-    (*obstacle_total) /= n_bins;
+  }
+  table->valid = 1;
+  return 1;
+}
+
+static int horizonBucket(int value, int bucket)
+{
+  // rounds to the nearest multiple of bucket, halves away from zero:
+  return ((value >= 0) ? value + bucket / 2 : value - bucket / 2) / bucket * bucket;
+}
 
+static struct sky_horizon_table* getHorizonTable(struct sky_horizon_cache* cache, unsigned int width, unsigned int height, unsigned int n_bins, int pitch_pixels, int roll_angle)
+{
+  // the tables are made for one image size and are dropped when it changes. The attitude of a drone jitters from
+  // frame to frame, so the horizon is rounded to buckets of pitch and roll that share a table:
+  struct sky_horizon_table* table;
+  int i;
+  pitch_pixels = horizonBucket(pitch_pixels, SKY_HORIZON_PITCH_BUCKET);
+  roll_angle = horizonBucket(roll_angle, SKY_HORIZON_ROLL_BUCKET);
+  if(cache->width != width || cache->height != height)
+  {
+    freeHorizonCache(cache);
+    cache->width = width;
+    cache->height = height;
   }
-  else
+  for(i = 0; i < SKY_HORIZON_CACHE_SIZE; i++)
   {
-    (*max_bin) = 0;
-    (*obstacle_total) = 0;
+    table = &cache->tables[i];
+    if(table->valid && table->pitch_pixels == pitch_pixels && table->roll_angle == roll_angle && table->n_bins == n_bins)
+    {
+      return table;
+    }
   }
-  // 1000 is the resolution of the tan-function
-  drawLine((unsigned char *)frame_buf, a, y1*RESOLUTION, RESOLUTION);
-  blackDot((unsigned char *)frame_buf, x12+halfWidth, y12);
+  // replace the oldest table:
+  table = &cache->tables[cache->next];
+  cache->next = (cache->next + 1) % SKY_HORIZON_CACHE_SIZE;
+  if(!makeHorizonTable(table, width, height, n_bins, pitch_pixels, roll_angle)) return 0;
+  return table;
+}
+
+static void freeHorizonCache(struct sky_horizon_cache* cache)
+{
+  int i;
+  for(i = 0; i < SKY_HORIZON_CACHE_SIZE; i++)
+  {
+    free(cache->tables[i].spans);
+    cache->tables[i].spans = 0;
+    cache->tables[i].n_spans = 0;
+    cache->tables[i].max_spans = 0;
+    cache->tables[i].valid = 0;
+  }
+  cache->next = 0;
+}
+
+void freeHorizonTables(void)
+{
+  int i;
+  freeHorizonCache(&horizon_cache);
+  for(i = 0; i < 4; i++)
+  {
+    freeHorizonCache(&horizon_cache_decimated[i]);
+  }
+}
+
+static int obstacles2WayMask(struct sky_horizon_cache* cache, unsigned int* obstacles, unsigned int n_bins, struct sky_mask* mask, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle)
+{
+  // Same as getObstacles2Way on a mask: the walk along the horizon comes from a table that is cached per bucket of pitch and
+  // roll, the ground macropixels of its spans are counted a word at a time.
+  unsigned int bin, bin_size;
+  int s;
+  struct sky_horizon_table* table;
+  struct sky_horizon_span* span;
+
+  for(bin = 0; bin < n_bins; bin++)
+  {
+    obstacles[bin] = 0;
+  }
+  (*max_bin) = 0;
+  (*obstacle_total) = 0;
+  table = getHorizonTable(cache, mask->width, mask->height, n_bins, pitch_pixels, roll_angle);
+  if(table == 0)
+  {
+    // no memory for the table:
+    return SKY_TREE_INVALID;
+  }
+  if(!table->visible)
+  {
+    return SKY_TREE_OK;
+  }
+  for(s = 0; s < table->n_spans; s++)
+  {
+    span = &table->spans[s];
+    obstacles[span->bin] += countMaskBits(&mask->ground[span->y * mask->words_per_row], span->x_start, span->x_end, SKY_MASK_MACROPIXELS);
+  }
+  bin_size = mask->width / n_bins;
+  scaleObstacles(obstacles, n_bins, bin_size * (mask->height / 2), max_bin, obstacle_total, MAX_SIGNAL);
+  return SKY_TREE_OK;
+}
+
+int getObstacles2WayMask(unsigned int* obstacles, unsigned int n_bins, struct sky_mask* mask, unsigned int* max_bin, unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle)
+{
+  return obstacles2WayMask(&horizon_cache, obstacles, n_bins, mask, max_bin, obstacle_total, MAX_SIGNAL, pitch_pixels, roll_angle);
 }
 
 void drawLine(unsigned char *frame_buf, int a, int b, int resolution)
@@ -1217,12 +1942,52 @@ void getUncertainty(unsigned int* uncertainty, unsigned int n_bins, unsigned cha
   uncertainty[n_bins-1] /= bin_size;
 }
 
-static inline int pitch_angle_to_pitch_pixel(int pitch)
+void getUncertaintyMask(unsigned int* uncertainty, unsigned int n_bins, struct sky_mask* mask)
+{
+  // Same as getUncertainty, with the uncertainty of every macropixel read from the mask.
+  unsigned int x, y, bin_size, bin, HALF_HEIGHT, uncertainty_line, last_bin, row_size;
+  unsigned char *column;
+
+  for(bin = 0; bin < n_bins; bin++)
+  {
+    uncertainty[bin] = 0;
+  }
+  bin_size = mask->width / n_bins;
+  HALF_HEIGHT = mask->height / 2;
+  row_size = (mask->width + 1) / 2;
+  last_bin = 0;
+
+  for(x = 0; x < mask->width; x++)
+  {
+    bin = x / bin_size;
+    if(bin >= n_bins) bin = n_bins - 1;
+    if(bin > last_bin)
+    {
+      uncertainty[bin-1] /= bin_size;
+      last_bin = bin;
+    }
+    column = &mask->uncertainty[x / 2];
+    uncertainty_line = 0;
+    for(y = 0; y < HALF_HEIGHT; y++)
+    {
+      uncertainty_line += column[y * row_size];
+    }
+    uncertainty[bin] += uncertainty_line / HALF_HEIGHT;
+  }
+  uncertainty[n_bins-1] /= bin_size;
+}
+
+static inline int pitchAngleToPitchPixel(int pitch, unsigned int height)
 {
-  int pitch_pixel = scale_to_range(pitch, -MAX_PITCH_ANGLE, MAX_PITCH_ANGLE, imgHeight);
-  pitch_pixel -= imgHeight / 2;
+  int pitch_pixel = scale_to_range(pitch, -MAX_PITCH_ANGLE, MAX_PITCH_ANGLE, height);
+  pitch_pixel -= height / 2;
   return pitch_pixel;
 }
+
+static inline int pitch_angle_to_pitch_pixel(int pitch)
+{
+  return pitchAngleToPitchPixel(pitch, imgHeight);
+}
 static inline uint8_t scale_to_range(int x, int min, int max, int range)
 {
   if (x < min)
@@ -1236,11 +2001,9 @@ static inline uint8_t scale_to_range(int x, int min, int max, int range)
   return (uint8_t) x;
 }
 
-void get_obstacle_bins_above_horizon(unsigned char *frame_buf, unsigned char *frame_buf2, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll)
+static int adjustFactorToTree(char adjust_factor)
 {
-  int MAX_BIN_VALUE = MAX_I2C_BYTE;
-  unsigned int max_bin, bin_total;
-
+  // maps the adjust factor 0-10 to the steps of the adjust tree
   if(adjust_factor < 3)
   {
     if(adjust_factor == 0) adjust_factor = -10;
@@ -1259,10 +2022,16 @@ void get_obstacle_bins_above_horizon(unsigned char *frame_buf, unsigned char *fr
     if(adjust_factor == 9) adjust_factor = 11;
     if(adjust_factor == 10) adjust_factor = 15;
   }
+  return adjust_factor;
+}
 
+void get_obstacle_bins_above_horizon(unsigned char *frame_buf, unsigned char *frame_buf2, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll)
+{
+  int MAX_BIN_VALUE = MAX_I2C_BYTE;
+  unsigned int max_bin, bin_total;
 
   // Segment Pixels into ground and sky
-  segment_no_yco_AdjustTree(frame_buf, frame_buf2, adjust_factor);
+  segment_no_yco_AdjustTree(frame_buf, frame_buf2, adjustFactorToTree(adjust_factor));
 
   // Make obstacle bins
   getObstacles2Way(obstacle_bins, n_bins, (unsigned char *)frame_buf, &max_bin, &bin_total, MAX_BIN_VALUE, pitch_angle_to_pitch_pixel(pitch), roll);
@@ -1272,3 +2041,68 @@ void get_obstacle_bins_above_horizon(unsigned char *frame_buf, unsigned char *fr
 
 }
 
+int get_obstacle_bins_above_horizon_mask(unsigned char *frame_buf, struct sky_mask* mask, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll)
+{
+  int MAX_BIN_VALUE = MAX_I2C_BYTE;
+  unsigned int max_bin, bin_total;
+
+  // Segment Pixels into ground and sky
+  if(segmentSkyTreeMask(frame_buf, mask, &sky_tree_no_yco_adjust, adjustFactorToTree(adjust_factor)) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+
+  // Make obstacle bins
+  if(getObstacles2WayMask(obstacle_bins, n_bins, mask, &max_bin, &bin_total, MAX_BIN_VALUE, pitch_angle_to_pitch_pixel(pitch), roll) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+
+  // Get uncertainty per obstacle
+  getUncertaintyMask(uncertainty_bins, n_bins, mask);
+  return SKY_TREE_OK;
+}
+
+static int decimatedCacheIndex(int factor)
+{
+  // the index of the horizon cache of a factor of 1, 2, 4 or 8:
+  return (factor >= 8) ? 3 : (factor >= 4) ? 2 : (factor >= 2) ? 1 : 0;
+}
+
+int get_obstacle_bins_above_horizon_decimated(unsigned char *frame_buf, struct sky_mask* small_mask, int factor, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll)
+{
+  int MAX_BIN_VALUE = MAX_I2C_BYTE;
+  unsigned int max_bin, bin_total;
+
+  // Segment Pixels into ground and sky
+  if(segmentSkyTreeDecimated(frame_buf, small_mask, &sky_tree_no_yco_adjust, adjustFactorToTree(adjust_factor), factor) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+
+  // Make obstacle bins, at the small size the horizon scales with the image
+  if(obstacles2WayMask(&horizon_cache_decimated[decimatedCacheIndex(factor)], obstacle_bins, n_bins, small_mask, &max_bin, &bin_total, MAX_BIN_VALUE, pitchAngleToPitchPixel(pitch, small_mask->height), roll) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+
+  // Get uncertainty per obstacle
+  getUncertaintyMask(uncertainty_bins, n_bins, small_mask);
+  return SKY_TREE_OK;
+}
+
+int skyseg_obstacle_bins(struct skyseg_ctx* ctx, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll)
+{
+  int MAX_BIN_VALUE = MAX_I2C_BYTE;
+  unsigned int max_bin, bin_total;
+
+  // Make obstacle bins
+  if(obstacles2WayMask(&ctx->horizon, obstacle_bins, n_bins, &ctx->mask, &max_bin, &bin_total, MAX_BIN_VALUE, pitchAngleToPitchPixel(pitch, ctx->height), roll) != SKY_TREE_OK)
+  {
+    return SKY_TREE_INVALID;
+  }
+
+  // Get uncertainty per obstacle
+  getUncertaintyMask(uncertainty_bins, n_bins, &ctx->mask);
+  return SKY_TREE_OK;
+}
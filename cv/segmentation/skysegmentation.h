@@ -1,8 +1,79 @@
 #ifndef SKYSEGMENTATION
 #define SKYSEGMENTATION
 
+#include <pthread.h>
+#include "skytree.h"
+#include "image.h"
+
 extern unsigned int imgWidth, imgHeight;
 
+#define SKY_MASK_WORD_BITS 32
+#define SKY_SEG_MAX_BANDS 16
+#define SKY_HORIZON_CACHE_SIZE 8
+#define SKY_HORIZON_PITCH_BUCKET 4  // pixels of pitch that share a horizon table
+#define SKY_HORIZON_ROLL_BUCKET 2   // degrees of roll that share a horizon table
+
+/***
+ *    \brief:   Result of a sky segmentation that leaves the image untouched
+ *
+ *              ground = one bit per pixel, set for ground pixels: pixel x of row y is bit x % 32 of
+ *                       word y * words_per_row + x / 32
+ *              uncertainty = one byte per macropixel, row y starts at y * ((width + 1) / 2)
+ */
+
+struct sky_mask
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int words_per_row;
+  unsigned int *ground;
+  unsigned char *uncertainty;
+};
+
+/***
+ *    \brief:   Allocate and free the buffers of a mask, initSkyMask returns SKY_TREE_OK or SKY_TREE_INVALID
+ */
+
+extern int initSkyMask(struct sky_mask* mask, unsigned int width, unsigned int height);
+extern void freeSkyMask(struct sky_mask* mask);
+
+
+/***
+ *    \brief:   Summed-area tables of a frame, so the patch features below cost the same for every patch size
+ *
+ *              luma, u, v = integral images (see image_integral_create) of the Y, U and V of every pixel, the
+ *                       luma with the squared sums, which are exact for patches up to 257 x 257
+ *              row = scratch row of the values of one image row
+ *              computeSkyIntegral fills the tables, once per frame
+ */
+
+struct sky_integral
+{
+  unsigned int width;
+  unsigned int height;
+  struct image_integral_t luma;
+  struct image_integral_t u;
+  struct image_integral_t v;
+  unsigned char *row;
+};
+
+extern int initSkyIntegral(struct sky_integral* integral, unsigned int width, unsigned int height);
+extern void freeSkyIntegral(struct sky_integral* integral);
+extern void computeSkyIntegral(unsigned char *frame_buf, struct sky_integral* integral);
+
+/***
+ *    \brief:   Patch features from the tables, with the patch moved into the image as in getPatchMean
+ *
+ *              the patch of a patch_size is the 2 * (patch_size / 2) + 1 pixels square around x, y
+ *              getPatchMeanIntegral = mean luma of the patch, the value of getPatchMean for an odd patch_size
+ *                       (getPatchMean divides the sum by patch_size * patch_size, also for an even size)
+ *              getPatchVarianceIntegral = variance of the luma in the patch
+ *              getPatchChromaIntegral = mean U and V of the patch
+ */
+
+extern int getPatchMeanIntegral(struct sky_integral* integral, int x, int y, int patch_size);
+extern int getPatchVarianceIntegral(struct sky_integral* integral, int x, int y, int patch_size);
+extern void getPatchChromaIntegral(struct sky_integral* integral, int x, int y, int patch_size, int* u, int* v);
 
 /***
  *    \brief:   Sky Segmentation: find ground/sky pixels
@@ -15,6 +86,39 @@ extern unsigned int imgWidth, imgHeight;
 
 extern void segment_no_yco_AdjustTree(unsigned char *frame_buf, unsigned char *frame_buf2, int adjust_factor);
 
+/***
+ *    \brief:   Sky Segmentation with a decision tree, e.g. one of the built-in trees or one from loadSkyTree
+ *
+ *              frame_buf = input image -> output of the classification
+ *              frame_buf2 = output of the certainty of the classification
+ *              tree = the decision tree, see skytree.h
+ *              adjust_factor = added adjust_factor times the adjust of a node to its threshold
+ *              returns SKY_TREE_OK, or SKY_TREE_INVALID when the tree is invalid or memory ran out
+ */
+
+extern int segmentSkyTree(unsigned char *frame_buf, unsigned char *frame_buf2, const struct sky_tree* tree, int adjust_factor);
+
+/***
+ *    \brief:   Same as segmentSkyTree, but the classification goes to a mask and frame_buf is only read
+ *
+ *              mask = output, initialized with the size of the image (imgWidth x imgHeight)
+ *              drawSkyMask paints a mask into frame_buf and frame_buf2 as segmentSkyTree does
+ */
+
+extern int segmentSkyTreeMask(unsigned char *frame_buf, struct sky_mask* mask, const struct sky_tree* tree, int adjust_factor);
+extern void drawSkyMask(unsigned char *frame_buf, unsigned char *frame_buf2, struct sky_mask* mask);
+
+/***
+ *    \brief:   Sky Segmentation at a lower resolution, the frame is downscaled by averaging blocks of pixels
+ *
+ *              small_mask = output, initialized with (imgWidth / factor) rounded down to even x imgHeight / factor
+ *              factor = 1, 2, 4 or 8, other factors return SKY_TREE_INVALID
+ *              upsampleSkyMask scales a small mask up to a mask of the full image
+ */
+
+extern int segmentSkyTreeDecimated(unsigned char *frame_buf, struct sky_mask* small_mask, const struct sky_tree* tree, int adjust_factor, int factor);
+extern void upsampleSkyMask(struct sky_mask* small_mask, struct sky_mask* mask, int factor);
+
 /***
  *    \brief:   Sky Segmentation: find ground/sky pixels
  *              no_yco: No y-coordinate in decission tree
@@ -28,4 +132,138 @@ extern void segment_no_yco_AdjustTree(unsigned char *frame_buf, unsigned char *f
 
 void get_obstacle_bins_above_horizon(unsigned char *frame_buf, unsigned char *frame_buf2, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll);
 
+/***
+ *    \brief:   Same as get_obstacle_bins_above_horizon, with the classification in a mask instead of the images
+ *
+ *              frame_buf = input image, it is not changed (no ground, obstacle or horizon overlay)
+ *              mask = classification output, initialized with the size of the image
+ *              only ground pixels of the classification are obstacles, black pixels of the image are not
+ *              the horizon is rounded to the nearest SKY_HORIZON_PITCH_BUCKET pixels of pitch and
+ *              SKY_HORIZON_ROLL_BUCKET degrees of roll, so its table can be reused while the attitude jitters
+ *              returns SKY_TREE_OK, or SKY_TREE_INVALID when memory ran out or the mask has the wrong size
+ *              the horizon tables are shared by all callers, so this is for a single thread, see skyseg_ctx
+ */
+
+int get_obstacle_bins_above_horizon_mask(unsigned char *frame_buf, struct sky_mask* mask, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll);
+
+/***
+ *    \brief:   Same as get_obstacle_bins_above_horizon_mask, with the segmentation and the bins at a lower resolution
+ *
+ *              small_mask = classification output, see segmentSkyTreeDecimated
+ *              factor = the downscale factor of the image (1, 2, 4 or 8)
+ *              the horizon tables are cached per factor, apart from those of get_obstacle_bins_above_horizon_mask
+ */
+
+int get_obstacle_bins_above_horizon_decimated(unsigned char *frame_buf, struct sky_mask* small_mask, int factor, char adjust_factor, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll);
+
+/***
+ *    \brief:   Free the tables of the horizon lines that get_obstacle_bins_above_horizon_mask keeps per pitch and roll, as they
+ *              are shared by all callers it must not run while another thread uses them
+ */
+
+void freeHorizonTables(void);
+
+/***
+ *    \brief:   The macropixels that the bins above the horizon count, kept per bucket of pitch and roll
+ *
+ *              a span is a run of macropixels in row y, from pixel x_start up to x_end, in one bin
+ *              the tables of a cache are for one image size, they are dropped when the size changes
+ */
+
+struct sky_horizon_span
+{
+  unsigned short y;
+  unsigned short x_start;
+  unsigned short x_end;
+  unsigned short bin;
+};
+
+struct sky_horizon_table
+{
+  int valid;
+  int pitch_pixels;
+  int roll_angle;
+  unsigned int n_bins;
+  int visible;
+  int n_spans;
+  int max_spans;
+  struct sky_horizon_span* spans;
+};
+
+struct sky_horizon_cache
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int next;
+  struct sky_horizon_table tables[SKY_HORIZON_CACHE_SIZE];
+};
+
+/***
+ *    \brief:   Sky segmentation context: the image size, the tree, the scratch rows, the mask and the horizon tables
+ *              of one stream of frames, so the functions below do not use imgWidth, imgHeight or static state and
+ *              several contexts can run at the same time
+ *
+ *              The image is split in n_bands bands of rows that are segmented independently, each with scratch rows
+ *              of its own. skyseg_init starts n_bands - 1 workers that wait for the frames of skyseg_segment, so no
+ *              threads are created per frame, and skyseg_free stops them. The workers keep a pointer to the context,
+ *              it must not be copied or moved between skyseg_init and skyseg_free. An application with a pool of
+ *              workers of its own calls skyseg_begin_frame once and then skyseg_segment_band for every band
+ *              0 .. n_bands - 1.
+ */
+
+struct skyseg_ctx
+{
+  unsigned int width;
+  unsigned int height;
+  const struct sky_tree* tree;
+  struct sky_tree_compiled compiled;
+  int n_bands;
+  int padded_width;
+  unsigned char *luma_rows;
+  short *feature_rows;
+  struct sky_mask mask;
+  struct sky_horizon_cache horizon;
+  struct sky_integral integral;     // made by skyseg_begin_frame for trees with patch features
+  // the workers of skyseg_segment, the bands of a frame are handed out by next_band:
+  int n_workers;
+  pthread_t workers[SKY_SEG_MAX_BANDS];
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned int frame;
+  unsigned char *frame_buf;
+  int next_band;
+  int pending;
+  int quit;
+};
+
+/***
+ *    \brief:   Initialize and free a context, skyseg_init returns SKY_TREE_OK or SKY_TREE_INVALID
+ *
+ *              tree = the decision tree, e.g. &sky_tree_no_yco_adjust
+ *              n_bands = number of bands of rows, from 1 up to SKY_SEG_MAX_BANDS
+ */
+
+extern int skyseg_init(struct skyseg_ctx* ctx, unsigned int width, unsigned int height, const struct sky_tree* tree, int n_bands);
+extern void skyseg_free(struct skyseg_ctx* ctx);
+
+/***
+ *    \brief:   Segment a frame of the size of the context into ctx->mask, as segmentSkyTreeMask
+ *
+ *              skyseg_begin_frame prepares the tree for the frame, skyseg_segment_band then segments one band
+ *              skyseg_segment does both, with the bands shared by the calling thread and the workers of the context
+ *              skyseg_begin_frame and skyseg_segment return SKY_TREE_OK or SKY_TREE_INVALID
+ */
+
+extern int skyseg_begin_frame(struct skyseg_ctx* ctx, unsigned char *frame_buf, int adjust_factor);
+extern void skyseg_segment_band(struct skyseg_ctx* ctx, unsigned char *frame_buf, int band);
+extern int skyseg_segment(struct skyseg_ctx* ctx, unsigned char *frame_buf, int adjust_factor);
+
+/***
+ *    \brief:   The obstacle bins above the horizon of the last segmented frame, as get_obstacle_bins_above_horizon_mask
+ *              returns SKY_TREE_OK, or SKY_TREE_INVALID when memory ran out
+ */
+
+extern int skyseg_obstacle_bins(struct skyseg_ctx* ctx, unsigned int n_bins, unsigned int* obstacle_bins, unsigned int* uncertainty_bins, int pitch, int roll);
+
 #endif /* SKYSEGMENTATION */
@@ -0,0 +1,383 @@
+#include "skytree.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "simd.h"
+
+/******************Defines********************/
+#define NODE(feature, scale, threshold, adjust, low, high) {feature, scale, threshold, adjust, low, high}
+#define LEAF(uncertainty, ground) {SKY_TREE_LEAF, SKY_SCALE_ABSOLUTE, 0, 0, uncertainty, ground}
+#define GROUND 1
+#define SKY 0
+
+/******************Built-in trees********************/
+
+// segmentSkyUncertainty2, the comments give the certainty of the leaves:
+static const struct sky_tree_node uncertainty2_nodes[] =
+{
+  NODE(SKY_FEATURE_ROW, SKY_SCALE_HEIGHT, 41, 0, 1, 28),         // 0: high in the image
+  NODE(SKY_FEATURE_GRADIENT, SKY_SCALE_ABSOLUTE, 4, 0, 2, 13),   // 1: little gradient
+  NODE(SKY_FEATURE_U, SKY_SCALE_ABSOLUTE, 137, 0, 3, 12),        // 2
+  NODE(SKY_FEATURE_Y, SKY_SCALE_MAX_Y, 30, 0, 4, 11),            // 3: not very bright: was 59, now 30
+  NODE(SKY_FEATURE_V, SKY_SCALE_ABSOLUTE, 143, 0, 5, 10),        // 4
+  NODE(SKY_FEATURE_ROW, SKY_SCALE_HEIGHT, 29, 0, 6, 9),          // 5
+  NODE(SKY_FEATURE_GRADIENT, SKY_SCALE_ABSOLUTE, 3, 0, 7, 8),    // 6: was 1
+  LEAF(30, SKY),                                                 // 7: 70.0%
+  LEAF(22, GROUND),                                              // 8: 77.6%
+  LEAF(12, GROUND),                                              // 9: 87.76%
+  LEAF(23, SKY),                                                 // 10: 76,53%
+  LEAF(12, SKY),                                                 // 11: 87.37%
+  LEAF(6, SKY),                                                  // 12: 93,45%
+  NODE(SKY_FEATURE_Y, SKY_SCALE_MAX_Y, 30, 0, 14, 21),           // 13: more gradient
+  NODE(SKY_FEATURE_U, SKY_SCALE_ABSOLUTE, 141, 0, 15, 16),       // 14
+  LEAF(8, GROUND),                                               // 15: 92.0%
+  NODE(SKY_FEATURE_U, SKY_SCALE_ABSOLUTE, 152, 0, 17, 20),       // 16
+  NODE(SKY_FEATURE_ROW, SKY_SCALE_HEIGHT, 21, 0, 18, 19),        // 17
+  LEAF(32, SKY),                                                 // 18: 67.7%
+  LEAF(20, GROUND),                                              // 19: 80.0%
+  LEAF(25, SKY),                                                 // 20: 74.5%
+  NODE(SKY_FEATURE_U, SKY_SCALE_ABSOLUTE, 135, 0, 22, 27),       // 21
+  NODE(SKY_FEATURE_GRADIENT, SKY_SCALE_ABSOLUTE, 28, 0, 23, 26), // 22: medium gradient
+  NODE(SKY_FEATURE_Y, SKY_SCALE_MAX_Y, 75, 0, 24, 25),           // 23
+  LEAF(28, GROUND),                                              // 24: 71.5%
+  LEAF(26, SKY),                                                 // 25: 74.1%
+  LEAF(21, GROUND),                                              // 26: high gradient, 78.6%
+  LEAF(20, SKY),                                                 // 27: 79.5%
+  NODE(SKY_FEATURE_ROW, SKY_SCALE_HEIGHT, 57, 0, 29, 38),        // 28
+  NODE(SKY_FEATURE_Y, SKY_SCALE_MAX_Y, 58, 0, 30, 31),           // 29
+  LEAF(5, GROUND),                                               // 30: 94.5%
+  NODE(SKY_FEATURE_GRADIENT, SKY_SCALE_ABSOLUTE, 16, 0, 32, 37), // 31
+  NODE(SKY_FEATURE_V, SKY_SCALE_ABSOLUTE, 118, 0, 33, 34),       // 32
+  LEAF(15, SKY),                                                 // 33: 85.1%
+  NODE(SKY_FEATURE_ROW, SKY_SCALE_HEIGHT, 47, 0, 35, 36),        // 34
+  LEAF(29, SKY),                                                 // 35: 70.3%
+  LEAF(28, GROUND),                                              // 36: 71.9%
+  LEAF(16, GROUND),                                              // 37: 84.2%
+  LEAF(1, GROUND)                                                // 38: 98,74%
+};
+
+// segment_no_yco, no y-coordinate in the tree:
+static const struct sky_tree_node no_yco_nodes[] =
+{
+  NODE(SKY_FEATURE_FD_YCV, SKY_SCALE_ABSOLUTE, 10, 0, 1, 12),          // 0
+  NODE(SKY_FEATURE_V, SKY_SCALE_ABSOLUTE, 153, 0, 2, 9),               // 1
+  NODE(SKY_FEATURE_FD_YCV, SKY_SCALE_ABSOLUTE, -125, 0, 3, 4),         // 2
+  LEAF(2, GROUND),                                                     // 3: 98%
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 4, 0, 5, 8),     // 4
+  NODE(SKY_FEATURE_V, SKY_SCALE_ABSOLUTE, 129, 0, 6, 7),               // 5
+  LEAF(26, SKY),                                                       // 6: 74%
+  LEAF(25, GROUND),                                                    // 7: 75%
+  LEAF(10, GROUND),                                                    // 8: 90%
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 7, 0, 10, 11),   // 9
+  LEAF(31, SKY),                                                       // 10: 69%
+  LEAF(12, GROUND),                                                    // 11: 88%
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 7, 0, 13, 16),   // 12
+  NODE(SKY_FEATURE_FD_CV, SKY_SCALE_ABSOLUTE, -83, 0, 14, 15),         // 13
+  LEAF(33, GROUND),                                                    // 14: 67%
+  LEAF(10, SKY),                                                       // 15: 90%
+  NODE(SKY_FEATURE_FD_YCV, SKY_SCALE_ABSOLUTE, 164, 0, 17, 24),        // 16
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 13, 0, 18, 23),  // 17
+  NODE(SKY_FEATURE_FD_CV, SKY_SCALE_ABSOLUTE, -52, 0, 19, 20),         // 18
+  LEAF(21, GROUND),                                                    // 19: 79%
+  NODE(SKY_FEATURE_Y, SKY_SCALE_MAX_Y, 60, 0, 21, 22),                 // 20
+  LEAF(24, GROUND),                                                    // 21: 76%
+  LEAF(29, SKY),                                                       // 22: 71%
+  LEAF(16, GROUND),                                                    // 23: 84%
+  LEAF(24, SKY)                                                        // 24: 76%
+};
+
+// segment_no_yco_AdjustTree, the thresholds move with the adjust factor to find more or less ground:
+static const struct sky_tree_node no_yco_adjust_nodes[] =
+{
+  NODE(SKY_FEATURE_FD_YCV, SKY_SCALE_ABSOLUTE, 58, -48, 1, 12),        // 0
+  NODE(SKY_FEATURE_V, SKY_SCALE_ABSOLUTE, 150, 3, 2, 9),               // 1
+  NODE(SKY_FEATURE_FD_YCV, SKY_SCALE_ABSOLUTE, -77, -48, 3, 4),        // 2
+  LEAF(2, GROUND),                                                     // 3: 98%
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 2, 2, 5, 8),     // 4
+  NODE(SKY_FEATURE_V, SKY_SCALE_ABSOLUTE, 126, 3, 6, 7),               // 5
+  LEAF(26, SKY),                                                       // 6: 74%
+  LEAF(25, GROUND),                                                    // 7: 75%
+  LEAF(10, GROUND),                                                    // 8: 90%
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 4, 2, 10, 11),   // 9
+  LEAF(31, SKY),                                                       // 10: 69%
+  LEAF(12, GROUND),                                                    // 11: 88%
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 5, 2, 13, 16),   // 12
+  NODE(SKY_FEATURE_FD_CV, SKY_SCALE_ABSOLUTE, -51, -48, 14, 15),       // 13
+  LEAF(33, GROUND),                                                    // 14: 67%
+  LEAF(10, SKY),                                                       // 15: 90%
+  NODE(SKY_FEATURE_FD_YCV, SKY_SCALE_ABSOLUTE, 212, -48, 17, 24),      // 16
+  NODE(SKY_FEATURE_PATCH_TEXTURE, SKY_SCALE_ABSOLUTE, 11, 2, 18, 23),  // 17
+  NODE(SKY_FEATURE_FD_CV, SKY_SCALE_ABSOLUTE, -19, -48, 19, 20),       // 18
+  LEAF(21, GROUND),                                                    // 19: 79%
+  NODE(SKY_FEATURE_Y, SKY_SCALE_MAX_Y, 66, -5, 21, 22),                // 20
+  LEAF(24, GROUND),                                                    // 21: 76%
+  LEAF(29, SKY),                                                       // 22: 71%
+  LEAF(16, GROUND),                                                    // 23: 84%
+  LEAF(24, SKY)                                                        // 24: 76%
+};
+
+const struct sky_tree sky_tree_uncertainty2 = {sizeof(uncertainty2_nodes) / sizeof(struct sky_tree_node), uncertainty2_nodes};
+const struct sky_tree sky_tree_no_yco = {sizeof(no_yco_nodes) / sizeof(struct sky_tree_node), no_yco_nodes};
+const struct sky_tree sky_tree_no_yco_adjust = {sizeof(no_yco_adjust_nodes) / sizeof(struct sky_tree_node), no_yco_adjust_nodes};
+
+// names of the features and scales in tree files, in the order of the enums:
+static const char* feature_names[SKY_N_FEATURES] = {"row", "Y", "U", "V", "gradient", "FD_YCV", "FD_CV", "texture",
+                                                     "patchY", "patchU", "patchV"};
+static const char* scale_names[] = {"abs", "maxY", "height"};
+
+/**************************Code********************/
+
+int checkSkyTree(const struct sky_tree* tree)
+{
+  // every child has to come after its parent, so that a single pass over the nodes classifies the pixels:
+  int n;
+  const struct sky_tree_node* node;
+  if(tree->n_nodes < 1 || tree->n_nodes > SKY_TREE_MAX_NODES) return SKY_TREE_INVALID;
+
+  for(n = 0; n < tree->n_nodes; n++)
+  {
+    node = &tree->nodes[n];
+    if(node->feature == SKY_TREE_LEAF)
+    {
+      if(node->low > 255 || node->high > 1) return SKY_TREE_INVALID;
+    }
+    else
+    {
+      if(node->feature < 0 || node->feature >= SKY_N_FEATURES || node->scale > SKY_SCALE_HEIGHT) return SKY_TREE_INVALID;
+      if(node->low <= n || node->high <= n || node->low >= tree->n_nodes || node->high >= tree->n_nodes) return SKY_TREE_INVALID;
+    }
+  }
+  return SKY_TREE_OK;
+}
+
+static int findName(const char** names, int n_names, const char* name)
+{
+  int i;
+  for(i = 0; i < n_names; i++)
+  {
+    if(strcmp(names[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+int loadSkyTree(struct sky_tree* tree, const char* filename)
+{
+  // The file has one node per line, in the order of the array. Empty lines and lines starting with # are skipped.
+  // inner node: <feature> <scale> <threshold> <adjust> <low> <high>, e.g. "gradient abs 4 0 2 13"
+  // leaf:       leaf <uncertainty> <ground>, e.g. "leaf 30 0"
+  // The features are row, Y, U, V, gradient, FD_YCV, FD_CV and texture, the scales abs, maxY and height.
+  char line[128], feature[16], scale[16];
+  int n, n_read, threshold, adjust, low, high;
+  struct sky_tree_node* nodes;
+  FILE* file;
+
+  tree->n_nodes = 0;
+  tree->nodes = 0;
+  file = fopen(filename, "r");
+  if(file == 0) return SKY_TREE_INVALID;
+  nodes = (struct sky_tree_node *) malloc(SKY_TREE_MAX_NODES * sizeof(struct sky_tree_node));
+  if(nodes == 0)
+  {
+    fclose(file);
+    return SKY_TREE_INVALID;
+  }
+
+  n = 0;
+  while(fgets(line, sizeof(line), file) != 0)
+  {
+    if(sscanf(line, " %15s", feature) != 1 || feature[0] == '#') continue;
+    if(n == SKY_TREE_MAX_NODES) break;
+
+    if(strcmp(feature, "leaf") == 0)
+    {
+      n_read = sscanf(line, " %15s %d %d", feature, &low, &high);
+      if(n_read != 3 || low < 0 || high < 0) break;
+      nodes[n].feature = SKY_TREE_LEAF;
+      nodes[n].scale = SKY_SCALE_ABSOLUTE;
+      nodes[n].threshold = 0;
+      nodes[n].adjust = 0;
+    }
+    else
+    {
+      n_read = sscanf(line, " %15s %15s %d %d %d %d", feature, scale, &threshold, &adjust, &low, &high);
+      if(n_read != 6 || low < 0 || high < 0) break;
+      if(threshold < -32768 || threshold > 32767 || adjust < -32768 || adjust > 32767) break;
+      nodes[n].feature = findName(feature_names, SKY_N_FEATURES, feature);
+      nodes[n].scale = findName(scale_names, sizeof(scale_names) / sizeof(scale_names[0]), scale);
+      nodes[n].threshold = threshold;
+      nodes[n].adjust = adjust;
+      if(nodes[n].feature < 0 || nodes[n].scale > SKY_SCALE_HEIGHT) break;
+    }
+    nodes[n].low = (low > 65535) ? 65535 : low;
+    nodes[n].high = (high > 65535) ? 65535 : high;
+    n++;
+  }
+  // a line that could not be parsed stops the loop before the end of the file:
+  if(!feof(file)) n = 0;
+  fclose(file);
+
+  tree->n_nodes = n;
+  tree->nodes = nodes;
+  if(checkSkyTree(tree) != SKY_TREE_OK)
+  {
+    freeSkyTree(tree);
+    return SKY_TREE_INVALID;
+  }
+  return SKY_TREE_OK;
+}
+
+void freeSkyTree(struct sky_tree* tree)
+{
+  // only for trees from loadSkyTree:
+  free((void *) tree->nodes);
+  tree->nodes = 0;
+  tree->n_nodes = 0;
+}
+
+int compileSkyTree(const struct sky_tree* tree, struct sky_tree_compiled* compiled, int max_Y, int height, int adjust_factor)
+{
+  int n, threshold;
+  const struct sky_tree_node* node;
+  if(checkSkyTree(tree) != SKY_TREE_OK) return SKY_TREE_INVALID;
+
+  compiled->n_nodes = tree->n_nodes;
+  for(n = 0; n < tree->n_nodes; n++)
+  {
+    node = &tree->nodes[n];
+    compiled->feature[n] = node->feature;
+    compiled->low[n] = node->low;
+    compiled->high[n] = node->high;
+    if(node->feature == SKY_TREE_LEAF)
+    {
+      compiled->threshold[n] = 0;
+      continue;
+    }
+
+    threshold = node->threshold;
+    if(node->scale == SKY_SCALE_MAX_Y) threshold = (max_Y * threshold) / 100;
+    else if(node->scale == SKY_SCALE_HEIGHT) threshold = (height * threshold) / 100;
+    threshold += node->adjust * adjust_factor;
+
+    // the color channels are unsigned, so a negative threshold wraps around and lets every pixel pass:
+    if(threshold < 0 && (node->feature == SKY_FEATURE_Y || node->feature == SKY_FEATURE_U || node->feature == SKY_FEATURE_V
+                         || node->feature == SKY_FEATURE_PATCH_Y || node->feature == SKY_FEATURE_PATCH_U
+                         || node->feature == SKY_FEATURE_PATCH_V))
+    {
+      threshold = 32767;
+    }
+    threshold = (threshold < -32768) ? -32768 : threshold;
+    threshold = (threshold > 32767) ? 32767 : threshold;
+    compiled->threshold[n] = threshold;
+  }
+  return SKY_TREE_OK;
+}
+
+// the lanes of which the feature is larger than the threshold:
+static inline unsigned short compareSkyTreeLanes(const short* feature, short threshold)
+{
+#if defined(CV_SIMD_SSE2)
+  __m128i t = _mm_set1_epi16(threshold);
+  __m128i a = _mm_cmpgt_epi16(_mm_loadu_si128((__m128i *)feature), t);
+  __m128i b = _mm_cmpgt_epi16(_mm_loadu_si128((__m128i *)&feature[8]), t);
+  return (unsigned short) _mm_movemask_epi8(_mm_packs_epi16(a, b));
+#elif defined(CV_SIMD_NEON)
+  static const unsigned char lane_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  int16x8_t t = vdupq_n_s16(threshold);
+  uint8x16_t m = vcombine_u8(vmovn_u16(vcgtq_s16(vld1q_s16(feature), t)), vmovn_u16(vcgtq_s16(vld1q_s16(&feature[8]), t)));
+  // the bits are distinct, so adding the lanes of each half gives the mask:
+  uint8x8_t s;
+  m = vandq_u8(m, vld1q_u8(lane_bits));
+  s = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+  s = vpadd_u8(s, s);
+  s = vpadd_u8(s, s);
+  return (unsigned short)(vget_lane_u8(s, 0) | (vget_lane_u8(s, 1) << 8));
+#else
+  int l;
+  unsigned short mask = 0;
+  for(l = 0; l < SKY_TREE_BATCH; l++)
+  {
+    mask |= (unsigned short)((feature[l] > threshold) << l);
+  }
+  return mask;
+#endif
+}
+
+// set the lanes of a batch to a value:
+static inline void setSkyTreeLanes(unsigned char* values, unsigned short lanes, unsigned char value)
+{
+#if defined(CV_SIMD_SSE2)
+  const __m128i lane_bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i m = _mm_unpacklo_epi64(_mm_set1_epi8((char)(lanes & 0xFF)), _mm_set1_epi8((char)(lanes >> 8)));
+  __m128i v = _mm_loadu_si128((__m128i *)values);
+  m = _mm_cmpeq_epi8(_mm_and_si128(m, lane_bits), lane_bits);
+  v = _mm_or_si128(_mm_and_si128(m, _mm_set1_epi8((char) value)), _mm_andnot_si128(m, v));
+  _mm_storeu_si128((__m128i *)values, v);
+#elif defined(CV_SIMD_NEON)
+  static const unsigned char lane_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t m = vcombine_u8(vdup_n_u8(lanes & 0xFF), vdup_n_u8(lanes >> 8));
+  m = vtstq_u8(m, vld1q_u8(lane_bits));
+  vst1q_u8(values, vbslq_u8(m, vdupq_n_u8(value), vld1q_u8(values)));
+#else
+  int l;
+  for(l = 0; lanes != 0; l++, lanes >>= 1)
+  {
+    if(lanes & 1) values[l] = value;
+  }
+#endif
+}
+
+void classifySkyTreeBatch(const struct sky_tree_compiled* tree, struct sky_tree_batch* batch, unsigned short lanes)
+{
+  // The tree is walked depth first with a stack of the nodes that are still to be visited and the lanes that arrive
+  // there. Only the nodes that lanes reach are visited, so the features of a branch that is not taken are never
+  // computed. Every inner node pushes at most one node more than it pops, so the stack never holds more nodes than
+  // the tree.
+  unsigned short stack_node[SKY_TREE_MAX_NODES], stack_lanes[SKY_TREE_MAX_NODES];
+  unsigned short r, above, missing;
+  int n, f, top;
+
+  batch->ground = 0;
+  stack_node[0] = 0;
+  stack_lanes[0] = lanes;
+  top = (lanes != 0);
+  while(top > 0)
+  {
+    top--;
+    n = stack_node[top];
+    r = stack_lanes[top];
+
+    f = tree->feature[n];
+    if(f == SKY_TREE_LEAF)
+    {
+      setSkyTreeLanes(batch->uncertainty, r, (unsigned char) tree->low[n]);
+      if(tree->high[n]) batch->ground |= r;
+      continue;
+    }
+
+    if(f == SKY_FEATURE_ROW)
+    {
+      // the row is the same for all lanes:
+      above = (batch->row > tree->threshold[n]) ? 0xFFFF : 0;
+    }
+    else
+    {
+      missing = r & ~batch->computed[f];
+      if(missing)
+      {
+        batch->compute(batch, f, missing);
+        batch->computed[f] |= missing;
+      }
+      above = compareSkyTreeLanes(batch->feature[f], tree->threshold[n]);
+    }
+    if(r & above)
+    {
+      stack_node[top] = tree->high[n];
+      stack_lanes[top++] = r & above;
+    }
+    if(r & ~above)
+    {
+      stack_node[top] = tree->low[n];
+      stack_lanes[top++] = r & ~above;
+    }
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef SKYTREE
+#define SKYTREE
+
+/***
+ *    \brief:   Decision trees of the sky segmentation, stored as tables
+ *
+ *              A tree is an array of nodes. An inner node sends a pixel to its low child when the feature
+ *              is at most the threshold and to its high child otherwise; the children always come after
+ *              their parent in the array. A leaf holds the uncertainty (0-100) and whether the pixel is ground.
+ *
+ *              Thresholds are given per tree and resolved once per frame by compileSkyTree, they can be
+ *              absolute, a percentage of the maximal luma of the frame or a percentage of the image height,
+ *              and are shifted by adjust * adjust_factor.
+ *
+ *              Pixels are classified in batches of SKY_TREE_BATCH: every node compares all pixels of the batch
+ *              at once and the pixels are passed on to the children as bit masks, so there are no branches per
+ *              pixel. The tree is walked depth first and only the nodes that pixels reach are visited, features
+ *              are only computed for the pixels that reach a node testing them.
+ */
+
+#define SKY_TREE_LEAF -1
+#define SKY_TREE_MAX_NODES 255
+#define SKY_TREE_BATCH 16
+
+#define SKY_TREE_OK 0
+#define SKY_TREE_INVALID -1
+
+// the features of a pixel, Y, U and V are those of its macropixel:
+enum sky_feature
+{
+  SKY_FEATURE_ROW,            // y coordinate
+  SKY_FEATURE_Y,
+  SKY_FEATURE_U,
+  SKY_FEATURE_V,
+  SKY_FEATURE_GRADIENT,       // |dx| + |dy|, see getGradient
+  SKY_FEATURE_FD_YCV,         // see get_FD_YCV
+  SKY_FEATURE_FD_CV,          // see get_FD_CV
+  SKY_FEATURE_PATCH_TEXTURE,  // see getPatchTexture, with a patch size of 10
+  SKY_FEATURE_PATCH_Y,        // see getPatchMeanIntegral, with a patch size of 10
+  SKY_FEATURE_PATCH_U,        // see getPatchChromaIntegral, with a patch size of 10
+  SKY_FEATURE_PATCH_V,
+  SKY_N_FEATURES
+};
+
+// the unit of a threshold:
+enum sky_scale
+{
+  SKY_SCALE_ABSOLUTE,
+  SKY_SCALE_MAX_Y,            // percentage of the maximal luma (getMaximumY)
+  SKY_SCALE_HEIGHT            // percentage of the image height
+};
+
+struct sky_tree_node
+{
+  signed char feature;        // enum sky_feature, SKY_TREE_LEAF for a leaf
+  unsigned char scale;        // enum sky_scale of the threshold
+  short threshold;
+  short adjust;               // added to the threshold for every step of the adjust factor
+  unsigned short low;         // child for feature <= threshold, the uncertainty for a leaf
+  unsigned short high;        // child for feature > threshold, 1 for a ground leaf and 0 for a sky leaf
+};
+
+struct sky_tree
+{
+  int n_nodes;
+  const struct sky_tree_node* nodes;
+};
+
+// a tree with the thresholds of one frame:
+struct sky_tree_compiled
+{
+  int n_nodes;
+  signed char feature[SKY_TREE_MAX_NODES];
+  short threshold[SKY_TREE_MAX_NODES];
+  unsigned short low[SKY_TREE_MAX_NODES];
+  unsigned short high[SKY_TREE_MAX_NODES];
+};
+
+// the pixels of a batch, lane i is bit i of the lane masks:
+struct sky_tree_batch
+{
+  const short* feature[SKY_N_FEATURES];     // the SKY_TREE_BATCH values of a feature, set by compute
+  short values[SKY_N_FEATURES][SKY_TREE_BATCH];  // storage for features that are computed per batch
+  unsigned short computed[SKY_N_FEATURES];  // lanes of which the feature is known
+  int row;                                  // the row of the batch, SKY_FEATURE_ROW is never computed
+  // fills in a feature for the given lanes, called by classifySkyTreeBatch when it is needed:
+  void (*compute)(struct sky_tree_batch* batch, int feature, unsigned short lanes);
+  void* data;
+  unsigned char uncertainty[SKY_TREE_BATCH];
+  unsigned short ground;                    // lanes that are classified as ground
+};
+
+// the trees of segmentSkyUncertainty2, segment_no_yco and segment_no_yco_AdjustTree:
+extern const struct sky_tree sky_tree_uncertainty2;
+extern const struct sky_tree sky_tree_no_yco;
+extern const struct sky_tree sky_tree_no_yco_adjust;
+
+int checkSkyTree(const struct sky_tree* tree);
+int loadSkyTree(struct sky_tree* tree, const char* filename);
+void freeSkyTree(struct sky_tree* tree);
+int compileSkyTree(const struct sky_tree* tree, struct sky_tree_compiled* compiled, int max_Y, int height, int adjust_factor);
+void classifySkyTreeBatch(const struct sky_tree_compiled* tree, struct sky_tree_batch* batch, unsigned short lanes);
+
+#endif /* SKYTREE */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2016
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/simd.h
+ * Selection of the SIMD instruction set used by the vision functions.
+ *
+ * NEON is used on the ARM targets (Makefile.include builds those with -mfpu=neon),
+ * SSE2 on x86. Every vectorized function also has a plain C path, which is used
+ * when neither is available or when CV_SIMD_DISABLE is defined.
+ */
+
+#ifndef CV_SIMD_H
+#define CV_SIMD_H
+
+#if !defined(CV_SIMD_DISABLE) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define CV_SIMD_NEON 1
+#elif !defined(CV_SIMD_DISABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define CV_SIMD_SSE2 1
+#endif
+
+#if defined(CV_SIMD_NEON) || defined(CV_SIMD_SSE2)
+#define CV_SIMD 1
+#endif
+
+/* The kernels that are specialized for constant arguments (like the amount of filter taps) have to be inlined */
+#if defined(__GNUC__)
+#define CV_INLINE static inline __attribute__((always_inline))
+#else
+#define CV_INLINE static inline
+#endif
+
+#endif /* CV_SIMD_H */
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2016 Kimberly McGuire <k.n.mcguire@tudelft.nl
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/edge_stereo.c
+ * @brief calculate stereo disparity with edge histograms (EdgeStereo)
+ *
+ * A point at column x in the left image is found at column x - d in the right image,
+ * so the disparity d is searched in [0, disp_range]. The reference implementation uses
+ * the EdgeFlow block matcher directly. The fast variants compute the SAD of all windows
+ * at once per disparity with a running sum, which makes the cost independent of the window
+ * size, and compute the absolute differences with SIMD instructions when available.
+ */
+
+#include <lib/vision/edge_stereo.h>
+#include "simd.h"
+
+/**
+ * Calculate the edge histograms of the left and right image of an interlaced stereo frame
+ * The left image is stored in the even bytes and the right image in the odd bytes of the frame.
+ * @param[in] *img  The interlaced stereo frame
+ * @param[out] *edge_histogram_left  The edge histogram of the left image
+ * @param[out] *edge_histogram_right  The edge histogram of the right image
+ * @param[in] direction  Indicating if the histogram is made in either x or y direction
+ * @param[in] edge_threshold  A threshold if a gradient is considered a edge or not
+ */
+void calculate_edge_histogram_stereo(struct image_t *img, int32_t *edge_histogram_left,
+                                     int32_t *edge_histogram_right, char direction, uint16_t edge_threshold)
+{
+  calculate_edge_histogram_offset(img, edge_histogram_left, direction, edge_threshold, 0);
+  calculate_edge_histogram_offset(img, edge_histogram_right, direction, edge_threshold, 1);
+}
+
+/**
+ * Calculate the disparity per position between the left and right edge histogram
+ * Positions closer than window + disp_range to the left border or window to the right
+ * border are set to 0.
+ * @param[in] *edge_histogram_left  The edge histogram of the left image
+ * @param[in] *edge_histogram_right  The edge histogram of the right image
+ * @param[out] *disparity  The disparity per position in 1/subpixel_factor pixels
+ * @param[in] size  The size of the edge histograms
+ * @param[in] window  Indicating the search window size
+ * @param[in] disp_range  The maximum disparity (at most EDGE_STEREO_DISP_MAX)
+ * @param[in] subpixel_factor  The amount of subpixels per pixel, 1 for integer disparities
+ */
+void calculate_edge_disparity(int32_t *edge_histogram_left, int32_t *edge_histogram_right, int32_t *disparity,
+                              uint16_t size, uint8_t window, uint8_t disp_range, uint16_t subpixel_factor)
+{
+  uint16_t x;
+
+  calculate_edge_displacement_range(edge_histogram_left, edge_histogram_right, disparity, size, window,
+                                    -disp_range, 0, subpixel_factor);
+  for (x = 0; x < size; x++) {
+    disparity[x] = -disparity[x];
+  }
+}
+
+/**
+ * Absolute difference between the left histogram and the right histogram shifted by d
+ * @param[in] *left_hist  The left edge histogram (int32_t)
+ * @param[in] *right_hist  The right edge histogram (int32_t)
+ * @param[out] *diff  The absolute differences, diff[x] = |left[x] - right[x - d]| for d <= x < size
+ * @param[in] size  The size of the edge histograms
+ * @param[in] d  The disparity
+ */
+static void edge_absdiff_s32(void *left_hist, void *right_hist, uint32_t *diff, uint16_t size, uint16_t d)
+{
+  int32_t *left = (int32_t *)left_hist;
+  int32_t *right = (int32_t *)right_hist;
+  uint32_t x = d;
+
+#if defined(CV_SIMD_NEON)
+  for (; x + 4 <= size; x += 4) {
+    int32x4_t l = vld1q_s32(&left[x]);
+    int32x4_t r = vld1q_s32(&right[x - d]);
+    vst1q_u32(&diff[x], vreinterpretq_u32_s32(vabdq_s32(l, r)));
+  }
+#elif defined(CV_SIMD_SSE2)
+  for (; x + 4 <= size; x += 4) {
+    __m128i l = _mm_loadu_si128((__m128i *)&left[x]);
+    __m128i r = _mm_loadu_si128((__m128i *)&right[x - d]);
+    __m128i v = _mm_sub_epi32(l, r);
+    __m128i sign = _mm_srai_epi32(v, 31);
+    _mm_storeu_si128((__m128i *)&diff[x], _mm_sub_epi32(_mm_xor_si128(v, sign), sign));
+  }
+#endif
+  for (; x < size; x++) {
+    diff[x] = abs(left[x] - right[x - d]);
+  }
+}
+
+/**
+ * Absolute difference between the quantized left histogram and the shifted right histogram
+ * @param[in] *left_hist  The quantized left edge histogram (uint16_t)
+ * @param[in] *right_hist  The quantized right edge histogram (uint16_t)
+ * @param[out] *diff  The absolute differences, diff[x] = |left[x] - right[x - d]| for d <= x < size
+ * @param[in] size  The size of the edge histograms
+ * @param[in] d  The disparity
+ */
+static void edge_absdiff_u16(void *left_hist, void *right_hist, uint32_t *diff, uint16_t size, uint16_t d)
+{
+  uint16_t *left = (uint16_t *)left_hist;
+  uint16_t *right = (uint16_t *)right_hist;
+  uint32_t x = d;
+
+#if defined(CV_SIMD_NEON)
+  for (; x + 8 <= size; x += 8) {
+    uint16x8_t v = vabdq_u16(vld1q_u16(&left[x]), vld1q_u16(&right[x - d]));
+    vst1q_u32(&diff[x], vmovl_u16(vget_low_u16(v)));
+    vst1q_u32(&diff[x + 4], vmovl_u16(vget_high_u16(v)));
+  }
+#elif defined(CV_SIMD_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  for (; x + 8 <= size; x += 8) {
+    __m128i l = _mm_loadu_si128((__m128i *)&left[x]);
+    __m128i r = _mm_loadu_si128((__m128i *)&right[x - d]);
+    __m128i v = _mm_or_si128(_mm_subs_epu16(l, r), _mm_subs_epu16(r, l));
+    _mm_storeu_si128((__m128i *)&diff[x], _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i *)&diff[x + 4], _mm_unpackhi_epi16(v, zero));
+  }
+#endif
+  for (; x < size; x++) {
+    diff[x] = abs((int32_t)left[x] - (int32_t)right[x - d]);
+  }
+}
+
+/**
+ * Winner-takes-all search over the disparities with running window sums
+ * @param[in] absdiff  Function calculating the absolute differences for a disparity
+ * @param[in] *left  The left edge histogram
+ * @param[in] *right  The right edge histogram
+ * @param[out] *disparity  The disparity per position in 1/subpixel_factor pixels
+ * @param[in] size  The size of the edge histograms (at most EDGE_STEREO_MAX_SIZE)
+ * @param[in] window  Indicating the search window size
+ * @param[in] disp_range  The maximum disparity
+ * @param[in] subpixel_factor  The amount of subpixels per pixel
+ */
+static void edge_disparity_search(void (*absdiff)(void *, void *, uint32_t *, uint16_t, uint16_t),
+                                  void *left, void *right, int32_t *disparity, uint16_t size, uint8_t window,
+                                  uint8_t disp_range, uint16_t subpixel_factor)
+{
+  int32_t W = window;
+  int32_t D = disp_range;
+  int32_t start = W + D;
+  int32_t end = size - W;
+  int32_t x, d;
+
+  // The costs per position of the search
+  uint32_t diff[EDGE_STEREO_MAX_SIZE];
+  uint32_t cost_best[EDGE_STEREO_MAX_SIZE];
+  uint32_t cost_prev[EDGE_STEREO_MAX_SIZE];
+  uint32_t cost_left[EDGE_STEREO_MAX_SIZE];
+  uint32_t cost_right[EDGE_STEREO_MAX_SIZE];
+  int32_t disp_best[EDGE_STEREO_MAX_SIZE];
+
+  memset(disparity, 0, sizeof(int32_t) * size);
+  if (start >= end || D > EDGE_STEREO_DISP_MAX || size > EDGE_STEREO_MAX_SIZE) {
+    return;
+  }
+
+  for (d = 0; d <= D; d++) {
+    absdiff(left, right, diff, size, d);
+
+    // SAD of the window around start, which is then shifted along the histogram
+    uint32_t sad = 0;
+    for (x = start - W; x <= start + W; x++) {
+      sad += diff[x];
+    }
+
+    for (x = start; x < end; x++) {
+      if (x > start) {
+        sad += diff[x + W] - diff[x - W - 1];
+      }
+
+      // Keep the first minimum and the costs of its neighbouring disparities for the subpixel fit
+      if (d == 0 || sad < cost_best[x]) {
+        cost_best[x] = sad;
+        cost_left[x] = (d > 0) ? cost_prev[x] : 0;
+        disp_best[x] = d;
+      } else if (disp_best[x] == d - 1) {
+        cost_right[x] = sad;
+      }
+      cost_prev[x] = sad;
+    }
+  }
+
+  for (x = start; x < end; x++) {
+    disparity[x] = disp_best[x] * subpixel_factor;
+
+    if (disp_best[x] > 0 && disp_best[x] < D) {
+      int64_t curv = (int64_t)cost_left[x] - 2 * (int64_t)cost_best[x] + cost_right[x];
+      if (curv > 0) {
+        disparity[x] += (int32_t)((subpixel_factor * ((int64_t)cost_left[x] - cost_right[x])) / (2 * curv));
+      }
+    }
+  }
+}
+
+/**
+ * Calculate the disparity per position between the left and right edge histogram
+ * Gives the same result as calculate_edge_disparity, but its cost does not depend on the window size.
+ * @param[in] *edge_histogram_left  The edge histogram of the left image
+ * @param[in] *edge_histogram_right  The edge histogram of the right image
+ * @param[out] *disparity  The disparity per position in 1/subpixel_factor pixels
+ * @param[in] size  The size of the edge histograms (at most EDGE_STEREO_MAX_SIZE)
+ * @param[in] window  Indicating the search window size
+ * @param[in] disp_range  The maximum disparity (at most EDGE_STEREO_DISP_MAX)
+ * @param[in] subpixel_factor  The amount of subpixels per pixel, 1 for integer disparities
+ */
+void calculate_edge_disparity_fast(int32_t *edge_histogram_left, int32_t *edge_histogram_right, int32_t *disparity,
+                                   uint16_t size, uint8_t window, uint8_t disp_range, uint16_t subpixel_factor)
+{
+  edge_disparity_search(edge_absdiff_s32, edge_histogram_left, edge_histogram_right, disparity, size, window,
+                        disp_range, subpixel_factor);
+}
+
+/**
+ * Quantize an edge histogram to 16 bit fixed point
+ * @param[in] *edge_histogram  The edge histogram
+ * @param[out] *edge_histogram_q  The quantized edge histogram, saturated at 0xFFFF
+ * @param[in] size  The size of the edge histogram
+ * @param[in] shift  The amount of bits the histogram is shifted to the right
+ */
+void edge_histogram_quantize(int32_t *edge_histogram, uint16_t *edge_histogram_q, uint16_t size, uint8_t shift)
+{
+  uint16_t x;
+
+  for (x = 0; x < size; x++) {
+    int32_t v = edge_histogram[x] >> shift;
+    edge_histogram_q[x] = (v > 0xFFFF) ? 0xFFFF : ((v < 0) ? 0 : v);
+  }
+}
+
+/**
+ * Calculate the disparity per position between two quantized edge histograms
+ * The 16 bit histograms double the amount of positions per SIMD instruction and halve the memory traffic.
+ * @param[in] *edge_histogram_left  The quantized edge histogram of the left image
+ * @param[in] *edge_histogram_right  The quantized edge histogram of the right image
+ * @param[out] *disparity  The disparity per position in 1/subpixel_factor pixels
+ * @param[in] size  The size of the edge histograms (at most EDGE_STEREO_MAX_SIZE)
+ * @param[in] window  Indicating the search window size
+ * @param[in] disp_range  The maximum disparity (at most EDGE_STEREO_DISP_MAX)
+ * @param[in] subpixel_factor  The amount of subpixels per pixel, 1 for integer disparities
+ */
+void calculate_edge_disparity_q16(uint16_t *edge_histogram_left, uint16_t *edge_histogram_right, int32_t *disparity,
+                                  uint16_t size, uint8_t window, uint8_t disp_range, uint16_t subpixel_factor)
+{
+  edge_disparity_search(edge_absdiff_u16, edge_histogram_left, edge_histogram_right, disparity, size, window,
+                        disp_range, subpixel_factor);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2016 Kimberly McGuire <k.n.mcguire@tudelft.nl
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/edge_stereo.h
+ * @brief calculate stereo disparity with edge histograms (EdgeStereo)
+ *
+ * The edge histograms of the left and right image of an interlaced stereo frame are
+ * matched with the same block matching as EdgeFlow, which gives a disparity per column.
+ */
+
+#ifndef EDGE_STEREO_H_
+#define EDGE_STEREO_H_
+
+#include "std.h"
+#include "lib/vision/image.h"
+#include "lib/vision/edge_flow.h"
+
+#ifndef EDGE_STEREO_DISP_MAX
+#define EDGE_STEREO_DISP_MAX (2 * DISP_RANGE_MAX)   ///< Maximum disparity that can be searched
+#endif
+#ifndef EDGE_STEREO_MAX_SIZE
+#define EDGE_STEREO_MAX_SIZE EDGEFLOW_MAX_SIZE      ///< Maximum size of the edge histograms of the fast searches
+#endif
+
+void calculate_edge_histogram_stereo(struct image_t *img, int32_t *edge_histogram_left,
+                                     int32_t *edge_histogram_right, char direction, uint16_t edge_threshold);
+void calculate_edge_disparity(int32_t *edge_histogram_left, int32_t *edge_histogram_right, int32_t *disparity,
+                              uint16_t size, uint8_t window, uint8_t disp_range, uint16_t subpixel_factor);
+void calculate_edge_disparity_fast(int32_t *edge_histogram_left, int32_t *edge_histogram_right, int32_t *disparity,
+                                   uint16_t size, uint8_t window, uint8_t disp_range, uint16_t subpixel_factor);
+void edge_histogram_quantize(int32_t *edge_histogram, uint16_t *edge_histogram_q, uint16_t size, uint8_t shift);
+void calculate_edge_disparity_q16(uint16_t *edge_histogram_left, uint16_t *edge_histogram_right, int32_t *disparity,
+                                  uint16_t size, uint8_t window, uint8_t disp_range, uint16_t subpixel_factor);
+
+#endif /* EDGE_STEREO_H_ */
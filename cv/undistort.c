@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2016
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/undistort.c
+ * Lens undistortion with precomputed fixed-point remap tables
+ *
+ * All floating point work is done once in undistort_init. Every undistorted
+ * pixel gets the offset of the distorted pixel left above its position and the
+ * fraction of that position in 1/256 pixel, so the remapping of an image is a
+ * gather of 4 pixels and a bilinear blend with 8 bit weights per pixel. The
+ * blend runs on 8 pixels at once in 16 bit lanes. Positions outside the image
+ * are clamped to the border.
+ *
+ * Points and flow are undistorted through a coarse grid of undistorted positions
+ * of the distorted image, with bilinear interpolation in 16.16 fixed point.
+ */
+
+#include "undistort.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "simd.h"
+
+/**
+ * Distort a normalized image position
+ * @param[in] *cam The camera
+ * @param[in] x The undistorted x (in focal lengths from the principal point)
+ * @param[in] y The undistorted y
+ * @param[out] *xd The distorted x
+ * @param[out] *yd The distorted y
+ */
+static void undistort_distort(struct undistort_camera_t *cam, float x, float y, float *xd, float *yd)
+{
+  float r2 = x * x + y * y;
+  float radial = 1.f + r2 * (cam->k1 + r2 * (cam->k2 + r2 * cam->k3));
+  *xd = x * radial + 2.f * cam->p1 * x * y + cam->p2 * (r2 + 2.f * x * x);
+  *yd = y * radial + cam->p1 * (r2 + 2.f * y * y) + 2.f * cam->p2 * x * y;
+}
+
+/**
+ * Undistort a normalized image position by fixed-point iteration of the distortion model
+ * @param[in] *cam The camera
+ * @param[in] xd The distorted x (in focal lengths from the principal point)
+ * @param[in] yd The distorted y
+ * @param[out] *x The undistorted x
+ * @param[out] *y The undistorted y
+ */
+static void undistort_invert(struct undistort_camera_t *cam, float xd, float yd, float *x, float *y)
+{
+  float xu = xd, yu = yd;
+
+  for (uint8_t i = 0; i < 20; i++) {
+    float r2 = xu * xu + yu * yu;
+    float radial = 1.f + r2 * (cam->k1 + r2 * (cam->k2 + r2 * cam->k3));
+    float dx = 2.f * cam->p1 * xu * yu + cam->p2 * (r2 + 2.f * xu * xu);
+    float dy = cam->p1 * (r2 + 2.f * yu * yu) + 2.f * cam->p2 * xu * yu;
+    if (radial <= 0.f) {
+      break;
+    }
+    xu = (xd - dx) / radial;
+    yu = (yd - dy) / radial;
+  }
+  *x = xu;
+  *y = yu;
+}
+
+/**
+ * Prepare the undistortion of images and points of one camera and image size
+ * @param[out] *undistort The undistortion
+ * @param[in] *camera The intrinsics and distortion coefficients of the camera
+ * @param[in] w The width of the images (at least 2, even for YUV422)
+ * @param[in] h The height of the images (at least 2)
+ * @param[in] n_bands The amount of row bands of undistort_image, which run on threads (1 up to UNDISTORT_MAX_BANDS)
+ * @return True when the memory could be allocated and the size is supported
+ */
+bool undistort_init(struct undistort_t *undistort, struct undistort_camera_t *camera, uint16_t w, uint16_t h,
+                    uint8_t n_bands)
+{
+  memset(undistort, 0, sizeof(struct undistort_t));
+  undistort->w = w;
+  undistort->h = h;
+  undistort->n_bands = (n_bands < 1) ? 1 : ((n_bands > UNDISTORT_MAX_BANDS) ? UNDISTORT_MAX_BANDS : n_bands);
+  undistort->grid_w = (w + UNDISTORT_GRID - 2) / UNDISTORT_GRID + 1;
+  undistort->grid_h = (h + UNDISTORT_GRID - 2) / UNDISTORT_GRID + 1;
+  if (w < 2 || h < 2 || camera->fx == 0.f || camera->fy == 0.f) {
+    return false;
+  }
+
+  undistort->offset = malloc(sizeof(uint32_t) * w * h);
+  undistort->frac = malloc(sizeof(uint16_t) * w * h);
+  undistort->grid = malloc(sizeof(int32_t) * 2 * undistort->grid_w * undistort->grid_h);
+  if (undistort->offset == NULL || undistort->frac == NULL || undistort->grid == NULL) {
+    undistort_free(undistort);
+    return false;
+  }
+
+  // The distorted position of every undistorted pixel, in 1/256 pixel and clamped so the right and lower pixels exist
+  int32_t max_x = (w - 1) * 256 - 1;
+  int32_t max_y = (h - 1) * 256 - 1;
+  for (uint16_t v = 0; v < h; v++) {
+    for (uint16_t u = 0; u < w; u++) {
+      float xd, yd;
+      undistort_distort(camera, (u - camera->cx) / camera->fx, (v - camera->cy) / camera->fy, &xd, &yd);
+      float px = (xd * camera->fx + camera->cx) * 256.f;
+      float py = (yd * camera->fy + camera->cy) * 256.f;
+      int32_t sx = (px <= 0.f) ? 0 : ((px >= max_x) ? max_x : (int32_t)(px + 0.5f));
+      int32_t sy = (py <= 0.f) ? 0 : ((py >= max_y) ? max_y : (int32_t)(py + 0.5f));
+      undistort->offset[v * w + u] = (sy >> 8) * w + (sx >> 8);
+      undistort->frac[v * w + u] = (sx & 0xFF) | ((sy & 0xFF) << 8);
+    }
+  }
+
+  // The undistorted position of every grid node of the distorted image
+  for (uint16_t gy = 0; gy < undistort->grid_h; gy++) {
+    for (uint16_t gx = 0; gx < undistort->grid_w; gx++) {
+      float x, y;
+      undistort_invert(camera, (gx * UNDISTORT_GRID - camera->cx) / camera->fx,
+                       (gy * UNDISTORT_GRID - camera->cy) / camera->fy, &x, &y);
+      int32_t *node = &undistort->grid[2 * (gy * undistort->grid_w + gx)];
+      node[0] = lroundf((x * camera->fx + camera->cx) * 65536.f);
+      node[1] = lroundf((y * camera->fy + camera->cy) * 65536.f);
+    }
+  }
+  return true;
+}
+
+/**
+ * Free the tables of an undistortion
+ * @param[in] *undistort The undistortion
+ */
+void undistort_free(struct undistort_t *undistort)
+{
+  free(undistort->offset);
+  free(undistort->frac);
+  free(undistort->grid);
+  undistort->offset = NULL;
+  undistort->frac = NULL;
+  undistort->grid = NULL;
+}
+
+/**
+ * Bilinear blend of 4 pixels, first horizontally and then vertically, both rounded to 8 bit
+ * @param[in] p00 The pixel left above
+ * @param[in] p01 The pixel right above
+ * @param[in] p10 The pixel left below
+ * @param[in] p11 The pixel right below
+ * @param[in] frac The fraction of the position (x in the low, y in the high byte)
+ * @return The blended value
+ */
+static inline uint8_t undistort_blend(uint16_t p00, uint16_t p01, uint16_t p10, uint16_t p11, uint16_t frac)
+{
+  uint16_t fx = frac & 0xFF, fy = frac >> 8;
+  uint16_t top = (p00 * (256 - fx) + p01 * fx + 128) >> 8;
+  uint16_t bottom = (p10 * (256 - fx) + p11 * fx + 128) >> 8;
+  return (top * (256 - fy) + bottom * fy + 128) >> 8;
+}
+
+/**
+ * Bilinear blend of 8 gathered pixels
+ * @param[in] *p The pixels left above, right above, left below and right below (4 times 8)
+ * @param[in] *frac The fractions of the 8 positions
+ * @param[out] *dst The 8 blended values
+ */
+CV_INLINE void undistort_blend_8(uint16_t *p, uint16_t *frac, uint8_t *dst)
+{
+#if defined(CV_SIMD_SSE2)
+  __m128i f = _mm_loadu_si128((__m128i *)frac);
+  __m128i c256 = _mm_set1_epi16(256);
+  __m128i c128 = _mm_set1_epi16(128);
+  __m128i fx = _mm_and_si128(f, _mm_set1_epi16(0xFF));
+  __m128i fy = _mm_srli_epi16(f, 8);
+  __m128i ix = _mm_sub_epi16(c256, fx);
+  __m128i top = _mm_add_epi16(_mm_mullo_epi16(_mm_loadu_si128((__m128i *)p), ix),
+                              _mm_mullo_epi16(_mm_loadu_si128((__m128i *)(p + 8)), fx));
+  __m128i bottom = _mm_add_epi16(_mm_mullo_epi16(_mm_loadu_si128((__m128i *)(p + 16)), ix),
+                                 _mm_mullo_epi16(_mm_loadu_si128((__m128i *)(p + 24)), fx));
+  top = _mm_srli_epi16(_mm_add_epi16(top, c128), 8);
+  bottom = _mm_srli_epi16(_mm_add_epi16(bottom, c128), 8);
+  __m128i out = _mm_add_epi16(_mm_mullo_epi16(top, _mm_sub_epi16(c256, fy)), _mm_mullo_epi16(bottom, fy));
+  out = _mm_srli_epi16(_mm_add_epi16(out, c128), 8);
+  _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(out, out));
+#elif defined(CV_SIMD_NEON)
+  uint16x8_t f = vld1q_u16(frac);
+  uint16x8_t fx = vandq_u16(f, vdupq_n_u16(0xFF));
+  uint16x8_t fy = vshrq_n_u16(f, 8);
+  uint16x8_t ix = vsubq_u16(vdupq_n_u16(256), fx);
+  uint16x8_t top = vmlaq_u16(vmulq_u16(vld1q_u16(p), ix), vld1q_u16(p + 8), fx);
+  uint16x8_t bottom = vmlaq_u16(vmulq_u16(vld1q_u16(p + 16), ix), vld1q_u16(p + 24), fx);
+  top = vrshrq_n_u16(top, 8);
+  bottom = vrshrq_n_u16(bottom, 8);
+  uint16x8_t out = vmlaq_u16(vmulq_u16(top, vsubq_u16(vdupq_n_u16(256), fy)), bottom, fy);
+  vst1_u8(dst, vmovn_u16(vrshrq_n_u16(out, 8)));
+#else
+  for (uint8_t i = 0; i < 8; i++) {
+    dst[i] = undistort_blend(p[i], p[8 + i], p[16 + i], p[24 + i], frac[i]);
+  }
+#endif
+}
+
+/**
+ * Undistort the rows y0 up to y1 of an image
+ * The rows can be done in any order and by several threads at once.
+ * @param[in] *undistort The undistortion (see undistort_init)
+ * @param[in] *input The distorted image (YUV422 or grayscale, w x h pixels)
+ * @param[out] *output The undistorted image of the type and size of the input
+ * @param[in] y0 The first row
+ * @param[in] y1 The end of the rows
+ */
+void undistort_image_rows(struct undistort_t *undistort, struct image_t *input, struct image_t *output, uint16_t y0,
+                          uint16_t y1)
+{
+  uint16_t w = undistort->w;
+  uint8_t *src = (uint8_t *)input->buf;
+  uint8_t *dst = (uint8_t *)output->buf;
+  // The luma of YUV422 is every second byte, starting at the second
+  uint8_t step = (input->type == IMAGE_YUV422) ? 2 : 1;
+  uint8_t *luma = src + step - 1;
+  uint32_t below = w * step;
+  uint16_t p[32];
+  uint8_t out[8];
+  uint16_t x;
+
+  for (uint16_t y = y0; y < y1; y++) {
+    uint32_t *offset = &undistort->offset[y * w];
+    uint16_t *frac = &undistort->frac[y * w];
+    uint8_t *row = &dst[y * w * step];
+
+    for (x = 0; x + 8 <= w; x += 8) {
+      for (uint8_t i = 0; i < 8; i++) {
+        uint8_t *s = &luma[offset[x + i] * step];
+        p[i] = s[0];
+        p[8 + i] = s[step];
+        p[16 + i] = s[below];
+        p[24 + i] = s[below + step];
+      }
+      undistort_blend_8(p, &frac[x], out);
+      if (step == 1) {
+        memcpy(&row[x], out, 8);
+      } else {
+        for (uint8_t i = 0; i < 8; i++) {
+          row[2 * (x + i) + 1] = out[i];
+        }
+      }
+    }
+    for (; x < w; x++) {
+      uint8_t *s = &luma[offset[x] * step];
+      row[(x + 1) * step - 1] = undistort_blend(s[0], s[step], s[below], s[below + step], frac[x]);
+    }
+
+    // The macropixels get the U and V of the macropixel of the pixel nearest to the position of their first pixel
+    if (step == 2) {
+      for (x = 0; x + 1 < w; x += 2) {
+        uint32_t nearest = offset[x] + ((frac[x] & 0xFF) >= 128) + ((frac[x] >> 8) >= 128) * w;
+        uint8_t *s = &src[2 * (nearest & ~1)];
+        row[2 * x] = s[0];
+        row[2 * x + 2] = s[2];
+      }
+    }
+  }
+}
+
+/* A band of rows of undistort_image */
+struct undistort_band_t {
+  struct undistort_t *undistort;
+  struct image_t *input;
+  struct image_t *output;
+  uint8_t band;
+};
+
+/**
+ * Undistort a band of rows
+ * @param[in] *data The band
+ * @return NULL
+ */
+static void *undistort_band_thread(void *data)
+{
+  struct undistort_band_t *band = (struct undistort_band_t *)data;
+  struct undistort_t *undistort = band->undistort;
+  uint16_t y0 = band->band * undistort->h / undistort->n_bands;
+  uint16_t y1 = (band->band + 1) * undistort->h / undistort->n_bands;
+
+  undistort_image_rows(undistort, band->input, band->output, y0, y1);
+  return NULL;
+}
+
+/**
+ * Undistort an image
+ * The rows are split in bands, the first band runs on the calling thread and every other band on a thread of its own.
+ * @param[in] *undistort The undistortion (see undistort_init)
+ * @param[in] *input The distorted image (YUV422 or grayscale, w x h pixels)
+ * @param[out] *output The undistorted image, which gets the type of the input (can't be the input)
+ */
+void undistort_image(struct undistort_t *undistort, struct image_t *input, struct image_t *output)
+{
+  uint32_t size = undistort->w * undistort->h * ((input->type == IMAGE_YUV422) ? 2 : 1);
+  if (undistort->offset == NULL || input->w != undistort->w || input->h != undistort->h ||
+      (input->type != IMAGE_YUV422 && input->type != IMAGE_GRAYSCALE) || input->buf_size < size ||
+      output->buf_size < size || (input->type == IMAGE_YUV422 && undistort->w % 2 != 0)) {
+    return;
+  }
+  output->type = input->type;
+  output->w = input->w;
+  output->h = input->h;
+  output->ts = input->ts;
+  output->pprz_ts = input->pprz_ts;
+
+  struct undistort_band_t bands[UNDISTORT_MAX_BANDS];
+  pthread_t threads[UNDISTORT_MAX_BANDS];
+  bool started[UNDISTORT_MAX_BANDS];
+
+  for (uint8_t b = 0; b < undistort->n_bands; b++) {
+    bands[b].undistort = undistort;
+    bands[b].input = input;
+    bands[b].output = output;
+    bands[b].band = b;
+    started[b] = false;
+  }
+  for (uint8_t b = 1; b < undistort->n_bands; b++) {
+    started[b] = (pthread_create(&threads[b], NULL, undistort_band_thread, &bands[b]) == 0);
+    if (!started[b]) {
+      // No thread, so the band runs here
+      undistort_band_thread(&bands[b]);
+    }
+  }
+  undistort_band_thread(&bands[0]);
+  for (uint8_t b = 1; b < undistort->n_bands; b++) {
+    if (started[b]) {
+      pthread_join(threads[b], NULL);
+    }
+  }
+}
+
+/**
+ * Undistort a position by bilinear interpolation on the grid
+ * @param[in] *undistort The undistortion
+ * @param[in,out] *point The position in 1/subpixel_factor pixel, clamped to the image
+ * @param[in] subpixel_factor The subpixels per pixel
+ */
+static void undistort_point(struct undistort_t *undistort, struct point_t *point, uint16_t subpixel_factor)
+{
+  // The position in the grid, in 1/65536 grid cell
+  int64_t max_x = (int64_t)(undistort->w - 1) << 16;
+  int64_t max_y = (int64_t)(undistort->h - 1) << 16;
+  int64_t px = ((int64_t)point->x << 16) / subpixel_factor;
+  int64_t py = ((int64_t)point->y << 16) / subpixel_factor;
+  px = (px < 0) ? 0 : ((px > max_x) ? max_x : px);
+  py = (py < 0) ? 0 : ((py > max_y) ? max_y : py);
+  px /= UNDISTORT_GRID;
+  py /= UNDISTORT_GRID;
+
+  uint16_t gx = px >> 16, gy = py >> 16;
+  gx = (gx + 1 >= undistort->grid_w) ? undistort->grid_w - 2 : gx;
+  gy = (gy + 1 >= undistort->grid_h) ? undistort->grid_h - 2 : gy;
+  int64_t ax = px - ((int64_t)gx << 16);
+  int64_t ay = py - ((int64_t)gy << 16);
+
+  int32_t *n00 = &undistort->grid[2 * (gy * undistort->grid_w + gx)];
+  int32_t *n10 = n00 + 2 * undistort->grid_w;
+  for (uint8_t c = 0; c < 2; c++) {
+    int64_t top = n00[c] * (65536 - ax) + n00[2 + c] * ax;
+    int64_t bottom = n10[c] * (65536 - ax) + n10[2 + c] * ax;
+    int64_t pos = (top >> 16) * (65536 - ay) + (bottom >> 16) * ay;
+    // Back from 1/2^32 pixel to subpixels, rounded
+    pos = (pos * subpixel_factor + ((int64_t)1 << 31)) >> 32;
+    if (c == 0) {
+      point->x = pos;
+    } else {
+      point->y = pos;
+    }
+  }
+}
+
+/**
+ * Undistort points in place
+ * @param[in] *undistort The undistortion (see undistort_init)
+ * @param[in,out] *points The positions in 1/subpixel_factor pixel of the distorted image
+ * @param[in] points_cnt The amount of points
+ * @param[in] subpixel_factor The subpixels per pixel (1 for pixels)
+ */
+void undistort_points(struct undistort_t *undistort, struct point_t *points, uint16_t points_cnt,
+                      uint16_t subpixel_factor)
+{
+  if (undistort->grid == NULL || subpixel_factor == 0) {
+    return;
+  }
+  for (uint16_t i = 0; i < points_cnt; i++) {
+    undistort_point(undistort, &points[i], subpixel_factor);
+  }
+}
+
+/**
+ * Undistort flow vectors in place, both the position and the end of every vector
+ * @param[in] *undistort The undistortion (see undistort_init)
+ * @param[in,out] *vectors The flow vectors, with the position and flow in 1/subpixel_factor pixel
+ * @param[in] vectors_cnt The amount of vectors
+ * @param[in] subpixel_factor The subpixels per pixel
+ */
+void undistort_flow(struct undistort_t *undistort, struct flow_t *vectors, uint16_t vectors_cnt,
+                    uint16_t subpixel_factor)
+{
+  if (undistort->grid == NULL || subpixel_factor == 0) {
+    return;
+  }
+  for (uint16_t i = 0; i < vectors_cnt; i++) {
+    struct point_t end = {vectors[i].pos.x + vectors[i].flow_x, vectors[i].pos.y + vectors[i].flow_y};
+    undistort_point(undistort, &vectors[i].pos, subpixel_factor);
+    undistort_point(undistort, &end, subpixel_factor);
+    vectors[i].flow_x = end.x - vectors[i].pos.x;
+    vectors[i].flow_y = end.y - vectors[i].pos.y;
+  }
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016
+ *
+ * This file is part of Paparazzi.
+ *
+ * Paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * Paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file modules/computer_vision/lib/vision/undistort.h
+ * Lens undistortion with precomputed fixed-point remap tables
+ *
+ * The camera is a pinhole camera with radial (k1, k2, k3) and tangential (p1, p2)
+ * distortion. The undistorted image has the intrinsics of the distorted one. The
+ * tables are made once by undistort_init: a map from every undistorted pixel to
+ * its distorted position for the remapping of images, and a grid of undistorted
+ * positions of the distorted image for the undistortion of points and flow.
+ */
+
+#ifndef UNDISTORT_H
+#define UNDISTORT_H
+
+#include "std.h"
+#include "image.h"
+
+#define UNDISTORT_MAX_BANDS 8     ///< Maximum amount of row bands (threads) of the remapping
+#define UNDISTORT_GRID 8          ///< Pixels between the nodes of the point undistortion grid
+
+/* Intrinsics and distortion coefficients of a camera, in pixels */
+struct undistort_camera_t {
+  float fx;               ///< Focal length along the columns
+  float fy;               ///< Focal length along the rows
+  float cx;               ///< Column of the principal point
+  float cy;               ///< Row of the principal point
+  float k1;               ///< Radial distortion of r^2
+  float k2;               ///< Radial distortion of r^4
+  float k3;               ///< Radial distortion of r^6
+  float p1;               ///< Tangential distortion
+  float p2;               ///< Tangential distortion
+};
+
+/* Remap tables of a camera (see undistort_init) */
+struct undistort_t {
+  uint16_t w;             ///< Image width
+  uint16_t h;             ///< Image height
+  uint8_t n_bands;        ///< Amount of row bands of undistort_image, every band but the first runs on a thread
+  uint32_t *offset;       ///< Per undistorted pixel the distorted pixel left above its position
+  uint16_t *frac;         ///< Per undistorted pixel the fraction of its position in 1/256 pixel (x low, y high byte)
+  uint16_t grid_w;        ///< Columns of the point grid
+  uint16_t grid_h;        ///< Rows of the point grid
+  int32_t *grid;          ///< Undistorted x and y of the grid nodes, 16.16 fixed point
+};
+
+bool undistort_init(struct undistort_t *undistort, struct undistort_camera_t *camera, uint16_t w, uint16_t h,
+                    uint8_t n_bands);
+void undistort_free(struct undistort_t *undistort);
+void undistort_image(struct undistort_t *undistort, struct image_t *input, struct image_t *output);
+void undistort_image_rows(struct undistort_t *undistort, struct image_t *input, struct image_t *output, uint16_t y0,
+                          uint16_t y1);
+void undistort_points(struct undistort_t *undistort, struct point_t *points, uint16_t points_cnt,
+                      uint16_t subpixel_factor);
+void undistort_flow(struct undistort_t *undistort, struct flow_t *vectors, uint16_t vectors_cnt,
+                    uint16_t subpixel_factor);
+
+#endif /* UNDISTORT_H */
@@ -62,6 +62,36 @@ PRINT_CONFIG_VAR(VIDEO_THREAD_NICE_LEVEL)
 #endif
 PRINT_CONFIG_VAR(VIDEO_THREAD_MAX_CAMERAS)
 
+// The size of the debayered image, 272x272 as the images of the bebop front camera have always been. The whole
+// frame is scaled to this size, 0 is the size of the rotated half resolution image
+#ifndef VIDEO_THREAD_DEBAYER_WIDTH
+#define VIDEO_THREAD_DEBAYER_WIDTH 272
+#endif
+PRINT_CONFIG_VAR(VIDEO_THREAD_DEBAYER_WIDTH)
+
+#ifndef VIDEO_THREAD_DEBAYER_HEIGHT
+#define VIDEO_THREAD_DEBAYER_HEIGHT 272
+#endif
+PRINT_CONFIG_VAR(VIDEO_THREAD_DEBAYER_HEIGHT)
+
+// The sample format of the raw images (BAYER_RAW16, or MIPI packed BAYER_RAW10 or BAYER_RAW12)
+#ifndef VIDEO_THREAD_DEBAYER_FORMAT
+#define VIDEO_THREAD_DEBAYER_FORMAT BAYER_RAW16
+#endif
+PRINT_CONFIG_VAR(VIDEO_THREAD_DEBAYER_FORMAT)
+
+// The rotation or mirror of the frames, for the mounting of the camera (see enum image_orientation)
+#ifndef VIDEO_THREAD_ROTATION
+#define VIDEO_THREAD_ROTATION IMAGE_ROTATE_0
+#endif
+PRINT_CONFIG_VAR(VIDEO_THREAD_ROTATION)
+
+// The amount of threads of the debayering
+#ifndef VIDEO_THREAD_DEBAYER_BANDS
+#define VIDEO_THREAD_DEBAYER_BANDS 2
+#endif
+PRINT_CONFIG_VAR(VIDEO_THREAD_DEBAYER_BANDS)
+
 struct video_config_t *cameras[VIDEO_THREAD_MAX_CAMERAS];
 
 // Main thread
@@ -88,12 +118,36 @@ static void *video_thread_function(void *data)
   snprintf(print_tag, 80, "video_thread-%s", vid->dev_name);
 
   struct image_t img_color;
+  struct image_t img_rotated;
+  struct bayer_t bayer;
+  enum image_orientation rotation = VIDEO_THREAD_ROTATION;
+  img_rotated.buf = NULL;
 
   // create the images
   if (vid->filters & VIDEO_FILTER_DEBAYER) {
-    // fixme: don't hardcode size, works for bebop front camera for now
-#define IMG_FLT_SIZE 272
-    image_create(&img_color, IMG_FLT_SIZE, IMG_FLT_SIZE, IMAGE_YUV422);
+    // the raw image is rotated by 270 degrees (the bebop front camera is mounted sideways)
+    uint16_t debayer_w = VIDEO_THREAD_DEBAYER_WIDTH ? VIDEO_THREAD_DEBAYER_WIDTH : (vid->output_size.h / 2) & ~1;
+    uint16_t debayer_h = VIDEO_THREAD_DEBAYER_HEIGHT ? VIDEO_THREAD_DEBAYER_HEIGHT : vid->output_size.w / 2;
+    enum bayer_rotation bayer_rotation = BAYER_ROTATE_270;
+
+    // a rotation of the frames is added to that of the debayering, so it needs no pass of its own. The frames keep
+    // the size they would have after rotating the debayered image, mirrors are still done afterwards.
+    if (rotation == IMAGE_ROTATE_90 || rotation == IMAGE_ROTATE_180 || rotation == IMAGE_ROTATE_270) {
+      // both count quarter turns clockwise
+      bayer_rotation = (enum bayer_rotation)((BAYER_ROTATE_270 + rotation) % 4);
+      if (rotation != IMAGE_ROTATE_180) {
+        uint16_t w = debayer_w;
+        debayer_w = debayer_h & ~1;
+        debayer_h = w;
+      }
+      rotation = IMAGE_ROTATE_0;
+    }
+    if (!bayer_init(&bayer, vid->output_size.w, vid->output_size.h, VIDEO_THREAD_DEBAYER_FORMAT, debayer_w, debayer_h,
+                    0, 0, bayer_rotation, BAYER_SAMPLE_NEAREST, VIDEO_THREAD_DEBAYER_BANDS)) {
+      fprintf(stderr, "[%s] Could not initialize the debayering.\n", print_tag);
+      return 0;
+    }
+    image_create(&img_color, debayer_w, debayer_h, IMAGE_YUV422);
   }
 
   // Start the streaming of the V4L2 device
@@ -144,11 +198,23 @@ static void *video_thread_function(void *data)
 
     // run selected filters
     if (vid->filters & VIDEO_FILTER_DEBAYER) {
-      BayerToYUV(&img, &img_color, 0, 0);
+      bayer_convert(&bayer, &img, &img_color);
       // use color image for further processing
       img_final = &img_color;
     }
 
+    // rotate or mirror the frame when the debayering did not, the rotated image is created at the first frame
+    if (rotation != IMAGE_ROTATE_0 &&
+        (img_final->type == IMAGE_YUV422 || img_final->type == IMAGE_GRAYSCALE)) {
+      if (img_rotated.buf == NULL) {
+        struct img_size_t size;
+        image_rotate_size(img_final, rotation, &size);
+        image_create(&img_rotated, size.w, size.h, img_final->type);
+      }
+      image_rotate(img_final, &img_rotated, rotation);
+      img_final = &img_rotated;
+    }
+
     // Run processing if required
     cv_run_device(vid, img_final);
 
@@ -156,7 +222,11 @@ static void *video_thread_function(void *data)
     v4l2_image_free(vid->thread.dev, &img);
   }
 
-  image_free(&img_color);
+  if (vid->filters & VIDEO_FILTER_DEBAYER) {
+    bayer_free(&bayer);
+    image_free(&img_color);
+  }
+  image_free(&img_rotated);
 
   return 0;
 }
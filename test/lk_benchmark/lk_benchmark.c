@@ -0,0 +1,95 @@
+/*
+ * Benchmark of the int based Lucas-Kanade tracker of optic_flow_gdc.c:
+ * the original implementation (lk_reference.c) against opticFlowLKYUV422,
+ * which runs on lucas_kanade_core. Both get the same synthetic UYVY frames
+ * and should give exactly the same flow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "opticflow/optic_flow_gdc.h"
+#include "lk_reference.h"
+
+#define IMG_W 320
+#define IMG_H 240
+#define N_POINTS 100
+#define N_FRAMES 50
+
+static double get_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A textured scene moved by (dx, dy) pixels, with some noise */
+static void render_frame(unsigned char *frame, double dx, double dy)
+{
+  for (int y = 0; y < IMG_H; y++) {
+    for (int x = 0; x < IMG_W; x++) {
+      double sx = x - dx, sy = y - dy;
+      double v = 128 + 50 * sin(sx * 0.21) + 40 * cos(sy * 0.17 - sx * 0.05) + 30 * sin((sx + sy) * 0.33);
+      v += rand() % 5 - 2;
+      frame[(y * IMG_W + x) * 2] = 128;
+      frame[(y * IMG_W + x) * 2 + 1] = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int half_window_size = (argc > 1) ? atoi(argv[1]) : 5;
+  int max_iterations = (argc > 2) ? atoi(argv[2]) : 10;
+
+  unsigned char *frames[N_FRAMES + 1];
+  int p_x[N_POINTS], p_y[N_POINTS];
+  int new_x[2][N_POINTS], new_y[2][N_POINTS], status[2][N_POINTS];
+  double time[2] = {0, 0};
+  int mismatches = 0, tracked = 0;
+
+  printf("Lucas-Kanade benchmark, %dx%d, %d points, half window %d, %d iterations\n", IMG_W, IMG_H, N_POINTS,
+         half_window_size, max_iterations);
+
+  // Render a scene moving along a circle
+  srand(1);
+  for (int f = 0; f <= N_FRAMES; f++) {
+    frames[f] = malloc(IMG_W * IMG_H * 2);
+    render_frame(frames[f], 3 * cos(f * 0.3), 3 * sin(f * 0.3));
+  }
+
+  for (int f = 0; f < N_FRAMES; f++) {
+    for (int p = 0; p < N_POINTS; p++) {
+      p_x[p] = 10 + (p % 10) * (IMG_W - 20) / 10;
+      p_y[p] = 10 + (p / 10) * (IMG_H - 20) / 10;
+    }
+
+    double start = get_time();
+    opticFlowLK_ref(frames[f + 1], frames[f], p_x, p_y, N_POINTS, IMG_W, IMG_H, new_x[0], new_y[0], status[0],
+                    half_window_size, max_iterations);
+    double mid = get_time();
+    opticFlowLKYUV422(frames[f + 1], frames[f], p_x, p_y, N_POINTS, IMG_W, IMG_H, new_x[1], new_y[1], status[1],
+                      half_window_size, max_iterations);
+    double end = get_time();
+    time[0] += mid - start;
+    time[1] += end - mid;
+
+    for (int p = 0; p < N_POINTS; p++) {
+      tracked += status[1][p];
+      if (new_x[0][p] != new_x[1][p] || new_y[0][p] != new_y[1][p] || status[0][p] != status[1][p]) {
+        mismatches++;
+      }
+    }
+  }
+
+  printf("reference:         %8.3f ms/frame\n", time[0] * 1000 / N_FRAMES);
+  printf("lucas_kanade_core: %8.3f ms/frame (%.1fx)\n", time[1] * 1000 / N_FRAMES, time[0] / time[1]);
+  printf("tracked %d of %d points, %d differ from the reference\n", tracked, N_FRAMES * N_POINTS, mismatches);
+
+  for (int f = 0; f <= N_FRAMES; f++) {
+    free(frames[f]);
+  }
+  return (mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,10 @@
+/*
+ * Reference copy of the original int based Lucas-Kanade tracker of optic_flow_gdc.c
+ */
+
+#ifndef LK_REFERENCE_H
+#define LK_REFERENCE_H
+
+int opticFlowLK_ref(unsigned char * new_image_buf, unsigned char * old_image_buf, int* p_x, int* p_y, int n_found_points, int imW, int imH, int* new_x, int* new_y, int* status, int half_window_size, int max_iterations);
+
+#endif /* LK_REFERENCE_H */
@@ -0,0 +1,215 @@
+/*
+ * Benchmark of the sky segmentation at reduced resolution: the obstacle bins
+ * above the horizon at full resolution (get_obstacle_bins_above_horizon_mask)
+ * against the bins of a frame downscaled by 2 and 4, made directly at the
+ * small size or from the small mask scaled up to the full frame, and the full
+ * resolution split in bands of rows on threads (skyseg_segment). The frames
+ * are synthetic, with a horizon that moves with pitch and roll and dark
+ * textured obstacles that stick out above it. The patch means of the
+ * summed-area tables are checked against getPatchMean first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "segmentation/skysegmentation.h"
+
+#define IMG_W 320
+#define IMG_H 240
+#define N_FRAMES 50
+#define N_BINS 10
+#define MAX_BIN_VALUE 254
+#define ADJUST_FACTOR 3
+#define MAX_BANDS 4
+
+// used by the segmentation
+unsigned int imgWidth, imgHeight;
+
+int getObstacles2WayMask(unsigned int* obstacles, unsigned int n_bins, struct sky_mask* mask, unsigned int* max_bin,
+                         unsigned int* obstacle_total, int MAX_SIGNAL, int pitch_pixels, int roll_angle);
+int getPatchMean(unsigned char *frame_buf, int x, int y, int patch_size);
+
+// a tree on the patch means alone: ground where the mean luma is at most 120
+static const struct sky_tree_node patch_nodes[] = {
+  {SKY_FEATURE_PATCH_Y, SKY_SCALE_ABSOLUTE, 120, 0, 1, 2},
+  {SKY_TREE_LEAF, SKY_SCALE_ABSOLUTE, 0, 0, 0, 1},
+  {SKY_TREE_LEAF, SKY_SCALE_ABSOLUTE, 0, 0, 0, 0}
+};
+static const struct sky_tree patch_tree = {3, patch_nodes};
+
+static double get_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned char clip(double v)
+{
+  return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+/* Bright sky above a line with the given slope and height, textured ground and obstacles below and across it */
+static void render_frame(unsigned char *frame, double horizon, double slope, int f)
+{
+  for (int y = 0; y < IMG_H; y++) {
+    for (int x = 0; x < IMG_W; x += 2) {
+      int ix = (y * IMG_W + x) * 2;
+      double line = horizon + slope * (x - IMG_W / 2);
+      int obstacle = ((x + 3 * f) % 80 < 14) && y > line - 30 - 20 * sin(x * 0.05);
+      for (int i = 0; i < 2; i++) {
+        double v;
+        if (y < line && !obstacle) {
+          v = 200 - 0.2 * y + rand() % 4;
+        } else {
+          v = 70 + 30 * sin((x + i) * 0.7) * cos(y * 0.9) + rand() % 30;
+        }
+        frame[ix + 1 + 2 * i] = clip(v);
+      }
+      frame[ix] = (y < line && !obstacle) ? 150 + rand() % 6 : 115 + rand() % 20;
+      frame[ix + 2] = (y < line && !obstacle) ? 115 + rand() % 6 : 130 + rand() % 20;
+    }
+  }
+}
+
+int main(void)
+{
+  int factors[] = {2, 4};
+  unsigned char *frames[N_FRAMES];
+  int pitch[N_FRAMES], roll[N_FRAMES];
+  unsigned int full_bins[N_FRAMES][N_BINS], bins[N_BINS], uncertainty[N_BINS], max_bin, bin_total;
+  struct sky_mask full_masks[N_FRAMES], small_mask, upsampled;
+  double start, time_full = 0;
+
+  imgWidth = IMG_W;
+  imgHeight = IMG_H;
+  printf("Sky segmentation benchmark, %dx%d, %d bins, %d frames\n", IMG_W, IMG_H, N_BINS, N_FRAMES);
+
+  srand(1);
+  for (int f = 0; f < N_FRAMES; f++) {
+    pitch[f] = (int)(8 * sin(f * 0.2));
+    roll[f] = (int)(10 * sin(f * 0.13));
+    frames[f] = malloc(IMG_W * IMG_H * 2);
+    // the horizon of get_obstacle_bins_above_horizon, the slope is approximately tan(roll)
+    render_frame(frames[f], IMG_H / 2 + (pitch[f] * (IMG_H / 2)) / 40.0, -tan(roll[f] * M_PI / 180), f);
+  }
+
+  // The summed-area tables against the patch loops, odd patch sizes cover patch_size * patch_size pixels
+  struct sky_integral integral;
+  int mean_mismatches = 0, tree_mismatches = 0;
+  initSkyIntegral(&integral, IMG_W, IMG_H);
+  computeSkyIntegral(frames[0], &integral);
+  for (int patch_size = 1; patch_size <= 21; patch_size += 4) {
+    for (int y = 0; y < IMG_H; y++) {
+      for (int x = 0; x < IMG_W; x++) {
+        mean_mismatches += getPatchMeanIntegral(&integral, x, y, patch_size) != getPatchMean(frames[0], x, y, patch_size);
+      }
+    }
+  }
+  freeSkyIntegral(&integral);
+
+  // and in a tree, the patches of size 10 are 11 x 11 pixels
+  initSkyMask(&small_mask, IMG_W, IMG_H);
+  segmentSkyTreeMask(frames[0], &small_mask, &patch_tree, 0);
+  for (int y = 0; y < IMG_H; y++) {
+    for (int x = 0; x < IMG_W; x += 2) {
+      int ground = getPatchMean(frames[0], x, y, 11) <= 120 || getPatchMean(frames[0], x + 1, y, 11) <= 120;
+      unsigned int word = y * small_mask.words_per_row + x / SKY_MASK_WORD_BITS;
+      tree_mismatches += (int)((small_mask.ground[word] >> (x % SKY_MASK_WORD_BITS)) & 1) != ground;
+    }
+  }
+  freeSkyMask(&small_mask);
+  printf("patch means:           %d pixel(s) differ from getPatchMean, %d macropixel(s) in the tree\n",
+         mean_mismatches, tree_mismatches);
+
+  // Full resolution
+  for (int f = 0; f < N_FRAMES; f++) {
+    initSkyMask(&full_masks[f], IMG_W, IMG_H);
+    start = get_time();
+    get_obstacle_bins_above_horizon_mask(frames[f], &full_masks[f], ADJUST_FACTOR, N_BINS, full_bins[f], uncertainty,
+                                         pitch[f], roll[f]);
+    time_full += get_time() - start;
+  }
+  printf("full resolution:       %7.3f ms/frame\n", time_full * 1000 / N_FRAMES);
+
+  // Full resolution in bands, ADJUST_FACTOR 3 is no adjust of the tree
+  for (int n_bands = 1; n_bands <= MAX_BANDS; n_bands *= 2) {
+    struct skyseg_ctx ctx;
+    double time_bands = 0;
+    int mismatches = 0;
+
+    skyseg_init(&ctx, IMG_W, IMG_H, &sky_tree_no_yco_adjust, n_bands);
+    for (int f = 0; f < N_FRAMES; f++) {
+      start = get_time();
+      skyseg_segment(&ctx, frames[f], 0);
+      skyseg_obstacle_bins(&ctx, N_BINS, bins, uncertainty, pitch[f], roll[f]);
+      time_bands += get_time() - start;
+      mismatches += memcmp(bins, full_bins[f], sizeof(bins)) != 0;
+    }
+    printf("%d band(s):             %7.3f ms/frame  %6.1fx  %d frame(s) with other bins\n", n_bands,
+           time_bands * 1000 / N_FRAMES, time_full / time_bands, mismatches);
+    skyseg_free(&ctx);
+  }
+  printf("factor  path        ms/frame  speedup  mask agreement  mean |bin error|  max |bin error|\n");
+
+  for (unsigned int i = 0; i < sizeof(factors) / sizeof(factors[0]); i++) {
+    int factor = factors[i];
+    double time_small = 0, time_up = 0, agreement = 0, error_small = 0, error_up = 0;
+    int max_small = 0, max_up = 0;
+
+    initSkyMask(&small_mask, (IMG_W / factor) & ~1, IMG_H / factor);
+    initSkyMask(&upsampled, IMG_W, IMG_H);
+    for (int f = 0; f < N_FRAMES; f++) {
+      // bins at the small size
+      start = get_time();
+      get_obstacle_bins_above_horizon_decimated(frames[f], &small_mask, factor, ADJUST_FACTOR, N_BINS, bins,
+                                                uncertainty, pitch[f], roll[f]);
+      time_small += get_time() - start;
+      for (int b = 0; b < N_BINS; b++) {
+        int error = abs((int)bins[b] - (int)full_bins[f][b]);
+        error_small += error;
+        max_small = (error > max_small) ? error : max_small;
+      }
+
+      // bins of the upsampled mask
+      start = get_time();
+      segmentSkyTreeDecimated(frames[f], &small_mask, &sky_tree_no_yco_adjust, 0, factor);
+      upsampleSkyMask(&small_mask, &upsampled, factor);
+      getObstacles2WayMask(bins, N_BINS, &upsampled, &max_bin, &bin_total, MAX_BIN_VALUE,
+                           (pitch[f] * (IMG_H / 2)) / 40, roll[f]);
+      time_up += get_time() - start;
+      for (int b = 0; b < N_BINS; b++) {
+        int error = abs((int)bins[b] - (int)full_bins[f][b]);
+        error_up += error;
+        max_up = (error > max_up) ? error : max_up;
+      }
+
+      // pixels with the same class as at full resolution
+      int same = 0;
+      for (int y = 0; y < IMG_H; y++) {
+        for (int x = 0; x < IMG_W; x++) {
+          unsigned int word = y * upsampled.words_per_row + x / SKY_MASK_WORD_BITS;
+          unsigned int bit = 1u << (x % SKY_MASK_WORD_BITS);
+          same += ((upsampled.ground[word] & bit) != 0) == ((full_masks[f].ground[word] & bit) != 0);
+        }
+      }
+      agreement += (double)same / (IMG_W * IMG_H);
+    }
+    printf("%6d  small bins  %8.3f  %6.1fx  %14s  %16.1f  %15d\n", factor, time_small * 1000 / N_FRAMES,
+           time_full / time_small, "", error_small / (N_FRAMES * N_BINS), max_small);
+    printf("%6d  upsampled   %8.3f  %6.1fx  %13.1f%%  %16.1f  %15d\n", factor, time_up * 1000 / N_FRAMES,
+           time_full / time_up, agreement * 100 / N_FRAMES, error_up / (N_FRAMES * N_BINS), max_up);
+    freeSkyMask(&small_mask);
+    freeSkyMask(&upsampled);
+  }
+
+  for (int f = 0; f < N_FRAMES; f++) {
+    freeSkyMask(&full_masks[f]);
+    free(frames[f]);
+  }
+  freeHorizonTables();
+  return 0;
+}